@@ -0,0 +1,845 @@
+// bench_cppcore.cpp - libshoematch 原生基准（Google Benchmark）
+// 输入：合成鞋楦状网格（默认 10k / 100k / 1M 三角形）与可选的真实网格目录（--meshes=DIR），
+// 每个内核按 1..N 线程扫描；计数器给出 candidates/s、queries/s 与进程峰值 RSS。
+// 随机源（表面采样、RANSAC、描述子扰动）固定种子，同一机器上多次运行结果可比。
+//
+//   cppcore_bench --meshes=DIR --benchmark_out=bench.json --benchmark_out_format=json
+//
+// 自有参数（在 benchmark::Initialize 之前剥离）：
+//   --meshes=DIR       目录内 Open3D 可读的网格（.ply/.obj/.stl/.off）、.3dm 与 .slpm 预处理文件作为候选；
+//                      同时注册 read_mesh_files（冷读取整个目录）
+//   --target=FILE      目标网格；缺省取 --meshes 中的第一个
+//   --sizes=a,b,...    合成网格三角形数（默认 10000,100000,1000000）
+//   --max_threads=N    线程扫描上限（默认 omp_get_max_threads()），按 1, 2, 4, ... , N
+//   --batch=K          合成批量的候选数（默认 8）
+//   --simd=ISA         SIMD 内核实现（scalar / avx2 / avx512 / neon，默认按 CPU 自动选择），用于同机对比
+//   --selfcheck        不跑基准，只做并发自检（任务池恰好一次、并发上限、取消、BatchJob 取消与析构），
+//                      失败时退出码为 1
+
+#include "shoematch.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+
+#ifdef HYBRID_WITH_OPENMP
+  #include <omp.h>
+#endif
+#ifndef _WIN32
+  #include <sys/resource.h>
+  #include <time.h>
+#endif
+
+using namespace shoematch;
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr int kSeed = 42;
+
+// ----------------------------- 参数与环境 -----------------------------
+
+struct Config {
+    std::string mesh_dir, target_file;
+    std::vector<size_t> sizes{10000, 100000, 1000000};
+    int max_threads{1};
+    int batch{8};
+    bool selfcheck{false};
+};
+Config g_cfg;
+
+// 与 Python 侧默认一致（hybrid_matcher.py）
+constexpr double kVoxel = 5.0, kFpfhRadius = 10.0, kIcpThr = 15.0;
+constexpr double kClearance = 2.0, kSafetyDelta = 0.3;
+constexpr size_t kSamples = 20000;
+
+int hw_threads() {
+#ifdef HYBRID_WITH_OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// 任务池与 OpenMP 一起设置（全局线程预算）
+void set_threads(int n) { set_thread_budget(std::max(1, n)); }
+
+// 进程峰值驻留内存（MB）；单调不减，需要逐项隔离时配合 --benchmark_filter 分开运行
+double peak_rss_mb() {
+#ifdef _WIN32
+    return 0.0;
+#else
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+  #ifdef __APPLE__
+    return ru.ru_maxrss / (1024.0 * 1024.0);
+  #else
+    return ru.ru_maxrss / 1024.0;
+  #endif
+#endif
+}
+
+std::vector<int> thread_counts() {
+    std::vector<int> ts;
+    for (int t = 1; t < g_cfg.max_threads; t *= 2) ts.push_back(t);
+    ts.push_back(g_cfg.max_threads);
+    return ts;
+}
+
+void finish(benchmark::State &state, const char *rate_name, double items_per_iter, int threads) {
+    state.counters[rate_name] = benchmark::Counter(items_per_iter * double(state.iterations()),
+                                                   benchmark::Counter::kIsRate);
+    state.counters["threads"] = threads;
+    state.counters["peak_rss_mb"] = peak_rss_mb();
+}
+
+// ----------------------------- 输入数据 -----------------------------
+
+// 鞋楦状合成网格：经纬细分的单位球映射成前掌宽、脚跟/脚尖收窄、脚背隆起的椭球（约 270 x 100 x 120 mm）
+std::shared_ptr<geometry::TriangleMesh> synthetic_last(size_t n_tris, double scale) {
+    const int res = std::max(4, (int)std::lround(std::sqrt(double(n_tris) / 4.0)));
+    auto m = geometry::TriangleMesh::CreateSphere(1.0, res);
+    for (auto &v : m->vertices_) {
+        const double x = v.x();   // -1 脚跟 .. 1 脚尖
+        const double w = 0.85 + 0.15 * std::cos(1.2 * (x - 0.3));
+        const double h = 1.0 + 0.25 * std::max(0.0, v.z()) * (1.0 - x * x);
+        v = Eigen::Vector3d(135.0 * x, 50.0 * w * v.y(), 60.0 * h * v.z()) * scale;
+    }
+    return m;
+}
+
+// 候选：放大 4%..10% 并带小角度旋转与平移，保证 RANSAC/ICP 真正要做事，且余量多为正
+std::shared_ptr<geometry::TriangleMesh> synthetic_candidate(size_t n_tris, int k) {
+    auto m = synthetic_last(n_tris, 1.04 + 0.06 * (k % 4) / 3.0);
+    const double a = 0.05 * (1 + k % 3);
+    Eigen::Matrix4d T = Eigen::Matrix4d::Identity();
+    T.topLeftCorner<3, 3>() = Eigen::AngleAxisd(a, Eigen::Vector3d(0.2, 0.3, 1.0).normalized()).toRotationMatrix();
+    T.topRightCorner<3, 1>() = Eigen::Vector3d(5.0 * k, -3.0, 2.0);
+    m->Transform(T);
+    return m;
+}
+
+struct Dataset {
+    std::string name;
+    std::shared_ptr<geometry::TriangleMesh> target;              // 已清理
+    std::vector<std::shared_ptr<geometry::TriangleMesh>> cands;  // 已清理，局部坐标系
+    std::vector<std::shared_ptr<PreparedMesh>> prepared;         // 懒构建
+    std::unique_ptr<TargetContext> tgt;                          // 懒构建
+    std::optional<AlignResult> align;                            // 首个候选对目标的配准（懒构建）
+};
+
+std::map<std::string, Dataset> g_data;
+
+std::shared_ptr<geometry::TriangleMesh> load_mesh(const fs::path &p) {
+    auto m = read_mesh_file(p.string());
+    clean_mesh(*m);
+    return m;
+}
+
+Dataset &dataset(const std::string &name) {
+    auto it = g_data.find(name);
+    if (it != g_data.end()) return it->second;
+    Dataset d;
+    d.name = name;
+    if (name == "real") {
+        std::vector<fs::path> files;
+        for (const auto &e : fs::directory_iterator(g_cfg.mesh_dir))
+            if (e.is_regular_file()) files.push_back(e.path());
+        std::sort(files.begin(), files.end());
+        for (const auto &p : files) {
+            try {
+                d.cands.push_back(load_mesh(p));
+            } catch (const std::exception &e) {
+                std::fprintf(stderr, "bench: skipping %s (%s)\n", p.string().c_str(), e.what());
+            }
+        }
+        if (d.cands.empty()) throw std::runtime_error("no readable meshes in " + g_cfg.mesh_dir);
+        d.target = g_cfg.target_file.empty() ? d.cands.front() : load_mesh(g_cfg.target_file);
+    } else {
+        const size_t n = std::stoull(name);
+        d.target = synthetic_last(n, 1.0);
+        clean_mesh(*d.target);
+        for (int k = 0; k < g_cfg.batch; ++k) {
+            d.cands.push_back(synthetic_candidate(n, k));
+            clean_mesh(*d.cands.back());
+        }
+    }
+    return g_data.emplace(name, std::move(d)).first->second;
+}
+
+const TargetContext &target_ctx(Dataset &d) {
+    if (!d.tgt) {
+        utility::random::Seed(kSeed);
+        auto mT = std::make_shared<geometry::TriangleMesh>(*d.target);
+        d.tgt = std::make_unique<TargetContext>(make_target_context(*mT, kVoxel, kFpfhRadius, kIcpThr, kSamples));
+    }
+    return *d.tgt;
+}
+
+const std::vector<std::shared_ptr<PreparedMesh>> &prepared(Dataset &d) {
+    if (d.prepared.empty()) {
+        utility::random::Seed(kSeed);
+        for (const auto &m : d.cands)
+            d.prepared.push_back(prepare_from_mesh(std::make_shared<geometry::TriangleMesh>(*m),
+                                                   {{kVoxel, kFpfhRadius}}, 20000));
+    }
+    return d.prepared;
+}
+
+// 余量类内核的坐标系：首个候选配准到目标后的变换
+const AlignResult &aligned(Dataset &d) {
+    if (!d.align) {
+        const PreparedMesh &S = *prepared(d).front();
+        RegLevel scratch;
+        utility::random::Seed(kSeed);
+        d.align = align_dual(level_or_make(S, kVoxel, kFpfhRadius, scratch), *S.chamfer_pts, *S.chamfer_kd,
+                             target_ctx(d), kIcpThr);
+    }
+    return *d.align;
+}
+
+std::vector<std::string> dataset_names() {
+    std::vector<std::string> names;
+    for (size_t n : g_cfg.sizes) names.push_back(std::to_string(n));
+    if (!g_cfg.mesh_dir.empty()) names.push_back("real");
+    return names;
+}
+
+BatchParams batch_params(bool decide_only) {
+    return BatchParams{kVoxel, kFpfhRadius, kIcpThr, kClearance, kSafetyDelta, decide_only,
+                       QuantileSpec(), resolve_device("CPU:0"), false};
+}
+
+// ----------------------------- 单网格内核 -----------------------------
+
+void BM_CoarseFeatures(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    for (auto _ : state) benchmark::DoNotOptimize(coarse_features_from_mesh(*d.target));
+    finish(state, "queries_per_s", 1, threads);
+}
+
+void BM_Prepare(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    utility::random::Seed(kSeed);
+    for (auto _ : state) {
+        auto m = std::make_shared<geometry::TriangleMesh>(*d.cands.front());
+        benchmark::DoNotOptimize(prepare_from_mesh(m, {{kVoxel, kFpfhRadius}}, 20000));
+    }
+    finish(state, "candidates_per_s", 1, threads);
+}
+
+// .slpm 冷启动：mmap 加载 + 首次 BVH（页缓存已热，衡量的是解析 / 拷贝而非磁盘）
+void BM_PreparedLoad(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const std::string path = (fs::temp_directory_path() / ("cppcore_bench_" + ds + ".slpm")).string();
+    prepared(d).front()->save(path);
+    for (auto _ : state) {
+        auto pm = PreparedMesh::load(path);
+        benchmark::DoNotOptimize(&pm->scene());
+    }
+    fs::remove(path);
+    finish(state, "candidates_per_s", 1, threads);
+}
+
+void BM_Chamfer(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    utility::random::Seed(kSeed);
+    auto A = sample_pcd(*d.cands.front(), 20000), B = sample_pcd(*d.target, 20000);
+    const geometry::KDTreeFlann ka(*A), kb(*B);
+    for (auto _ : state) benchmark::DoNotOptimize(chamfer(*A, ka, *B, kb));
+    finish(state, "queries_per_s", double(A->points_.size() + B->points_.size()), threads);
+}
+
+// 预处理候选对目标的双假设配准（align_icp_with_mirror 的内核）
+void BM_AlignDual(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const TargetContext &tgt = target_ctx(d);
+    const PreparedMesh &S = *prepared(d).front();
+    RegLevel scratch;
+    const RegLevel &L = level_or_make(S, kVoxel, kFpfhRadius, scratch);
+    utility::random::Seed(kSeed);
+    for (auto _ : state) benchmark::DoNotOptimize(align_dual(L, *S.chamfer_pts, *S.chamfer_kd, tgt, kIcpThr));
+    finish(state, "candidates_per_s", 1, threads);
+}
+
+void BM_AlignMulti(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const std::vector<double> scales{0.98, 1.0, 1.02};
+    const std::vector<RegParams> params{{kVoxel * 2, kFpfhRadius * 2, kIcpThr * 2}, {kVoxel, kFpfhRadius, kIcpThr}};
+    utility::random::Seed(kSeed);
+    for (auto _ : state) {
+        geometry::TriangleMesh mS = *d.cands.front(), mT = *d.target;
+        const Eigen::Vector3d c = std::accumulate(mS.vertices_.begin(), mS.vertices_.end(), Eigen::Vector3d(0, 0, 0)) /
+                                  double(mS.vertices_.size());
+        benchmark::DoNotOptimize(align_multi_mesh(mS, c, mT, scales, params, true, 1.5));
+    }
+    finish(state, "candidates_per_s", 1, threads);
+}
+
+// 采样式余量：目标采样点对候选 BVH（clearance_sampling 的内核，全量统计与提前退出两种）
+void BM_ClearanceStats(benchmark::State &state, std::string ds, bool decide_only) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const TargetContext &tgt = target_ctx(d);
+    const ClearanceScene cs = ClearanceScene::of(prepared(d).front()).at(aligned(d).T);
+    size_t evaluated = 0;
+    for (auto _ : state) {
+        if (decide_only) {
+            const DecideOut o = clearance_decide(cs, tgt.clearance_pts->points_, kClearance + kSafetyDelta);
+            evaluated += o.evaluated;
+        } else {
+            benchmark::DoNotOptimize(clearance_stats(cs, tgt.clearance_pts->points_));
+            evaluated += tgt.clearance_pts->points_.size();
+        }
+    }
+    state.counters["queries_per_s"] = benchmark::Counter(double(evaluated), benchmark::Counter::kIsRate);
+    state.counters["threads"] = threads;
+    state.counters["peak_rss_mb"] = peak_rss_mb();
+}
+
+// 目标余量采样集（TargetSamples 的内核），三种方式、曲率加密
+void BM_SampleTarget(benchmark::State &state, std::string ds, std::string method) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const SampleParams P{method, kSeed, 1.0};
+    for (auto _ : state) benchmark::DoNotOptimize(sample_target(*d.target, kSamples, P));
+    finish(state, "queries_per_s", double(kSamples), threads);
+}
+
+// 逐顶点余量场（clearance_field 的内核），候选顶点对目标表面
+void BM_ClearanceField(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const ClearanceScene scene = ClearanceScene::build(*d.target);
+    const Eigen::Matrix4d T = aligned(d).T;
+    const auto &V = prepared(d).front()->mesh().vertices_;
+    std::vector<float> field(V.size());
+    const auto world = [&](size_t i) { return Eigen::Vector3d(T.topLeftCorner<3, 3>() * V[i] + T.topRightCorner<3, 1>()); };
+    for (auto _ : state) {
+        clearance_field_query(scene, V.size(), world, 1.f, field.data(), nullptr, threads);
+        benchmark::ClobberMemory();
+    }
+    finish(state, "queries_per_s", double(V.size()), threads);
+}
+
+// 体素窄带形式化复核（clearance_sdf_volume 的内核）：窄带构建 + 候选 SDF 查询
+void BM_NarrowBand(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const ClearanceScene scene = ClearanceScene::of(prepared(d).front()).at(aligned(d).T);
+    size_t cells = 0;
+    for (auto _ : state) {
+        const NarrowBand nb = build_narrow_band(*d.target, 1.0, 3.0, threads);
+        benchmark::DoNotOptimize(formal_check_band(scene, nb, kClearance, threads));
+        cells += nb.cells.size();
+    }
+    state.counters["queries_per_s"] = benchmark::Counter(double(cells), benchmark::Counter::kIsRate);
+    state.counters["threads"] = threads;
+    state.counters["peak_rss_mb"] = peak_rss_mb();
+}
+
+// 64 个等距横截面（mesh_sections 的内核）
+void BM_Sections(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const Eigen::Vector3d N(1, 0, 0);
+    const auto bb = d.target->GetAxisAlignedBoundingBox();
+    std::vector<double> offsets(64);
+    for (size_t k = 0; k < offsets.size(); ++k)
+        offsets[k] = bb.min_bound_.x() + (k + 0.5) * (bb.max_bound_.x() - bb.min_bound_.x()) / offsets.size();
+    for (auto _ : state) benchmark::DoNotOptimize(compute_sections(*d.target, N, offsets, true));
+    finish(state, "queries_per_s", double(offsets.size()), threads);
+}
+
+// 薄壁聚类（thin_regions 的内核），余量场预先算好，只计聚类本身
+void BM_ThinRegions(benchmark::State &state, std::string ds, std::string connectivity) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    set_threads(threads);
+    const auto &V = d.target->vertices_;
+    std::vector<float> clr(V.size());
+    clearance_field_query(ClearanceScene::of(prepared(d).front()).at(aligned(d).T), V.front().data(), V.size(),
+                          -1.f, clr.data(), nullptr, 0);
+    for (auto _ : state)
+        benchmark::DoNotOptimize(thin_regions_from(V, clr.data(), 6.0, 5.0, connectivity, &d.target->triangles_));
+    finish(state, "queries_per_s", double(V.size()), threads);
+}
+
+// ----------------------------- 批量与索引 -----------------------------
+
+// 整条 对齐+余量 批量流水线（batch_align_and_check 的内核）
+void BM_Batch(benchmark::State &state, std::string ds, bool use_prepared, bool decide_only) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    const BatchParams P = batch_params(decide_only);
+    if (use_prepared) prepared(d);
+    utility::random::Seed(kSeed);
+    for (auto _ : state) {
+        state.PauseTiming();
+        geometry::TriangleMesh mT = *d.target;   // 已清理
+        std::vector<std::shared_ptr<geometry::TriangleMesh>> meshes;
+        if (!use_prepared)
+            for (const auto &m : d.cands) meshes.push_back(std::make_shared<geometry::TriangleMesh>(*m));
+        std::vector<BatchOut> outs(d.cands.size());
+        state.ResumeTiming();
+        if (use_prepared) run_batch_prepared(mT, d.prepared, P, kSamples, threads, outs);
+        else run_batch(mT, meshes, P, kSamples, threads, outs);
+        for (const auto &o : outs)
+            if (!o.error.empty()) { state.SkipWithError(o.error.c_str()); break; }
+    }
+    finish(state, "candidates_per_s", double(d.cands.size()), threads);
+}
+
+// 级联调度：与 batch_align_and_check_prepared 同一批候选，只保留 top-4
+void BM_Cascade(benchmark::State &state, std::string ds) {
+    Dataset &d = dataset(ds);
+    const int threads = (int)state.range(0);
+    prepared(d);
+    MatchParams M;
+    M.voxel = kVoxel; M.fpfh_radius = kFpfhRadius; M.icp_thr = kIcpThr;
+    M.samples = kSamples; M.threads = threads;
+    M.cascade = true; M.final_k = 4;
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < d.prepared.size(); ++i) ids.push_back(std::to_string(i));
+    utility::random::Seed(kSeed);
+    size_t aligned = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        geometry::TriangleMesh mT = *d.target;   // 已清理
+        state.ResumeTiming();
+        const auto res = cascade_match(mT, ids, d.prepared, M);
+        aligned = 0;
+        for (const auto &r : res) {
+            if (!r.result.error.empty()) { state.SkipWithError(r.result.error.c_str()); break; }
+            aligned += r.stage >= 3;
+        }
+    }
+    state.counters["aligned"] = double(aligned);
+    finish(state, "candidates_per_s", double(d.prepared.size()), threads);
+}
+
+// 冷读取 --meshes 目录（含 .3dm 网格化与 clean_mesh）
+void BM_ReadMeshFiles(benchmark::State &state) {
+    const int threads = (int)state.range(0);
+    std::vector<std::string> paths;
+    for (const auto &e : fs::directory_iterator(g_cfg.mesh_dir))
+        if (e.is_regular_file()) paths.push_back(e.path().string());
+    std::sort(paths.begin(), paths.end());
+    std::vector<std::string> errors;
+    size_t ok = 0;
+    for (auto _ : state) {
+        auto meshes = read_mesh_files(paths, errors, true, threads);
+        ok = 0;
+        for (const auto &m : meshes) ok += m != nullptr;
+    }
+    finish(state, "candidates_per_s", double(ok), threads);
+}
+
+// 粗特征索引查询（FeatureIndex.query）：目标描述子加扰动复制成 n 条
+void BM_IndexQuery(benchmark::State &state) {
+    const size_t n = (size_t)state.range(0);
+    const int threads = (int)state.range(1);
+    set_threads(threads);
+    const CoarseFeat base = coarse_features_from_mesh(*synthetic_last(10000, 1.0));
+    FeatureIndex index;
+    std::mt19937 rng(kSeed);
+    std::uniform_real_distribution<double> s(0.95, 1.15);
+    std::uniform_real_distribution<float> u(0.8f, 1.2f);
+    for (size_t i = 0; i < n; ++i) {
+        CoarseFeat f = base;
+        const double k = s(rng);
+        f.extents *= k; f.pca_extents *= k; f.volume *= k * k * k; f.area *= k * k;
+        for (auto &h : f.hist) h *= u(rng);
+        for (auto &g : f.d2) g *= u(rng);
+        for (auto &w : f.width) w *= float(k);
+        index.add("cand_" + std::to_string(i), f);
+    }
+    for (auto _ : state) benchmark::DoNotOptimize(index.query(base, kClearance, 50, 1.0, 0.05, 0.5, 1.0));
+    finish(state, "queries_per_s", 1, threads);
+}
+
+// ----------------------------- 并发自检（--selfcheck） -----------------------------
+// 不计时，只验证调度语义；每项打印 ok / FAILED，main 按失败数返回
+
+int g_failed = 0;
+
+void expect(bool ok, const std::string &what) {
+    std::fprintf(stderr, "selfcheck: %-56s %s\n", what.c_str(), ok ? "ok" : "FAILED");
+    g_failed += !ok;
+}
+
+bool each_once(const std::vector<std::atomic<int>> &hits) {
+    for (const auto &h : hits)
+        if (h.load() != 1) return false;
+    return true;
+}
+
+// 嵌套 fork-join：外层任务在 wait 里帮忙执行内层任务，内外层每个下标恰好执行一次
+void check_pool() {
+    constexpr int kOuter = 256, kInner = 16;
+    std::vector<std::atomic<int>> hits(kOuter * kInner);
+    parallel_for(kOuter, [&](int i) {
+        TaskGroup g;
+        for (int k = 0; k < kInner; ++k) g.run([&hits, at = i * kInner + k] { hits[at].fetch_add(1); });
+        g.wait();
+    });
+    expect(each_once(hits), "nested TaskGroup: every task runs once");
+
+    // CapScope：同时在跑的任务数不超过上限（含发起线程），嵌套层共用同一上限
+    for (int cap : {1, 2, 3}) {
+        constexpr int kN = 64;
+        std::vector<std::atomic<int>> h(kN * 4);
+        std::atomic<int> active{0}, peak{0};
+        auto busy = [&](std::atomic<int> &slot) {
+            const int a = active.fetch_add(1) + 1;
+            int p = peak.load();
+            while (a > p && !peak.compare_exchange_weak(p, a)) {}
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            slot.fetch_add(1);
+            active.fetch_sub(1);
+        };
+        {
+            CapScope cs(cap);
+            parallel_for(kN, [&](int i) { parallel_for(4, [&](int k) { busy(h[i * 4 + k]); }); });
+        }
+        expect(each_once(h) && peak.load() <= cap,
+               "CapScope(" + std::to_string(cap) + "): peak " + std::to_string(peak.load()) + " tasks");
+    }
+}
+
+// wait 不空转：本组任务都在别的线程上执行时，等待线程睡到最后一个完成（线程 CPU 时间远小于墙钟时间）
+void check_wait_sleeps() {
+#ifndef _WIN32
+    auto cpu_ms = [] {
+        timespec t{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+        return t.tv_sec * 1e3 + t.tv_nsec * 1e-6;
+    };
+    TaskGroup g;
+    const double c0 = cpu_ms();
+    for (int k = 0; k < 2; ++k) g.run([] { std::this_thread::sleep_for(std::chrono::milliseconds(200)); });
+    // 当前线程先执行了其中一个（本组未开始的任务），另一个在工作线程上
+    g.wait();
+    const double used = cpu_ms() - c0;
+    expect(used < 50.0, "TaskGroup::wait sleeps: waiter used " + std::to_string((int)used) + " ms CPU");
+#endif
+}
+
+// 取消：中途置位后，其余下标在 checkpoint 处抛 Cancelled；每个下标恰好一次（完成或取消），wait 重抛 Cancelled
+void check_cancel() {
+    constexpr int kN = 512;
+    std::atomic<bool> flag{false};
+    std::vector<std::atomic<int>> seen(kN);
+    std::atomic<int> n_cancelled{0};
+    bool threw = false;
+    {
+        CancelScope cs(&flag);
+        try {
+            parallel_for(kN, [&](int i) {
+                if (i == kN / 2) flag.store(true);
+                try {
+                    checkpoint();
+                } catch (const Cancelled &) {
+                    seen[i].fetch_add(1);
+                    n_cancelled.fetch_add(1);
+                    throw;
+                }
+                seen[i].fetch_add(1);
+            });
+        } catch (const Cancelled &) {
+            threw = true;
+        }
+    }
+    expect(threw && each_once(seen) && n_cancelled.load() > 0,
+           "cancel halfway: " + std::to_string(n_cancelled.load()) + "/" + std::to_string(kN) + " cancelled");
+    expect(tl_cancel == nullptr, "CancelScope restores the thread-local flag");
+}
+
+constexpr size_t kJobCands = 16, kJobTris = 2000, kJobSamples = 2000;
+
+std::vector<std::shared_ptr<geometry::TriangleMesh>> job_cands() {
+    std::vector<std::shared_ptr<geometry::TriangleMesh>> ms;
+    for (size_t k = 0; k < kJobCands; ++k) ms.push_back(synthetic_candidate(kJobTris, (int)k));
+    return ms;
+}
+
+// BatchJob：取到一半结果后 cancel()，next() 取到结束；每个下标恰好一次（结果或 "cancelled"），回调也恰好一次
+void check_job() {
+    std::vector<std::atomic<int>> cb_hits(kJobCands);
+    auto job = BatchJob::start(synthetic_last(kJobTris, 1.0), job_cands(), {}, batch_params(false), kJobSamples, 0,
+                               [&](size_t i, const BatchOut &) { cb_hits[i].fetch_add(1); });
+    std::vector<std::atomic<int>> seen(kJobCands);
+    size_t got = 0, n_cancelled = 0;
+    bool other = false;
+    auto take = [&](std::vector<BatchJob::Item> items) {
+        for (const auto &[i, o] : items) {
+            seen[i].fetch_add(1);
+            ++got;
+            if (o.error == "cancelled") ++n_cancelled;
+            else if (!o.error.empty()) {
+                std::fprintf(stderr, "selfcheck: candidate %zu failed: %s\n", i, o.error.c_str());
+                other = true;
+            }
+        }
+    };
+    while (got < kJobCands / 2) take(job->next());
+    job->cancel();
+    for (auto items = job->next(); !items.empty(); items = job->next()) take(std::move(items));
+    job->join();
+    expect(job->done() && job->completed() == kJobCands && each_once(seen) && each_once(cb_hits) && !other,
+           "BatchJob cancel halfway: " + std::to_string(n_cancelled) + "/" + std::to_string(kJobCands) +
+               " cancelled");
+}
+
+// 回调阻塞时析构作业（对应 py_job：回调等 GIL，最后一个引用放开 GIL 后析构）：
+// 析构取消并 join，回调拿到“GIL”后返回，其余候选以 "cancelled" 入队，析构随之返回
+void check_job_dtor() {
+    std::mutex m;
+    std::condition_variable cv;
+    bool gil = true, entered = false;
+    std::vector<std::atomic<int>> cb_hits(kJobCands);
+    auto job = BatchJob::start(synthetic_last(kJobTris, 1.0), job_cands(), {}, batch_params(false), kJobSamples, 0,
+                               [&](size_t i, const BatchOut &) {
+                                   std::unique_lock<std::mutex> lk(m);
+                                   entered = true;
+                                   cv.notify_all();
+                                   cv.wait(lk, [&] { return !gil; });
+                                   cb_hits[i].fetch_add(1);
+                               });
+    {
+        std::unique_lock<std::mutex> lk(m);
+        cv.wait(lk, [&] { return entered; });
+    }
+    std::thread release([&] {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));   // 析构已在 join 里等
+        std::lock_guard<std::mutex> lk(m);
+        gil = false;
+        cv.notify_all();
+    });
+    job.reset();
+    release.join();
+    expect(each_once(cb_hits), "BatchJob destroyed while a callback blocks");
+}
+
+// 回调里放掉最后一个句柄：一半时取走句柄并析构（跑在池任务或后台线程上，不能 join）；
+// 或者回调闭包一直持有唯一句柄（引用环），最后一个结果入队后回调被释放、作业随之析构
+void check_job_release() {
+    struct Probe {
+        std::mutex m;
+        std::condition_variable cv;
+        bool dropped{false};   // 作业已释放回调闭包
+    };
+    auto run = [](bool at_half) {
+        auto pr = std::make_shared<Probe>();
+        std::vector<std::atomic<int>> cb_hits(kJobCands);
+        std::weak_ptr<BatchJob> weak;
+        {
+            auto self = std::make_shared<std::shared_ptr<BatchJob>>();   // 只由闭包持有
+            std::shared_ptr<void> guard(nullptr, [pr](void *) {
+                std::lock_guard<std::mutex> lk(pr->m);
+                pr->dropped = true;
+                pr->cv.notify_all();
+            });
+            auto calls = std::make_shared<std::atomic<size_t>>(0);
+            std::unique_lock<std::mutex> lk(pr->m);   // 句柄交给闭包之前回调先等着
+            auto job = BatchJob::start(
+                synthetic_last(kJobTris, 1.0), job_cands(), {}, batch_params(false), kJobSamples, 0,
+                [pr, self, guard, calls, &cb_hits, at_half](size_t i, const BatchOut &) {
+                    cb_hits[i].fetch_add(1);
+                    std::shared_ptr<BatchJob> mine;
+                    {
+                        std::lock_guard<std::mutex> lk(pr->m);
+                        if (calls->fetch_add(1) + 1 == kJobCands / 2 && at_half) mine = std::move(*self);
+                    }
+                    mine.reset();   // 在回调里析构作业
+                });
+            weak = job;
+            *self = std::move(job);
+        }
+        {
+            std::unique_lock<std::mutex> lk(pr->m);
+            pr->cv.wait(lk, [&] { return pr->dropped; });
+        }
+        for (int k = 0; k < 1000 && !weak.expired(); ++k) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        return each_once(cb_hits) && weak.expired();
+    };
+    expect(run(true), "BatchJob released inside its callback");
+    expect(run(false), "BatchJob freed when its callback owns the handle");
+}
+
+// 死锁时不挂住 CI：超时直接失败退出
+class Watchdog {
+public:
+    explicit Watchdog(int seconds) : t_([this, seconds] {
+        std::unique_lock<std::mutex> lk(m_);
+        if (!cv_.wait_for(lk, std::chrono::seconds(seconds), [this] { return done_; })) {
+            std::fprintf(stderr, "selfcheck: timed out after %d s\n", seconds);
+            std::_Exit(1);
+        }
+    }) {}
+    ~Watchdog() {
+        {
+            std::lock_guard<std::mutex> lk(m_);
+            done_ = true;
+        }
+        cv_.notify_all();
+        t_.join();
+    }
+
+private:
+    std::mutex m_;
+    std::condition_variable cv_;
+    bool done_{false};
+    std::thread t_;
+};
+
+int selfcheck() {
+    set_threads(std::max(4, g_cfg.max_threads));   // 单核机器上也真的走任务池
+    utility::random::Seed(kSeed);
+    Watchdog wd(600);
+    check_pool();
+    check_wait_sleeps();
+    check_cancel();
+    check_job_release();
+    check_job();
+    check_job_dtor();
+    std::fprintf(stderr, "selfcheck: %s\n", g_failed ? "FAILED" : "all ok");
+    return g_failed ? 1 : 0;
+}
+
+// ----------------------------- 注册 -----------------------------
+
+template <class F>
+void register_each(const std::string &name, F fn) {
+    for (const auto &ds : dataset_names()) {
+        auto *b = benchmark::RegisterBenchmark((name + "/" + ds).c_str(), fn, ds);
+        for (int t : thread_counts()) b->Arg(t);
+        b->ArgName("threads")->Unit(benchmark::kMillisecond)->UseRealTime();
+    }
+}
+
+void register_all() {
+    register_each("coarse_features", BM_CoarseFeatures);
+    register_each("prepare_mesh", BM_Prepare);
+    register_each("prepared_load", BM_PreparedLoad);
+    register_each("chamfer", BM_Chamfer);
+    register_each("align_dual", BM_AlignDual);
+    register_each("align_multi", BM_AlignMulti);
+    register_each("clearance_sampling", [](benchmark::State &s, std::string ds) { BM_ClearanceStats(s, ds, false); });
+    register_each("clearance_decide", [](benchmark::State &s, std::string ds) { BM_ClearanceStats(s, ds, true); });
+    register_each("sample_target_uniform", [](benchmark::State &s, std::string ds) { BM_SampleTarget(s, ds, "uniform"); });
+    register_each("sample_target_stratified",
+                  [](benchmark::State &s, std::string ds) { BM_SampleTarget(s, ds, "stratified"); });
+    register_each("sample_target_poisson", [](benchmark::State &s, std::string ds) { BM_SampleTarget(s, ds, "poisson"); });
+    register_each("clearance_field", BM_ClearanceField);
+    register_each("clearance_sdf_volume", BM_NarrowBand);
+    register_each("mesh_sections", BM_Sections);
+    register_each("thin_regions_radius", [](benchmark::State &s, std::string ds) { BM_ThinRegions(s, ds, "radius"); });
+    register_each("thin_regions_mesh", [](benchmark::State &s, std::string ds) { BM_ThinRegions(s, ds, "mesh"); });
+    register_each("batch_align_and_check", [](benchmark::State &s, std::string ds) { BM_Batch(s, ds, false, false); });
+    register_each("batch_align_and_check_prepared",
+                  [](benchmark::State &s, std::string ds) { BM_Batch(s, ds, true, false); });
+    register_each("batch_decide_prepared", [](benchmark::State &s, std::string ds) { BM_Batch(s, ds, true, true); });
+    register_each("cascade_match", BM_Cascade);
+
+    if (!g_cfg.mesh_dir.empty()) {
+        auto *r = benchmark::RegisterBenchmark("read_mesh_files/real", BM_ReadMeshFiles);
+        for (int t : thread_counts()) r->Arg(t);
+        r->ArgName("threads")->Unit(benchmark::kMillisecond)->UseRealTime();
+    }
+
+    auto *b = benchmark::RegisterBenchmark("feature_index_query", BM_IndexQuery);
+    for (int64_t n : {1000, 10000, 100000})
+        for (int t : thread_counts()) b->Args({n, t});
+    b->ArgNames({"entries", "threads"})->Unit(benchmark::kMicrosecond)->UseRealTime();
+}
+
+bool take_flag(const std::string &arg, const char *flag, std::string &out) {
+    const std::string prefix = std::string(flag) + "=";
+    if (arg.compare(0, prefix.size(), prefix) != 0) return false;
+    out = arg.substr(prefix.size());
+    return true;
+}
+
+// 剥离自有参数，其余原样交给 Google Benchmark
+void parse_args(int &argc, char **argv) {
+    g_cfg.max_threads = hw_threads();
+    int w = 1;
+    for (int i = 1; i < argc; ++i) {
+        const std::string a = argv[i];
+        std::string v;
+        if (take_flag(a, "--meshes", v)) g_cfg.mesh_dir = v;
+        else if (take_flag(a, "--target", v)) g_cfg.target_file = v;
+        else if (take_flag(a, "--max_threads", v)) g_cfg.max_threads = std::max(1, std::stoi(v));
+        else if (take_flag(a, "--batch", v)) g_cfg.batch = std::max(1, std::stoi(v));
+        else if (take_flag(a, "--simd", v)) simd::set_isa(v);
+        else if (a == "--selfcheck") g_cfg.selfcheck = true;
+        else if (take_flag(a, "--sizes", v)) {
+            g_cfg.sizes.clear();
+            for (size_t p = 0; p < v.size();) {
+                const size_t q = std::min(v.find(',', p), v.size());
+                if (q > p) g_cfg.sizes.push_back(std::stoull(v.substr(p, q - p)));
+                p = q + 1;
+            }
+        } else argv[w++] = argv[i];
+    }
+    argc = w;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    try {
+        parse_args(argc, argv);
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "bench: bad argument (%s)\n", e.what());
+        return 2;
+    }
+    if (g_cfg.selfcheck) return selfcheck();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+
+    utility::random::Seed(kSeed);
+    benchmark::AddCustomContext("seed", std::to_string(kSeed));
+    benchmark::AddCustomContext("max_threads", std::to_string(g_cfg.max_threads));
+    benchmark::AddCustomContext("simd", simd::isa_name(simd::isa()));
+#ifdef HYBRID_WITH_OPENMP
+    benchmark::AddCustomContext("openmp", "on");
+#else
+    benchmark::AddCustomContext("openmp", "off");
+#endif
+    if (!g_cfg.mesh_dir.empty()) benchmark::AddCustomContext("meshes", g_cfg.mesh_dir);
+
+    register_all();
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
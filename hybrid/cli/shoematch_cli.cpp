@@ -0,0 +1,284 @@
+// shoematch_cli.cpp - 原生批量入口（不经 Python）
+// 预处理候选库，并把一个目标对整个库做端到端匹配：
+//   shoematch prepare --out LIB [--levels 5:10,2.5:6] [--chamfer-samples 20000] [--threads N] [--max-edge MM] MESH...
+//   shoematch match --library LIB --target FILE [--clearance 2.0] [--safety-delta 0.3] [--topk 32]
+//                   [--samples 20000] [--sampling uniform|stratified|poisson] [--seed 0] [--curvature-weight 0]
+//                   [--threads N] [--decide-only] [--device CPU:0] [--profile] [--json OUT|-]
+//                   [--cascade [--final-k 8] [--max-align 64] [--prune-ratio 1.5] [--no-formal]]
+// 网格读取见 read_mesh_file（Open3D 可读格式、.3dm 或 .slpm），prepare 并行读取输入。退出码：0 成功，1 运行错误，2 参数错误。
+
+#include "shoematch.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+
+using namespace shoematch;
+namespace fs = std::filesystem;
+
+namespace {
+
+struct UsageError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+const char *const kUsage =
+    "usage:\n"
+    "  shoematch prepare --out LIB [--levels V:R,...] [--chamfer-samples N] [--threads N] [--max-edge MM] MESH...\n"
+    "  shoematch match --library LIB --target FILE [--clearance MM] [--safety-delta MM] [--topk K]\n"
+    "                  [--samples N] [--sampling METHOD] [--seed N] [--curvature-weight W]\n"
+    "                  [--threads N] [--decide-only] [--device DEV] [--profile] [--json OUT|-]\n"
+    "                  [--cascade [--final-k K] [--max-align N] [--prune-ratio R] [--no-formal]]\n";
+
+// ----------------------------- 参数解析 -----------------------------
+// --key value / --key=value / --flag；其余为位置参数
+
+struct Args {
+    std::map<std::string, std::string> opts;
+    std::set<std::string> flags;
+    std::vector<std::string> positional;
+
+    bool has(const std::string &k) const { return opts.count(k) > 0; }
+    std::string str(const std::string &k, const std::string &def = "") const {
+        auto it = opts.find(k);
+        return it == opts.end() ? def : it->second;
+    }
+    double num(const std::string &k, double def) const {
+        if (!has(k)) return def;
+        try {
+            return std::stod(opts.at(k));
+        } catch (const std::exception &) {
+            throw UsageError("--" + k + " expects a number");
+        }
+    }
+    std::string required(const std::string &k) const {
+        if (!has(k)) throw UsageError("missing --" + k);
+        return opts.at(k);
+    }
+};
+
+Args parse(int argc, char **argv, int first, const std::set<std::string> &flag_names) {
+    Args a;
+    for (int i = first; i < argc; ++i) {
+        std::string s = argv[i];
+        if (s.rfind("--", 0) != 0) { a.positional.push_back(s); continue; }
+        s = s.substr(2);
+        const size_t eq = s.find('=');
+        if (eq != std::string::npos) a.opts[s.substr(0, eq)] = s.substr(eq + 1);
+        else if (flag_names.count(s)) a.flags.insert(s);
+        else if (i + 1 < argc) a.opts[s] = argv[++i];
+        else throw UsageError("--" + s + " expects a value");
+    }
+    return a;
+}
+
+// "5:10,2.5:6" -> {(5, 10), (2.5, 6)}
+std::vector<std::pair<double, double>> parse_levels(const std::string &s) {
+    std::vector<std::pair<double, double>> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        const size_t c = item.find(':');
+        if (c == std::string::npos) throw UsageError("--levels expects voxel:radius pairs");
+        out.emplace_back(std::stod(item.substr(0, c)), std::stod(item.substr(c + 1)));
+    }
+    if (out.empty()) throw UsageError("--levels is empty");
+    return out;
+}
+
+// ----------------------------- JSON 输出 -----------------------------
+
+std::string json_str(const std::string &s) {
+    std::string o = "\"";
+    for (unsigned char c : s) {
+        if (c == '"' || c == '\\') { o += '\\'; o += char(c); }
+        else if (c < 0x20) { char b[8]; std::snprintf(b, sizeof(b), "\\u%04x", c); o += b; }
+        else o += char(c);
+    }
+    return o + "\"";
+}
+
+std::string json_num(double v) {
+    if (!std::isfinite(v)) return "null";
+    char b[32];
+    std::snprintf(b, sizeof(b), "%.6g", v);
+    return b;
+}
+
+void write_profile(std::ostream &os, const Profile &p) {
+    os << "{";
+    for (int i = 0; i < kStages; ++i)
+        os << json_str(kStageNames[i]) << ": {\"sec\": " << json_num(p.sec[i]) << ", \"calls\": " << p.calls[i] << "}, ";
+    os << "\"sdf_points\": " << p.sdf_points << ", \"ransac_correspondences\": " << p.ransac_corr
+       << ", \"icp_iterations\": " << p.icp_iterations << "}";
+}
+
+void write_result(std::ostream &os, const MatchResult &r, bool profile, bool cascade) {
+    const BatchOut &o = r.result;
+    os << "  {\"id\": " << json_str(r.id) << ", \"index_score\": " << json_num(r.index_score);
+    if (cascade) {
+        os << ", \"stage\": " << r.stage << ", \"cut_by\": " << json_str(r.cut_by) << ", \"rank\": " << r.rank
+           << ", \"coarse_chamfer\": " << json_num(r.coarse_chamfer);
+        if (r.has_formal)
+            os << ", \"formal\": {\"pass\": " << (r.formal.pass ? "true" : "false")
+               << ", \"min_clearance\": " << json_num(r.formal.min_c) << ", \"mean_clearance\": "
+               << json_num(r.formal.mean_c) << ", \"inside_ratio\": " << json_num(r.formal.inside_ratio) << "}";
+    }
+    if (!o.error.empty()) {
+        os << ", \"error\": " << json_str(o.error) << "}";
+        return;
+    }
+    if (cascade && r.stage < 3) {   // 粗筛阶段被剪掉：没有配准结果
+        os << ", \"pass\": false}";
+        return;
+    }
+    os << ", \"pass\": " << (o.pass ? "true" : "false") << ", \"mirrored\": " << (o.align.mirrored ? "true" : "false")
+       << ", \"chamfer\": " << json_num(o.align.chamfer);
+    if (o.decide_only) {
+        os << ", \"min_clearance\": " << json_num(o.decide.min_c) << ", \"decided_by\": " << json_str(o.decide.decided_by)
+           << ", \"evaluated\": " << o.decide.evaluated;
+    } else {
+        os << ", \"min_clearance\": " << json_num(o.clr.min_c) << ", \"mean_clearance\": " << json_num(o.clr.mean_c)
+           << ", \"p01_clearance\": " << json_num(o.clr.p01) << ", \"inside_ratio\": " << json_num(o.clr.inside_ratio)
+           << ", \"quantiles\": {";
+        for (size_t k = 0; k < o.clr.quantiles.size(); ++k)
+            os << (k ? ", " : "") << json_str(json_num(o.clr.quantiles[k].first)) << ": " << json_num(o.clr.quantiles[k].second);
+        os << "}";
+    }
+    os << ", \"T\": [";
+    for (int i = 0; i < 4; ++i) {
+        os << (i ? ", [" : "[");
+        for (int j = 0; j < 4; ++j) os << (j ? ", " : "") << json_num(o.align.T(i, j));
+        os << "]";
+    }
+    os << "]";
+    if (profile) { os << ", \"profile\": "; write_profile(os, o.prof); }
+    os << "}";
+}
+
+// ----------------------------- 子命令 -----------------------------
+
+int cmd_prepare(int argc, char **argv) {
+    const Args a = parse(argc, argv, 2, {});
+    const std::string out = a.required("out");
+    const auto levels = parse_levels(a.str("levels", "5:10"));
+    const size_t chamfer_samples = (size_t)a.num("chamfer-samples", 20000);
+    const int threads = (int)a.num("threads", 0);
+    Load3dmParams L;
+    L.max_edge = a.num("max-edge", L.max_edge);
+    if (a.positional.empty()) throw UsageError("no input meshes");
+
+    std::set<std::string> seen;
+    for (const auto &p : a.positional)
+        if (!seen.insert(fs::path(p).stem().string()).second)
+            throw UsageError("duplicate candidate id: " + fs::path(p).stem().string());
+
+    std::vector<std::string> read_errors;
+    auto loaded = read_mesh_files(a.positional, read_errors, false, threads, L);
+    std::vector<std::string> ids;
+    std::vector<std::shared_ptr<geometry::TriangleMesh>> meshes;
+    for (size_t i = 0; i < loaded.size(); ++i) {
+        const std::string &p = a.positional[i];
+        if (!read_errors[i].empty()) { std::fprintf(stderr, "skip %s: %s\n", p.c_str(), read_errors[i].c_str()); continue; }
+        ids.push_back(fs::path(p).stem().string());
+        meshes.push_back(std::move(loaded[i]));
+    }
+    fs::create_directories(out);
+    const auto errors = build_library(out, ids, meshes, levels, chamfer_samples, threads);
+    size_t ok = 0;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (errors[i].empty()) ++ok;
+        else std::fprintf(stderr, "fail %s: %s\n", ids[i].c_str(), errors[i].c_str());
+    }
+    std::fprintf(stderr, "prepared %zu / %zu candidates -> %s\n", ok, a.positional.size(), out.c_str());
+    return ok > 0 ? 0 : 1;
+}
+
+int cmd_match(int argc, char **argv) {
+    const Args a = parse(argc, argv, 2, {"decide-only", "profile", "cascade", "no-formal"});
+    MatchParams M;
+    M.clearance = a.num("clearance", M.clearance);
+    M.safety_delta = a.num("safety-delta", M.safety_delta);
+    M.topk = (size_t)a.num("topk", (double)M.topk);
+    M.samples = (size_t)a.num("samples", (double)M.samples);
+    M.sampling.method = a.str("sampling", M.sampling.method);
+    M.sampling.seed = (uint64_t)a.num("seed", (double)M.sampling.seed);
+    M.sampling.curvature_weight = a.num("curvature-weight", M.sampling.curvature_weight);
+    M.threads = (int)a.num("threads", M.threads);
+    M.voxel = a.num("voxel", M.voxel);
+    M.fpfh_radius = a.num("fpfh-radius", M.fpfh_radius);
+    M.icp_thr = a.num("icp-thr", M.icp_thr);
+    M.device = a.str("device", M.device);
+    M.decide_only = a.flags.count("decide-only") > 0;
+    M.profile = a.flags.count("profile") > 0;
+    M.cascade = a.flags.count("cascade") > 0;
+    M.final_k = (size_t)a.num("final-k", (double)M.final_k);
+    M.max_align = (size_t)a.num("max-align", (double)M.max_align);
+    M.prune_ratio = a.num("prune-ratio", M.prune_ratio);
+    M.formal = a.flags.count("no-formal") == 0;
+
+    auto lib = CandidateLibrary::open(a.required("library"));
+    auto mT = read_mesh_file(a.required("target"));
+    auto res = match_library(*lib, *mT, M);
+
+    // 通过的在前，再按 chamfer 升序；失败项放最后（级联结果已按名次排好）
+    if (!M.cascade) std::stable_sort(res.begin(), res.end(), [](const MatchResult &x, const MatchResult &y) {
+        const bool ex = !x.result.error.empty(), ey = !y.result.error.empty();
+        if (ex != ey) return ey;
+        if (x.result.pass != y.result.pass) return x.result.pass;
+        return x.result.align.chamfer < y.result.align.chamfer;
+    });
+
+    if (a.has("json")) {
+        std::ofstream f;
+        const std::string path = a.str("json");
+        if (path != "-") {
+            f.open(path);
+            if (!f) throw std::runtime_error("cannot open for writing: " + path);
+        }
+        std::ostream &os = path == "-" ? std::cout : f;
+        os << "[\n";
+        for (size_t i = 0; i < res.size(); ++i) {
+            write_result(os, res[i], M.profile, M.cascade);
+            os << (i + 1 < res.size() ? ",\n" : "\n");
+        }
+        os << "]\n";
+        if (path == "-") return 0;
+    }
+
+    std::printf("%-32s %6s %9s %9s %8s\n", "candidate", "pass", "chamfer", "min_clr", "mirror");
+    for (const auto &r : res) {
+        const BatchOut &o = r.result;
+        if (!o.error.empty()) { std::printf("%-32s  error: %s\n", r.id.c_str(), o.error.c_str()); continue; }
+        if (M.cascade && r.stage < 3) { std::printf("%-32s %6s  cut by %s\n", r.id.c_str(), "no", r.cut_by); continue; }
+        const double min_c = o.decide_only ? o.decide.min_c : o.clr.min_c;
+        std::printf("%-32s %6s %9.3f %9.3f %8s\n", r.id.c_str(), o.pass ? "yes" : "no", o.align.chamfer, min_c,
+                    o.align.mirrored ? "yes" : "no");
+    }
+    std::fprintf(stderr, "%zu candidates evaluated (library: %zu)\n", res.size(), lib->index->size());
+    return 0;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 2) { std::fputs(kUsage, stderr); return 2; }
+    const std::string cmd = argv[1];
+    try {
+        if (cmd == "prepare") return cmd_prepare(argc, argv);
+        if (cmd == "match") return cmd_match(argc, argv);
+        if (cmd == "-h" || cmd == "--help") { std::fputs(kUsage, stdout); return 0; }
+        throw UsageError("unknown command: " + cmd);
+    } catch (const UsageError &e) {
+        std::fprintf(stderr, "shoematch: %s\n%s", e.what(), kUsage);
+        return 2;
+    } catch (const std::exception &e) {
+        std::fprintf(stderr, "shoematch: %s\n", e.what());
+        return 1;
+    }
+}
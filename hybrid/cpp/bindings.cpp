@@ -2,19 +2,22 @@
 // 依赖：Open3D >= 0.18, pybind11, Eigen3
 // 功能：ICP/RANSAC 配准、Chamfer、采样式 SDF、体素窄带 SDF（形式化复核）
 //      最薄点定位、薄壁段聚类与区域标注、剖切线段、批量并行接口
+// 内核在 core/shoematch.{h,cpp}（libshoematch）；这里只做 numpy 视图、GIL 与 dict 转换
 
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
 #include <pybind11/stl.h>
 
-#include <open3d/Open3D.h>
-#include <open3d/t/geometry/TriangleMesh.h>
-#include <open3d/t/geometry/RaycastingScene.h>
+#include "core/shoematch.h"
 
 #include <Eigen/Dense>
-#include <numeric>
-#include <optional>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <set>
+#include <tuple>
 
 #ifdef HYBRID_WITH_OPENMP
   #include <omp.h>
@@ -23,168 +26,280 @@
 namespace py = pybind11;
 using namespace py::literals;
 using namespace open3d;
+using namespace shoematch;
+
+// ----------------------------- 性能计数 -----------------------------
+
+static py::dict stage_dict(double sec, uint64_t calls) { return py::dict("sec"_a = sec, "calls"_a = calls); }
+
+static py::dict profile_to_dict(const Profile &p) {
+    py::dict d;
+    double total = 0;
+    for (int i = 0; i < kStages; ++i) { d[kStageNames[i]] = stage_dict(p.sec[i], p.calls[i]); total += p.sec[i]; }
+    d["total_sec"] = total;
+    d["sdf_points"] = p.sdf_points;
+    d["ransac_correspondences"] = p.ransac_corr;
+    d["ransac_fitness"] = p.ransac_fitness;
+    d["icp_iterations"] = p.icp_iterations;
+    d["icp_fitness"] = p.icp_fitness;
+    d["icp_rmse"] = p.icp_rmse;
+    return d;
+}
+
+static py::dict global_stats_to_dict() {
+    py::dict d;
+    for (int i = 0; i < kStages; ++i)
+        d[kStageNames[i]] = stage_dict(g_stats.ns[i].load() * 1e-9, g_stats.calls[i].load());
+    d["sdf_points"] = g_stats.sdf_points.load();
+    d["ransac_correspondences"] = g_stats.ransac_corr.load();
+    d["icp_iterations"] = g_stats.icp_iterations.load();
+    d["scratch_misses"] = g_stats.scratch_misses.load();
+    d["scratch_bytes"] = g_stats.scratch_bytes.load();
+    return d;
+}
 
 // ----------------------------- 工具函数 -----------------------------
 
-static std::shared_ptr<geometry::TriangleMesh>
-mesh_from_np(py::array_t<double> verts, py::array_t<int> faces) {
-    auto bufV = verts.request();
-    if (bufV.ndim != 2 || bufV.shape[1] != 3) {
-        throw std::runtime_error("verts must be (N,3) float64");
+// numpy 网格视图（需持有 GIL 创建与析构）：C 连续的 float32/float64 顶点、int32/int64 面直接借用，
+// 其它 dtype 或非连续数组在这里统一转换一次；读取裸指针的后续步骤可在释放 GIL 后进行
+struct NpMesh {
+    py::array V, F;                 // 保持缓冲存活
+    const void *pv{nullptr}, *pf{nullptr};
+    size_t nV{0}, nF{0};
+    bool v32{false}, f64{false};
+
+    Eigen::Vector3d vertex(size_t i) const {
+        if (v32) { const float *p = static_cast<const float *>(pv) + 3 * i; return {p[0], p[1], p[2]}; }
+        const double *p = static_cast<const double *>(pv) + 3 * i; return {p[0], p[1], p[2]};
     }
-    auto m = std::make_shared<geometry::TriangleMesh>();
-    m->vertices_.resize(bufV.shape[0]);
-
-    const double* pV = static_cast<const double*>(bufV.ptr);
-    for (ssize_t i = 0; i < bufV.shape[0]; ++i) {
-        m->vertices_[i] = Eigen::Vector3d(pV[3 * i + 0], pV[3 * i + 1], pV[3 * i + 2]);
+    Eigen::Vector3i face(size_t i) const {
+        if (f64) { const int64_t *p = static_cast<const int64_t *>(pf) + 3 * i; return {(int)p[0], (int)p[1], (int)p[2]}; }
+        const int32_t *p = static_cast<const int32_t *>(pf) + 3 * i; return {p[0], p[1], p[2]};
     }
+};
 
-    if (faces.size() > 0) {
-        auto bufF = faces.request();
-        if (bufF.ndim != 2 || bufF.shape[1] != 3) {
-            throw std::runtime_error("faces must be (M,3) int32");
-        }
-        m->triangles_.resize(bufF.shape[0]);
-        const int* pF = static_cast<const int*>(bufF.ptr);
-        for (ssize_t i = 0; i < bufF.shape[0]; ++i) {
-            m->triangles_[i] = Eigen::Vector3i(pF[3 * i + 0], pF[3 * i + 1], pF[3 * i + 2]);
+static NpMesh np_mesh(py::handle verts, py::handle faces) {
+    constexpr int kC = py::array::c_style;
+    NpMesh m;
+    if (py::isinstance<py::array_t<float, kC>>(verts)) { m.V = py::reinterpret_borrow<py::array>(verts); m.v32 = true; }
+    else if (py::isinstance<py::array_t<double, kC>>(verts)) m.V = py::reinterpret_borrow<py::array>(verts);
+    else m.V = py::array_t<double, kC | py::array::forcecast>::ensure(verts);
+    if (!m.V || m.V.ndim() != 2 || m.V.shape(1) != 3) {
+        throw std::runtime_error("verts must be (N,3) float32/float64");
+    }
+    m.nV = (size_t)m.V.shape(0); m.pv = m.V.data();
+
+    if (py::len(faces) > 0) {
+        if (py::isinstance<py::array_t<int32_t, kC>>(faces)) m.F = py::reinterpret_borrow<py::array>(faces);
+        else if (py::isinstance<py::array_t<int64_t, kC>>(faces)) { m.F = py::reinterpret_borrow<py::array>(faces); m.f64 = true; }
+        else m.F = py::array_t<int32_t, kC | py::array::forcecast>::ensure(faces);
+        if (!m.F || m.F.ndim() != 2 || m.F.shape(1) != 3) {
+            throw std::runtime_error("faces must be (M,3) int32/int64");
         }
+        m.nF = (size_t)m.F.shape(0); m.pf = m.F.data();
     }
+    return m;
+}
 
-    if (!m->triangles_.empty()) {
-        m->RemoveDegenerateTriangles();
-        m->RemoveDuplicatedTriangles();
-    }
-    m->RemoveDuplicatedVertices();
-    m->RemoveUnreferencedVertices();
+static std::shared_ptr<geometry::TriangleMesh> legacy_from_np(const NpMesh &v) {
+    StageTimer st(Stage::Ingest);
+    auto m = std::make_shared<geometry::TriangleMesh>();
+    m->vertices_.resize(v.nV);
+    for (size_t i = 0; i < v.nV; ++i) m->vertices_[i] = v.vertex(i);
+    m->triangles_.resize(v.nF);
+    for (size_t i = 0; i < v.nF; ++i) m->triangles_[i] = v.face(i);
     return m;
 }
 
-static std::shared_ptr<geometry::PointCloud>
-sample_pcd(geometry::TriangleMesh &m, size_t n) {
-    if (m.triangles_.empty()) {
-        // 如果没有面，则用顶点构建点云
-        auto p = std::make_shared<geometry::PointCloud>();
-        p->points_ = m.vertices_;
-        return p;
-    }
-    return m.SamplePointsUniformly(n);
-}
-
-static void est_normals(geometry::PointCloud &pcd, double radius) {
-    pcd.EstimateNormals(geometry::KDTreeSearchParamHybrid(radius, 60));
-    pcd.NormalizeNormals();
-}
-
-static Eigen::Matrix4d ransac(geometry::PointCloud &src, geometry::PointCloud &tgt,
-                              double radius, double voxel) {
-    est_normals(src, radius);
-    est_normals(tgt, radius);
-
-    auto fsrc = pipelines::registration::ComputeFPFHFeature(
-        src, geometry::KDTreeSearchParamHybrid(radius, 100));
-    auto ftgt = pipelines::registration::ComputeFPFHFeature(
-        tgt, geometry::KDTreeSearchParamHybrid(radius, 100));
-
-    const double thr = voxel * 3.0;
-    std::vector<std::reference_wrapper<const pipelines::registration::CorrespondenceChecker>> checkers;
-    auto checker = std::make_shared<pipelines::registration::CorrespondenceCheckerBasedOnDistance>(thr);
-    checkers.push_back(*checker);
-    auto result = pipelines::registration::RegistrationRANSACBasedOnFeatureMatching(
-        src, tgt, *fsrc, *ftgt, true, thr,
-        pipelines::registration::TransformationEstimationPointToPoint(false), 4,
-        checkers,
-        pipelines::registration::RANSACConvergenceCriteria(8000, 1000));
-    return result.transformation_;
-}
-
-static Eigen::Matrix4d icp(geometry::PointCloud &src, geometry::PointCloud &tgt,
-                           const Eigen::Matrix4d &init, double thr) {
-    est_normals(tgt, thr);
-    auto result = pipelines::registration::RegistrationICP(
-        src, tgt, thr, init,
-        pipelines::registration::TransformationEstimationPointToPlane());
-    return result.transformation_;
-}
-
-static double chamfer(const geometry::PointCloud &A, const geometry::PointCloud &B) {
-    geometry::KDTreeFlann kdb(B), kda(A);
-    double sum = 0;
-    size_t n = 0;
-    std::vector<int> idx(1);
-    std::vector<double> dist(1);
-
-    for (const auto &p : A.points_) {
-        if (kdb.SearchKNN(p, 1, idx, dist)) {
-            sum += std::sqrt(dist[0]);
-            ++n;
-        }
+// 只拷贝 numpy 数据（需持有 GIL）；清理交给 clean_mesh，可在释放 GIL 后进行
+static std::shared_ptr<geometry::TriangleMesh> mesh_copy_np(py::handle verts, py::handle faces) {
+    return legacy_from_np(np_mesh(verts, faces));
+}
+
+static std::shared_ptr<geometry::TriangleMesh>
+mesh_from_np(py::handle verts, py::handle faces) {
+    auto m = mesh_copy_np(verts, faces);
+    clean_mesh(*m);
+    return m;
+}
+
+static py::tuple mesh_to_np(const geometry::TriangleMesh &m) {
+    py::array_t<double> V({(ssize_t)m.vertices_.size(), (ssize_t)3});
+    py::array_t<int> F({(ssize_t)m.triangles_.size(), (ssize_t)3});
+    if (!m.vertices_.empty()) std::memcpy(V.mutable_data(), m.vertices_[0].data(), sizeof(double) * 3 * m.vertices_.size());
+    if (!m.triangles_.empty()) std::memcpy(F.mutable_data(), m.triangles_[0].data(), sizeof(int) * 3 * m.triangles_.size());
+    return py::make_tuple(V, F);
+}
+
+static py::array_t<double> points_to_np(const std::shared_ptr<geometry::PointCloud> &p) {
+    const size_t n = p ? p->points_.size() : 0;
+    py::array_t<double> A({(ssize_t)n, (ssize_t)3});
+    if (n) std::memcpy(A.mutable_data(), p->points_[0].data(), sizeof(double) * 3 * n);
+    return A;
+}
+
+static py::array_t<double> mat4_to_np(const Eigen::Matrix4d &T) {
+    py::array_t<double> Tnp({4, 4});
+    auto r = Tnp.mutable_unchecked<2>();
+    for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) r(i, j) = T(i, j);
+    return Tnp;
+}
+
+static Eigen::Matrix4d mat4_from_np(py::array_t<double> T) {
+    auto buf = T.request();
+    if (buf.ndim != 2 || buf.shape[0] != 4 || buf.shape[1] != 4) throw std::runtime_error("T must be (4,4) float64");
+    auto r = T.unchecked<2>();
+    Eigen::Matrix4d M;
+    for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) M(i, j) = r(i, j);
+    return M;
+}
+
+// RaycastingScene 只收 Float32 顶点 + UInt32 索引（AddTriangles 内部自行拷贝进 BVH 缓冲）：
+// float32 顶点与 int32 面直接包成 Tensor 不拷贝，其余只做一次逐元素转换，不经过 legacy/FromLegacy
+static void add_np_to_scene(t::geometry::RaycastingScene &scene, const NpMesh &m) {
+    auto borrow = [](const void *p) {
+        return std::make_shared<core::Blob>(core::Device("CPU:0"), const_cast<void *>(p), [](void *) {});
+    };
+    const int64_t nV = (int64_t)m.nV, nF = (int64_t)m.nF;
+    core::Tensor V, F;
+    if (m.v32) {
+        V = core::Tensor({nV, 3}, {3, 1}, const_cast<void *>(m.pv), core::Float32, borrow(m.pv));
+    } else {
+        V = core::Tensor::Empty({nV, 3}, core::Float32);
+        float *dst = V.GetDataPtr<float>();
+        const double *src = static_cast<const double *>(m.pv);
+        for (int64_t i = 0; i < 3 * nV; ++i) dst[i] = (float)src[i];
     }
-    for (const auto &p : B.points_) {
-        if (kda.SearchKNN(p, 1, idx, dist)) {
-            sum += std::sqrt(dist[0]);
-            ++n;
+    if (!m.f64) {
+        const int32_t *src = static_cast<const int32_t *>(m.pf);
+        for (int64_t i = 0; i < 3 * nF; ++i)
+            if (src[i] < 0 || src[i] >= nV) throw std::runtime_error("face index out of range");
+        // int32 与 uint32 字节布局相同，索引已校验非负
+        F = core::Tensor({nF, 3}, {3, 1}, const_cast<void *>(m.pf), core::UInt32, borrow(m.pf));
+    } else {
+        F = core::Tensor::Empty({nF, 3}, core::UInt32);
+        uint32_t *dst = F.GetDataPtr<uint32_t>();
+        const int64_t *src = static_cast<const int64_t *>(m.pf);
+        for (int64_t i = 0; i < 3 * nF; ++i) {
+            if (src[i] < 0 || src[i] >= nV) throw std::runtime_error("face index out of range");
+            dst[i] = (uint32_t)src[i];
         }
     }
-    return n ? sum / n : 1e9;
+    StageTimer st(Stage::BVH);
+    scene.AddTriangles(V, F);
 }
 
-// ----------------------------- 粗特征 -----------------------------
-
-struct CoarseFeat {
-    double volume{0};
-    double area{0};
-    Eigen::Vector3d extents{0, 0, 0};
-    std::vector<float> hist; // 8 x 16 方向直方图
-};
+// 候选 BVH：assume_clean 时 numpy 缓冲直接入 scene；否则先做 legacy 清理
+// （重复三角形会破坏占据判定的射线奇偶计数）
+static void scene_from_np(t::geometry::RaycastingScene &scene, const NpMesh &m, bool assume_clean) {
+    if (assume_clean) { add_np_to_scene(scene, m); return; }
+    auto mC = legacy_from_np(m);
+    clean_mesh(*mC);
+    scene_add_legacy(scene, *mC);
+}
 
-static CoarseFeat coarse_features_from_mesh(const geometry::TriangleMesh &m) {
-    CoarseFeat f{};
-    auto bb = m.GetAxisAlignedBoundingBox();
-    f.extents = bb.GetExtent();
-    f.area = m.GetSurfaceArea();
-
-    double vol = 0.0; // signed volume by tetra origin
-    for (auto &tri : m.triangles_) {
-        const auto &a = m.vertices_[tri(0)];
-        const auto &b = m.vertices_[tri(1)];
-        const auto &c = m.vertices_[tri(2)];
-        vol += a.dot(b.cross(c));
-    }
-    f.volume = std::abs(vol / 6.0);
-
-    const int B1 = 8, B2 = 16;
-    f.hist.assign(B1 * B2, 0.f);
-    for (auto &tri : m.triangles_) {
-        const auto &a = m.vertices_[tri(0)];
-        const auto &b = m.vertices_[tri(1)];
-        const auto &c = m.vertices_[tri(2)];
-        Eigen::Vector3d n = (b - a).cross(c - a);
-        double len = n.norm();
-        if (len < 1e-12) continue;
-        n /= len;
-        double theta = std::acos(std::max(-1.0, std::min(1.0, n.z())));
-        double phi = std::atan2(n.y(), n.x());
-        if (phi < 0) phi += 2 * M_PI;
-        int i = std::min(B1 - 1, int(theta / M_PI * B1));
-        int j = std::min(B2 - 1, int(phi / (2 * M_PI) * B2));
-        f.hist[i * B2 + j] += 1.f;
-    }
-    float s = 0.f;
-    for (float v : f.hist) s += v;
-    if (s > 0) for (float &v : f.hist) v /= s;
-    return f;
+// 同上，包成已 commit 的句柄（单位变换）；可在释放 GIL 后调用
+static ClearanceScene clearance_scene_from_np(const NpMesh &m, bool assume_clean) {
+    auto s = std::make_shared<t::geometry::RaycastingScene>();
+    scene_from_np(*s, m, assume_clean);
+    return ClearanceScene(std::move(s));
 }
 
-py::dict coarse_features(py::array_t<double> v, py::array_t<int> f) {
-    auto m = mesh_from_np(v, f);
-    auto cf = coarse_features_from_mesh(*m);
+// ----------------------------- 粗特征 -----------------------------
+
+static py::dict coarse_feat_to_dict(const CoarseFeat &cf) {
     py::dict out;
     out["volume"] = cf.volume;
     out["area"] = cf.area;
     out["extents"] = py::make_tuple(cf.extents.x(), cf.extents.y(), cf.extents.z());
     out["normal_hist"] = cf.hist;
+    out["pca_extents"] = py::make_tuple(cf.pca_extents.x(), cf.pca_extents.y(), cf.pca_extents.z());
+    out["d2_hist"] = cf.d2;
+    out["width_profile"] = cf.width;
+    return out;
+}
+
+py::dict coarse_features(py::array_t<double> v, py::array_t<int> f) {
+    auto m = mesh_copy_np(v, f);
+    CoarseFeat cf;
+    {
+        py::gil_scoped_release nogil;
+        clean_mesh(*m);
+        cf = coarse_features_from_mesh(*m);
+    }
+    return coarse_feat_to_dict(cf);
+}
+
+// ----------------------------- 预处理候选缓存 -----------------------------
+
+std::shared_ptr<PreparedMesh> prepare_mesh(py::array_t<double> v, py::array_t<int> f,
+                                           std::vector<std::pair<double, double>> levels,
+                                           size_t chamfer_samples) {
+    auto m = mesh_from_np(v, f);
+    py::gil_scoped_release nogil;
+    return prepare_from_mesh(std::move(m), levels, chamfer_samples);
+}
+
+// ----------------------------- 网格读取 -----------------------------
+// .3dm 走 openNURBS（read_3dm），其余走 Open3D；读取与清理都在 C++ 内完成，只在返回时转成 numpy
+
+// 与 load_3dm_enhanced 的 mesh_quality 对应（无渲染网格时的网格边长）
+static Load3dmParams load_params(const std::string &quality, bool render_meshes) {
+    Load3dmParams P;
+    if (quality == "low") P.max_edge = 10.0;
+    else if (quality == "medium") P.max_edge = 5.0;
+    else if (quality == "high") P.max_edge = 2.5;
+    else throw std::runtime_error("mesh_quality must be 'low', 'medium' or 'high'");
+    P.render_meshes = render_meshes;
+    return P;
+}
+
+py::tuple load_mesh(const std::string &path, bool clean, const std::string &mesh_quality, bool render_meshes) {
+    const Load3dmParams P = load_params(mesh_quality, render_meshes);
+    std::shared_ptr<geometry::TriangleMesh> m;
+    {
+        py::gil_scoped_release nogil;
+        m = read_mesh_file(path, P);
+        if (clean) clean_mesh(*m);
+    }
+    return mesh_to_np(*m);
+}
+
+py::tuple load_meshes(std::vector<std::string> paths, bool clean, int threads,
+                      const std::string &mesh_quality, bool render_meshes) {
+    const Load3dmParams P = load_params(mesh_quality, render_meshes);
+    std::vector<std::shared_ptr<geometry::TriangleMesh>> meshes;
+    std::vector<std::string> errors;
+    {
+        py::gil_scoped_release nogil;
+        meshes = read_mesh_files(paths, errors, clean, threads, P);
+    }
+    py::list out, errs;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        out.append(meshes[i] ? py::object(mesh_to_np(*meshes[i])) : py::object(py::none()));
+        errs.append(errors[i].empty() ? py::object(py::none()) : py::object(py::str(errors[i])));
+    }
+    return py::make_tuple(out, errs);
+}
+
+// ----------------------------- 粗特征索引 -----------------------------
+
+py::list feature_index_query(const FeatureIndex &fi, py::array_t<double> v_tgt, py::array_t<int> f_tgt,
+                             double clearance, size_t k, double w_hist, double vol_tol,
+                             double w_d2, double w_width, double max_width_shortfall) {
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    std::vector<FeatureIndex::Hit> hits;
+    {
+        py::gil_scoped_release nogil;
+        clean_mesh(*mT);
+        hits = fi.query(coarse_features_from_mesh(*mT), clearance, k, w_hist, vol_tol,
+                        w_d2, w_width, max_width_shortfall);
+    }
+    py::list out;
+    for (const auto &h : hits)
+        out.append(py::dict("id"_a = fi.ids[h.idx], "index"_a = h.idx, "score"_a = h.score,
+                            "volume"_a = fi.volume[h.idx],
+                            "extents"_a = py::make_tuple(fi.e0[h.idx], fi.e1[h.idx], fi.e2[h.idx])));
     return out;
 }
 
@@ -195,315 +310,719 @@ py::dict align_icp(py::array_t<double> v_src, py::array_t<int> f_src,
                    double voxel, double fpfh_radius, double icp_thr) {
     auto mS = mesh_from_np(v_src, f_src);
     auto mT = mesh_from_np(v_tgt, f_tgt);
-    auto pS = sample_pcd(*mS, 50000)->VoxelDownSample(voxel);
-    auto pT = sample_pcd(*mT, 50000)->VoxelDownSample(voxel);
+    auto pS = downsample(*sample_pcd(*mS, 50000), voxel);
+    auto pT = downsample(*sample_pcd(*mT, 50000), voxel);
 
     Eigen::Matrix4d T0 = ransac(*pS, *pT, fpfh_radius, voxel);
     Eigen::Matrix4d T = icp(*pS, *pT, T0, icp_thr);
 
-    auto S_aligned = *mS;
-    S_aligned.Transform(T);
-    auto pSa = sample_pcd(S_aligned, 20000);
+    // 刚体变换与均匀采样可交换：采原网格再变换点云，不复制网格
+    auto pSa = sample_pcd(*mS, 20000);
+    pSa->Transform(T);
     auto pTb = sample_pcd(*mT, 20000);
     double ch = chamfer(*pSa, *pTb);
 
-    py::array_t<double> Tnp({4, 4});
-    auto r = Tnp.mutable_unchecked<2>();
-    for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) r(i, j) = T(i, j);
-
     py::dict out;
-    out["T"] = Tnp;
+    out["T"] = mat4_to_np(T);
     out["chamfer"] = ch;
     return out;
 }
 
 py::dict align_icp_with_mirror(py::array_t<double> v_src, py::array_t<int> f_src,
                                py::array_t<double> v_tgt, py::array_t<int> f_tgt,
-                               double voxel, double fpfh_radius, double icp_thr) {
+                               double voxel, double fpfh_radius, double icp_thr, const std::string &device,
+                               bool profile) {
+    Profile prof;
+    ProfileScope ps(profile ? &prof : nullptr);
     auto mS = mesh_from_np(v_src, f_src);
     auto mT = mesh_from_np(v_tgt, f_tgt);
-    auto pT = sample_pcd(*mT, 50000)->VoxelDownSample(voxel);
-
-    // 原始
-    auto pS0 = sample_pcd(*mS, 50000)->VoxelDownSample(voxel);
-    Eigen::Matrix4d T0 = icp(*pS0, *pT, ransac(*pS0, *pT, fpfh_radius, voxel), icp_thr);
-    auto Sa = *mS; Sa.Transform(T0);
-    double ch0 = chamfer(*sample_pcd(Sa, 20000), *sample_pcd(*mT, 20000));
-
-    // 镜像（YZ 平面，x -> -x）
-    Eigen::Matrix4d M = Eigen::Matrix4d::Identity(); M(0, 0) = -1.0;
-    auto Sm = *mS; Sm.Transform(M);
-    auto pSm = sample_pcd(Sm, 50000)->VoxelDownSample(voxel);
-    Eigen::Matrix4d Tm = icp(*pSm, *pT, ransac(*pSm, *pT, fpfh_radius, voxel), icp_thr);
-    auto Sb = Sm; Sb.Transform(Tm);
-    double chm = chamfer(*sample_pcd(Sb, 20000), *sample_pcd(*mT, 20000));
-
-    Eigen::Matrix4d Tbest = (chm < ch0 ? (Tm * M) : T0);
-    bool mirrored = (chm < ch0);
-    double ch = std::min(ch0, chm);
+    const core::Device dev = resolve_device(device);
+    AlignResult o;
+    {
+        // 原始与镜像（YZ 平面，x -> -x）共享两侧的采样、法向与 FPFH，两分支并发
+        py::gil_scoped_release nogil;
+        auto tgt = make_target_context(*mT, voxel, fpfh_radius, icp_thr, 0);
+        target_to_device(tgt, dev);
+        auto chS = sample_pcd(*mS, 20000);
+        RegLevel L = make_level(*mS, voxel, fpfh_radius);
+        level_to_device(L, dev);
+        o = align_dual(L, *chS, geometry::KDTreeFlann(*chS), tgt, icp_thr);
+    }
+    py::dict out("T"_a = mat4_to_np(o.T), "chamfer"_a = o.chamfer, "mirrored"_a = o.mirrored);
+    if (profile) out["profile"] = profile_to_dict(prof);
+    return out;
+}
 
-    py::array_t<double> Tnp({4, 4});
-    auto r = Tnp.mutable_unchecked<2>();
-    for (int i = 0; i < 4; ++i) for (int j = 0; j < 4; ++j) r(i, j) = Tbest(i, j);
+py::dict align_prepared_with_mirror(std::shared_ptr<PreparedMesh> src,
+                                    py::array_t<double> v_tgt, py::array_t<int> f_tgt,
+                                    double voxel, double fpfh_radius, double icp_thr, const std::string &device,
+                                    bool profile) {
+    if (!src) throw std::runtime_error("src is None");
+    Profile prof;
+    ProfileScope ps(profile ? &prof : nullptr);
+    auto mT = mesh_from_np(v_tgt, f_tgt);
+    const core::Device dev = resolve_device(device);
+    AlignResult o;
+    {
+        py::gil_scoped_release nogil;
+        auto tgt = make_target_context(*mT, voxel, fpfh_radius, icp_thr, 0);
+        target_to_device(tgt, dev);
+        src->to_device(dev);
+        RegLevel scratch;
+        o = align_dual(level_or_make(*src, voxel, fpfh_radius, scratch, dev), *src->chamfer_pts, *src->chamfer_kd,
+                       tgt, icp_thr);
+    }
+    py::dict out("T"_a = mat4_to_np(o.T), "chamfer"_a = o.chamfer, "mirrored"_a = o.mirrored);
+    if (profile) out["profile"] = profile_to_dict(prof);
+    return out;
+}
+
+// ----------------------------- 多尺度 / 多起点配准 -----------------------------
+
+static py::dict hypothesis_to_dict(const Hypothesis &h) {
+    return py::dict("T"_a = mat4_to_np(h.T), "chamfer"_a = h.chamfer, "mirrored"_a = h.mirrored,
+                    "scale"_a = h.scale, "start"_a = h.start);
+}
 
-    return py::dict("T"_a = Tnp, "chamfer"_a = ch, "mirrored"_a = mirrored);
+py::dict align_multi(py::array v_src, py::array f_src, py::array v_tgt, py::array f_tgt,
+                     std::vector<double> scales, std::vector<std::tuple<double, double, double>> param_sets,
+                     bool mirror, double prune_ratio) {
+    auto mS = mesh_copy_np(v_src, f_src);
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    Eigen::Vector3d c = Eigen::Vector3d::Zero();
+    for (const auto &p : mS->vertices_) c += p;
+    if (!mS->vertices_.empty()) c /= (double)mS->vertices_.size();
+    std::vector<RegParams> params;
+    for (const auto &ps : param_sets) params.push_back({std::get<0>(ps), std::get<1>(ps), std::get<2>(ps)});
+
+    MultiOut o;
+    {
+        py::gil_scoped_release nogil;
+        clean_mesh(*mS); clean_mesh(*mT);
+        o = align_multi_mesh(*mS, c, *mT, scales, params, mirror, prune_ratio);
+    }
+    if (o.best < 0) throw std::runtime_error("align_multi: no hypothesis survived");
+
+    py::dict out = hypothesis_to_dict(o.hyps[o.best]);
+    py::list per_scale, hyps;
+    for (int b : o.best_per_scale) per_scale.append(b >= 0 ? py::object(hypothesis_to_dict(o.hyps[b])) : py::object(py::none()));
+    for (const auto &h : o.hyps) {
+        py::dict d("scale"_a = h.scale, "start"_a = h.start, "mirrored"_a = h.mirrored, "pruned"_a = h.pruned,
+                   "score"_a = h.score, "chamfer"_a = h.chamfer);
+        if (!h.error.empty()) d["error"] = h.error;
+        hyps.append(d);
+    }
+    out["per_scale"] = per_scale;
+    out["hypotheses"] = hyps;
+    return out;
 }
 
 // ----------------------------- 采样式 SDF 余量 -----------------------------
 
-py::dict clearance_sampling(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
-                            py::array_t<double> v_cand, py::array_t<int> f_cand,
-                            double clearance, double safety_delta, size_t samples) {
-    auto mT = mesh_from_np(v_tgt, f_tgt);
-    auto mC = mesh_from_np(v_cand, f_cand);
-    auto pts = mT->SamplePointsUniformly(samples);
-
-    t::geometry::TriangleMesh tmC = t::geometry::TriangleMesh::FromLegacy(*mC);
-    t::geometry::RaycastingScene scene; scene.AddTriangles(tmC);
-
-    std::vector<float> buf; buf.reserve(pts->points_.size() * 3);
-    for (auto &p : pts->points_) { buf.push_back((float)p.x()); buf.push_back((float)p.y()); buf.push_back((float)p.z()); }
-    core::Tensor q(buf, {(int64_t)pts->points_.size(), 3}, core::Float32);
-
-    auto sdist = scene.ComputeSignedDistance(q); // negative inside
-    auto inside = scene.ComputeOccupancy(q);
-
-    std::vector<float> sdv(sdist.GetDataPtr<float>(), sdist.GetDataPtr<float>() + sdist.NumElements());
-    std::vector<float> inv(inside.GetDataPtr<float>(), inside.GetDataPtr<float>() + inside.NumElements());
-
-    std::vector<double> inner; inner.reserve(sdv.size()); size_t inside_cnt = 0;
-    for (size_t i = 0; i < sdv.size(); ++i) {
-        // inv[i] > 0.5f means the point is INSIDE the candidate mesh
-        // sdv[i] is negative when inside, positive when outside
-        // For clearance, we want the absolute distance when inside
-        if (inv[i] > 0.5f) { 
-            inside_cnt++; 
-            // Use absolute value of signed distance as clearance
-            inner.push_back(std::abs((double)sdv[i])); 
+// 分位数键名：整数百分位输出 pNN_clearance，另附完整 quantiles 列表与直方图
+static void put_quantiles(py::dict &out, const ClearanceResult &st) {
+    for (const auto &qv : st.quantiles) {
+        double pct = qv.first * 100.0;
+        if (std::abs(pct - std::round(pct)) < 1e-9) {
+            char key[32];
+            std::snprintf(key, sizeof(key), "p%02d_clearance", (int)std::round(pct));
+            out[key] = qv.second;
         }
     }
-    double inside_ratio = (double)inside_cnt / std::max<size_t>(1, sdv.size());
+    out["quantiles"] = st.quantiles;
+    out["hist"] = st.hist;
+    out["hist_range"] = py::make_tuple(0.0, st.hist_max);
+}
+
+static py::dict clearance_to_dict(const ClearanceResult &st, double clearance) {
+    // Pass only if ALL points are inside AND minimum clearance is sufficient (0.1% tolerance for numerical errors)
+    py::dict out("pass"_a = clearance_pass(st, clearance), "min_clearance"_a = st.min_c, "mean_clearance"_a = st.mean_c,
+                 "p01_clearance"_a = st.p01, "inside_ratio"_a = st.inside_ratio);
+    put_quantiles(out, st);
+    return out;
+}
+
+static py::dict decide_to_dict(const DecideOut &d) {
+    return py::dict("pass"_a = d.pass, "decided_by"_a = d.decided_by, "evaluated"_a = d.evaluated,
+                    "min_clearance"_a = d.min_c,
+                    "inside_ratio"_a = (double)(d.evaluated - d.n_outside) / std::max<size_t>(1, d.evaluated));
+}
+
+// 三个重载共用：目标清理 + 采样，再对候选句柄查询；cand() 在释放 GIL 后调用（BVH 在其中构建或复用）
+template <class Cand>
+static py::dict clearance_sampling_with(py::array v_tgt, py::array f_tgt, Cand &&cand, double clearance,
+                                        size_t samples, bool decide_only, const QuantileSpec &spec,
+                                        bool assume_clean, bool profile) {
+    Profile prof;
+    ProfileScope ps(profile ? &prof : nullptr);
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    ClearanceResult st;
+    DecideOut d;
+    {
+        py::gil_scoped_release nogil;
+        if (!assume_clean) clean_mesh(*mT);
+        auto pts = sample_target(*mT, samples);
+        const ClearanceScene cs = cand();
+        if (decide_only) d = clearance_decide(cs, pts->points_, clearance);
+        else st = clearance_stats(cs, pts->points_, spec);
+    }
+    py::dict out = decide_only ? decide_to_dict(d) : clearance_to_dict(st, clearance);
+    if (profile) out["profile"] = profile_to_dict(prof);
+    return out;
+}
+
+py::dict clearance_sampling(py::array v_tgt, py::array f_tgt, py::array v_cand, py::array f_cand,
+                            double clearance, double safety_delta, size_t samples, bool decide_only,
+                            std::vector<double> quantiles, int hist_bins, double hist_max, bool assume_clean,
+                            bool profile) {
+    const NpMesh vC = np_mesh(v_cand, f_cand);
+    return clearance_sampling_with(v_tgt, f_tgt, [&] { return clearance_scene_from_np(vC, assume_clean); },
+                                   clearance, samples, decide_only, make_spec(quantiles, hist_bins, hist_max),
+                                   assume_clean, profile);
+}
+
+// 候选已预处理：BVH 在局部坐标系复用，T 为候选到目标的对齐变换（相似变换）
+py::dict clearance_sampling_prepared(py::array v_tgt, py::array f_tgt,
+                                     std::shared_ptr<PreparedMesh> cand, py::array_t<double> T,
+                                     double clearance, double safety_delta, size_t samples, bool decide_only,
+                                     std::vector<double> quantiles, int hist_bins, double hist_max,
+                                     bool assume_clean, bool profile) {
+    if (!cand) throw std::runtime_error("cand is None");
+    const Eigen::Matrix4d Tm = mat4_from_np(T);
+    return clearance_sampling_with(v_tgt, f_tgt, [&] { return ClearanceScene::of(cand).at(Tm); },
+                                   clearance, samples, decide_only, make_spec(quantiles, hist_bins, hist_max),
+                                   assume_clean, profile);
+}
 
-    double min_c = 0, mean_c = 0, p01 = 0; bool pass = false;
-    if (!inner.empty()) {
-        std::sort(inner.begin(), inner.end());
-        min_c = inner.front();  // Minimum clearance (smallest distance from target to candidate interior)
-        mean_c = std::accumulate(inner.begin(), inner.end(), 0.0) / inner.size();
-        size_t k = (size_t)std::floor(0.01 * inner.size());
-        if (k >= inner.size()) k = inner.size() - 1;
-        p01 = inner[k];
-        // Pass only if ALL points are inside (inside_ratio == 1.0) AND minimum clearance is sufficient
-        pass = (inside_ratio >= 0.999) && (min_c >= clearance);  // Allow 0.1% tolerance for numerical errors
+// 候选句柄（已带变换）：跨尺度 / 对齐假设复用同一 BVH
+py::dict clearance_sampling_scene(py::array v_tgt, py::array f_tgt, const ClearanceScene &cand,
+                                  double clearance, double safety_delta, size_t samples, bool decide_only,
+                                  std::vector<double> quantiles, int hist_bins, double hist_max,
+                                  bool assume_clean, bool profile) {
+    return clearance_sampling_with(v_tgt, f_tgt, [&] { return cand; }, clearance, samples, decide_only,
+                                   make_spec(quantiles, hist_bins, hist_max), assume_clean, profile);
+}
+
+// 复用的目标采样集：本次调用只剩候选侧 BVH 查询
+py::dict clearance_sampling_set(const TargetSamples &tgt, const ClearanceScene &cand,
+                                double clearance, double safety_delta, bool decide_only,
+                                std::vector<double> quantiles, int hist_bins, double hist_max, bool profile) {
+    if (!tgt.pts) throw std::runtime_error("TargetSamples is empty");
+    Profile prof;
+    ProfileScope ps(profile ? &prof : nullptr);
+    const QuantileSpec spec = make_spec(quantiles, hist_bins, hist_max);
+    ClearanceResult st;
+    DecideOut d;
+    {
+        py::gil_scoped_release nogil;
+        if (decide_only) d = clearance_decide(cand, tgt.pts->points_, clearance);
+        else st = clearance_stats(cand, tgt.pts->points_, spec);
     }
-    return py::dict("pass"_a = pass, "min_clearance"_a = min_c, "mean_clearance"_a = mean_c,
-                    "p01_clearance"_a = p01, "inside_ratio"_a = inside_ratio);
+    py::dict out = decide_only ? decide_to_dict(d) : clearance_to_dict(st, clearance);
+    if (profile) out["profile"] = profile_to_dict(prof);
+    return out;
 }
 
 // ----------------------------- 批量并行：对齐 + 采样 SDF -----------------------------
 
+static py::dict batch_out_fields(const BatchOut &o) {
+    if (!o.error.empty()) return py::dict("error"_a = o.error);
+    if (o.decide_only)
+        return py::dict("mirrored"_a = o.align.mirrored, "chamfer"_a = o.align.chamfer,
+                        "min_clearance"_a = o.decide.min_c, "pass"_a = o.pass,
+                        "decided_by"_a = o.decide.decided_by, "evaluated"_a = o.decide.evaluated,
+                        "T"_a = mat4_to_np(o.align.T));
+    py::dict out("mirrored"_a = o.align.mirrored, "chamfer"_a = o.align.chamfer,
+                 "min_clearance"_a = o.clr.min_c, "mean_clearance"_a = o.clr.mean_c,
+                 "p01_clearance"_a = o.clr.p01, "pass"_a = o.pass, "T"_a = mat4_to_np(o.align.T));
+    put_quantiles(out, o.clr);
+    return out;
+}
+
+static py::dict batch_out_to_dict(const BatchOut &o, bool profile) {
+    py::dict d = batch_out_fields(o);
+    if (profile) d["profile"] = profile_to_dict(o.prof);
+    return d;
+}
+
+static py::list batch_outs_to_list(const std::vector<BatchOut> &outs, bool profile) {
+    py::list L; for (const auto &o : outs) L.append(batch_out_to_dict(o, profile));
+    return L;
+}
+
 py::list batch_align_and_check(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
                                std::vector<py::array_t<double>> V_cands,
                                std::vector<py::array_t<int>> F_cands,
                                double voxel, double fpfh_radius, double icp_thr,
                                double clearance, double safety_delta, size_t samples,
-                               int threads) {
-    auto mT = mesh_from_np(v_tgt, f_tgt);
+                               int threads, bool decide_only,
+                               std::vector<double> quantiles, int hist_bins, double hist_max,
+                               const std::string &device, bool profile,
+                               const std::string &sampling, uint64_t seed, double curvature_weight) {
+    if (V_cands.size() != F_cands.size()) throw std::runtime_error("V_cands and F_cands must have the same length");
+    const BatchParams P{voxel, fpfh_radius, icp_thr, clearance, safety_delta, decide_only,
+                         make_spec(quantiles, hist_bins, hist_max), resolve_device(device), profile,
+                         SampleParams{sampling, seed, curvature_weight}};
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+
+    const int n = (int)V_cands.size();
+    std::vector<std::shared_ptr<geometry::TriangleMesh>> meshes(n);
+    std::vector<BatchOut> outs(n);
+    for (int i = 0; i < n; ++i) {
+        ProfileScope ps(profile ? &outs[i].prof : nullptr);
+        try {
+            meshes[i] = mesh_copy_np(V_cands[i], F_cands[i]);
+        } catch (const std::exception &e) {
+            outs[i].error = e.what();
+        }
+    }
 
-    py::gil_scoped_release nogil;
-#ifdef HYBRID_WITH_OPENMP
-    if (threads > 0) omp_set_num_threads(threads);
-#endif
+    {
+        py::gil_scoped_release nogil;
+        run_batch(*mT, meshes, P, samples, threads, outs);
+    }
+    return batch_outs_to_list(outs, profile);
+}
 
-    std::vector<py::dict> outs(V_cands.size());
+// 预处理候选版本：循环内只做配准与 BVH 查询，不接触任何 Python 对象
+py::list batch_align_and_check_prepared(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
+                                        std::vector<std::shared_ptr<PreparedMesh>> cands,
+                                        double voxel, double fpfh_radius, double icp_thr,
+                                        double clearance, double safety_delta, size_t samples,
+                                        int threads, bool decide_only,
+                                        std::vector<double> quantiles, int hist_bins, double hist_max,
+                                        const std::string &device, bool profile,
+                                        const std::string &sampling, uint64_t seed, double curvature_weight) {
+    const BatchParams P{voxel, fpfh_radius, icp_thr, clearance, safety_delta, decide_only,
+                         make_spec(quantiles, hist_bins, hist_max), resolve_device(device), profile,
+                         SampleParams{sampling, seed, curvature_weight}};
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    std::vector<BatchOut> outs(cands.size());
+    {
+        py::gil_scoped_release nogil;
+        clean_mesh(*mT);
+        run_batch_prepared(*mT, cands, P, samples, threads, outs);
+    }
+    return batch_outs_to_list(outs, profile);
+}
 
-#pragma omp parallel for schedule(dynamic)
-    for (int i = 0; i < (int)V_cands.size(); ++i) {
+// ----------------------------- 异步批量作业 -----------------------------
+
+// Python 回调：在池线程上短暂持 GIL 转 dict 并调用；回调对象本身也在持 GIL 时释放
+static BatchJob::Callback py_callback(py::object cb, bool profile) {
+    if (cb.is_none()) return {};
+    std::shared_ptr<py::object> fn(new py::object(std::move(cb)), [](py::object *o) {
+        py::gil_scoped_acquire gil;
+        delete o;
+    });
+    return [fn, profile](size_t i, const BatchOut &o) {
+        py::gil_scoped_acquire gil;
         try {
-            auto mS = mesh_from_np(V_cands[i], F_cands[i]);
-
-            auto pT = sample_pcd(*mT, 50000);
-            auto pS0 = sample_pcd(*mS, 50000);
-            auto dsT = pT->VoxelDownSample(voxel);
-            auto dsS = pS0->VoxelDownSample(voxel);
-
-            Eigen::Matrix4d T0 = icp(*dsS, *dsT, ransac(*dsS, *dsT, fpfh_radius, voxel), icp_thr);
-            auto Sa = *mS; Sa.Transform(T0);
-            double ch0 = chamfer(*sample_pcd(Sa, 20000), *sample_pcd(*mT, 20000));
-
-            Eigen::Matrix4d M = Eigen::Matrix4d::Identity(); M(0, 0) = -1.0;
-            auto Sm = *mS; Sm.Transform(M);
-            auto dsSm = sample_pcd(Sm, 50000)->VoxelDownSample(voxel);
-            Eigen::Matrix4d Tm = icp(*dsSm, *dsT, ransac(*dsSm, *dsT, fpfh_radius, voxel), icp_thr);
-            auto Sb = Sm; Sb.Transform(Tm);
-            double chm = chamfer(*sample_pcd(Sb, 20000), *sample_pcd(*mT, 20000));
-
-            bool mirrored = (chm < ch0);
-            Eigen::Matrix4d Tbest = mirrored ? (Tm * M) : T0;
-
-            auto Saligned = *mS; Saligned.Transform(Tbest);
-
-            // clearance sampling
-            t::geometry::TriangleMesh tmC = t::geometry::TriangleMesh::FromLegacy(Saligned);
-            t::geometry::RaycastingScene scene; scene.AddTriangles(tmC);
-            auto pts = mT->SamplePointsUniformly(samples);
-            std::vector<float> buf; buf.reserve(pts->points_.size() * 3);
-            for (auto &p : pts->points_) { buf.push_back((float)p.x()); buf.push_back((float)p.y()); buf.push_back((float)p.z()); }
-            core::Tensor q(buf, {(int64_t)pts->points_.size(), 3}, core::Float32);
-            auto sdist = scene.ComputeSignedDistance(q);
-            auto inside = scene.ComputeOccupancy(q);
-
-            std::vector<float> sdv(sdist.GetDataPtr<float>(), sdist.GetDataPtr<float>() + sdist.NumElements());
-            std::vector<float> inv(inside.GetDataPtr<float>(), inside.GetDataPtr<float>() + inside.NumElements());
-            std::vector<double> inner; inner.reserve(sdv.size()); size_t inside_cnt = 0;
-            for (size_t k = 0; k < sdv.size(); ++k) { if (inv[k] > 0.5f) { inside_cnt++; inner.push_back(-(double)sdv[k]); } }
-            double min_c = 0, mean_c = 0, p01 = 0; bool pass = false;
-            if (!inner.empty()) {
-                std::sort(inner.begin(), inner.end());
-                min_c = inner.front();
-                mean_c = std::accumulate(inner.begin(), inner.end(), 0.0) / inner.size();
-                size_t kk = (size_t)std::floor(0.01 * inner.size());
-                if (kk >= inner.size()) kk = inner.size() - 1;
-                p01 = inner[kk];
-                pass = (min_c >= (clearance + safety_delta));
-            }
+            (*fn)(i, batch_out_to_dict(o, profile));
+        } catch (py::error_already_set &e) {
+            e.discard_as_unraisable("BatchJob callback");
+        }
+    };
+}
 
-            py::array_t<double> Tnp({4, 4});
-            auto r = Tnp.mutable_unchecked<2>();
-            for (int a = 0; a < 4; ++a) for (int b = 0; b < 4; ++b) r(a, b) = Tbest(a, b);
-            outs[i] = py::dict("mirrored"_a = mirrored, "chamfer"_a = std::min(ch0, chm),
-                               "min_clearance"_a = min_c, "mean_clearance"_a = mean_c,
-                               "p01_clearance"_a = p01, "pass"_a = pass, "T"_a = Tnp);
+// 作业析构要等后台线程，而回调可能正等 GIL：Python 侧最后一个引用释放时先放开 GIL。
+// 在回调里释放时析构跑在池线程上，只取消不等待（见 BatchJob::~BatchJob）
+static std::shared_ptr<BatchJob> py_job(std::shared_ptr<BatchJob> j) {
+    BatchJob *raw = j.get();
+    return std::shared_ptr<BatchJob>(raw, [j](BatchJob *) mutable {
+        if (PyGILState_Check()) {
+            py::gil_scoped_release nogil;
+            j.reset();
+        } else {
+            j.reset();
+        }
+    });
+}
+
+std::shared_ptr<BatchJob> batch_submit(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
+                                       std::vector<py::array_t<double>> V_cands,
+                                       std::vector<py::array_t<int>> F_cands,
+                                       double voxel, double fpfh_radius, double icp_thr,
+                                       double clearance, double safety_delta, size_t samples,
+                                       int threads, bool decide_only,
+                                       std::vector<double> quantiles, int hist_bins, double hist_max,
+                                       const std::string &device, bool profile,
+                                       const std::string &sampling, uint64_t seed, double curvature_weight,
+                                       py::object callback) {
+    if (V_cands.size() != F_cands.size()) throw std::runtime_error("V_cands and F_cands must have the same length");
+    const BatchParams P{voxel, fpfh_radius, icp_thr, clearance, safety_delta, decide_only,
+                         make_spec(quantiles, hist_bins, hist_max), resolve_device(device), profile,
+                         SampleParams{sampling, seed, curvature_weight}};
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    const size_t n = V_cands.size();
+    std::vector<std::shared_ptr<geometry::TriangleMesh>> meshes(n);
+    std::vector<std::string> errors(n);
+    for (size_t i = 0; i < n; ++i) {
+        try {
+            meshes[i] = mesh_copy_np(V_cands[i], F_cands[i]);
         } catch (const std::exception &e) {
-            outs[i] = py::dict("error"_a = e.what());
+            errors[i] = e.what();
         }
     }
+    return py_job(BatchJob::start(std::move(mT), std::move(meshes), std::move(errors), P, samples, threads,
+                                  py_callback(std::move(callback), profile)));
+}
 
-    py::gil_scoped_acquire gil;
-    py::list L; for (auto &o : outs) L.append(o);
-    return L;
+std::shared_ptr<BatchJob> batch_submit_prepared(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
+                                                std::vector<std::shared_ptr<PreparedMesh>> cands,
+                                                double voxel, double fpfh_radius, double icp_thr,
+                                                double clearance, double safety_delta, size_t samples,
+                                                int threads, bool decide_only,
+                                                std::vector<double> quantiles, int hist_bins, double hist_max,
+                                                const std::string &device, bool profile,
+                                                const std::string &sampling, uint64_t seed,
+                                                double curvature_weight, py::object callback) {
+    const BatchParams P{voxel, fpfh_radius, icp_thr, clearance, safety_delta, decide_only,
+                         make_spec(quantiles, hist_bins, hist_max), resolve_device(device), profile,
+                         SampleParams{sampling, seed, curvature_weight}};
+    return py_job(BatchJob::start(mesh_copy_np(v_tgt, f_tgt), std::move(cands), P, samples, threads,
+                                  py_callback(std::move(callback), profile)));
 }
 
-// ----------------------------- 体素窄带 SDF（形式化复核） -----------------------------
+static py::list job_items(std::vector<BatchJob::Item> &&items, bool profile) {
+    py::list L;
+    for (const auto &it : items) L.append(py::make_tuple(it.first, batch_out_to_dict(it.second, profile)));
+    return L;
+}
 
-py::dict clearance_sdf_volume(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
-                              py::array_t<double> v_cand, py::array_t<int> f_cand,
-                              double clearance, double voxel, double band_mm, int threads) {
-    auto mT = mesh_from_np(v_tgt, f_tgt);
-    auto mC = mesh_from_np(v_cand, f_cand);
-
-    t::geometry::TriangleMesh tT = t::geometry::TriangleMesh::FromLegacy(*mT);
-    t::geometry::TriangleMesh tC = t::geometry::TriangleMesh::FromLegacy(*mC);
-    t::geometry::RaycastingScene sceneT; sceneT.AddTriangles(tT);
-    t::geometry::RaycastingScene sceneC; sceneC.AddTriangles(tC);
-
-    auto bb = mT->GetAxisAlignedBoundingBox();
-    Eigen::Vector3d min = bb.min_bound_ - Eigen::Vector3d::Constant(band_mm);
-    Eigen::Vector3d max = bb.max_bound_ + Eigen::Vector3d::Constant(band_mm);
-
-    Eigen::Vector3i dims;
-    for (int i = 0; i < 3; ++i) dims[i] = std::max(1, (int)std::ceil((max[i] - min[i]) / voxel));
-
-    const int64_t NX = dims[0], NY = dims[1], NZ = dims[2];
-    std::vector<float> pts; pts.reserve((size_t)NX * NY * NZ * 3);
-    for (int64_t ix = 0; ix < NX; ++ix) {
-        double x = min.x() + (ix + 0.5) * voxel;
-        for (int64_t iy = 0; iy < NY; ++iy) {
-            double y = min.y() + (iy + 0.5) * voxel;
-            for (int64_t iz = 0; iz < NZ; ++iz) {
-                double z = min.z() + (iz + 0.5) * voxel;
-                pts.push_back((float)x); pts.push_back((float)y); pts.push_back((float)z);
-            }
+// 分 0.1 s 小段等待（不持 GIL），段间检查 Ctrl-C
+static py::list job_wait(BatchJob &j, double timeout, size_t max) {
+    using clock = std::chrono::steady_clock;
+    const auto t_end = clock::now() + std::chrono::duration_cast<clock::duration>(
+                                          std::chrono::duration<double>(std::max(0.0, timeout)));
+    for (;;) {
+        double slice = 0.1;
+        if (timeout >= 0)
+            slice = std::min(slice, std::max(0.0, std::chrono::duration<double>(t_end - clock::now()).count()));
+        std::vector<BatchJob::Item> got;
+        {
+            py::gil_scoped_release nogil;
+            got = j.next(slice, max);
         }
+        if (!got.empty() || j.done() || (timeout >= 0 && clock::now() >= t_end))
+            return job_items(std::move(got), j.params().profile);
+        if (PyErr_CheckSignals() != 0) throw py::error_already_set();
     }
-    core::Tensor Q(pts, {(int64_t)(pts.size() / 3), 3}, core::Float32);
+}
 
-    auto dT = sceneT.ComputeDistance(Q); // unsigned
-    std::vector<float> dTvec(dT.GetDataPtr<float>(), dT.GetDataPtr<float>() + dT.NumElements());
+// ----------------------------- 候选库与端到端匹配 -----------------------------
+
+py::list build_library_np(const std::string &dir, std::vector<std::string> ids,
+                          std::vector<py::array_t<double>> V_cands, std::vector<py::array_t<int>> F_cands,
+                          std::vector<std::pair<double, double>> levels, size_t chamfer_samples, int threads) {
+    if (ids.size() != V_cands.size() || V_cands.size() != F_cands.size())
+        throw std::runtime_error("ids, V_cands and F_cands must have the same length");
+    std::vector<std::shared_ptr<geometry::TriangleMesh>> meshes(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) meshes[i] = mesh_copy_np(V_cands[i], F_cands[i]);
+    std::vector<std::string> errors;
+    {
+        py::gil_scoped_release nogil;
+        errors = build_library(dir, ids, meshes, levels, chamfer_samples, threads);
+    }
+    py::list out;
+    for (const auto &e : errors) out.append(e.empty() ? py::object(py::none()) : py::object(py::str(e)));
+    return out;
+}
 
-    std::vector<int64_t> sel_idx; sel_idx.reserve(dTvec.size() / 8);
-    for (int64_t i = 0; i < (int64_t)dTvec.size(); ++i)
-        if (dTvec[i] <= (float)band_mm) sel_idx.push_back(i);
-    if (sel_idx.empty()) return py::dict("pass"_a = false, "reason"_a = "no samples in band");
+// 直接从文件建库：并行读取（含 .3dm），id 为文件名去扩展名；读取失败的文件在对应位置返回错误
+py::list build_library_files(const std::string &dir, std::vector<std::string> paths,
+                             std::vector<std::pair<double, double>> levels, size_t chamfer_samples, int threads,
+                             const std::string &mesh_quality) {
+    const Load3dmParams P = load_params(mesh_quality, true);
+    std::vector<std::string> errors(paths.size());
+    {
+        py::gil_scoped_release nogil;
+        std::vector<std::string> read_errors;
+        auto meshes = read_mesh_files(paths, read_errors, false, threads, P);
+        std::vector<std::string> ids;
+        std::vector<std::shared_ptr<geometry::TriangleMesh>> ok;
+        std::vector<size_t> where;
+        std::set<std::string> seen;
+        for (size_t i = 0; i < paths.size(); ++i) {
+            const std::string id = std::filesystem::path(paths[i]).stem().string();
+            if (!read_errors[i].empty()) { errors[i] = read_errors[i]; continue; }
+            if (!seen.insert(id).second) { errors[i] = "duplicate candidate id: " + id; continue; }
+            ids.push_back(id);
+            ok.push_back(std::move(meshes[i]));
+            where.push_back(i);
+        }
+        const auto build_errors = build_library(dir, ids, ok, levels, chamfer_samples, threads);
+        for (size_t k = 0; k < where.size(); ++k) errors[where[k]] = build_errors[k];
+    }
+    py::list out;
+    for (const auto &e : errors) out.append(e.empty() ? py::object(py::none()) : py::object(py::str(e)));
+    return out;
+}
 
-    core::Tensor idx(sel_idx.data(), {(int64_t)sel_idx.size()}, core::Int64);
-    auto Qb = Q.IndexGet({idx});
+// 级联字段：stage / cut_by / rank / coarse_chamfer，做过形式复核的附 "formal"
+static py::list match_results_to_list(const std::vector<MatchResult> &res, bool profile, bool cascade) {
+    py::list out;
+    for (const auto &r : res) {
+        // 级联里没做到完整配准的候选没有 T / 余量
+        const bool aligned = !cascade || r.stage >= 3 || !r.result.error.empty();
+        py::dict d = aligned ? batch_out_to_dict(r.result, profile) : py::dict("pass"_a = false);
+        d["id"] = r.id;
+        d["index_score"] = r.index_score;
+        if (cascade) {
+            d["stage"] = r.stage;
+            d["cut_by"] = r.cut_by;
+            d["rank"] = r.rank;
+            d["coarse_chamfer"] = r.coarse_chamfer;
+            if (r.has_formal)
+                d["formal"] = py::dict("pass"_a = r.formal.pass, "min_clearance"_a = r.formal.min_c,
+                                       "mean_clearance"_a = r.formal.mean_c, "inside_ratio"_a = r.formal.inside_ratio,
+                                       "reason"_a = r.formal.reason);
+        }
+        out.append(d);
+    }
+    return out;
+}
 
-    auto sdC = sceneC.ComputeSignedDistance(Qb);
-    std::vector<float> sdc(sdC.GetDataPtr<float>(), sdC.GetDataPtr<float>() + sdC.NumElements());
+py::list match_library_np(const std::string &dir, py::array_t<double> v_tgt, py::array_t<int> f_tgt,
+                          double clearance, double safety_delta, size_t topk, size_t samples, int threads,
+                          bool decide_only, double voxel, double fpfh_radius, double icp_thr,
+                          const std::string &device, bool profile,
+                          const std::string &sampling, uint64_t seed, double curvature_weight,
+                          bool cascade, size_t final_k, size_t max_align, double prune_ratio, bool formal) {
+    MatchParams M;
+    M.clearance = clearance; M.safety_delta = safety_delta; M.topk = topk; M.samples = samples;
+    M.threads = threads; M.decide_only = decide_only;
+    M.voxel = voxel; M.fpfh_radius = fpfh_radius; M.icp_thr = icp_thr;
+    M.device = device; M.profile = profile;
+    M.sampling = SampleParams{sampling, seed, curvature_weight};
+    M.cascade = cascade; M.final_k = final_k; M.max_align = max_align; M.prune_ratio = prune_ratio;
+    M.formal = formal;
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    std::vector<MatchResult> res;
+    {
+        py::gil_scoped_release nogil;
+        res = match_library(*CandidateLibrary::open(dir), *mT, M);
+    }
+    return match_results_to_list(res, profile, cascade);
+}
 
-    double min_c = 1e18, mean_c = 0.0;
-    size_t inside_cnt = 0, cnt = 0;
-    for (float v : sdc) {
-        if (v <= 0.f) {
-            inside_cnt++;
-            double c = -double(v);
-            min_c = std::min(min_c, c);
-            mean_c += c; cnt++;
-        }
+// 级联调度：候选为 PreparedMesh 列表，ids 缺省为 "0", "1", ...
+py::list cascade_match_np(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
+                          std::vector<std::shared_ptr<PreparedMesh>> cands, std::vector<std::string> ids,
+                          double clearance, double safety_delta, size_t final_k, size_t max_align,
+                          double prune_ratio, size_t coarse_points, bool formal, double formal_voxel,
+                          double band_mm, size_t samples, int threads, bool decide_only,
+                          double voxel, double fpfh_radius, double icp_thr,
+                          const std::string &device, bool profile,
+                          const std::string &sampling, uint64_t seed, double curvature_weight, bool assume_clean) {
+    if (ids.empty()) for (size_t i = 0; i < cands.size(); ++i) ids.push_back(std::to_string(i));
+    MatchParams M;
+    M.clearance = clearance; M.safety_delta = safety_delta; M.samples = samples;
+    M.threads = threads; M.decide_only = decide_only;
+    M.voxel = voxel; M.fpfh_radius = fpfh_radius; M.icp_thr = icp_thr;
+    M.device = device; M.profile = profile;
+    M.sampling = SampleParams{sampling, seed, curvature_weight};
+    M.cascade = true; M.final_k = final_k; M.max_align = max_align; M.prune_ratio = prune_ratio;
+    M.coarse_points = coarse_points; M.formal = formal; M.formal_voxel = formal_voxel; M.formal_band = band_mm;
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    std::vector<MatchResult> res;
+    {
+        py::gil_scoped_release nogil;
+        if (!assume_clean) clean_mesh(*mT);
+        res = cascade_match(*mT, ids, cands, M);
     }
-    if (cnt > 0) mean_c /= cnt; else { min_c = 0.0; mean_c = 0.0; }
+    return match_results_to_list(res, profile, true);
+}
 
-    double eps = 0.866 * voxel; // 误差上界（sqrt(3)/2 * g）
-    bool ok = (min_c - eps >= clearance);
+// ----------------------------- 体素窄带 SDF（形式化复核） -----------------------------
+
+static py::dict formal_out_to_dict(const FormalOut &o, const NarrowBand &nb) {
+    if (!o.reason.empty()) return py::dict("pass"_a = false, "reason"_a = o.reason);
     py::dict out;
-    out["pass"] = ok;
-    out["min_clearance"] = min_c;
-    out["mean_clearance"] = mean_c;
-    out["voxel"] = voxel;
-    out["band_mm"] = band_mm;
-    out["eps"] = eps;
-    out["inside_ratio"] = (double)inside_cnt / (double)sel_idx.size();
+    out["pass"] = o.pass;
+    out["min_clearance"] = o.min_c;
+    out["mean_clearance"] = o.mean_c;
+    out["voxel"] = nb.voxel;
+    out["band_mm"] = nb.band_mm;
+    out["eps"] = 0.866 * nb.voxel;
+    out["inside_ratio"] = o.inside_ratio;
     return out;
 }
 
-py::list batch_formal_check(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
-                            std::vector<py::array_t<double>> V_cands,
-                            std::vector<py::array_t<int>> F_cands,
-                            double clearance, double voxel, double band_mm, int threads) {
-    py::list out;
-    for (size_t i = 0; i < V_cands.size(); ++i) {
+template <class Cand>
+static py::dict clearance_sdf_volume_with(py::array v_tgt, py::array f_tgt, Cand &&cand, double clearance,
+                                          double voxel, double band_mm, int threads, bool assume_clean) {
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    NarrowBand nb;
+    FormalOut o;
+    {
+        py::gil_scoped_release nogil;
+        if (!assume_clean) clean_mesh(*mT);
+        nb = build_narrow_band(*mT, voxel, band_mm, std::max(0, threads));
+        o = formal_check_band(cand(), nb, clearance, std::max(0, threads));
+    }
+    return formal_out_to_dict(o, nb);
+}
+
+py::dict clearance_sdf_volume(py::array v_tgt, py::array f_tgt, py::array v_cand, py::array f_cand,
+                              double clearance, double voxel, double band_mm, int threads, bool assume_clean) {
+    const NpMesh vC = np_mesh(v_cand, f_cand);
+    return clearance_sdf_volume_with(v_tgt, f_tgt, [&] { return clearance_scene_from_np(vC, assume_clean); },
+                                     clearance, voxel, band_mm, threads, assume_clean);
+}
+
+py::dict clearance_sdf_volume_scene(py::array v_tgt, py::array f_tgt, const ClearanceScene &cand,
+                                    double clearance, double voxel, double band_mm, int threads, bool assume_clean) {
+    return clearance_sdf_volume_with(v_tgt, f_tgt, [&] { return cand; }, clearance, voxel, band_mm, threads,
+                                     assume_clean);
+}
+
+// 两个重载共用：窄带只算一次；cand(i) 在并行区内返回第 i 个候选句柄，outs[i].reason 已非空的跳过
+template <class Cand>
+static py::list batch_formal_with(py::array v_tgt, py::array f_tgt, std::vector<FormalOut> &outs, Cand &&cand,
+                                  double clearance, double voxel, double band_mm, int threads, bool assume_clean) {
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    const int n = (int)outs.size();
+    std::vector<char> ok(n, 0);
+    for (int i = 0; i < n; ++i) ok[i] = outs[i].reason.empty();
+
+    NarrowBand nb;
+    {
+        py::gil_scoped_release nogil;
+        CapScope cap(threads);
+        const int team = thread_cap();
+        bool band_ok = true;
         try {
-            out.append(clearance_sdf_volume(v_tgt, f_tgt, V_cands[i], F_cands[i],
-                                            clearance, voxel, band_mm, threads));
+            if (!assume_clean) clean_mesh(*mT);
+            nb = build_narrow_band(*mT, voxel, band_mm, std::max(0, threads));
         } catch (const std::exception &e) {
-            out.append(py::dict("pass"_a = false, "reason"_a = e.what()));
+            band_ok = false;
+            for (auto &o : outs) if (o.reason.empty()) o.reason = e.what();
         }
+
+        // 候选数不少于线程数时按候选并行、每次查询单线程；否则串行候选、查询内部并行
+        const bool per_cand = (n >= team && team > 1);
+        const int qthreads = per_cand ? 1 : std::max(0, threads);
+
+        auto one = [&](int i) {
+            if (!band_ok || !ok[i]) return;
+            try {
+                outs[i] = formal_check_band(cand(i), nb, clearance, qthreads);
+            } catch (const std::exception &e) {
+                outs[i].reason = e.what();
+            }
+        };
+        if (per_cand) parallel_for(n, one);
+        else for (int i = 0; i < n; ++i) one(i);
     }
+
+    py::list out;
+    for (const auto &o : outs) out.append(formal_out_to_dict(o, nb));
     return out;
 }
 
-// ----------------------------- 最薄点定位 -----------------------------
+py::list batch_formal_check(py::array v_tgt, py::array f_tgt,
+                            std::vector<py::array> V_cands, std::vector<py::array> F_cands,
+                            double clearance, double voxel, double band_mm, int threads, bool assume_clean) {
+    if (V_cands.size() != F_cands.size()) throw std::runtime_error("V_cands and F_cands must have the same length");
 
-py::dict min_clearance_point(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
-                             py::array_t<double> v_cand, py::array_t<int> f_cand) {
-    auto mT = mesh_from_np(v_tgt, f_tgt);
-    auto mC = mesh_from_np(v_cand, f_cand);
-    t::geometry::TriangleMesh tC = t::geometry::TriangleMesh::FromLegacy(*mC);
-    t::geometry::RaycastingScene scene; scene.AddTriangles(tC);
+    // 候选只取 numpy 视图，网格数据在并行区内直接进 scene
+    const size_t n = V_cands.size();
+    std::vector<NpMesh> views(n);
+    std::vector<FormalOut> outs(n);
+    for (size_t i = 0; i < n; ++i) {
+        try {
+            views[i] = np_mesh(V_cands[i], F_cands[i]);
+        } catch (const std::exception &e) {
+            outs[i].reason = e.what();
+        }
+    }
+    return batch_formal_with(v_tgt, f_tgt, outs, [&](int i) { return clearance_scene_from_np(views[i], assume_clean); },
+                             clearance, voxel, band_mm, threads, assume_clean);
+}
+
+// 候选句柄（各自带对齐变换）：不再逐候选建 BVH
+py::list batch_formal_check_scenes(py::array v_tgt, py::array f_tgt, const std::vector<ClearanceScene> &cands,
+                                   double clearance, double voxel, double band_mm, int threads, bool assume_clean) {
+    std::vector<FormalOut> outs(cands.size());
+    return batch_formal_with(v_tgt, f_tgt, outs, [&](int i) -> const ClearanceScene & { return cands[i]; },
+                             clearance, voxel, band_mm, threads, assume_clean);
+}
 
-    std::vector<float> buf; buf.reserve(mT->vertices_.size() * 3);
-    for (const auto &p : mT->vertices_) buf.insert(buf.end(), {(float)p.x(), (float)p.y(), (float)p.z()});
-    core::Tensor Q(buf, {(int64_t)mT->vertices_.size(), 3}, core::Float32);
+// ----------------------------- 逐顶点余量场 -----------------------------
 
-    auto sdist = scene.ComputeSignedDistance(Q); // neg inside
-    auto hit   = scene.ComputeClosestPoints(Q);
-    auto hpos  = hit["points"]; // Nx3
+// float64 顶点直接打包；float32 顶点逐块取进暂存
+static void field_query(const ClearanceScene &cs, const NpMesh &q, float sign, float *clr, float *closest,
+                        int threads) {
+    if (!q.v32) clearance_field_query(cs, static_cast<const double *>(q.pv), q.nV, sign, clr, closest, threads);
+    else clearance_field_query(cs, q.nV, [&q](size_t i) { return q.vertex(i); }, sign, clr, closest, threads);
+}
 
-    const float *sd = sdist.GetDataPtr<float>();
-    const float *hp = static_cast<const float*>(hpos.GetDataPtr());
+py::object clearance_field(py::array v_tgt, py::array f_tgt, py::array v_cand, py::array f_cand,
+                           const std::string &on, bool closest_points, int threads, bool assume_clean) {
+    if (on != "target" && on != "candidate") throw std::runtime_error("on must be 'target' or 'candidate'");
+    const bool on_target = on == "target";
+    const NpMesh q = on_target ? np_mesh(v_tgt, f_tgt) : np_mesh(v_cand, f_cand);
+    const NpMesh s = on_target ? np_mesh(v_cand, f_cand) : np_mesh(v_tgt, f_tgt);
+    if (s.nF == 0) throw std::runtime_error("surface mesh has no faces");
+
+    py::array_t<float> field((ssize_t)q.nV);
+    py::array_t<float> closest;
+    if (closest_points) closest = py::array_t<float>({(ssize_t)q.nV, (ssize_t)3});
+    float *pf = field.mutable_data();
+    float *pc = closest_points ? closest.mutable_data() : nullptr;
+    {
+        py::gil_scoped_release nogil;
+        const ClearanceScene cs = clearance_scene_from_np(s, assume_clean);
+        field_query(cs, q, on_target ? -1.f : 1.f, pf, pc, threads);
+    }
+    if (closest_points) return py::make_tuple(field, closest);
+    return field;
+}
 
-    double min_c = 1e18; int64_t idx_min = -1; size_t N = (size_t)mT->vertices_.size();
-    for (size_t i = 0; i < N; ++i) {
-        float v = sd[i];
-        if (v <= 0.f) {
-            double c = -double(v);
-            if (c < min_c) { min_c = c; idx_min = (int64_t)i; }
-        }
+// surface 为句柄：on="target" 时 v 是目标顶点、surface 是候选；on="candidate" 时 v 是候选顶点、surface 是目标
+// on 不设默认值：数组版默认 "candidate"，句柄版若默认另一侧会在两种调用间悄悄翻转含义
+py::object clearance_field_scene(py::array v, const ClearanceScene &surface, const std::string &on,
+                                 bool closest_points, int threads) {
+    if (on != "target" && on != "candidate") throw std::runtime_error("on must be 'target' or 'candidate'");
+    const NpMesh q = np_mesh(v, py::tuple());
+    py::array_t<float> field((ssize_t)q.nV);
+    py::array_t<float> closest;
+    if (closest_points) closest = py::array_t<float>({(ssize_t)q.nV, (ssize_t)3});
+    float *pf = field.mutable_data();
+    float *pc = closest_points ? closest.mutable_data() : nullptr;
+    {
+        py::gil_scoped_release nogil;
+        field_query(surface, q, on == "target" ? -1.f : 1.f, pf, pc, threads);
     }
+    if (closest_points) return py::make_tuple(field, closest);
+    return field;
+}
+
+// ----------------------------- 最薄点定位 -----------------------------
+
+// mT 已清理；cs 把目标坐标变回候选局部坐标，返回的距离与最近点都在目标坐标系
+static py::dict min_clearance_point_on(const geometry::TriangleMesh &mT, const ClearanceScene &cs) {
+    // 先在线求内部最小 clearance（块内 simd::inside 归约，再回找块内第一个取到最小值的点），
+    // 只对最薄的那一个点求最近点
+    double min_c = 1e18; int64_t idx_min = -1;
+    sdf_query_points_blocks(cs, mT.vertices_, 0, mT.vertices_.size(), [&](size_t b, size_t m, float *sd) {
+        const simd::Inside in = simd::inside(sd, m, true);   // neg inside
+        if (!in.n || !(in.min < min_c)) return;
+        size_t k = 0;
+        while (!(sd[k] <= 0.f && -sd[k] == in.min)) ++k;
+        min_c = in.min; idx_min = (int64_t)(b + k);
+    });
     if (idx_min < 0) return py::dict("found"_a = false);
 
-    Eigen::Vector3d pt = mT->vertices_[(size_t)idx_min];
-    Eigen::Vector3d pc(hp[3 * idx_min + 0], hp[3 * idx_min + 1], hp[3 * idx_min + 2]);
+    Eigen::Vector3d pt = mT.vertices_[(size_t)idx_min];
+    const Eigen::Vector3d pl = cs.to_local(pt);
+    core::Tensor Q = core::Tensor::Empty({1, 3}, core::Float32);
+    float *q = Q.GetDataPtr<float>();
+    q[0] = (float)pl.x(); q[1] = (float)pl.y(); q[2] = (float)pl.z();
+    auto hit = cs.bvh().ComputeClosestPoints(Q);
+    const float *hp = static_cast<const float*>(hit["points"].GetDataPtr());
+    Eigen::Vector3d pc = cs.to_frame(Eigen::Vector3d(hp[0], hp[1], hp[2]));
 
     py::dict out;
     out["found"] = true;
@@ -514,150 +1033,158 @@ py::dict min_clearance_point(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
     return out;
 }
 
+py::dict min_clearance_point(py::array v_tgt, py::array f_tgt, py::array v_cand, py::array f_cand,
+                             bool assume_clean) {
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    if (!assume_clean) clean_mesh(*mT);
+    return min_clearance_point_on(*mT, clearance_scene_from_np(np_mesh(v_cand, f_cand), assume_clean));
+}
+
+py::dict min_clearance_point_scene(py::array v_tgt, py::array f_tgt, const ClearanceScene &cand,
+                                   bool assume_clean) {
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    if (!assume_clean) clean_mesh(*mT);
+    return min_clearance_point_on(*mT, cand);
+}
+
 // ----------------------------- 剖切线段 -----------------------------
 
+static Eigen::Vector3d vec3_from_np(py::handle h, const char *name) {
+    auto a = py::array_t<double, py::array::c_style | py::array::forcecast>::ensure(h);
+    if (!a || a.size() != 3) throw std::runtime_error(std::string(name) + " must be a len=3 array");
+    const double *p = a.data();
+    return {p[0], p[1], p[2]};
+}
+
 py::dict mesh_section(py::array_t<double> v, py::array_t<int> f,
                       py::array_t<double> p0, py::array_t<double> nrm) {
     auto m = mesh_from_np(v, f);
-    auto P0buf = p0.request();
-    auto Nbuf  = nrm.request();
-    if (P0buf.size != 3 || Nbuf.size != 3) throw std::runtime_error("p0, n must be len=3 arrays");
-    double P0x = ((double*)P0buf.ptr)[0], P0y = ((double*)P0buf.ptr)[1], P0z = ((double*)P0buf.ptr)[2];
-    double Nx = ((double*)Nbuf.ptr)[0], Ny = ((double*)Nbuf.ptr)[1], Nz = ((double*)Nbuf.ptr)[2];
-    Eigen::Vector3d P0(P0x, P0y, P0z), N(Nx, Ny, Nz); N.normalize();
-
-    auto sgn = [&](const Eigen::Vector3d &x) { return (N.dot(x - P0)); };
-
-    std::vector<std::array<double, 6>> segs;
-    segs.reserve(m->triangles_.size() / 10 + 1);
-
-    for (const auto &tri : m->triangles_) {
-        Eigen::Vector3d a = m->vertices_[tri(0)];
-        Eigen::Vector3d b = m->vertices_[tri(1)];
-        Eigen::Vector3d c = m->vertices_[tri(2)];
-        double da = sgn(a), db = sgn(b), dc = sgn(c);
-
-        int pos = (da > 0) + (db > 0) + (dc > 0);
-        int neg = (da < 0) + (db < 0) + (dc < 0);
-        if (pos == 3 || neg == 3) continue;
-
-        auto cut = [&](const Eigen::Vector3d &P, double dP,
-                       const Eigen::Vector3d &Q, double dQ, Eigen::Vector3d &X) {
-            double t = dP / (dP - dQ);
-            X = P + t * (Q - P);
-        };
-
-        std::vector<Eigen::Vector3d> pts; pts.reserve(2);
-        auto proc = [&](const Eigen::Vector3d &P, double dP, const Eigen::Vector3d &Q, double dQ) {
-            if ((dP > 0 && dQ < 0) || (dP < 0 && dQ > 0)) {
-                Eigen::Vector3d X; cut(P, dP, Q, dQ, X); pts.push_back(X);
-            }
-        };
-        proc(a, da, b, db); proc(b, db, c, dc); proc(c, dc, a, da);
-        if (pts.size() == 2) {
-            segs.push_back({pts[0].x(), pts[0].y(), pts[0].z(),
-                            pts[1].x(), pts[1].y(), pts[1].z()});
-        }
-    }
+    const Eigen::Vector3d P0 = vec3_from_np(p0, "p0"), N = vec3_from_np(nrm, "n").normalized();
+    const auto S = compute_sections(*m, N, {N.dot(P0)}, false);
 
+    const auto &segs = S[0].segs;
     py::array_t<double> A({(ssize_t)segs.size(), (ssize_t)6});
     auto w = A.mutable_unchecked<2>();
     for (ssize_t i = 0; i < (ssize_t)segs.size(); ++i)
-        for (int j = 0; j < 6; ++j) w(i, j) = segs[i][j];
+        for (int j = 0; j < 3; ++j) { w(i, j) = segs[i].p[0][j]; w(i, 3 + j) = segs[i].p[1][j]; }
     return py::dict("segments"_a = A);
 }
 
-// ----------------------------- 薄壁段聚类与区域标注 -----------------------------
+static py::list polylines_to_list(const Section &S) {
+    py::list L;
+    for (const auto &pl : S.polylines) {
+        py::array_t<double> A({(ssize_t)pl.size(), (ssize_t)3});
+        if (!pl.empty()) std::memcpy(A.mutable_data(), pl[0].data(), sizeof(double) * 3 * pl.size());
+        L.append(A);
+    }
+    return L;
+}
 
-py::list thin_regions(py::array_t<double> v_tgt, py::array_t<int> f_tgt,
-                      py::array_t<double> v_cand, py::array_t<int> f_cand,
-                      double thr_mm, double radius_mm) {
-    auto mT = mesh_from_np(v_tgt, f_tgt);
-    auto mC = mesh_from_np(v_cand, f_cand);
-    t::geometry::TriangleMesh tC = t::geometry::TriangleMesh::FromLegacy(*mC);
-    t::geometry::RaycastingScene scene; scene.AddTriangles(tC);
-
-    // 计算每个目标顶点 clearance
-    std::vector<float> buf; buf.reserve(mT->vertices_.size() * 3);
-    for (const auto &p : mT->vertices_) buf.insert(buf.end(), {(float)p.x(), (float)p.y(), (float)p.z()});
-    core::Tensor Q(buf, {(int64_t)mT->vertices_.size(), 3}, core::Float32);
-    auto sdist = scene.ComputeSignedDistance(Q);
-    const float *sd = sdist.GetDataPtr<float>();
-    size_t N = mT->vertices_.size();
-
-    // 选薄壁点
-    std::vector<int> idxs; idxs.reserve(N);
-    for (size_t i = 0; i < N; ++i)
-        if (sd[i] <= 0.f && (-double(sd[i]) < thr_mm)) idxs.push_back((int)i);
-    if (idxs.empty()) return py::list();
-
-    // 半径聚类（简易贪心）
-    std::vector<int> label(N, -1);
-    int cid = 0;
-    double r2 = radius_mm * radius_mm;
-    for (int i : idxs) {
-        if (label[i] != -1) continue;
-        label[i] = cid;
-        // 扩张：线性扫描（足够快；需要更快可改 KDTree）
-        bool grown = true;
-        while (grown) {
-            grown = false;
-            for (int j : idxs) if (label[j] == -1) {
-                const auto &pi = mT->vertices_[i];
-                const auto &pj = mT->vertices_[j];
-                if ((pi - pj).squaredNorm() <= r2) { label[j] = cid; grown = true; }
-            }
+// 一次调用切出整叠平行截面（p0s: (K,3)，共用法向）；给出 v_cand/f_cand 时同时切候选并报告逐站间隙
+py::list mesh_sections(py::array_t<double> v, py::array_t<int> f,
+                       py::array_t<double, py::array::c_style | py::array::forcecast> p0s,
+                       py::array_t<double> nrm, py::object v_cand, py::object f_cand) {
+    if (p0s.ndim() != 2 || p0s.shape(1) != 3) throw std::runtime_error("p0s must be (K,3)");
+    if (v_cand.is_none() != f_cand.is_none()) throw std::runtime_error("v_cand and f_cand must be given together");
+    const bool paired = !v_cand.is_none();
+    const Eigen::Vector3d N = vec3_from_np(nrm, "nrm").normalized();
+    std::vector<double> offsets((size_t)p0s.shape(0));
+    const double *pp = p0s.data();
+    for (size_t k = 0; k < offsets.size(); ++k) offsets[k] = N.dot(Eigen::Vector3d(pp[3 * k], pp[3 * k + 1], pp[3 * k + 2]));
+
+    auto mT = mesh_copy_np(v, f);
+    std::shared_ptr<geometry::TriangleMesh> mC = paired ? mesh_copy_np(v_cand, f_cand) : nullptr;
+    std::vector<Section> ST, SC;
+    std::vector<SectionGap> gaps;
+    {
+        py::gil_scoped_release nogil;
+        clean_mesh(*mT);
+        ST = compute_sections(*mT, N, offsets, true);
+        if (paired) {
+            clean_mesh(*mC);
+            SC = compute_sections(*mC, N, offsets, true);
+            gaps.resize(offsets.size());
+            parallel_for((int)offsets.size(), [&](int k) { gaps[k] = section_gap(ST[k], SC[k]); });
         }
-        cid++;
     }
 
-    // 汇总
-    py::list regions;
-    regions.attr("reserve")(cid);
-    for (int k = 0; k < cid; ++k) {
-        std::vector<int> verts_k; verts_k.reserve(128);
-        double min_c = 1e9;
-        Eigen::Vector3d centroid = Eigen::Vector3d::Zero(); int cnt = 0;
-        for (size_t i = 0; i < N; ++i) if (label[i] == k) {
-            verts_k.push_back((int)i);
-            double clr = -double(sd[i]);
-            min_c = std::min(min_c, clr);
-            centroid += mT->vertices_[i];
-            cnt++;
+    py::list out;
+    for (size_t k = 0; k < ST.size(); ++k) {
+        py::dict d("offset"_a = ST[k].offset, "polylines"_a = polylines_to_list(ST[k]), "closed"_a = ST[k].closed);
+        if (paired) {
+            d["cand_polylines"] = polylines_to_list(SC[k]);
+            d["cand_closed"] = SC[k].closed;
+            const SectionGap &g = gaps[k];
+            d["gap"] = g.found ? py::dict("min"_a = g.min_gap, "mean"_a = g.mean_gap, "max"_a = g.max_gap)
+                               : py::dict();
         }
-        if (cnt > 0) centroid /= cnt; else centroid.setZero();
+        out.append(d);
+    }
+    return out;
+}
 
-        // 骨架：PCA 主方向的两端点
-        Eigen::MatrixXd P(3, verts_k.size());
-        for (size_t t = 0; t < verts_k.size(); ++t) {
-            auto &v = mT->vertices_[verts_k[t]];
-            P.col(t) << v.x(), v.y(), v.z();
-        }
-        Eigen::Vector3d mean = P.rowwise().mean();
-        Eigen::MatrixXd Z = P.colwise() - mean;
-        Eigen::Matrix3d C = (Z * Z.transpose()) / std::max<ptrdiff_t>(1, Z.cols());
-        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(C);
-        Eigen::Vector3d dir = es.eigenvectors().col(2);
-        std::vector<std::pair<double, int>> proj; proj.reserve(verts_k.size());
-        for (size_t t = 0; t < verts_k.size(); ++t) {
-            Eigen::Vector3d d = P.col(t) - mean;
-            proj.emplace_back(dir.dot(d), (int)t);
-        }
-        std::sort(proj.begin(), proj.end());
-        auto pA = P.col(proj.front().second);
-        auto pB = P.col(proj.back().second);
+// ----------------------------- 薄壁段聚类与区域标注 -----------------------------
 
+static py::list thin_regions_to_list(const std::vector<Region> &R) {
+    py::list regions;
+    for (const Region &g : R) {
         py::dict reg;
-        reg["min_clearance"] = min_c;
-        reg["centroid"] = py::make_tuple(centroid.x(), centroid.y(), centroid.z());
-        reg["endpoints"] = py::make_tuple(py::make_tuple(pA.x(), pA.y(), pA.z()),
-                                          py::make_tuple(pB.x(), pB.y(), pB.z()));
-        reg["indices"] = verts_k; // 目标顶点索引集合
+        reg["min_clearance"] = g.min_c;
+        reg["centroid"] = py::make_tuple(g.centroid.x(), g.centroid.y(), g.centroid.z());
+        reg["endpoints"] = py::make_tuple(py::make_tuple(g.pA.x(), g.pA.y(), g.pA.z()),
+                                          py::make_tuple(g.pB.x(), g.pB.y(), g.pB.z()));
+        reg["indices"] = g.indices;
         regions.append(reg);
     }
     return regions;
 }
 
+static py::list thin_regions_on(const geometry::TriangleMesh &mT, const ClearanceScene &cs,
+                                double thr_mm, double radius_mm, const std::string &connectivity) {
+    // 每个目标顶点的 clearance 直接写入预分配缓冲
+    std::vector<float> clr(mT.vertices_.size());
+    sdf_query_points(cs, mT.vertices_, 0, clr.size(), [&](size_t i, float v) { clr[i] = -v; });
+    return thin_regions_to_list(thin_regions_from(mT.vertices_, clr.data(), thr_mm, radius_mm, connectivity, &mT.triangles_));
+}
+
+py::list thin_regions(py::array v_tgt, py::array f_tgt, py::array v_cand, py::array f_cand,
+                      double thr_mm, double radius_mm, bool assume_clean, const std::string &connectivity) {
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    if (!assume_clean) clean_mesh(*mT);
+    return thin_regions_on(*mT, clearance_scene_from_np(np_mesh(v_cand, f_cand), assume_clean), thr_mm, radius_mm,
+                           connectivity);
+}
+
+py::list thin_regions_scene(py::array v_tgt, py::array f_tgt, const ClearanceScene &cand,
+                            double thr_mm, double radius_mm, bool assume_clean, const std::string &connectivity) {
+    auto mT = mesh_copy_np(v_tgt, f_tgt);
+    if (!assume_clean) clean_mesh(*mT);
+    return thin_regions_on(*mT, cand, thr_mm, radius_mm, connectivity);
+}
+
+// 复用 clearance_field(on="target") 的结果，不再查询 SDF；索引对应传入的 v_tgt（f_tgt 仅 mesh 连通时需要）
+py::list thin_regions_field(py::array_t<double, py::array::c_style | py::array::forcecast> v_tgt,
+                            py::array_t<float, py::array::c_style | py::array::forcecast> field,
+                            double thr_mm, double radius_mm, const std::string &connectivity, py::object f_tgt) {
+    if (v_tgt.ndim() != 2 || v_tgt.shape(1) != 3) throw std::runtime_error("v_tgt must be (N,3)");
+    const size_t N = (size_t)v_tgt.shape(0);
+    if (field.ndim() != 1 || (size_t)field.shape(0) != N) throw std::runtime_error("field must be (N,) matching v_tgt");
+    std::vector<Eigen::Vector3d> V(N);
+    const double *pv = v_tgt.data();
+    for (size_t i = 0; i < N; ++i) V[i] = {pv[3 * i], pv[3 * i + 1], pv[3 * i + 2]};
+    std::vector<Eigen::Vector3i> tris;
+    if (!f_tgt.is_none()) {
+        const NpMesh m = np_mesh(v_tgt, f_tgt);
+        tris.resize(m.nF);
+        for (size_t i = 0; i < m.nF; ++i) {
+            tris[i] = m.face(i);
+            if (tris[i].minCoeff() < 0 || (size_t)tris[i].maxCoeff() >= N)
+                throw std::runtime_error("f_tgt index out of range");
+        }
+    }
+    return thin_regions_to_list(thin_regions_from(V, field.data(), thr_mm, radius_mm, connectivity, &tris));
+}
+
 py::list label_regions(py::array_t<double> v_tgt, py::list regions) {
     // 直接用顶点做 PCA（不需要 faces）
     auto bufV = v_tgt.request();
@@ -702,40 +1229,358 @@ PYBIND11_MODULE(cppcore, m) {
     // 粗特征
     m.def("coarse_features", &coarse_features, "Compute coarse descriptors");
 
+    // 网格读取（.3dm 需 openNURBS）
+    m.attr("HAS_OPENNURBS") = has_opennurbs();
+    m.def("load_mesh", &load_mesh,
+          "Read a mesh file natively (.3dm via openNURBS, Open3D formats, .slpm); returns (V, F)",
+          py::arg("path"), py::arg("clean") = true, py::arg("mesh_quality") = "high",
+          py::arg("render_meshes") = true);
+    m.def("load_meshes", &load_meshes,
+          "Read many mesh files in parallel; returns ([(V, F) or None], [error or None])",
+          py::arg("paths"), py::arg("clean") = true, py::arg("threads") = -1,
+          py::arg("mesh_quality") = "high", py::arg("render_meshes") = true);
+
+    // 预处理候选缓存
+    py::class_<PreparedMesh, std::shared_ptr<PreparedMesh>>(m, "PreparedMesh",
+        "Cleaned candidate mesh with cached clouds, normals, FPFH (original + mirrored) and BVH")
+        .def("save", &PreparedMesh::save, py::arg("path"), py::call_guard<py::gil_scoped_release>())
+        .def_static("load", &PreparedMesh::load, py::arg("path"), py::arg("verify") = false,
+                    py::call_guard<py::gil_scoped_release>(),
+                    "Memory-map a .slpm container; verify=True also checks every section hash")
+        .def("to_device", [](PreparedMesh &p, const std::string &device) {
+            const core::Device d = resolve_device(device);
+            p.to_device(d);
+            return d.ToString();
+        }, py::arg("device"), py::call_guard<py::gil_scoped_release>(),
+           "Keep registration clouds resident on a device (falls back to CPU:0); returns the device used")
+        .def_property_readonly("levels", [](const PreparedMesh &p) {
+            std::vector<std::pair<double, double>> L;
+            for (const auto &l : p.levels) L.emplace_back(l.voxel, l.fpfh_radius);
+            return L;
+        })
+        .def_property_readonly("features", [](const PreparedMesh &p) { return coarse_feat_to_dict(p.feat); })
+        .def_property_readonly("num_vertices", &PreparedMesh::num_vertices)
+        .def_property_readonly("num_triangles", &PreparedMesh::num_triangles)
+        .def_readonly("mesh_hash", &PreparedMesh::mesh_hash)
+        .def_readonly("params_hash", &PreparedMesh::params_hash)
+        .def("vertices", [](const PreparedMesh &p) {
+            const auto &V = p.mesh().vertices_;
+            py::array_t<double> A({(ssize_t)V.size(), (ssize_t)3});
+            if (!V.empty()) std::memcpy(A.mutable_data(), V[0].data(), sizeof(double) * 3 * V.size());
+            return A;
+        })
+        .def("faces", [](const PreparedMesh &p) {
+            const auto &F = p.mesh().triangles_;
+            py::array_t<int> A({(ssize_t)F.size(), (ssize_t)3});
+            if (!F.empty()) std::memcpy(A.mutable_data(), F[0].data(), sizeof(int) * 3 * F.size());
+            return A;
+        });
+    py::class_<ClearanceScene>(m, "ClearanceScene",
+        "Candidate BVH built once in its local frame; at(T) reuses it under any similarity transform "
+        "(local -> target). Accepted by clearance_sampling / clearance_sdf_volume / batch_formal_check / "
+        "clearance_field / min_clearance_point / thin_regions in place of (v_cand, f_cand)")
+        .def(py::init([](py::array v, py::array f, bool assume_clean) {
+            const NpMesh M = np_mesh(v, f);
+            if (M.nF == 0) throw std::runtime_error("mesh has no faces");
+            py::gil_scoped_release nogil;
+            return clearance_scene_from_np(M, assume_clean);
+        }), py::arg("v"), py::arg("f"), py::arg("assume_clean") = false)
+        .def(py::init([](std::shared_ptr<PreparedMesh> p) {
+            py::gil_scoped_release nogil;
+            return ClearanceScene::of(p);
+        }), py::arg("cand"), "Share the prepared candidate's BVH")
+        .def("at", [](const ClearanceScene &cs, py::array_t<double> T) { return cs.at(mat4_from_np(T)); },
+             py::arg("T"), "Same BVH under T (rotation, optionally mirrored, x uniform scale + translation)")
+        .def_property_readonly("T", [](const ClearanceScene &cs) { return mat4_to_np(cs.T); })
+        .def_property_readonly("scale", [](const ClearanceScene &cs) { return cs.scale; });
+    py::class_<TargetSamples>(m, "TargetSamples",
+        "Seeded target surface samples (uniform / stratified / poisson, optional curvature densification); "
+        "generate once per target and pass to clearance_sampling for every candidate")
+        .def(py::init([](py::array v, py::array f, size_t n, const std::string &method, uint64_t seed,
+                         double curvature_weight, bool assume_clean) {
+            auto mT = mesh_copy_np(v, f);
+            py::gil_scoped_release nogil;
+            if (!assume_clean) clean_mesh(*mT);
+            return TargetSamples::build(*mT, n, SampleParams{method, seed, curvature_weight});
+        }), py::arg("v"), py::arg("f"), py::arg("n") = 40000, py::arg("method") = "poisson", py::arg("seed") = 0,
+            py::arg("curvature_weight") = 1.0, py::arg("assume_clean") = false)
+        .def_property_readonly("points", [](const TargetSamples &S) { return points_to_np(S.pts); })
+        .def_property_readonly("method", [](const TargetSamples &S) { return S.params.method; })
+        .def_property_readonly("seed", [](const TargetSamples &S) { return S.params.seed; })
+        .def_property_readonly("curvature_weight", [](const TargetSamples &S) { return S.params.curvature_weight; })
+        .def("__len__", &TargetSamples::size)
+        .def(py::pickle(
+            [](const TargetSamples &S) {
+                return py::make_tuple(points_to_np(S.pts), S.params.method, S.params.seed, S.params.curvature_weight);
+            },
+            [](py::tuple t) {
+                if (t.size() != 4) throw std::runtime_error("invalid TargetSamples state");
+                auto a = py::array_t<double, py::array::c_style | py::array::forcecast>::ensure(t[0]);
+                if (!a || a.ndim() != 2 || a.shape(1) != 3) throw std::runtime_error("invalid TargetSamples state");
+                TargetSamples S;
+                S.pts = std::make_shared<geometry::PointCloud>();
+                S.pts->points_.resize((size_t)a.shape(0));
+                if (a.shape(0) > 0) std::memcpy(S.pts->points_[0].data(), a.data(), sizeof(double) * 3 * a.shape(0));
+                S.params = SampleParams{t[1].cast<std::string>(), t[2].cast<uint64_t>(), t[3].cast<double>()};
+                return S;
+            }));
+    py::class_<FeatureIndex, std::shared_ptr<FeatureIndex>>(m, "FeatureIndex",
+        "Column-wise coarse features of a candidate library for pre-load top-K retrieval")
+        .def(py::init<>())
+        .def("add", [](FeatureIndex &fi, const std::string &id, py::array_t<double> v, py::array_t<int> f) {
+            auto mC = mesh_copy_np(v, f);
+            py::gil_scoped_release nogil;
+            clean_mesh(*mC);
+            fi.add(id, coarse_features_from_mesh(*mC));
+        }, py::arg("id"), py::arg("v"), py::arg("f"))
+        .def("add", [](FeatureIndex &fi, const std::string &id, const PreparedMesh &p) { fi.add(id, p.feat); },
+             py::arg("id"), py::arg("cand"))
+        .def("query", &feature_index_query,
+             "Feasible candidates (sorted extents enclose target + 2*clearance, volume >= Steiner bound, "
+             "width-profile shortfall <= max_width_shortfall), best first",
+             py::arg("v_tgt"), py::arg("f_tgt"), py::arg("clearance") = 2.0, py::arg("k") = 32,
+             py::arg("w_hist") = 0.5, py::arg("vol_tol") = 0.001, py::arg("w_d2") = 0.5, py::arg("w_width") = 1.0,
+             py::arg("max_width_shortfall") = std::numeric_limits<double>::infinity())
+        .def("save", &FeatureIndex::save, py::arg("path"), py::call_guard<py::gil_scoped_release>())
+        .def_static("load", &FeatureIndex::load, py::arg("path"), py::call_guard<py::gil_scoped_release>())
+        .def_property_readonly("ids", [](const FeatureIndex &fi) { return fi.ids; })
+        .def("__len__", &FeatureIndex::size);
+    m.def("prepare_mesh", &prepare_mesh, "Clean a candidate and precompute registration/clearance data",
+          py::arg("v"), py::arg("f"),
+          py::arg("levels") = std::vector<std::pair<double, double>>{{5.0, 10.0}},
+          py::arg("chamfer_samples") = 20000);
+
+    // 性能计数
+    m.def("stats", &global_stats_to_dict,
+          "Process-wide per-stage seconds/calls since import (or the last reset_stats())");
+    m.def("reset_stats", &reset_global_stats, "Zero the process-wide stage counters");
+
+    // 全局线程预算（工作窃取任务池）
+    m.def("set_thread_budget", [](int n) { py::gil_scoped_release nogil; set_thread_budget(n); },
+          "Resize the process-wide task pool (and OpenMP default) to N threads; N <= 0 restores the startup value",
+          py::arg("n"));
+    m.def("thread_budget", &thread_budget, "Threads in the process-wide task pool (including the calling thread)");
+
+    // SIMD 内核实现（运行时按 CPU 选择）
+    m.def("simd_isa", [] { return std::string(simd::isa_name(simd::isa())); },
+          "Active SIMD kernel set: 'avx512' / 'avx2' / 'neon' / 'scalar'");
+    m.def("set_simd_isa", &simd::set_isa,
+          "Force a SIMD kernel set (for benchmarks); '' or 'auto' restores CPU detection", py::arg("name"));
+
     // 对齐
+    m.def("cuda_available", [] {
+#ifdef HYBRID_WITH_CUDA
+        return core::cuda::IsAvailable();
+#else
+        return false;
+#endif
+    }, "True if built with WITH_CUDA and a CUDA device is present (device=\"CUDA:0\" is honoured)");
     m.def("align_icp", &align_icp, "Rigid registration (RANSAC→ICP) with chamfer",
           py::arg("v_src"), py::arg("f_src"), py::arg("v_tgt"), py::arg("f_tgt"),
           py::arg("voxel"), py::arg("fpfh_radius"), py::arg("icp_thr"));
     m.def("align_icp_with_mirror", &align_icp_with_mirror, "Registration with YZ-mirror option",
           py::arg("v_src"), py::arg("f_src"), py::arg("v_tgt"), py::arg("f_tgt"),
-          py::arg("voxel"), py::arg("fpfh_radius"), py::arg("icp_thr"));
+          py::arg("voxel"), py::arg("fpfh_radius"), py::arg("icp_thr"), py::arg("device") = "CPU:0",
+          py::arg("profile") = false);
+    m.def("align_icp_with_mirror", &align_prepared_with_mirror, "Registration with YZ-mirror option (prepared source)",
+          py::arg("src"), py::arg("v_tgt"), py::arg("f_tgt"),
+          py::arg("voxel"), py::arg("fpfh_radius"), py::arg("icp_thr"), py::arg("device") = "CPU:0",
+          py::arg("profile") = false);
+    m.def("align_multi", &align_multi,
+          "Multi-scale / multi-start registration on a shared pyramid (coarse-to-fine ICP, pruning)",
+          py::arg("v_src"), py::arg("f_src"), py::arg("v_tgt"), py::arg("f_tgt"),
+          py::arg("scales") = std::vector<double>{1.0},
+          py::arg("param_sets") = std::vector<std::tuple<double, double, double>>{
+              {5.0, 10.0, 15.0}, {4.0, 8.0, 12.0}, {6.0, 12.0, 18.0}},
+          py::arg("mirror") = true, py::arg("prune_ratio") = 1.5);
 
     // 采样式 SDF + 批量
     m.def("clearance_sampling", &clearance_sampling, "Sampling-based SDF clearance check",
           py::arg("v_tgt"), py::arg("f_tgt"), py::arg("v_cand"), py::arg("f_cand"),
-          py::arg("clearance"), py::arg("safety_delta"), py::arg("samples") = 120000);
+          py::arg("clearance"), py::arg("safety_delta"), py::arg("samples") = 120000,
+          py::arg("decide_only") = false,
+          py::arg("quantiles") = QuantileSpec().qs, py::arg("hist_bins") = 40, py::arg("hist_max") = 10.0,
+          py::arg("assume_clean") = false, py::arg("profile") = false);
+    m.def("clearance_sampling", &clearance_sampling_prepared, "Sampling-based SDF clearance check (prepared candidate)",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cand"), py::arg("T"),
+          py::arg("clearance"), py::arg("safety_delta"), py::arg("samples") = 120000,
+          py::arg("decide_only") = false,
+          py::arg("quantiles") = QuantileSpec().qs, py::arg("hist_bins") = 40, py::arg("hist_max") = 10.0,
+          py::arg("assume_clean") = false, py::arg("profile") = false);
+    m.def("clearance_sampling", &clearance_sampling_scene, "Sampling-based SDF clearance check (ClearanceScene handle)",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cand"),
+          py::arg("clearance"), py::arg("safety_delta"), py::arg("samples") = 120000,
+          py::arg("decide_only") = false,
+          py::arg("quantiles") = QuantileSpec().qs, py::arg("hist_bins") = 40, py::arg("hist_max") = 10.0,
+          py::arg("assume_clean") = false, py::arg("profile") = false);
+    m.def("clearance_sampling", &clearance_sampling_set,
+          "Sampling-based SDF clearance check on a reusable TargetSamples set (ClearanceScene candidate)",
+          py::arg("target"), py::arg("cand"), py::arg("clearance"), py::arg("safety_delta") = 0.3,
+          py::arg("decide_only") = false,
+          py::arg("quantiles") = QuantileSpec().qs, py::arg("hist_bins") = 40, py::arg("hist_max") = 10.0,
+          py::arg("profile") = false);
     m.def("batch_align_and_check", &batch_align_and_check, "Batch align+check (parallel)",
           py::arg("v_tgt"), py::arg("f_tgt"), py::arg("V_cands"), py::arg("F_cands"),
           py::arg("voxel"), py::arg("fpfh_radius"), py::arg("icp_thr"),
           py::arg("clearance"), py::arg("safety_delta"),
-          py::arg("samples") = 120000, py::arg("threads") = -1);
+          py::arg("samples") = 120000, py::arg("threads") = -1,
+          py::arg("decide_only") = false,
+          py::arg("quantiles") = QuantileSpec().qs, py::arg("hist_bins") = 40, py::arg("hist_max") = 10.0,
+          py::arg("device") = "CPU:0", py::arg("profile") = false,
+          py::arg("sampling") = "uniform", py::arg("seed") = 0, py::arg("curvature_weight") = 0.0);
+    m.def("batch_align_and_check", &batch_align_and_check_prepared, "Batch align+check (parallel, prepared candidates)",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cands"),
+          py::arg("voxel"), py::arg("fpfh_radius"), py::arg("icp_thr"),
+          py::arg("clearance"), py::arg("safety_delta"),
+          py::arg("samples") = 120000, py::arg("threads") = -1,
+          py::arg("decide_only") = false,
+          py::arg("quantiles") = QuantileSpec().qs, py::arg("hist_bins") = 40, py::arg("hist_max") = 10.0,
+          py::arg("device") = "CPU:0", py::arg("profile") = false,
+          py::arg("sampling") = "uniform", py::arg("seed") = 0, py::arg("curvature_weight") = 0.0);
+
+    // 异步批量作业：提交后立即返回句柄，按完成顺序取结果，可取消
+    py::class_<BatchJob, std::shared_ptr<BatchJob>>(m, "BatchJob",
+        "Handle of a running batch_submit(); iterate it for (index, result) as candidates finish")
+        .def("poll", [](BatchJob &j, long max) {
+                 return job_items(j.next(0, max < 0 ? std::numeric_limits<size_t>::max() : (size_t)max),
+                                  j.params().profile);
+             }, "Results finished since the last call, without waiting", py::arg("max") = -1)
+        .def("wait", [](BatchJob &j, std::optional<double> timeout, long max) {
+                 return job_wait(j, timeout ? *timeout : -1.0,
+                                 max < 0 ? std::numeric_limits<size_t>::max() : (size_t)max);
+             }, "Block (GIL released) until at least one result, the end of the job or the timeout",
+             py::arg("timeout") = py::none(), py::arg("max") = -1)
+        .def("cancel", &BatchJob::cancel,
+             "Request cancellation; running candidates stop at the next checkpoint with error 'cancelled'")
+        .def("join", &BatchJob::join, py::call_guard<py::gil_scoped_release>(),
+             "Wait for the background driver to finish (results stay queued)")
+        .def_property_readonly("done", &BatchJob::done)
+        .def_property_readonly("cancelled", &BatchJob::cancelled)
+        .def_property_readonly("completed", &BatchJob::completed)
+        .def_property_readonly("total", &BatchJob::total)
+        .def("__len__", &BatchJob::total)
+        .def("__iter__", [](py::object self) { return self; })
+        .def("__next__", [](BatchJob &j) {
+            py::list got = job_wait(j, -1.0, 1);
+            if (got.empty()) throw py::stop_iteration();
+            return py::object(got[0]);
+        })
+        .def("__enter__", [](py::object self) { return self; })
+        .def("__exit__", [](BatchJob &j, py::args) {
+            j.cancel();
+            py::gil_scoped_release nogil;
+            j.join();
+        });
+    m.def("batch_submit", &batch_submit,
+          "Asynchronous batch_align_and_check: returns a BatchJob immediately; callback(i, result) is called "
+          "as each candidate finishes",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("V_cands"), py::arg("F_cands"),
+          py::arg("voxel"), py::arg("fpfh_radius"), py::arg("icp_thr"),
+          py::arg("clearance"), py::arg("safety_delta"),
+          py::arg("samples") = 120000, py::arg("threads") = -1,
+          py::arg("decide_only") = false,
+          py::arg("quantiles") = QuantileSpec().qs, py::arg("hist_bins") = 40, py::arg("hist_max") = 10.0,
+          py::arg("device") = "CPU:0", py::arg("profile") = false,
+          py::arg("sampling") = "uniform", py::arg("seed") = 0, py::arg("curvature_weight") = 0.0,
+          py::arg("callback") = py::none());
+    m.def("batch_submit", &batch_submit_prepared, "Asynchronous batch_align_and_check (prepared candidates)",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cands"),
+          py::arg("voxel"), py::arg("fpfh_radius"), py::arg("icp_thr"),
+          py::arg("clearance"), py::arg("safety_delta"),
+          py::arg("samples") = 120000, py::arg("threads") = -1,
+          py::arg("decide_only") = false,
+          py::arg("quantiles") = QuantileSpec().qs, py::arg("hist_bins") = 40, py::arg("hist_max") = 10.0,
+          py::arg("device") = "CPU:0", py::arg("profile") = false,
+          py::arg("sampling") = "uniform", py::arg("seed") = 0, py::arg("curvature_weight") = 0.0,
+          py::arg("callback") = py::none());
+
+    // 候选库目录（<id>.slpm + index.slfi），与 CLI 共用
+    m.def("build_library", &build_library_np,
+          "Prepare candidates in parallel into DIR/<id>.slpm plus DIR/index.slfi; returns per-candidate error or None",
+          py::arg("dir"), py::arg("ids"), py::arg("V_cands"), py::arg("F_cands"),
+          py::arg("levels") = std::vector<std::pair<double, double>>{{5.0, 10.0}},
+          py::arg("chamfer_samples") = 20000, py::arg("threads") = -1);
+    m.def("build_library", &build_library_files,
+          "Read mesh files in parallel (ids = file stems) and prepare them into DIR; returns per-path error or None",
+          py::arg("dir"), py::arg("paths"),
+          py::arg("levels") = std::vector<std::pair<double, double>>{{5.0, 10.0}},
+          py::arg("chamfer_samples") = 20000, py::arg("threads") = -1, py::arg("mesh_quality") = "high");
+    m.def("match_library", &match_library_np,
+          "End-to-end match against a prepared library directory: index top-K, load, align + clearance",
+          py::arg("dir"), py::arg("v_tgt"), py::arg("f_tgt"),
+          py::arg("clearance") = 2.0, py::arg("safety_delta") = 0.3, py::arg("topk") = 32,
+          py::arg("samples") = 20000, py::arg("threads") = -1, py::arg("decide_only") = false,
+          py::arg("voxel") = 5.0, py::arg("fpfh_radius") = 10.0, py::arg("icp_thr") = 15.0,
+          py::arg("device") = "CPU:0", py::arg("profile") = false,
+          py::arg("sampling") = "uniform", py::arg("seed") = 0, py::arg("curvature_weight") = 0.0,
+          py::arg("cascade") = false, py::arg("final_k") = 8, py::arg("max_align") = 64,
+          py::arg("prune_ratio") = 1.5, py::arg("formal") = true);
+    m.def("cascade_match", &cascade_match_np,
+          "Cascade: coarse-feature feasibility -> PCA + low-res chamfer -> RANSAC/ICP + sampled clearance for the "
+          "best -> narrow-band formal check for the final K; pruned against the current K-th best chamfer",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cands"), py::arg("ids") = std::vector<std::string>{},
+          py::arg("clearance") = 2.0, py::arg("safety_delta") = 0.3, py::arg("final_k") = 8,
+          py::arg("max_align") = 64, py::arg("prune_ratio") = 1.5, py::arg("coarse_points") = 2000,
+          py::arg("formal") = true, py::arg("formal_voxel") = 0.30, py::arg("band_mm") = 8.0,
+          py::arg("samples") = 20000, py::arg("threads") = -1, py::arg("decide_only") = false,
+          py::arg("voxel") = 5.0, py::arg("fpfh_radius") = 10.0, py::arg("icp_thr") = 15.0,
+          py::arg("device") = "CPU:0", py::arg("profile") = false,
+          py::arg("sampling") = "uniform", py::arg("seed") = 0, py::arg("curvature_weight") = 0.0,
+          py::arg("assume_clean") = false);
 
     // 体素窄带 SDF（形式化复核）
     m.def("clearance_sdf_volume", &clearance_sdf_volume, "Voxel narrow-band SDF formal check",
           py::arg("v_tgt"), py::arg("f_tgt"), py::arg("v_cand"), py::arg("f_cand"),
-          py::arg("clearance"), py::arg("voxel") = 0.30, py::arg("band_mm") = 8.0, py::arg("threads") = -1);
+          py::arg("clearance"), py::arg("voxel") = 0.30, py::arg("band_mm") = 8.0, py::arg("threads") = -1,
+          py::arg("assume_clean") = false);
+    m.def("clearance_sdf_volume", &clearance_sdf_volume_scene, "Voxel narrow-band SDF formal check (ClearanceScene handle)",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cand"),
+          py::arg("clearance"), py::arg("voxel") = 0.30, py::arg("band_mm") = 8.0, py::arg("threads") = -1,
+          py::arg("assume_clean") = false);
     m.def("batch_formal_check", &batch_formal_check, "Batch narrow-band SDF checks",
           py::arg("v_tgt"), py::arg("f_tgt"), py::arg("V_cands"), py::arg("F_cands"),
-          py::arg("clearance"), py::arg("voxel") = 0.30, py::arg("band_mm") = 8.0, py::arg("threads") = -1);
+          py::arg("clearance"), py::arg("voxel") = 0.30, py::arg("band_mm") = 8.0, py::arg("threads") = -1,
+          py::arg("assume_clean") = false);
+    m.def("batch_formal_check", &batch_formal_check_scenes, "Batch narrow-band SDF checks (ClearanceScene handles)",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cands"),
+          py::arg("clearance"), py::arg("voxel") = 0.30, py::arg("band_mm") = 8.0, py::arg("threads") = -1,
+          py::arg("assume_clean") = false);
 
     // 诊断/可视化辅助
+    m.def("clearance_field", &clearance_field,
+          "Per-vertex clearance (float32, >0 = candidate encloses target, <0 = penetration); "
+          "returns (field, closest_points) when closest_points=True",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("v_cand"), py::arg("f_cand"),
+          py::arg("on") = "candidate", py::arg("closest_points") = false, py::arg("threads") = 0,
+          py::arg("assume_clean") = false);
+    m.def("clearance_field", &clearance_field_scene,
+          "Per-vertex clearance of v against a ClearanceScene surface (on='target': v = target vertices, "
+          "surface = candidate; on='candidate': the reverse). on is required: its meaning depends on the handle",
+          py::arg("v"), py::arg("surface"), py::arg("on"), py::arg("closest_points") = false,
+          py::arg("threads") = 0);
     m.def("min_clearance_point", &min_clearance_point, "Find thinnest point on target vs candidate",
-          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("v_cand"), py::arg("f_cand"));
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("v_cand"), py::arg("f_cand"),
+          py::arg("assume_clean") = false);
+    m.def("min_clearance_point", &min_clearance_point_scene, "Find thinnest point on target vs candidate (ClearanceScene handle)",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cand"), py::arg("assume_clean") = false);
     m.def("mesh_section", &mesh_section, "Triangle-plane intersection segments",
           py::arg("v"), py::arg("f"), py::arg("p0"), py::arg("nrm"));
+    m.def("mesh_sections", &mesh_sections,
+          "Stack of parallel sections in one sweep: chained polylines per plane; with v_cand/f_cand also "
+          "the target-to-candidate gap per station",
+          py::arg("v"), py::arg("f"), py::arg("p0s"), py::arg("nrm"),
+          py::arg("v_cand") = py::none(), py::arg("f_cand") = py::none());
     m.def("thin_regions", &thin_regions, "Cluster thin-wall vertices into regions",
           py::arg("v_tgt"), py::arg("f_tgt"), py::arg("v_cand"), py::arg("f_cand"),
-          py::arg("thr_mm"), py::arg("radius_mm"));
+          py::arg("thr_mm"), py::arg("radius_mm"), py::arg("assume_clean") = false,
+          py::arg("connectivity") = "radius");
+    m.def("thin_regions", &thin_regions_scene, "Cluster thin-wall vertices into regions (ClearanceScene handle)",
+          py::arg("v_tgt"), py::arg("f_tgt"), py::arg("cand"),
+          py::arg("thr_mm"), py::arg("radius_mm"), py::arg("assume_clean") = false,
+          py::arg("connectivity") = "radius");
+    m.def("thin_regions", &thin_regions_field, "Cluster thin-wall vertices from a precomputed clearance_field(on='target')",
+          py::arg("v_tgt"), py::arg("field"), py::arg("thr_mm"), py::arg("radius_mm"),
+          py::arg("connectivity") = "radius", py::arg("f_tgt") = py::none());
     m.def("label_regions", &label_regions, "Label regions with shoe semantics",
           py::arg("v_tgt"), py::arg("regions"));
-}
\ No newline at end of file
+}
@@ -0,0 +1,3706 @@
+// shoematch.cpp - libshoematch 内核实现（见 shoematch.h）
+
+#include "shoematch.h"
+
+#include <open3d/t/pipelines/registration/Registration.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <unordered_map>
+
+#ifdef HYBRID_WITH_OPENMP
+  #include <omp.h>
+#endif
+
+#ifndef _WIN32
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#else
+  #include <process.h>
+#endif
+
+#ifdef HYBRID_WITH_OPENNURBS
+  #include <opennurbs_public.h>
+#endif
+
+// x86 的 AVX2 / AVX-512 实现靠函数级 target 属性（MSVC 不支持，走标量）；aarch64 的 NEON 是基线指令集
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+  #define SHOEMATCH_SIMD_X86
+  #include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  #define SHOEMATCH_SIMD_NEON
+  #include <arm_neon.h>
+#endif
+
+namespace shoematch {
+
+GlobalStats g_stats;
+thread_local Profile *tl_profile = nullptr;
+
+// ----------------------------- 性能计数 -----------------------------
+
+void count_sdf_points(size_t n) {
+    g_stats.sdf_points.fetch_add(n, std::memory_order_relaxed);
+    if (tl_profile) tl_profile->sdf_points += n;
+}
+
+void reset_global_stats() {
+    for (int i = 0; i < kStages; ++i) { g_stats.ns[i] = 0; g_stats.calls[i] = 0; }
+    g_stats.sdf_points = 0; g_stats.ransac_corr = 0; g_stats.icp_iterations = 0;
+    g_stats.scratch_misses = 0;   // scratch_bytes 是当前保留量，不清零
+}
+
+// ----------------------------- 工作窃取任务池 -----------------------------
+
+thread_local const std::atomic<bool> *tl_cancel = nullptr;
+
+static thread_local int tl_task_depth = 0;
+static thread_local const TaskPool *tl_pool = nullptr;   // 当前线程所属的池（工作线程）
+static thread_local size_t tl_worker = 0;
+
+// 任务内 OpenMP 单线程：Open3D 内部的 parallel for 在任务里不再另起线程组
+static void execute(TaskPool::Task &t) {
+    ++tl_task_depth;
+#ifdef HYBRID_WITH_OPENMP
+    const int prev = omp_get_max_threads();
+    omp_set_num_threads(1);
+#endif
+    t();
+#ifdef HYBRID_WITH_OPENMP
+    omp_set_num_threads(prev);
+#endif
+    --tl_task_depth;
+}
+
+TaskPool::TaskPool(int threads) {
+    const size_t nw = (size_t)std::max(1, threads) - 1;
+    for (size_t i = 0; i < std::max<size_t>(1, nw); ++i) queues_.push_back(std::make_unique<Queue>());
+    for (size_t i = 0; i < nw; ++i) workers_.emplace_back([this, i] { worker(i); });
+}
+
+TaskPool::~TaskPool() {
+    {
+        std::lock_guard<std::mutex> lk(sleep_m_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &w : workers_) w.join();
+}
+
+void TaskPool::submit(Task t) {
+    const size_t q = tl_pool == this ? tl_worker : rr_.fetch_add(1) % queues_.size();
+    {
+        std::lock_guard<std::mutex> lk(queues_[q]->m);
+        queues_[q]->q.push_back(std::move(t));
+    }
+    {
+        std::lock_guard<std::mutex> lk(sleep_m_);
+        queued_.fetch_add(1);
+    }
+    cv_.notify_one();
+}
+
+// 自己的队列取队尾（最近提交，缓存热），其它队列偷队首（最早提交，通常粒度最大）
+bool TaskPool::pop(Task &t) {
+    const bool own = tl_pool == this;
+    const size_t n = queues_.size(), self = own ? tl_worker : 0;
+    for (size_t k = 0; k < n; ++k) {
+        Queue &q = *queues_[(self + k) % n];
+        std::lock_guard<std::mutex> lk(q.m);
+        if (q.q.empty()) continue;
+        if (own && k == 0) { t = std::move(q.q.back()); q.q.pop_back(); }
+        else { t = std::move(q.q.front()); q.q.pop_front(); }
+        queued_.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+void TaskPool::worker(size_t self) {
+    tl_pool = this;
+    tl_worker = self;
+    for (;;) {
+        Task t;
+        if (pop(t)) { execute(t); continue; }
+        std::unique_lock<std::mutex> lk(sleep_m_);
+        cv_.wait(lk, [&] { return stop_ || queued_.load() > 0; });
+        if (stop_ && queued_.load() == 0) return;
+    }
+}
+
+static int initial_budget() {
+#ifdef HYBRID_WITH_OPENMP
+    static const int n = omp_get_max_threads();
+#else
+    static const int n = (int)std::max(1u, std::thread::hardware_concurrency());
+#endif
+    return n;
+}
+
+static std::mutex g_pool_m;
+static std::shared_ptr<TaskPool> g_pool;
+
+std::shared_ptr<TaskPool> task_pool() {
+    std::lock_guard<std::mutex> lk(g_pool_m);
+    if (!g_pool) g_pool = std::make_shared<TaskPool>(initial_budget());
+    return g_pool;
+}
+
+// 旧池由仍在使用它的 TaskGroup 持有到结束，这里只换掉全局指针
+void set_thread_budget(int n) {
+    if (in_task()) throw std::runtime_error("set_thread_budget: cannot be called from inside a task");
+    if (n <= 0) n = initial_budget();
+#ifdef HYBRID_WITH_OPENMP
+    omp_set_num_threads(n);
+#endif
+    std::lock_guard<std::mutex> lk(g_pool_m);
+    if (g_pool && g_pool->threads() == n) return;
+    g_pool = std::make_shared<TaskPool>(n);
+}
+
+int thread_budget() { return task_pool()->threads(); }
+
+bool in_task() { return tl_task_depth > 0; }
+
+bool tasks_available() {
+#ifdef HYBRID_WITH_OPENMP
+    if (omp_in_parallel()) return false;
+#endif
+    return task_pool()->threads() > 1;
+}
+
+thread_local ThreadCap *tl_cap = nullptr;
+
+CapScope::CapScope(int threads) {
+    if (threads <= 0 || tl_cap) return;
+    cap_ = std::make_unique<ThreadCap>(threads);
+    tl_cap = cap_.get();
+#ifdef HYBRID_WITH_OPENMP
+    prev_omp_ = omp_get_max_threads();
+    omp_set_num_threads(std::min(prev_omp_, cap_->limit));
+#endif
+}
+
+CapScope::~CapScope() {
+    if (!cap_) return;
+    tl_cap = prev_;
+#ifdef HYBRID_WITH_OPENMP
+    omp_set_num_threads(prev_omp_);
+#endif
+}
+
+int thread_cap() {
+    const int n = thread_budget();
+    return tl_cap ? std::min(n, tl_cap->limit) : n;
+}
+
+TaskGroup::~TaskGroup() {
+    try { wait(); } catch (...) {}
+}
+
+void TaskGroup::Shared::fail(std::exception_ptr e) {
+    std::lock_guard<std::mutex> lk(m);
+    if (!err) err = std::move(e);
+}
+
+void TaskGroup::Shared::finish() {
+    std::lock_guard<std::mutex> lk(m);
+    if (--pending == 0 && sleepers) cv.notify_all();
+}
+
+void TaskGroup::run(std::function<void()> f) {
+    Shared &s = *s_;
+    if (cap_ && !cap_->try_acquire()) {
+        // 名额用完：当前线程已占一个名额，直接执行不扩大并发
+        try {
+            f();
+        } catch (...) {
+            s.fail(std::current_exception());
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lk(s.m);
+        Profile *slot = owner_ ? &s.slots.emplace_back() : nullptr;
+        ++s.pending;
+        s.queue.push_back([&s, slot, cancel = cancel_, cap = cap_, f = std::move(f)] {
+            {
+                ProfileScope ps(slot);
+                CancelScope cs(cancel);
+                ThreadCap *const prev = tl_cap;
+                tl_cap = cap;
+                try {
+                    f();
+                } catch (...) {
+                    s.fail(std::current_exception());
+                }
+                tl_cap = prev;
+                if (cap) cap->release();
+            }
+            s.finish();
+        });
+        if (s.sleepers) s.cv.notify_all();   // 本组任务又向本组提交：叫醒等待者来取
+    }
+    // 单线程池没有工作线程，任务全由 wait 执行，不投票据
+    if (pool_->threads() > 1)
+        pool_->submit([sp = s_] {
+            TaskPool::Task t;
+            {
+                std::lock_guard<std::mutex> lk(sp->m);
+                if (sp->queue.empty()) return;   // 已被等待者或别的票据取走
+                t = std::move(sp->queue.front());
+                sp->queue.pop_front();
+            }
+            t();
+        });
+}
+
+void TaskGroup::wait() {
+    Shared &s = *s_;
+    std::unique_lock<std::mutex> lk(s.m);
+    while (s.pending > 0) {
+        if (!s.queue.empty()) {
+            // 本组尚未开始的任务在当前线程执行（取最近提交的，缓存热）
+            TaskPool::Task t = std::move(s.queue.back());
+            s.queue.pop_back();
+            lk.unlock();
+            execute(t);
+            lk.lock();
+            continue;
+        }
+        ++s.sleepers;
+        s.cv.wait(lk, [&] { return s.pending == 0 || !s.queue.empty(); });
+        --s.sleepers;
+    }
+    if (owner_) {
+        for (const auto &p : s.slots) owner_->merge(p);
+        s.slots.clear();
+    }
+    std::exception_ptr e = std::exchange(s.err, nullptr);
+    lk.unlock();
+    if (e) std::rethrow_exception(e);
+}
+
+// ----------------------------- SIMD 内核 -----------------------------
+
+namespace simd {
+
+// 法向方向箱，与 θ = acos(n.z)、φ = atan2(n.y, n.x) 的 8 x 16 均匀分箱一致，但不调用超越函数：
+// θ 箱由 n.z 与 cos(kπ/8) 比较得到；φ 先按象限旋转到 [0, π/2)，再与 tan(π/8)、1、tan(3π/8) 比较
+static constexpr double kCos[7] = {0.92387953251128674, 0.70710678118654757, 0.38268343236508984, 0.0,
+                                   -0.38268343236508967, -0.70710678118654746, -0.92387953251128674};
+static constexpr double kTan1 = 0.41421356237309503, kTan3 = 2.4142135623730949;
+
+static inline int normal_bin(double x, double y, double z) {
+    int i = 0;
+    for (int k = 0; k < 7; ++k) i += z <= kCos[k];
+    int q = 0; double u = 1, v = 0;
+    if (x > 0 && y >= 0)       { q = 0; u = x;  v = y;  }
+    else if (x <= 0 && y > 0)  { q = 1; u = y;  v = -x; }
+    else if (x < 0 && y <= 0)  { q = 2; u = -x; v = -y; }
+    else if (x >= 0 && y < 0)  { q = 3; u = -y; v = x;  }
+    const int j = 4 * q + (v >= kTan1 * u) + (v >= u) + (v >= kTan3 * u);
+    return i * 16 + j;
+}
+
+// ---- 标量实现（其它实现的尾部与兜底） ----
+
+static inline void xform1(const double *M, double x, double y, double z, float *o) {
+    if (M) {
+        o[0] = (float)(M[0] * x + M[1] * y + M[2] * z + M[3]);
+        o[1] = (float)(M[4] * x + M[5] * y + M[6] * z + M[7]);
+        o[2] = (float)(M[8] * x + M[9] * y + M[10] * z + M[11]);
+    } else {
+        o[0] = (float)x; o[1] = (float)y; o[2] = (float)z;
+    }
+}
+
+static void pack_xyz_scalar(const double *p, size_t n, const double *M, float *out) {
+    for (size_t i = 0; i < n; ++i) xform1(M, p[3 * i], p[3 * i + 1], p[3 * i + 2], out + 3 * i);
+}
+
+static void grid_centers_scalar(const uint32_t *cells, size_t n, const double o[3], double voxel, int64_t NY, int64_t NZ,
+                                const double *M, float *out) {
+    for (size_t i = 0; i < n; ++i) {
+        const int64_t c = cells[i], iz = c % NZ, t = c / NZ, iy = t % NY, ix = t / NY;
+        xform1(M, o[0] + (ix + 0.5) * voxel, o[1] + (iy + 0.5) * voxel, o[2] + (iz + 0.5) * voxel, out + 3 * i);
+    }
+}
+
+static Inside inside_scalar(const float *sd, size_t n, bool closed) {
+    Inside r;
+    for (size_t i = 0; i < n; ++i) {
+        const float v = sd[i];
+        if (v < 0.f || (closed && v == 0.f)) { r.min = std::min(r.min, -v); r.sum += -v; r.n++; }
+    }
+    return r;
+}
+
+static size_t compact_inside_scalar(const float *sd, size_t n, float *out) {
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i) if (sd[i] < 0.f) out[k++] = -sd[i];
+    return k;
+}
+
+static void min_sum_scalar(const float *v, size_t n, float &mn, double &sum) {
+    for (size_t i = 0; i < n; ++i) { mn = std::min(mn, v[i]); sum += v[i]; }
+}
+
+static void histogram_scalar(const float *v, size_t n, double w, int bins, uint32_t *hist) {
+    const int last = bins - 1;
+    for (size_t i = 0; i < n; ++i) hist[w > 0 ? std::min(last, (int)(v[i] / w)) : last]++;
+}
+
+static void plane_dot_scalar(const double *p, size_t n, const double N[3], double *out) {
+    for (size_t i = 0; i < n; ++i) out[i] = N[0] * p[3 * i] + N[1] * p[3 * i + 1] + N[2] * p[3 * i + 2];
+}
+
+static void plane_span_scalar(const double *sv, const int *tri, size_t nF, const double *D, int K, int *kb, int *ke) {
+    for (size_t t = 0; t < nF; ++t) {
+        const double a = sv[tri[3 * t]], b = sv[tri[3 * t + 1]], c = sv[tri[3 * t + 2]];
+        const double lo = std::min(a, std::min(b, c)), hi = std::max(a, std::max(b, c));
+        kb[t] = int(std::upper_bound(D, D + K, lo) - D);
+        ke[t] = int(std::upper_bound(D, D + K, hi) - D);
+    }
+}
+
+static void tri_moments_scalar(const double *X, const double *Y, const double *Z, const int *tri, int64_t b, int64_t e,
+                               double *area, int *bin, double acc[11]) {
+    for (int64_t t = b; t < e; ++t) {
+        const int ia = tri[3 * t], ib = tri[3 * t + 1], ic = tri[3 * t + 2];
+        const double ax = X[ia], ay = Y[ia], az = Z[ia];
+        const double ux = X[ib] - ax, uy = Y[ib] - ay, uz = Z[ib] - az;
+        const double vx = X[ic] - ax, vy = Y[ic] - ay, vz = Z[ic] - az;
+        const double nx = uy * vz - uz * vy, ny = uz * vx - ux * vz, nz = ux * vy - uy * vx;
+        const double len = std::sqrt(nx * nx + ny * ny + nz * nz);
+        const double A = 0.5 * len;
+        area[t - b] = A;
+        bin[t - b] = len >= 1e-12 ? normal_bin(nx / len, ny / len, nz / len) : -1;
+        acc[0] += ax * nx + ay * ny + az * nz;   // = a·(b×c)，原点四面体有向体积 ×6
+        acc[1] += A;
+        // 三角形上 ∫x dA = A·s/3，∫x xᵀ dA = A/12·(Σ vᵢvᵢᵀ + s sᵀ)，s = a + b + c
+        const double px[3] = {ax, X[ib], X[ic]}, py[3] = {ay, Y[ib], Y[ic]}, pz[3] = {az, Z[ib], Z[ic]};
+        const double Sx = px[0] + px[1] + px[2], Sy = py[0] + py[1] + py[2], Sz = pz[0] + pz[1] + pz[2];
+        acc[2] += A * Sx / 3; acc[3] += A * Sy / 3; acc[4] += A * Sz / 3;
+        double qxx = Sx * Sx, qxy = Sx * Sy, qxz = Sx * Sz, qyy = Sy * Sy, qyz = Sy * Sz, qzz = Sz * Sz;
+        for (int k = 0; k < 3; ++k) {
+            qxx += px[k] * px[k]; qxy += px[k] * py[k]; qxz += px[k] * pz[k];
+            qyy += py[k] * py[k]; qyz += py[k] * pz[k]; qzz += pz[k] * pz[k];
+        }
+        const double w = A / 12;
+        acc[5] += w * qxx; acc[6] += w * qxy; acc[7] += w * qxz;
+        acc[8] += w * qyy; acc[9] += w * qyz; acc[10] += w * qzz;
+    }
+}
+
+#ifdef SHOEMATCH_SIMD_X86
+
+// GCC 12 的 *intrin.h 以 _mm*_undefined_*() 作 gather / 掩码指令的源操作数，-Wall 下误报未初始化
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// ---- AVX2（4 x double / 8 x float；三元组用 gather 读、SSE 洗牌交织写） ----
+
+#define SM_AVX2 __attribute__((target("avx2")))
+
+// 4 组 x/y/z 交织为 x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+static SM_AVX2 inline void store_xyz4(float *o, __m128 X, __m128 Y, __m128 Z) {
+    const __m128 t0 = _mm_unpacklo_ps(X, Y), t1 = _mm_unpackhi_ps(X, Y);
+    const __m128 u = _mm_shuffle_ps(Z, t0, _MM_SHUFFLE(2, 2, 0, 0));
+    const __m128 v = _mm_shuffle_ps(t0, Z, _MM_SHUFFLE(1, 1, 3, 3));
+    const __m128 w = _mm_shuffle_ps(Z, t1, _MM_SHUFFLE(2, 2, 2, 2));
+    const __m128 r = _mm_shuffle_ps(t1, Z, _MM_SHUFFLE(3, 3, 3, 3));
+    _mm_storeu_ps(o, _mm_shuffle_ps(t0, u, _MM_SHUFFLE(2, 0, 1, 0)));
+    _mm_storeu_ps(o + 4, _mm_shuffle_ps(v, t1, _MM_SHUFFLE(1, 0, 2, 0)));
+    _mm_storeu_ps(o + 8, _mm_shuffle_ps(w, r, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+
+struct Affine4 {
+    __m256d m[12];
+    bool id;
+    SM_AVX2 explicit Affine4(const double *M) : id(!M) {
+        for (int k = 0; k < 12; ++k) m[k] = _mm256_set1_pd(M ? M[k] : 0.0);
+    }
+    SM_AVX2 __m256d row(int r, __m256d x, __m256d y, __m256d z) const {
+        return _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(m[4 * r], x), _mm256_mul_pd(m[4 * r + 1], y)),
+                                           _mm256_mul_pd(m[4 * r + 2], z)), m[4 * r + 3]);
+    }
+    SM_AVX2 void emit(float *o, __m256d x, __m256d y, __m256d z) const {
+        if (!id) { const __m256d X = row(0, x, y, z), Y = row(1, x, y, z); z = row(2, x, y, z); x = X; y = Y; }
+        store_xyz4(o, _mm256_cvtpd_ps(x), _mm256_cvtpd_ps(y), _mm256_cvtpd_ps(z));
+    }
+};
+
+static SM_AVX2 void pack_xyz_avx2(const double *p, size_t n, const double *M, float *out) {
+    const Affine4 A(M);
+    const __m128i idx = _mm_setr_epi32(0, 3, 6, 9);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const double *q = p + 3 * i;
+        A.emit(out + 3 * i, _mm256_i32gather_pd(q, idx, 8), _mm256_i32gather_pd(q + 1, idx, 8),
+               _mm256_i32gather_pd(q + 2, idx, 8));
+    }
+    pack_xyz_scalar(p + 3 * i, n - i, M, out + 3 * i);
+}
+
+// 线性索引在 double 下解码：c < 2^32 时 floor(c / NZ) 精确（商的舍入误差小于 1 / NZ）
+static SM_AVX2 void grid_centers_avx2(const uint32_t *cells, size_t n, const double o[3], double voxel, int64_t NY,
+                                      int64_t NZ, const double *M, float *out) {
+    const Affine4 A(M);
+    const __m256d nz = _mm256_set1_pd((double)NZ), ny = _mm256_set1_pd((double)NY), vx = _mm256_set1_pd(voxel);
+    const __m256d half = _mm256_set1_pd(0.5), two32 = _mm256_set1_pd(4294967296.0), zero = _mm256_setzero_pd();
+    const __m256d ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), oz = _mm256_set1_pd(o[2]);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d c = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(cells + i)));
+        c = _mm256_add_pd(c, _mm256_and_pd(_mm256_cmp_pd(c, zero, _CMP_LT_OQ), two32));   // uint32 高位
+        const __m256d t = _mm256_floor_pd(_mm256_div_pd(c, nz));
+        const __m256d iz = _mm256_sub_pd(c, _mm256_mul_pd(t, nz));
+        const __m256d ix = _mm256_floor_pd(_mm256_div_pd(t, ny));
+        const __m256d iy = _mm256_sub_pd(t, _mm256_mul_pd(ix, ny));
+        A.emit(out + 3 * i, _mm256_add_pd(ox, _mm256_mul_pd(_mm256_add_pd(ix, half), vx)),
+               _mm256_add_pd(oy, _mm256_mul_pd(_mm256_add_pd(iy, half), vx)),
+               _mm256_add_pd(oz, _mm256_mul_pd(_mm256_add_pd(iz, half), vx)));
+    }
+    grid_centers_scalar(cells + i, n - i, o, voxel, NY, NZ, M, out + 3 * i);
+}
+
+static SM_AVX2 inline float hmin8(__m256 v) {
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+static SM_AVX2 inline double hsum4(__m256d v) {
+    __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+}
+
+// 8 个 float 扩成两组 double 累加
+static SM_AVX2 inline __m256d add_wide(__m256d s, __m256 v) {
+    return _mm256_add_pd(_mm256_add_pd(s, _mm256_cvtps_pd(_mm256_castps256_ps128(v))),
+                         _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+}
+
+static SM_AVX2 Inside inside_avx2(const float *sd, size_t n, bool closed) {
+    const __m256 zero = _mm256_setzero_ps(), inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+    __m256 mn = inf;
+    __m256d sum = _mm256_setzero_pd();
+    size_t cnt = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(sd + i);
+        const __m256 in = closed ? _mm256_cmp_ps(v, zero, _CMP_LE_OQ) : _mm256_cmp_ps(v, zero, _CMP_LT_OQ);
+        const __m256 c = _mm256_sub_ps(zero, v);
+        mn = _mm256_min_ps(mn, _mm256_blendv_ps(inf, c, in));
+        sum = add_wide(sum, _mm256_and_ps(c, in));
+        cnt += (size_t)__builtin_popcount((unsigned)_mm256_movemask_ps(in));
+    }
+    Inside r = inside_scalar(sd + i, n - i, closed);
+    r.min = std::min(r.min, hmin8(mn));
+    r.sum += hsum4(sum);
+    r.n += cnt;
+    return r;
+}
+
+// 8 位掩码 -> 把选中通道左移到低位的 permutevar8x32 下标
+struct CompactLut {
+    alignas(32) int32_t idx[256][8];
+    CompactLut() {
+        for (int m = 0; m < 256; ++m) {
+            int k = 0;
+            for (int j = 0; j < 8; ++j) if (m & (1 << j)) idx[m][k++] = j;
+            for (; k < 8; ++k) idx[m][k] = 0;
+        }
+    }
+};
+static const CompactLut kCompact;
+
+static SM_AVX2 size_t compact_inside_avx2(const float *sd, size_t n, float *out) {
+    const __m256 zero = _mm256_setzero_ps();
+    size_t k = 0, i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 v = _mm256_loadu_ps(sd + i);
+        const int m = _mm256_movemask_ps(_mm256_cmp_ps(v, zero, _CMP_LT_OQ));
+        const __m256i perm = _mm256_load_si256((const __m256i *)kCompact.idx[m]);
+        _mm256_storeu_ps(out + k, _mm256_permutevar8x32_ps(_mm256_sub_ps(zero, v), perm));   // k + 8 <= i + 8 <= n
+        k += (size_t)__builtin_popcount((unsigned)m);
+    }
+    return k + compact_inside_scalar(sd + i, n - i, out + k);
+}
+
+static SM_AVX2 void min_sum_avx2(const float *v, size_t n, float &mn, double &sum) {
+    __m256 m = _mm256_set1_ps(mn);
+    __m256d s = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256 x = _mm256_loadu_ps(v + i);
+        m = _mm256_min_ps(m, x);
+        s = add_wide(s, x);
+    }
+    mn = hmin8(m); sum += hsum4(s);
+    min_sum_scalar(v + i, n - i, mn, sum);
+}
+
+// 箱号在 double 下算（与标量逐位一致），四份子直方图轮流累加，避免同一箱的连续自增互相等待
+static SM_AVX2 void histogram_avx2(const float *v, size_t n, double w, int bins, uint32_t *hist) {
+    if (!(w > 0)) { hist[bins - 1] += (uint32_t)n; return; }
+    std::vector<uint32_t> sub(4 * (size_t)bins, 0u);
+    const __m256d wv = _mm256_set1_pd(w), lastv = _mm256_set1_pd(bins - 1);
+    alignas(16) int32_t b[4];
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m256d q = _mm256_min_pd(_mm256_div_pd(_mm256_cvtps_pd(_mm_loadu_ps(v + i)), wv), lastv);
+        _mm_store_si128((__m128i *)b, _mm256_cvttpd_epi32(q));
+        for (int j = 0; j < 4; ++j) sub[j * bins + b[j]]++;
+    }
+    for (int j = 0; j < 4; ++j) for (int k = 0; k < bins; ++k) hist[k] += sub[j * bins + k];
+    histogram_scalar(v + i, n - i, w, bins, hist);
+}
+
+static SM_AVX2 void plane_dot_avx2(const double *p, size_t n, const double N[3], double *out) {
+    const __m128i idx = _mm_setr_epi32(0, 3, 6, 9);
+    const __m256d a = _mm256_set1_pd(N[0]), b = _mm256_set1_pd(N[1]), c = _mm256_set1_pd(N[2]);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const double *q = p + 3 * i;
+        const __m256d d = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(a, _mm256_i32gather_pd(q, idx, 8)),
+                                                      _mm256_mul_pd(b, _mm256_i32gather_pd(q + 1, idx, 8))),
+                                        _mm256_mul_pd(c, _mm256_i32gather_pd(q + 2, idx, 8)));
+        _mm256_storeu_pd(out + i, d);
+    }
+    plane_dot_scalar(p + 3 * i, n - i, N, out + i);
+}
+
+// 无分支 upper_bound：步长从不超过 K 的最大 2 的幂减半，4 个三角形一起走
+static SM_AVX2 inline __m256d count_le(const double *D, int K, int top, __m256d x) {
+    const __m256d Kv = _mm256_set1_pd(K), one = _mm256_set1_pd(1.0);
+    __m256d pos = _mm256_setzero_pd();
+    for (int s = top; s > 0; s >>= 1) {
+        const __m256d sv = _mm256_set1_pd(s), cand = _mm256_add_pd(pos, sv);
+        const __m256d ok = _mm256_cmp_pd(cand, Kv, _CMP_LE_OQ);
+        const __m128i at = _mm256_cvttpd_epi32(_mm256_sub_pd(_mm256_min_pd(cand, Kv), one));
+        const __m256d take = _mm256_and_pd(ok, _mm256_cmp_pd(_mm256_i32gather_pd(D, at, 8), x, _CMP_LE_OQ));
+        pos = _mm256_add_pd(pos, _mm256_and_pd(take, sv));
+    }
+    return pos;
+}
+
+static SM_AVX2 void plane_span_avx2(const double *sv, const int *tri, size_t nF, const double *D, int K,
+                                    int *kb, int *ke) {
+    if (K <= 0) { std::fill(kb, kb + nF, 0); std::fill(ke, ke + nF, 0); return; }
+    int top = 1;
+    while (2 * top <= K) top *= 2;
+    const __m128i idx = _mm_setr_epi32(0, 3, 6, 9);
+    size_t t = 0;
+    for (; t + 4 <= nF; t += 4) {
+        const int *q = tri + 3 * t;
+        const __m256d a = _mm256_i32gather_pd(sv, _mm_i32gather_epi32(q, idx, 4), 8);
+        const __m256d b = _mm256_i32gather_pd(sv, _mm_i32gather_epi32(q + 1, idx, 4), 8);
+        const __m256d c = _mm256_i32gather_pd(sv, _mm_i32gather_epi32(q + 2, idx, 4), 8);
+        const __m256d lo = _mm256_min_pd(a, _mm256_min_pd(b, c)), hi = _mm256_max_pd(a, _mm256_max_pd(b, c));
+        _mm_storeu_si128((__m128i *)(kb + t), _mm256_cvttpd_epi32(count_le(D, K, top, lo)));
+        _mm_storeu_si128((__m128i *)(ke + t), _mm256_cvttpd_epi32(count_le(D, K, top, hi)));
+    }
+    plane_span_scalar(sv, tri + 3 * t, nF - t, D, K, kb + t, ke + t);
+}
+
+static SM_AVX2 inline __m256d sel(__m256d m, __m256d a, __m256d b) { return _mm256_blendv_pd(b, a, m); }   // m ? a : b
+
+// x0 y0 + x1 y1 + x2 y2，与标量同样从左到右求和
+static SM_AVX2 inline __m256d dot4(__m256d x0, __m256d x1, __m256d x2, __m256d y0, __m256d y1, __m256d y2) {
+    return _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(x0, y0), _mm256_mul_pd(x1, y1)), _mm256_mul_pd(x2, y2));
+}
+
+// 二阶面矩被积式 S T + Σ aᵢ bᵢ（三个顶点）
+static SM_AVX2 inline __m256d q2(__m256d S, __m256d T, __m256d a0, __m256d b0, __m256d a1, __m256d b1, __m256d a2,
+                                 __m256d b2) {
+    return _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(S, T), _mm256_mul_pd(a0, b0)), _mm256_mul_pd(a1, b1)),
+                         _mm256_mul_pd(a2, b2));
+}
+
+// normal_bin 的 4 路版本：各象限条件互斥，逐个 blend 与 if/else 链等价
+static SM_AVX2 inline __m256d normal_bin4(__m256d x, __m256d y, __m256d z) {
+    const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+    __m256d i = zero;
+    for (int k = 0; k < 7; ++k)
+        i = _mm256_add_pd(i, _mm256_and_pd(_mm256_cmp_pd(z, _mm256_set1_pd(kCos[k]), _CMP_LE_OQ), one));
+    const __m256d xg = _mm256_cmp_pd(x, zero, _CMP_GT_OQ), xl = _mm256_cmp_pd(x, zero, _CMP_LT_OQ);
+    const __m256d xge = _mm256_cmp_pd(x, zero, _CMP_GE_OQ), xle = _mm256_cmp_pd(x, zero, _CMP_LE_OQ);
+    const __m256d yg = _mm256_cmp_pd(y, zero, _CMP_GT_OQ), yl = _mm256_cmp_pd(y, zero, _CMP_LT_OQ);
+    const __m256d yge = _mm256_cmp_pd(y, zero, _CMP_GE_OQ), yle = _mm256_cmp_pd(y, zero, _CMP_LE_OQ);
+    const __m256d nx = _mm256_sub_pd(zero, x), ny = _mm256_sub_pd(zero, y);
+    __m256d q = zero, u = one, v = zero, m;
+    m = _mm256_and_pd(xg, yge);  u = sel(m, x, u);  v = sel(m, y, v);
+    m = _mm256_and_pd(xle, yg);  u = sel(m, y, u);  v = sel(m, nx, v); q = sel(m, one, q);
+    m = _mm256_and_pd(xl, yle);  u = sel(m, nx, u); v = sel(m, ny, v); q = sel(m, _mm256_set1_pd(2.0), q);
+    m = _mm256_and_pd(xge, yl);  u = sel(m, ny, u); v = sel(m, x, v);  q = sel(m, _mm256_set1_pd(3.0), q);
+    __m256d j = _mm256_mul_pd(q, _mm256_set1_pd(4.0));
+    j = _mm256_add_pd(j, _mm256_and_pd(_mm256_cmp_pd(v, _mm256_mul_pd(_mm256_set1_pd(kTan1), u), _CMP_GE_OQ), one));
+    j = _mm256_add_pd(j, _mm256_and_pd(_mm256_cmp_pd(v, u, _CMP_GE_OQ), one));
+    j = _mm256_add_pd(j, _mm256_and_pd(_mm256_cmp_pd(v, _mm256_mul_pd(_mm256_set1_pd(kTan3), u), _CMP_GE_OQ), one));
+    return _mm256_add_pd(_mm256_mul_pd(i, _mm256_set1_pd(16.0)), j);
+}
+
+static SM_AVX2 void tri_moments_avx2(const double *X, const double *Y, const double *Z, const int *tri, int64_t b,
+                                     int64_t e, double *area, int *bin, double acc[11]) {
+    const __m128i idx = _mm_setr_epi32(0, 3, 6, 9);
+    const __m256d half = _mm256_set1_pd(0.5), third = _mm256_set1_pd(3.0), twelfth = _mm256_set1_pd(12.0);
+    const __m256d eps = _mm256_set1_pd(1e-12), none = _mm256_set1_pd(-1.0);
+    __m256d s[11];
+    for (auto &v : s) v = _mm256_setzero_pd();
+    int64_t t = b;
+    for (; t + 4 <= e; t += 4) {
+        const int *q = tri + 3 * t;
+        const __m128i ia = _mm_i32gather_epi32(q, idx, 4), ib = _mm_i32gather_epi32(q + 1, idx, 4),
+                      ic = _mm_i32gather_epi32(q + 2, idx, 4);
+        const __m256d ax = _mm256_i32gather_pd(X, ia, 8), ay = _mm256_i32gather_pd(Y, ia, 8),
+                      az = _mm256_i32gather_pd(Z, ia, 8);
+        const __m256d bx = _mm256_i32gather_pd(X, ib, 8), by = _mm256_i32gather_pd(Y, ib, 8),
+                      bz = _mm256_i32gather_pd(Z, ib, 8);
+        const __m256d cx = _mm256_i32gather_pd(X, ic, 8), cy = _mm256_i32gather_pd(Y, ic, 8),
+                      cz = _mm256_i32gather_pd(Z, ic, 8);
+        const __m256d ux = _mm256_sub_pd(bx, ax), uy = _mm256_sub_pd(by, ay), uz = _mm256_sub_pd(bz, az);
+        const __m256d vx = _mm256_sub_pd(cx, ax), vy = _mm256_sub_pd(cy, ay), vz = _mm256_sub_pd(cz, az);
+        const __m256d nx = _mm256_sub_pd(_mm256_mul_pd(uy, vz), _mm256_mul_pd(uz, vy));
+        const __m256d ny = _mm256_sub_pd(_mm256_mul_pd(uz, vx), _mm256_mul_pd(ux, vz));
+        const __m256d nz = _mm256_sub_pd(_mm256_mul_pd(ux, vy), _mm256_mul_pd(uy, vx));
+        const __m256d len = _mm256_sqrt_pd(dot4(nx, ny, nz, nx, ny, nz));
+        const __m256d A = _mm256_mul_pd(half, len);
+        _mm256_storeu_pd(area + (t - b), A);
+        const __m256d nb = normal_bin4(_mm256_div_pd(nx, len), _mm256_div_pd(ny, len), _mm256_div_pd(nz, len));
+        const __m256d nbin = sel(_mm256_cmp_pd(len, eps, _CMP_GE_OQ), nb, none);
+        _mm_storeu_si128((__m128i *)(bin + (t - b)), _mm256_cvttpd_epi32(nbin));
+
+        s[0] = _mm256_add_pd(s[0], dot4(ax, ay, az, nx, ny, nz));
+        s[1] = _mm256_add_pd(s[1], A);
+        const __m256d Sx = _mm256_add_pd(_mm256_add_pd(ax, bx), cx), Sy = _mm256_add_pd(_mm256_add_pd(ay, by), cy),
+                      Sz = _mm256_add_pd(_mm256_add_pd(az, bz), cz);
+        s[2] = _mm256_add_pd(s[2], _mm256_div_pd(_mm256_mul_pd(A, Sx), third));
+        s[3] = _mm256_add_pd(s[3], _mm256_div_pd(_mm256_mul_pd(A, Sy), third));
+        s[4] = _mm256_add_pd(s[4], _mm256_div_pd(_mm256_mul_pd(A, Sz), third));
+        const __m256d w = _mm256_div_pd(A, twelfth);
+        s[5] = _mm256_add_pd(s[5], _mm256_mul_pd(w, q2(Sx, Sx, ax, ax, bx, bx, cx, cx)));
+        s[6] = _mm256_add_pd(s[6], _mm256_mul_pd(w, q2(Sx, Sy, ax, ay, bx, by, cx, cy)));
+        s[7] = _mm256_add_pd(s[7], _mm256_mul_pd(w, q2(Sx, Sz, ax, az, bx, bz, cx, cz)));
+        s[8] = _mm256_add_pd(s[8], _mm256_mul_pd(w, q2(Sy, Sy, ay, ay, by, by, cy, cy)));
+        s[9] = _mm256_add_pd(s[9], _mm256_mul_pd(w, q2(Sy, Sz, ay, az, by, bz, cy, cz)));
+        s[10] = _mm256_add_pd(s[10], _mm256_mul_pd(w, q2(Sz, Sz, az, az, bz, bz, cz, cz)));
+    }
+    for (int k = 0; k < 11; ++k) acc[k] += hsum4(s[k]);
+    tri_moments_scalar(X, Y, Z, tri, t, e, area + (t - b), bin + (t - b), acc);
+}
+
+// ---- AVX-512（8 x double / 16 x float；流式的打包与归约，其余沿用 AVX2） ----
+
+#define SM_AVX512 __attribute__((target("avx512f")))
+
+static SM_AVX512 inline __m512d row8(const __m512d *m, __m512d x, __m512d y, __m512d z) {
+    return _mm512_add_pd(_mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(m[0], x), _mm512_mul_pd(m[1], y)),
+                                       _mm512_mul_pd(m[2], z)), m[3]);
+}
+
+static SM_AVX512 inline void emit8(float *o, const __m512d *m, bool id, __m512d x, __m512d y, __m512d z) {
+    if (!id) {
+        const __m512d X = row8(m, x, y, z), Y = row8(m + 4, x, y, z);
+        z = row8(m + 8, x, y, z); x = X; y = Y;
+    }
+    const __m256 X = _mm512_cvtpd_ps(x), Y = _mm512_cvtpd_ps(y), Z = _mm512_cvtpd_ps(z);
+    store_xyz4(o, _mm256_castps256_ps128(X), _mm256_castps256_ps128(Y), _mm256_castps256_ps128(Z));
+    store_xyz4(o + 12, _mm256_extractf128_ps(X, 1), _mm256_extractf128_ps(Y, 1), _mm256_extractf128_ps(Z, 1));
+}
+
+static SM_AVX512 void pack_xyz_avx512(const double *p, size_t n, const double *M, float *out) {
+    __m512d m[12];
+    for (int k = 0; k < 12; ++k) m[k] = _mm512_set1_pd(M ? M[k] : 0.0);
+    const __m256i idx = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const double *q = p + 3 * i;
+        emit8(out + 3 * i, m, !M, _mm512_i32gather_pd(idx, q, 8), _mm512_i32gather_pd(idx, q + 1, 8),
+              _mm512_i32gather_pd(idx, q + 2, 8));
+    }
+    pack_xyz_scalar(p + 3 * i, n - i, M, out + 3 * i);
+}
+
+static SM_AVX512 void grid_centers_avx512(const uint32_t *cells, size_t n, const double o[3], double voxel, int64_t NY,
+                                          int64_t NZ, const double *M, float *out) {
+    __m512d m[12];
+    for (int k = 0; k < 12; ++k) m[k] = _mm512_set1_pd(M ? M[k] : 0.0);
+    const __m512d nz = _mm512_set1_pd((double)NZ), ny = _mm512_set1_pd((double)NY), vx = _mm512_set1_pd(voxel);
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d ox = _mm512_set1_pd(o[0]), oy = _mm512_set1_pd(o[1]), oz = _mm512_set1_pd(o[2]);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m512d c = _mm512_cvtepu32_pd(_mm256_loadu_si256((const __m256i *)(cells + i)));
+        const __m512d t = _mm512_roundscale_pd(_mm512_div_pd(c, nz), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        const __m512d iz = _mm512_sub_pd(c, _mm512_mul_pd(t, nz));
+        const __m512d ix = _mm512_roundscale_pd(_mm512_div_pd(t, ny), _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+        const __m512d iy = _mm512_sub_pd(t, _mm512_mul_pd(ix, ny));
+        emit8(out + 3 * i, m, !M, _mm512_add_pd(ox, _mm512_mul_pd(_mm512_add_pd(ix, half), vx)),
+              _mm512_add_pd(oy, _mm512_mul_pd(_mm512_add_pd(iy, half), vx)),
+              _mm512_add_pd(oz, _mm512_mul_pd(_mm512_add_pd(iz, half), vx)));
+    }
+    grid_centers_scalar(cells + i, n - i, o, voxel, NY, NZ, M, out + 3 * i);
+}
+
+static SM_AVX512 inline __m512d add_wide16(__m512d s, __m512 v) {
+    return _mm512_add_pd(_mm512_add_pd(s, _mm512_cvtps_pd(_mm512_castps512_ps256(v))),
+                         _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1))));
+}
+
+static SM_AVX512 Inside inside_avx512(const float *sd, size_t n, bool closed) {
+    const __m512 zero = _mm512_setzero_ps(), inf = _mm512_set1_ps(std::numeric_limits<float>::infinity());
+    __m512 mn = inf;
+    __m512d sum = _mm512_setzero_pd();
+    size_t cnt = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512 v = _mm512_loadu_ps(sd + i);
+        const __mmask16 in = closed ? _mm512_cmp_ps_mask(v, zero, _CMP_LE_OQ) : _mm512_cmp_ps_mask(v, zero, _CMP_LT_OQ);
+        const __m512 c = _mm512_maskz_sub_ps(in, zero, v);
+        mn = _mm512_mask_min_ps(mn, in, mn, c);
+        sum = add_wide16(sum, c);
+        cnt += (size_t)__builtin_popcount((unsigned)in);
+    }
+    Inside r = inside_scalar(sd + i, n - i, closed);
+    r.min = std::min(r.min, _mm512_reduce_min_ps(mn));
+    r.sum += _mm512_reduce_add_pd(sum);
+    r.n += cnt;
+    return r;
+}
+
+static SM_AVX512 size_t compact_inside_avx512(const float *sd, size_t n, float *out) {
+    const __m512 zero = _mm512_setzero_ps();
+    size_t k = 0, i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512 v = _mm512_loadu_ps(sd + i);
+        const __mmask16 m = _mm512_cmp_ps_mask(v, zero, _CMP_LT_OQ);
+        _mm512_storeu_ps(out + k, _mm512_maskz_compress_ps(m, _mm512_sub_ps(zero, v)));   // k + 16 <= i + 16 <= n
+        k += (size_t)__builtin_popcount((unsigned)m);
+    }
+    return k + compact_inside_scalar(sd + i, n - i, out + k);
+}
+
+static SM_AVX512 void min_sum_avx512(const float *v, size_t n, float &mn, double &sum) {
+    __m512 m = _mm512_set1_ps(mn);
+    __m512d s = _mm512_setzero_pd();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512 x = _mm512_loadu_ps(v + i);
+        m = _mm512_min_ps(m, x);
+        s = add_wide16(s, x);
+    }
+    mn = _mm512_reduce_min_ps(m); sum += _mm512_reduce_add_pd(s);
+    min_sum_scalar(v + i, n - i, mn, sum);
+}
+
+static SM_AVX512 void histogram_avx512(const float *v, size_t n, double w, int bins, uint32_t *hist) {
+    if (!(w > 0)) { hist[bins - 1] += (uint32_t)n; return; }
+    std::vector<uint32_t> sub(8 * (size_t)bins, 0u);
+    const __m512d wv = _mm512_set1_pd(w), lastv = _mm512_set1_pd(bins - 1);
+    alignas(32) int32_t b[8];
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m512d q = _mm512_min_pd(_mm512_div_pd(_mm512_cvtps_pd(_mm256_loadu_ps(v + i)), wv), lastv);
+        _mm256_store_si256((__m256i *)b, _mm512_cvttpd_epi32(q));
+        for (int j = 0; j < 8; ++j) sub[j * bins + b[j]]++;
+    }
+    for (int j = 0; j < 8; ++j) for (int k = 0; k < bins; ++k) hist[k] += sub[j * bins + k];
+    histogram_scalar(v + i, n - i, w, bins, hist);
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif  // SHOEMATCH_SIMD_X86
+
+#ifdef SHOEMATCH_SIMD_NEON
+
+// ---- NEON（aarch64：2 x double / 4 x float；vld3 / vst3 直接解交织） ----
+
+static inline void emit4_neon(float *o, const double *M, float64x2_t x0, float64x2_t y0, float64x2_t z0, float64x2_t x1,
+                              float64x2_t y1, float64x2_t z1) {
+    if (M) {
+        auto row = [M](int r, float64x2_t x, float64x2_t y, float64x2_t z) {
+            return vaddq_f64(vaddq_f64(vaddq_f64(vmulq_n_f64(x, M[4 * r]), vmulq_n_f64(y, M[4 * r + 1])),
+                                       vmulq_n_f64(z, M[4 * r + 2])), vdupq_n_f64(M[4 * r + 3]));
+        };
+        const float64x2_t X0 = row(0, x0, y0, z0), Y0 = row(1, x0, y0, z0), Z0 = row(2, x0, y0, z0);
+        const float64x2_t X1 = row(0, x1, y1, z1), Y1 = row(1, x1, y1, z1), Z1 = row(2, x1, y1, z1);
+        x0 = X0; y0 = Y0; z0 = Z0; x1 = X1; y1 = Y1; z1 = Z1;
+    }
+    float32x4x3_t v;
+    v.val[0] = vcombine_f32(vcvt_f32_f64(x0), vcvt_f32_f64(x1));
+    v.val[1] = vcombine_f32(vcvt_f32_f64(y0), vcvt_f32_f64(y1));
+    v.val[2] = vcombine_f32(vcvt_f32_f64(z0), vcvt_f32_f64(z1));
+    vst3q_f32(o, v);
+}
+
+static void pack_xyz_neon(const double *p, size_t n, const double *M, float *out) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float64x2x3_t a = vld3q_f64(p + 3 * i), b = vld3q_f64(p + 3 * i + 6);
+        emit4_neon(out + 3 * i, M, a.val[0], a.val[1], a.val[2], b.val[0], b.val[1], b.val[2]);
+    }
+    pack_xyz_scalar(p + 3 * i, n - i, M, out + 3 * i);
+}
+
+static void grid_centers_neon(const uint32_t *cells, size_t n, const double o[3], double voxel, int64_t NY, int64_t NZ,
+                              const double *M, float *out) {
+    const float64x2_t nz = vdupq_n_f64((double)NZ), ny = vdupq_n_f64((double)NY), half = vdupq_n_f64(0.5);
+    auto decode = [&](uint32x2_t cc, float64x2_t &x, float64x2_t &y, float64x2_t &z) {
+        const float64x2_t c = vcvtq_f64_u64(vmovl_u32(cc));
+        const float64x2_t t = vrndmq_f64(vdivq_f64(c, nz)), iz = vsubq_f64(c, vmulq_f64(t, nz));
+        const float64x2_t ix = vrndmq_f64(vdivq_f64(t, ny)), iy = vsubq_f64(t, vmulq_f64(ix, ny));
+        x = vaddq_f64(vdupq_n_f64(o[0]), vmulq_n_f64(vaddq_f64(ix, half), voxel));
+        y = vaddq_f64(vdupq_n_f64(o[1]), vmulq_n_f64(vaddq_f64(iy, half), voxel));
+        z = vaddq_f64(vdupq_n_f64(o[2]), vmulq_n_f64(vaddq_f64(iz, half), voxel));
+    };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const uint32x4_t c = vld1q_u32(cells + i);
+        float64x2_t x0, y0, z0, x1, y1, z1;
+        decode(vget_low_u32(c), x0, y0, z0);
+        decode(vget_high_u32(c), x1, y1, z1);
+        emit4_neon(out + 3 * i, M, x0, y0, z0, x1, y1, z1);
+    }
+    grid_centers_scalar(cells + i, n - i, o, voxel, NY, NZ, M, out + 3 * i);
+}
+
+static Inside inside_neon(const float *sd, size_t n, bool closed) {
+    const float32x4_t inf = vdupq_n_f32(std::numeric_limits<float>::infinity());
+    float32x4_t mn = inf;
+    float64x2_t sum = vdupq_n_f64(0.0);
+    uint32x4_t cnt = vdupq_n_u32(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t v = vld1q_f32(sd + i);
+        const uint32x4_t in = closed ? vclezq_f32(v) : vcltzq_f32(v);
+        const float32x4_t c = vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(vnegq_f32(v)), in));
+        mn = vminq_f32(mn, vbslq_f32(in, c, inf));
+        sum = vaddq_f64(vaddq_f64(sum, vcvt_f64_f32(vget_low_f32(c))), vcvt_high_f64_f32(c));
+        cnt = vsubq_u32(cnt, in);   // 真为全 1（-1）
+    }
+    Inside r = inside_scalar(sd + i, n - i, closed);
+    r.min = std::min(r.min, vminvq_f32(mn));
+    r.sum += vaddvq_f64(sum);
+    r.n += vaddvq_u32(cnt);
+    return r;
+}
+
+static void min_sum_neon(const float *v, size_t n, float &mn, double &sum) {
+    float32x4_t m = vdupq_n_f32(mn);
+    float64x2_t s = vdupq_n_f64(0.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t x = vld1q_f32(v + i);
+        m = vminq_f32(m, x);
+        s = vaddq_f64(vaddq_f64(s, vcvt_f64_f32(vget_low_f32(x))), vcvt_high_f64_f32(x));
+    }
+    mn = vminvq_f32(m); sum += vaddvq_f64(s);
+    min_sum_scalar(v + i, n - i, mn, sum);
+}
+
+static void plane_dot_neon(const double *p, size_t n, const double N[3], double *out) {
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        const float64x2x3_t a = vld3q_f64(p + 3 * i);
+        vst1q_f64(out + i, vaddq_f64(vaddq_f64(vmulq_n_f64(a.val[0], N[0]), vmulq_n_f64(a.val[1], N[1])),
+                                     vmulq_n_f64(a.val[2], N[2])));
+    }
+    plane_dot_scalar(p + 3 * i, n - i, N, out + i);
+}
+
+#endif  // SHOEMATCH_SIMD_NEON
+
+struct Kernels {
+    Isa isa;
+    void (*pack_xyz)(const double *, size_t, const double *, float *);
+    void (*grid_centers)(const uint32_t *, size_t, const double *, double, int64_t, int64_t, const double *, float *);
+    Inside (*inside)(const float *, size_t, bool);
+    size_t (*compact_inside)(const float *, size_t, float *);
+    void (*min_sum)(const float *, size_t, float &, double &);
+    void (*histogram)(const float *, size_t, double, int, uint32_t *);
+    void (*plane_dot)(const double *, size_t, const double *, double *);
+    void (*plane_span)(const double *, const int *, size_t, const double *, int, int *, int *);
+    void (*tri_moments)(const double *, const double *, const double *, const int *, int64_t, int64_t, double *,
+                        int *, double *);
+};
+
+static const Kernels kScalar{Isa::Scalar, pack_xyz_scalar, grid_centers_scalar, inside_scalar, compact_inside_scalar,
+                             min_sum_scalar, histogram_scalar, plane_dot_scalar, plane_span_scalar, tri_moments_scalar};
+#ifdef SHOEMATCH_SIMD_X86
+static const Kernels kAvx2{Isa::Avx2, pack_xyz_avx2, grid_centers_avx2, inside_avx2, compact_inside_avx2,
+                           min_sum_avx2, histogram_avx2, plane_dot_avx2, plane_span_avx2, tri_moments_avx2};
+static const Kernels kAvx512{Isa::Avx512, pack_xyz_avx512, grid_centers_avx512, inside_avx512, compact_inside_avx512,
+                             min_sum_avx512, histogram_avx512, plane_dot_avx2, plane_span_avx2, tri_moments_avx2};
+#endif
+#ifdef SHOEMATCH_SIMD_NEON
+// 无 gather / compress：压缩、分箱、区间与三角形遍历走标量
+static const Kernels kNeon{Isa::Neon, pack_xyz_neon, grid_centers_neon, inside_neon, compact_inside_scalar,
+                           min_sum_neon, histogram_scalar, plane_dot_neon, plane_span_scalar, tri_moments_scalar};
+#endif
+
+static const Kernels *kernels_for(Isa i) {
+    switch (i) {
+#ifdef SHOEMATCH_SIMD_X86
+    case Isa::Avx512:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx512f") ? &kAvx512 : nullptr;
+    case Isa::Avx2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? &kAvx2 : nullptr;
+#endif
+#ifdef SHOEMATCH_SIMD_NEON
+    case Isa::Neon: return &kNeon;
+#endif
+    case Isa::Scalar: return &kScalar;
+    default: return nullptr;
+    }
+}
+
+static const Kernels *best_kernels() {
+    for (Isa i : {Isa::Avx512, Isa::Avx2, Isa::Neon})
+        if (const Kernels *k = kernels_for(i)) return k;
+    return &kScalar;
+}
+
+static Isa parse_isa(const std::string &name) {
+    for (Isa i : {Isa::Scalar, Isa::Neon, Isa::Avx2, Isa::Avx512})
+        if (name == isa_name(i)) return i;
+    throw std::runtime_error("unknown SIMD ISA: " + name + " (expected scalar / neon / avx2 / avx512 / auto)");
+}
+
+static const Kernels *select_kernels(const std::string &name) {
+    if (name.empty() || name == "auto") return best_kernels();
+    const Kernels *k = kernels_for(parse_isa(name));
+    if (!k) throw std::runtime_error("SIMD ISA not supported on this CPU/build: " + name);
+    return k;
+}
+
+static std::atomic<const Kernels *> g_kernels{nullptr};
+
+static const Kernels &K() {
+    const Kernels *k = g_kernels.load(std::memory_order_acquire);
+    if (!k) {
+        const char *env = std::getenv("SHOEMATCH_SIMD");
+        try { k = select_kernels(env ? env : ""); } catch (const std::exception &) { k = best_kernels(); }
+        g_kernels.store(k, std::memory_order_release);
+    }
+    return *k;
+}
+
+Isa isa() { return K().isa; }
+
+const char *isa_name(Isa i) {
+    switch (i) {
+    case Isa::Neon: return "neon";
+    case Isa::Avx2: return "avx2";
+    case Isa::Avx512: return "avx512";
+    default: return "scalar";
+    }
+}
+
+void set_isa(const std::string &name) { g_kernels.store(select_kernels(name), std::memory_order_release); }
+
+void pack_xyz(const double *p, size_t n, const double *M, float *out) { K().pack_xyz(p, n, M, out); }
+
+void grid_centers(const uint32_t *cells, size_t n, const double o[3], double voxel, int64_t NY, int64_t NZ,
+                  const double *M, float *out) {
+    K().grid_centers(cells, n, o, voxel, NY, NZ, M, out);
+}
+
+Inside inside(const float *sd, size_t n, bool closed) { return K().inside(sd, n, closed); }
+
+size_t compact_inside(const float *sd, size_t n, float *out) { return K().compact_inside(sd, n, out); }
+
+void min_sum(const float *v, size_t n, float &mn, double &sum) { K().min_sum(v, n, mn, sum); }
+
+void histogram(const float *v, size_t n, double w, int bins, uint32_t *hist) { K().histogram(v, n, w, bins, hist); }
+
+void plane_dot(const double *p, size_t n, const double N[3], double *out) { K().plane_dot(p, n, N, out); }
+
+void plane_span(const double *sv, const int *tri, size_t nF, const double *D, int K_, int *kb, int *ke) {
+    K().plane_span(sv, tri, nF, D, K_, kb, ke);
+}
+
+void tri_moments(const double *X, const double *Y, const double *Z, const int *tri, int64_t b, int64_t e,
+                 double *area, int *bin, double acc[11]) {
+    K().tri_moments(X, Y, Z, tri, b, e, area, bin, acc);
+}
+
+void affine_rows(const Eigen::Matrix4d &T, double M[12]) {
+    for (int r = 0; r < 3; ++r)
+        for (int c = 0; c < 4; ++c) M[4 * r + c] = T(r, c);
+}
+
+}  // namespace simd
+
+// ----------------------------- 工具函数 -----------------------------
+
+void clean_mesh(geometry::TriangleMesh &m) {
+    StageTimer st(Stage::Ingest);
+    if (!m.triangles_.empty()) {
+        m.RemoveDegenerateTriangles();
+        m.RemoveDuplicatedTriangles();
+    }
+    m.RemoveDuplicatedVertices();
+    m.RemoveUnreferencedVertices();
+}
+
+std::shared_ptr<geometry::PointCloud>
+sample_pcd(geometry::TriangleMesh &m, size_t n) {
+    if (m.triangles_.empty()) {
+        // 如果没有面，则用顶点构建点云
+        auto p = std::make_shared<geometry::PointCloud>();
+        p->points_ = m.vertices_;
+        return p;
+    }
+    StageTimer st(Stage::Sample);
+    return m.SamplePointsUniformly(n);
+}
+
+std::shared_ptr<geometry::PointCloud> downsample(const geometry::PointCloud &p, double voxel) {
+    StageTimer st(Stage::Downsample);
+    return p.VoxelDownSample(voxel);
+}
+
+void est_normals(geometry::PointCloud &pcd, double radius) {
+    StageTimer st(Stage::Normals);
+    pcd.EstimateNormals(geometry::KDTreeSearchParamHybrid(radius, 60));
+    pcd.NormalizeNormals();
+}
+
+// 按 radius 网格的 Morton 码排序：相邻下标在空间上也相邻
+static std::vector<size_t> morton_order(const std::vector<Eigen::Vector3d> &p, double cell) {
+    auto spread = [](uint64_t x) {   // 21 位 -> 每位间隔两个 0
+        x &= 0x1fffff;
+        x = (x | x << 32) & 0x1f00000000ffffull;
+        x = (x | x << 16) & 0x1f0000ff0000ffull;
+        x = (x | x << 8) & 0x100f00f00f00f00full;
+        x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+        x = (x | x << 2) & 0x1249249249249249ull;
+        return x;
+    };
+    Eigen::Vector3d lo = Eigen::Vector3d::Constant(std::numeric_limits<double>::infinity());
+    for (const auto &x : p) lo = lo.cwiseMin(x);
+    std::vector<std::pair<uint64_t, size_t>> key(p.size());
+    for (size_t i = 0; i < p.size(); ++i) {
+        const Eigen::Vector3d g = (p[i] - lo) / cell;
+        key[i] = {spread((uint64_t)g.x()) | spread((uint64_t)g.y()) << 1 | spread((uint64_t)g.z()) << 2, i};
+    }
+    std::sort(key.begin(), key.end());
+    std::vector<size_t> order(p.size());
+    for (size_t i = 0; i < p.size(); ++i) order[i] = key[i].second;
+    return order;
+}
+
+// 池可用时按 Morton 序切成空间紧凑的块，每块一个任务（indices 只算该块，块间仅边界点的 SPFH 重复）
+std::shared_ptr<pipelines::registration::Feature>
+fpfh(const geometry::PointCloud &pcd, double radius) {
+    StageTimer st(Stage::FPFH);
+    const geometry::KDTreeSearchParamHybrid param(radius, 100);
+    const size_t kBlock = 2048, n = pcd.points_.size();
+    if (n < 2 * kBlock || !tasks_available()) return pipelines::registration::ComputeFPFHFeature(pcd, param);
+
+    const auto order = morton_order(pcd.points_, radius);
+    auto out = std::make_shared<pipelines::registration::Feature>();
+    out->Resize(33, (int)n);
+    parallel_for((int)((n + kBlock - 1) / kBlock), [&](int b) {
+        const size_t lo = b * kBlock, hi = std::min(n, lo + kBlock);
+        const std::vector<size_t> idx(order.begin() + lo, order.begin() + hi);
+        const auto f = pipelines::registration::ComputeFPFHFeature(pcd, param, idx);
+        for (size_t k = 0; k < idx.size(); ++k) out->data_.col(idx[k]) = f->data_.col(k);
+    });
+    return out;
+}
+
+Eigen::Matrix4d ransac_fpfh(const geometry::PointCloud &src, const geometry::PointCloud &tgt,
+                            const pipelines::registration::Feature &fsrc,
+                            const pipelines::registration::Feature &ftgt, double voxel) {
+    StageTimer st(Stage::RANSAC);
+    const double thr = voxel * 3.0;
+    std::vector<std::reference_wrapper<const pipelines::registration::CorrespondenceChecker>> checkers;
+    auto checker = std::make_shared<pipelines::registration::CorrespondenceCheckerBasedOnDistance>(thr);
+    checkers.push_back(*checker);
+    auto result = pipelines::registration::RegistrationRANSACBasedOnFeatureMatching(
+        src, tgt, fsrc, ftgt, true, thr,
+        pipelines::registration::TransformationEstimationPointToPoint(false), 4,
+        checkers,
+        pipelines::registration::RANSACConvergenceCriteria(8000, 1000));
+    g_stats.ransac_corr.fetch_add(result.correspondence_set_.size(), std::memory_order_relaxed);
+    if (tl_profile) { tl_profile->ransac_corr += result.correspondence_set_.size(); tl_profile->ransac_fitness = result.fitness_; }
+    return result.transformation_;
+}
+
+Eigen::Matrix4d ransac(geometry::PointCloud &src, geometry::PointCloud &tgt,
+                       double radius, double voxel) {
+    est_normals(src, radius);
+    est_normals(tgt, radius);
+
+    auto fsrc = fpfh(src, radius);
+    auto ftgt = fpfh(tgt, radius);
+    return ransac_fpfh(src, tgt, *fsrc, *ftgt, voxel);
+}
+
+Eigen::Matrix4d icp_p2l(const geometry::PointCloud &src, const geometry::PointCloud &tgt,
+                        const Eigen::Matrix4d &init, double thr) {
+    StageTimer st(Stage::ICP);
+    auto result = pipelines::registration::RegistrationICP(
+        src, tgt, thr, init,
+        pipelines::registration::TransformationEstimationPointToPlane());
+    if (tl_profile) { tl_profile->icp_fitness = result.fitness_; tl_profile->icp_rmse = result.inlier_rmse_; }
+    return result.transformation_;
+}
+
+Eigen::Matrix4d icp(geometry::PointCloud &src, geometry::PointCloud &tgt,
+                    const Eigen::Matrix4d &init, double thr) {
+    est_normals(tgt, thr);
+    return icp_p2l(src, tgt, init, thr);
+}
+
+core::Device resolve_device(const std::string &device) {
+    core::Device d(device);
+    if (!d.IsCUDA()) return d;
+#ifdef HYBRID_WITH_CUDA
+    if (core::cuda::IsAvailable()) return d;
+#endif
+    return core::Device("CPU:0");
+}
+
+std::shared_ptr<t::geometry::PointCloud> pcd_to_device(const geometry::PointCloud &p, const core::Device &d) {
+    return std::make_shared<t::geometry::PointCloud>(t::geometry::PointCloud::FromLegacy(p, core::Float32, d));
+}
+
+Eigen::Matrix4d icp_p2l_dev(const t::geometry::PointCloud &src, const t::geometry::PointCloud &tgt,
+                            const Eigen::Matrix4d &init, double thr) {
+    namespace treg = t::pipelines::registration;
+    StageTimer st(Stage::ICP);
+    auto result = treg::ICP(src, tgt, thr, core::eigen_converter::EigenMatrixToTensor(init),
+                            treg::TransformationEstimationPointToPlane(), treg::ICPConvergenceCriteria());
+    g_stats.icp_iterations.fetch_add(result.num_iterations_, std::memory_order_relaxed);
+    if (tl_profile) {
+        tl_profile->icp_iterations += result.num_iterations_;
+        tl_profile->icp_fitness = result.fitness_; tl_profile->icp_rmse = result.inlier_rmse_;
+    }
+    return core::eigen_converter::TensorToEigenMatrixXd(result.transformation_);
+}
+
+bool in_parallel_region() {
+    if (in_task()) return true;
+#ifdef HYBRID_WITH_OPENMP
+    return omp_in_parallel();
+#else
+    return false;
+#endif
+}
+
+double nn_sum(const std::vector<Eigen::Vector3d> &q, const Eigen::Matrix4d &G,
+              const geometry::KDTreeFlann &kd, double dscale, double stop) {
+    const size_t kBlock = 4096;
+    const Eigen::Matrix3d R = G.topLeftCorner<3, 3>();
+    const Eigen::Vector3d tr = G.topRightCorner<3, 1>();
+    const bool par = !in_parallel_region();
+    double sum = 0.0;
+    for (size_t b = 0; b < q.size() && sum <= stop; b += kBlock) {
+        checkpoint();
+        const int64_t e = (int64_t)std::min(q.size(), b + kBlock);
+        double part = 0.0;
+#pragma omp parallel reduction(+ : part) if (par)
+        {
+            std::vector<int> idx(1);
+            std::vector<double> d2(1);
+#pragma omp for
+            for (int64_t i = (int64_t)b; i < e; ++i)
+                if (kd.SearchKNN(Eigen::Vector3d(R * q[i] + tr), 1, idx, d2)) part += std::sqrt(d2[0]);
+        }
+        sum += part * dscale;
+    }
+    return sum;
+}
+
+double chamfer(const geometry::PointCloud &A, const geometry::KDTreeFlann &kda,
+               const geometry::PointCloud &B, const geometry::KDTreeFlann &kdb,
+               const Eigen::Matrix4d &G, double best) {
+    const size_t n = A.points_.size() + B.points_.size();
+    if (A.points_.empty() || B.points_.empty()) return 1e9;
+    StageTimer st(Stage::Chamfer);
+    const double stop = best * (double)n;
+    const double s = G.topLeftCorner<3, 3>().col(0).norm();   // 相似变换的缩放
+    double sum = nn_sum(A.points_, G, kdb, 1.0, stop);
+    if (sum > stop) return std::numeric_limits<double>::infinity();
+    sum += nn_sum(B.points_, G.inverse(), kda, s, stop - sum);
+    if (sum > stop) return std::numeric_limits<double>::infinity();
+    return sum / (double)n;
+}
+
+double chamfer(const geometry::PointCloud &A, const geometry::PointCloud &B) {
+    std::optional<geometry::KDTreeFlann> kda, kdb;
+    {
+        StageTimer st(Stage::Chamfer);
+        kda.emplace(A); kdb.emplace(B);
+    }
+    return chamfer(A, *kda, B, *kdb);
+}
+
+const Eigen::Matrix4d &mirror_yz() {
+    static const Eigen::Matrix4d M = [] {
+        Eigen::Matrix4d m = Eigen::Matrix4d::Identity(); m(0, 0) = -1.0; return m;
+    }();
+    return M;
+}
+
+void commit_scene(t::geometry::RaycastingScene &scene) {
+    core::Tensor q = core::Tensor::Zeros({1, 3}, core::Float32);
+    scene.ComputeDistance(q);
+}
+
+void scene_add_legacy(t::geometry::RaycastingScene &scene, const geometry::TriangleMesh &m) {
+    StageTimer st(Stage::BVH);
+    scene.AddTriangles(t::geometry::TriangleMesh::FromLegacy(m));
+}
+
+// ----------------------------- 粗特征 -----------------------------
+
+CoarseFeat coarse_features_from_mesh(const geometry::TriangleMesh &m) {
+    constexpr int H = CoarseFeat::kHistDim, B = CoarseFeat::kWidthBins, D = CoarseFeat::kD2Bins;
+    CoarseFeat f{};
+    f.extents = m.GetAxisAlignedBoundingBox().GetExtent();
+    f.hist.assign(H, 0.f); f.d2.assign(D, 0.f); f.width.assign(B, 0.f);
+
+    const int64_t nV = (int64_t)m.vertices_.size(), nF = (int64_t)m.triangles_.size();
+    std::vector<double> X(nV), Y(nV), Z(nV);
+    for (int64_t i = 0; i < nV; ++i) { const auto &p = m.vertices_[i]; X[i] = p.x(); Y[i] = p.y(); Z[i] = p.z(); }
+    std::vector<double> farea(nF);
+
+    // 三角形遍历按 4096 个一块交给 simd::tri_moments（有向体积、面积、一二阶面矩、法向方向箱）
+    constexpr int64_t kBlock = 4096;
+    const int64_t nblk = (nF + kBlock - 1) / kBlock;
+    const int *tri = m.triangles_.empty() ? nullptr : m.triangles_[0].data();
+    double acc[11] = {};
+    std::vector<double> hist(H, 0.0);
+#pragma omp parallel
+    {
+        std::vector<double> h(H, 0.0);
+        std::vector<int> bin(kBlock);
+#pragma omp for schedule(static) reduction(+ : acc[:11])
+        for (int64_t k = 0; k < nblk; ++k) {
+            const int64_t b = k * kBlock, e = std::min(nF, b + kBlock);
+            simd::tri_moments(X.data(), Y.data(), Z.data(), tri, b, e, farea.data() + b, bin.data(), acc);
+            for (int64_t t = b; t < e; ++t) if (bin[t - b] >= 0) h[bin[t - b]] += farea[t];
+        }
+#pragma omp critical
+        for (int j = 0; j < H; ++j) hist[j] += h[j];
+    }
+    const double vol = acc[0], area = acc[1], mx = acc[2], my = acc[3], mz = acc[4];
+    const double sxx = acc[5], sxy = acc[6], sxz = acc[7], syy = acc[8], syz = acc[9], szz = acc[10];
+    f.volume = std::abs(vol / 6.0);
+    f.area = area;
+    if (area > 0) for (int j = 0; j < H; ++j) f.hist[j] = float(hist[j] / area);
+    if (area <= 0 || nV == 0) return f;
+
+    // 主轴：表面协方差特征向量（降序）
+    const Eigen::Vector3d mu(mx / area, my / area, mz / area);
+    Eigen::Matrix3d C;
+    C << sxx, sxy, sxz, sxy, syy, syz, sxz, syz, szz;
+    C = C / area - mu * mu.transpose();
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(C);
+    Eigen::Vector3d a0 = es.eigenvectors().col(2);
+    const Eigen::Vector3d a1 = es.eigenvectors().col(1), a2 = es.eigenvectors().col(0);
+
+    // 顶点遍历 1：主轴坐标范围与主轴三阶矩（定向用）
+    double lo0 = 1e300, hi0 = -1e300, lo1 = 1e300, hi1 = -1e300, lo2 = 1e300, hi2 = -1e300, m3 = 0;
+#pragma omp parallel for schedule(static) reduction(min : lo0, lo1, lo2) reduction(max : hi0, hi1, hi2) reduction(+ : m3)
+    for (int64_t i = 0; i < nV; ++i) {
+        const double dx = X[i] - mu.x(), dy = Y[i] - mu.y(), dz = Z[i] - mu.z();
+        const double s0 = a0.x() * dx + a0.y() * dy + a0.z() * dz;
+        const double s1 = a1.x() * dx + a1.y() * dy + a1.z() * dz;
+        const double s2 = a2.x() * dx + a2.y() * dy + a2.z() * dz;
+        lo0 = std::min(lo0, s0); hi0 = std::max(hi0, s0);
+        lo1 = std::min(lo1, s1); hi1 = std::max(hi1, s1);
+        lo2 = std::min(lo2, s2); hi2 = std::max(hi2, s2);
+        m3 += s0 * s0 * s0;
+    }
+    f.pca_extents = {hi0 - lo0, hi1 - lo1, hi2 - lo2};
+    std::sort(f.pca_extents.data(), f.pca_extents.data() + 3, std::greater<double>());
+    if (m3 < 0) { a0 = -a0; std::swap(lo0, hi0); lo0 = -lo0; hi0 = -hi0; }
+
+    // 顶点遍历 2：沿主轴分 B 段，每段次轴坐标的 max - min 即截面宽度
+    const double span0 = std::max(hi0 - lo0, 1e-12);
+    std::vector<double> wlo(B, 1e300), whi(B, -1e300);
+#pragma omp parallel
+    {
+        std::vector<double> l(B, 1e300), u(B, -1e300);
+#pragma omp for schedule(static)
+        for (int64_t i = 0; i < nV; ++i) {
+            const double dx = X[i] - mu.x(), dy = Y[i] - mu.y(), dz = Z[i] - mu.z();
+            const double s0 = a0.x() * dx + a0.y() * dy + a0.z() * dz;
+            const double s1 = a1.x() * dx + a1.y() * dy + a1.z() * dz;
+            const int b = std::min(B - 1, std::max(0, int((s0 - lo0) / span0 * B)));
+            l[b] = std::min(l[b], s1); u[b] = std::max(u[b], s1);
+        }
+#pragma omp critical
+        for (int b = 0; b < B; ++b) { wlo[b] = std::min(wlo[b], l[b]); whi[b] = std::max(whi[b], u[b]); }
+    }
+    for (int b = 0; b < B; ++b) f.width[b] = whi[b] > wlo[b] ? float(whi[b] - wlo[b]) : 0.f;
+
+    // D2：固定种子按面积采样 kD2Samples 个表面点，全部点对距离按包围盒对角线归一化
+    constexpr int kD2Samples = 512;
+    std::vector<double> cdf(nF);
+    std::partial_sum(farea.begin(), farea.end(), cdf.begin());
+    std::mt19937 rng(0x5EED);
+    std::uniform_real_distribution<double> U(0.0, 1.0);
+    std::vector<Eigen::Vector3d> P(kD2Samples);
+    for (auto &p : P) {
+        const int64_t t = std::min<int64_t>(nF - 1, std::upper_bound(cdf.begin(), cdf.end(), U(rng) * cdf.back()) - cdf.begin());
+        const auto &tri = m.triangles_[t];
+        const double r1 = std::sqrt(U(rng)), r2 = U(rng);
+        p = (1 - r1) * m.vertices_[tri(0)] + r1 * (1 - r2) * m.vertices_[tri(1)] + r1 * r2 * m.vertices_[tri(2)];
+    }
+    const double diag = std::max(f.extents.norm(), 1e-12);
+    std::vector<double> d2(D, 0.0);
+    for (int i = 0; i < kD2Samples; ++i)
+        for (int j = i + 1; j < kD2Samples; ++j)
+            d2[std::min(D - 1, int((P[i] - P[j]).norm() / diag * D))] += 1.0;
+    const double npairs = 0.5 * kD2Samples * (kD2Samples - 1);
+    for (int b = 0; b < D; ++b) f.d2[b] = float(d2[b] / npairs);
+    return f;
+}
+
+// ----------------------------- 预处理候选缓存 -----------------------------
+
+void level_to_device(RegLevel &L, const core::Device &d) {
+    if (d.IsCPU()) { L.down_dev.reset(); L.down_mirror_dev.reset(); return; }
+    if (L.down_dev && L.down_dev->GetDevice() == d) return;
+    L.down_dev = pcd_to_device(*L.down, d);
+    L.down_mirror_dev = pcd_to_device(*L.down_mirror, d);
+}
+
+// YZ 镜像下点积不变、叉积反号：FPFH 三个分量中只有 v·n2（第 11..21 箱）取反，
+// 对应箱 11+k <-> 11+(10-k) 互换，其余两段不变；因此镜像 FPFH 可由原始 FPFH 直接重排得到
+static std::shared_ptr<pipelines::registration::Feature>
+mirror_fpfh(const pipelines::registration::Feature &f) {
+    auto m = std::make_shared<pipelines::registration::Feature>(f);
+    if (f.Dimension() != 33) throw std::runtime_error("mirror_fpfh: expected 33-dim FPFH");
+    for (int k = 0; k < 11; ++k) m->data_.row(11 + k) = f.data_.row(21 - k);
+    return m;
+}
+
+void mirror_level(RegLevel &L) {
+    L.down_mirror = std::make_shared<geometry::PointCloud>(*L.down);
+    L.down_mirror->Transform(mirror_yz());
+    L.fpfh_mirror = mirror_fpfh(*L.fpfh);
+}
+
+RegLevel make_level_from(const geometry::PointCloud &base, double voxel, double radius) {
+    RegLevel L;
+    L.voxel = voxel; L.fpfh_radius = radius;
+    L.down = downsample(base, voxel);
+    est_normals(*L.down, radius);
+    L.fpfh = fpfh(*L.down, radius);
+    mirror_level(L);
+    return L;
+}
+
+RegLevel make_level(geometry::TriangleMesh &m, double voxel, double radius) {
+    return make_level_from(*sample_pcd(m, 50000), voxel, radius);
+}
+
+std::shared_ptr<PreparedMesh>
+prepare_from_mesh(std::shared_ptr<geometry::TriangleMesh> m,
+                  const std::vector<std::pair<double, double>> &levels, size_t chamfer_samples) {
+    auto pm = std::make_shared<PreparedMesh>(std::move(m));
+    geometry::TriangleMesh &mesh = pm->mesh();
+    pm->feat = coarse_features_from_mesh(mesh);
+    pm->chamfer_samples = chamfer_samples;
+    pm->chamfer_pts = sample_pcd(mesh, chamfer_samples);
+    pm->chamfer_kd = std::make_shared<geometry::KDTreeFlann>(*pm->chamfer_pts);
+    for (const auto &lv : levels) pm->levels.push_back(make_level(mesh, lv.first, lv.second));
+    pm->mesh_hash = PreparedMesh::hash_mesh(mesh);
+    pm->params_hash = PreparedMesh::hash_params(levels, chamfer_samples);
+    return pm;
+}
+
+// ----------------------------- 只读文件映射 -----------------------------
+
+struct MappedFile {
+    const uint8_t *data{nullptr};
+    size_t size{0};
+
+    static std::shared_ptr<const MappedFile> open(const std::string &path);
+    ~MappedFile();
+
+private:
+#ifdef _WIN32
+    std::vector<uint64_t> buf_;   // 无 mmap 时整块读入（8 字节对齐）
+#endif
+};
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string &path) {
+    auto f = std::make_shared<MappedFile>();
+#ifdef _WIN32
+    std::ifstream is(path, std::ios::binary | std::ios::ate);
+    if (!is) throw std::runtime_error("cannot open: " + path);
+    f->size = (size_t)is.tellg();
+    f->buf_.resize((f->size + 7) / 8);
+    is.seekg(0);
+    if (f->size && !is.read(reinterpret_cast<char *>(f->buf_.data()), (std::streamsize)f->size))
+        throw std::runtime_error("read failed: " + path);
+    f->data = reinterpret_cast<const uint8_t *>(f->buf_.data());
+#else
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open: " + path);
+    struct stat st;
+    if (::fstat(fd, &st) != 0) { ::close(fd); throw std::runtime_error("cannot stat: " + path); }
+    f->size = (size_t)st.st_size;
+    if (f->size > 0) {
+        void *p = ::mmap(nullptr, f->size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) { ::close(fd); throw std::runtime_error("mmap failed: " + path); }
+        f->data = static_cast<const uint8_t *>(p);
+    }
+    ::close(fd);   // 映射独立于描述符
+#endif
+    return f;
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (data) ::munmap(const_cast<uint8_t *>(data), size);
+#endif
+}
+
+// 磁盘格式 v3（小端）：
+//   Header（64 B）| 段表 n x Section（40 B）| 各段负载（偏移 64 字节对齐）
+//   每段是 count x dim 的平铺数组，元素字节数 elem：VERT f32、FACE u32、直方图类 f32，其余 f64。
+//   Header.table_hash 覆盖段表，Section.hash 覆盖该段负载；mesh_hash = H(FACE, seed = H(VERT))。
+// v2：CoarseFeat 增加 pca_extents / d2 / width，直方图改为面积加权
+// v3：段表容器 + mmap 加载，顶点改为 float32，加入内容哈希
+namespace pm_io {
+constexpr char kMagic[4] = {'S', 'L', 'P', 'M'};
+constexpr uint32_t kVersion = 3;
+constexpr size_t kAlign = 64;
+
+struct Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t n_sections;
+    uint32_t reserved;
+    uint64_t mesh_hash, params_hash, table_hash, file_size, chamfer_samples, pad;
+};
+static_assert(sizeof(Header) == 64, "Header layout");
+
+struct Section {
+    uint32_t tag, level, dim, elem;
+    uint64_t offset, count, hash;
+    size_t bytes() const { return (size_t)count * dim * elem; }
+};
+static_assert(sizeof(Section) == 40, "Section layout");
+
+enum Tag : uint32_t {
+    kVert = 1, kFace, kFeatScalars, kFeatHist, kFeatD2, kFeatWidth, kChamfer,
+    kLevelParams, kLevelPoints, kLevelNormals, kLevelFpfh, kLevelFpfhMirror,
+};
+
+// 64 位内容哈希：逐 8 字节乘-异或混合，尾部逐字节；用于失效判断与完整性校验，非加密
+uint64_t hash64(const void *p, size_t n, uint64_t h = 0x9e3779b97f4a7c15ull) {
+    constexpr uint64_t kMul = 0xff51afd7ed558ccdull;
+    const uint8_t *b = static_cast<const uint8_t *>(p);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, b + i, 8);
+        h = (h ^ w) * kMul;
+        h ^= h >> 32;
+    }
+    for (; i < n; ++i) { h = (h ^ b[i]) * kMul; h ^= h >> 32; }
+    h = (h ^ n) * kMul;
+    return h ^ (h >> 33);
+}
+
+size_t align_up(size_t x) { return (x + kAlign - 1) / kAlign * kAlign; }
+
+std::vector<float> vertices_f32(const geometry::TriangleMesh &m) {
+    std::vector<float> V(3 * m.vertices_.size());
+    for (size_t i = 0; i < m.vertices_.size(); ++i)
+        for (int k = 0; k < 3; ++k) V[3 * i + k] = (float)m.vertices_[i][k];
+    return V;
+}
+
+void check_faces(const uint32_t *F, size_t nF, size_t nV) {
+    uint32_t mx = 0;
+    for (size_t i = 0; i < 3 * nF; ++i) mx = std::max(mx, F[i]);
+    if (nF && mx >= nV) throw std::runtime_error("PreparedMesh: face index out of range");
+}
+
+// 段先登记（指针 + 形状 + 哈希），write 时统一排布偏移并按对齐补零
+struct Writer {
+    struct Item { Section s; const void *p; };
+    std::vector<Item> items;
+
+    template <class T> void add(uint32_t tag, uint32_t level, const T *p, size_t count, size_t dim) {
+        Section s{tag, level, (uint32_t)dim, (uint32_t)sizeof(T), 0, count, 0};
+        s.hash = hash64(p, s.bytes());
+        items.push_back({s, p});
+    }
+    void add_pts(uint32_t tag, uint32_t level, const std::vector<Eigen::Vector3d> &v) {
+        add(tag, level, v.empty() ? nullptr : v[0].data(), v.size(), 3);
+    }
+    void add_feature(uint32_t tag, uint32_t level, const pipelines::registration::Feature &f) {
+        add(tag, level, f.data_.data(), f.Num(), f.Dimension());
+    }
+
+    const Section &section(uint32_t tag) const {
+        for (const auto &it : items) if (it.s.tag == tag) return it.s;
+        throw std::runtime_error("PreparedMesh: missing section");
+    }
+
+    static std::string temp_name(const std::string &path) {
+        static std::atomic<uint64_t> seq{0};
+#ifdef _WIN32
+        const long pid = (long)_getpid();
+#else
+        const long pid = (long)getpid();
+#endif
+        return path + ".tmp." + std::to_string(pid) + "." + std::to_string(seq.fetch_add(1));
+    }
+
+    void write(const std::string &path, Header h) {
+        std::vector<Section> table;
+        size_t off = align_up(sizeof(Header) + items.size() * sizeof(Section));
+        for (auto &it : items) {
+            it.s.offset = off;
+            off = align_up(off + it.s.bytes());
+            table.push_back(it.s);
+        }
+        h.n_sections = (uint32_t)table.size();
+        h.file_size = off;
+        h.table_hash = hash64(table.data(), table.size() * sizeof(Section));
+
+        // 先写同目录下的临时文件再改名：其它进程已映射的旧文件保持完整；临时名带 pid 与进程内序号，
+        // 多个进程 / 线程同时写同一文件时各写各的，最后一次改名生效
+        const std::string tmp = temp_name(path);
+        std::error_code ec;
+        {
+            std::ofstream os(tmp, std::ios::binary | std::ios::trunc);
+            if (!os) throw std::runtime_error("cannot open for writing: " + tmp);
+            static const char zeros[kAlign] = {};
+            size_t pos = 0;
+            auto emit = [&](const void *p, size_t n) {
+                if (n) os.write(static_cast<const char *>(p), (std::streamsize)n);
+                pos += n;
+            };
+            emit(&h, sizeof(h));
+            emit(table.data(), table.size() * sizeof(Section));
+            for (const auto &it : items) {
+                emit(zeros, it.s.offset - pos);
+                emit(it.p, it.s.bytes());
+            }
+            emit(zeros, off - pos);
+            os.close();
+            if (!os) {
+                std::filesystem::remove(tmp, ec);
+                throw std::runtime_error("write failed: " + tmp);
+            }
+        }
+        std::filesystem::rename(tmp, path, ec);
+        if (ec) {
+            std::filesystem::remove(tmp, ec);
+            throw std::runtime_error("cannot replace " + path);
+        }
+    }
+};
+
+// 同一容器也承载 index.slfi（magic / version / kind 不同）
+Header read_header(const MappedFile &f, const std::string &path, const char *magic = kMagic,
+                   uint32_t version = kVersion, const char *kind = "PreparedMesh") {
+    Header h;
+    if (f.size < sizeof(Header)) throw std::runtime_error(std::string("not a ") + kind + " file: " + path);
+    std::memcpy(&h, f.data, sizeof(Header));
+    if (std::memcmp(h.magic, magic, 4) != 0 || h.version != version)
+        throw std::runtime_error(std::string("not a ") + kind + " file (or version mismatch): " + path);
+    if (h.file_size != f.size || sizeof(Header) + (size_t)h.n_sections * sizeof(Section) > f.size)
+        throw std::runtime_error(std::string("truncated ") + kind + " file: " + path);
+    return h;
+}
+
+// 本进程内的段视图：段表已校验（边界、对齐、元素大小），负载指针直接指向映射
+struct Reader {
+    const MappedFile &f;
+    const std::string &path;
+    const char *kind;
+    std::vector<Section> table;
+
+    Reader(const MappedFile &file, const Header &h, const std::string &p, bool verify,
+           const char *k = "PreparedMesh") : f(file), path(p), kind(k) {
+        table.resize(h.n_sections);
+        std::memcpy(table.data(), f.data + sizeof(Header), table.size() * sizeof(Section));
+        if (hash64(table.data(), table.size() * sizeof(Section)) != h.table_hash)
+            throw std::runtime_error(std::string("corrupt ") + kind + " section table: " + path);
+        for (const auto &s : table) {
+            if (s.offset % kAlign != 0 || s.offset > f.size || s.bytes() > f.size - s.offset)
+                throw std::runtime_error(std::string("corrupt ") + kind + " section: " + path);
+            if (verify && hash64(f.data + s.offset, s.bytes()) != s.hash)
+                throw std::runtime_error(std::string(kind) + " content hash mismatch: " + path);
+        }
+    }
+
+    const Section *find(uint32_t tag, uint32_t level = 0) const {
+        for (const auto &s : table) if (s.tag == tag && s.level == level) return &s;
+        return nullptr;
+    }
+    template <class T> const T *get(uint32_t tag, uint32_t level, size_t dim, size_t &count) const {
+        const Section *s = find(tag, level);
+        if (!s || s->elem != sizeof(T) || (dim && s->dim != dim))
+            throw std::runtime_error(std::string(kind) + ": missing or malformed section in " + path);
+        count = s->count * (dim ? 1 : s->dim);
+        return reinterpret_cast<const T *>(f.data + s->offset);
+    }
+    void pts(uint32_t tag, uint32_t level, std::vector<Eigen::Vector3d> &v) const {
+        size_t n;
+        const double *p = get<double>(tag, level, 3, n);
+        v.resize(n);
+        if (n) std::memcpy(v[0].data(), p, sizeof(double) * 3 * n);
+    }
+    std::vector<float> floats(uint32_t tag) const {
+        size_t n;
+        const float *p = get<float>(tag, 0, 0, n);
+        return std::vector<float>(p, p + n);
+    }
+    std::shared_ptr<pipelines::registration::Feature> feature(uint32_t tag, uint32_t level) const {
+        const Section *s = find(tag, level);
+        if (!s || s->elem != sizeof(double)) throw std::runtime_error("PreparedMesh: missing FPFH in " + path);
+        auto fe = std::make_shared<pipelines::registration::Feature>();
+        fe->Resize((int)s->dim, (int)s->count);
+        if (s->bytes()) std::memcpy(fe->data_.data(), f.data + s->offset, s->bytes());
+        return fe;
+    }
+};
+
+} // namespace pm_io
+
+uint64_t PreparedMesh::hash_mesh(const geometry::TriangleMesh &m) {
+    const std::vector<float> V = pm_io::vertices_f32(m);
+    const void *F = m.triangles_.empty() ? nullptr : m.triangles_[0].data();
+    return pm_io::hash64(F, sizeof(uint32_t) * 3 * m.triangles_.size(),
+                         pm_io::hash64(V.data(), sizeof(float) * V.size()));
+}
+
+uint64_t PreparedMesh::hash_params(const std::vector<std::pair<double, double>> &levels, size_t chamfer_samples) {
+    std::vector<double> p = {(double)pm_io::kVersion, (double)chamfer_samples};
+    for (const auto &l : levels) { p.push_back(l.first); p.push_back(l.second); }
+    return pm_io::hash64(p.data(), sizeof(double) * p.size());
+}
+
+bool PreparedMesh::read_hashes(const std::string &path, uint64_t &mesh_hash, uint64_t &params_hash) {
+    std::ifstream is(path, std::ios::binary);
+    pm_io::Header h;
+    if (!is.read(reinterpret_cast<char *>(&h), sizeof(h))) return false;
+    if (std::memcmp(h.magic, pm_io::kMagic, 4) != 0 || h.version != pm_io::kVersion) return false;
+    mesh_hash = h.mesh_hash;
+    params_hash = h.params_hash;
+    return true;
+}
+
+const std::shared_ptr<geometry::TriangleMesh> &PreparedMesh::mesh_ptr() const {
+    std::call_once(mesh_once_, [this] {
+        if (mesh_ || !map_) return;
+        pm_io::check_faces(view_.F, view_.nF, view_.nV);
+        auto m = std::make_shared<geometry::TriangleMesh>();
+        m->vertices_.resize(view_.nV);
+        for (size_t i = 0; i < view_.nV; ++i)
+            m->vertices_[i] = Eigen::Vector3d(view_.V[3 * i], view_.V[3 * i + 1], view_.V[3 * i + 2]);
+        m->triangles_.resize(view_.nF);
+        if (view_.nF) std::memcpy(m->triangles_[0].data(), view_.F, sizeof(uint32_t) * 3 * view_.nF);
+        mesh_ = std::move(m);
+    });
+    if (!mesh_) throw std::runtime_error("PreparedMesh has no mesh");
+    return mesh_;
+}
+
+size_t PreparedMesh::num_vertices() const { return map_ ? view_.nV : (mesh_ ? mesh_->vertices_.size() : 0); }
+size_t PreparedMesh::num_triangles() const { return map_ ? view_.nF : (mesh_ ? mesh_->triangles_.size() : 0); }
+
+t::geometry::RaycastingScene &PreparedMesh::scene() const {
+    std::call_once(scene_once_, [this] {
+        scene_ = std::make_shared<t::geometry::RaycastingScene>();
+        StageTimer st(Stage::BVH);
+        if (map_) {
+            // 映射内的 float32 顶点 / uint32 面直接包成 Tensor（AddTriangles 自行拷贝进 BVH 缓冲）
+            pm_io::check_faces(view_.F, view_.nF, view_.nV);
+            auto borrow = [](const void *p) {
+                return std::make_shared<core::Blob>(core::Device("CPU:0"), const_cast<void *>(p), [](void *) {});
+            };
+            core::Tensor V({(int64_t)view_.nV, 3}, {3, 1}, const_cast<float *>(view_.V), core::Float32, borrow(view_.V));
+            core::Tensor F({(int64_t)view_.nF, 3}, {3, 1}, const_cast<uint32_t *>(view_.F), core::UInt32, borrow(view_.F));
+            scene_->AddTriangles(V, F);
+        } else {
+            scene_->AddTriangles(t::geometry::TriangleMesh::FromLegacy(mesh()));
+        }
+        commit_scene(*scene_);
+    });
+    return *scene_;
+}
+
+void PreparedMesh::save(const std::string &path) const {
+    using namespace pm_io;
+    Writer w;
+    // 映射加载的对象原样写回映射里的网格，不展开
+    std::vector<float> V32;
+    const float *V = view_.V;
+    const uint32_t *F = view_.F;
+    size_t nV = view_.nV, nF = view_.nF;
+    if (!map_) {
+        const geometry::TriangleMesh &m = mesh();
+        V32 = vertices_f32(m);
+        V = V32.data();
+        F = m.triangles_.empty() ? nullptr : reinterpret_cast<const uint32_t *>(m.triangles_[0].data());
+        nV = m.vertices_.size();
+        nF = m.triangles_.size();
+    }
+    w.add(kVert, 0, V, nV, 3);
+    w.add(kFace, 0, F, nF, 3);
+
+    const double scalars[8] = {feat.volume, feat.area, feat.extents.x(), feat.extents.y(), feat.extents.z(),
+                               feat.pca_extents.x(), feat.pca_extents.y(), feat.pca_extents.z()};
+    w.add(kFeatScalars, 0, scalars, 1, 8);
+    w.add(kFeatHist, 0, feat.hist.data(), 1, feat.hist.size());
+    w.add(kFeatD2, 0, feat.d2.data(), 1, feat.d2.size());
+    w.add(kFeatWidth, 0, feat.width.data(), 1, feat.width.size());
+    w.add_pts(kChamfer, 0, chamfer_pts->points_);
+
+    std::vector<std::array<double, 2>> params(levels.size());
+    std::vector<std::pair<double, double>> level_list;
+    for (size_t k = 0; k < levels.size(); ++k) {
+        const RegLevel &L = levels[k];
+        const uint32_t lv = (uint32_t)k;
+        params[k] = {L.voxel, L.fpfh_radius};
+        level_list.emplace_back(L.voxel, L.fpfh_radius);
+        w.add(kLevelParams, lv, params[k].data(), 1, 2);
+        w.add_pts(kLevelPoints, lv, L.down->points_);
+        w.add_pts(kLevelNormals, lv, L.down->normals_);
+        w.add_feature(kLevelFpfh, lv, *L.fpfh);
+        w.add_feature(kLevelFpfhMirror, lv, *L.fpfh_mirror);
+    }
+
+    Header h{};
+    std::memcpy(h.magic, kMagic, 4);
+    h.version = kVersion;
+    h.mesh_hash = hash64(F, w.section(kFace).bytes(), hash64(V, w.section(kVert).bytes()));
+    h.params_hash = hash_params(level_list, chamfer_samples);
+    h.chamfer_samples = chamfer_samples;
+    w.write(path, h);
+}
+
+std::shared_ptr<PreparedMesh> PreparedMesh::load(const std::string &path, bool verify) {
+    using namespace pm_io;
+    auto map = MappedFile::open(path);
+    const Header h = read_header(*map, path);
+    const Reader r(*map, h, path, verify);
+
+    auto pm = std::make_shared<PreparedMesh>();
+    pm->map_ = map;
+    pm->view_.V = r.get<float>(kVert, 0, 3, pm->view_.nV);
+    pm->view_.F = r.get<uint32_t>(kFace, 0, 3, pm->view_.nF);
+    if (pm->view_.nF == 0) throw std::runtime_error("PreparedMesh has no faces: " + path);
+    pm->mesh_hash = h.mesh_hash;
+    pm->params_hash = h.params_hash;
+    pm->chamfer_samples = (size_t)h.chamfer_samples;
+
+    size_t n;
+    const double *sc = r.get<double>(kFeatScalars, 0, 8, n);
+    pm->feat.volume = sc[0]; pm->feat.area = sc[1];
+    pm->feat.extents = Eigen::Vector3d(sc[2], sc[3], sc[4]);
+    pm->feat.pca_extents = Eigen::Vector3d(sc[5], sc[6], sc[7]);
+    pm->feat.hist = r.floats(kFeatHist);
+    pm->feat.d2 = r.floats(kFeatD2);
+    pm->feat.width = r.floats(kFeatWidth);
+
+    pm->chamfer_pts = std::make_shared<geometry::PointCloud>();
+    r.pts(kChamfer, 0, pm->chamfer_pts->points_);
+    pm->chamfer_kd = std::make_shared<geometry::KDTreeFlann>(*pm->chamfer_pts);
+
+    for (uint32_t lv = 0; r.find(kLevelParams, lv); ++lv) {
+        RegLevel L;
+        const double *lp = r.get<double>(kLevelParams, lv, 2, n);
+        L.voxel = lp[0]; L.fpfh_radius = lp[1];
+        L.down = std::make_shared<geometry::PointCloud>();
+        r.pts(kLevelPoints, lv, L.down->points_);
+        r.pts(kLevelNormals, lv, L.down->normals_);
+        L.fpfh = r.feature(kLevelFpfh, lv);
+        L.fpfh_mirror = r.feature(kLevelFpfhMirror, lv);
+        L.down_mirror = std::make_shared<geometry::PointCloud>(*L.down);
+        L.down_mirror->Transform(mirror_yz());
+        pm->levels.push_back(std::move(L));
+    }
+    return pm;
+}
+
+// ----------------------------- 粗特征索引 -----------------------------
+
+namespace fi_io {
+constexpr char kMagic[4] = {'S', 'L', 'F', 'I'};
+constexpr uint32_t kVersion = 3;
+constexpr const char *kKind = "FeatureIndex";
+enum Tag : uint32_t { kIdLen = 1, kIdBytes, kVolume, kArea, kE0, kE1, kE2, kHist, kD2, kWidth };
+} // namespace fi_io
+
+// 与 .slpm 同一容器（pm_io::Writer）：每列一段，段表与各段带内容哈希，先写临时文件再改名；
+// ids 存为长度列 + 拼接字节。load 总是校验哈希，截断或半写的文件抛异常（CandidateLibrary::open 会重建）
+void FeatureIndex::save(const std::string &path) const {
+    using namespace pm_io;
+    const size_t N = size();
+    std::vector<uint32_t> len(N);
+    std::string bytes;
+    for (size_t i = 0; i < N; ++i) { len[i] = (uint32_t)ids[i].size(); bytes += ids[i]; }
+    Writer w;
+    w.add(fi_io::kIdLen, 0, len.data(), N, 1);
+    w.add(fi_io::kIdBytes, 0, bytes.data(), bytes.size(), 1);
+    w.add(fi_io::kVolume, 0, volume.data(), N, 1);
+    w.add(fi_io::kArea, 0, area.data(), N, 1);
+    w.add(fi_io::kE0, 0, e0.data(), N, 1);
+    w.add(fi_io::kE1, 0, e1.data(), N, 1);
+    w.add(fi_io::kE2, 0, e2.data(), N, 1);
+    w.add(fi_io::kHist, 0, hist.data(), N, kHistDim);
+    w.add(fi_io::kD2, 0, d2.data(), N, kD2Dim);
+    w.add(fi_io::kWidth, 0, width.data(), N, kWidthDim);
+    Header h{};
+    std::memcpy(h.magic, fi_io::kMagic, 4);
+    h.version = fi_io::kVersion;
+    w.write(path, h);
+}
+
+std::shared_ptr<FeatureIndex> FeatureIndex::load(const std::string &path) {
+    using namespace pm_io;
+    auto map = MappedFile::open(path);
+    const Header h = read_header(*map, path, fi_io::kMagic, fi_io::kVersion, fi_io::kKind);
+    const Reader r(*map, h, path, true, fi_io::kKind);
+    auto column = [&](uint32_t tag, size_t dim, auto &out, size_t n) {
+        using T = typename std::decay_t<decltype(out)>::value_type;
+        size_t cnt;
+        const T *p = r.get<T>(tag, 0, dim, cnt);
+        if (cnt != n) throw std::runtime_error("FeatureIndex: column length mismatch in " + path);
+        out.assign(p, p + cnt * dim);
+    };
+    auto fi = std::make_shared<FeatureIndex>();
+    size_t n, nb;
+    const uint32_t *len = r.get<uint32_t>(fi_io::kIdLen, 0, 1, n);
+    const char *bytes = r.get<char>(fi_io::kIdBytes, 0, 1, nb);
+    fi->ids.resize(n);
+    for (size_t i = 0, o = 0; i < n; o += len[i++]) {
+        if (len[i] > nb - o) throw std::runtime_error("FeatureIndex: corrupt id table in " + path);
+        fi->ids[i].assign(bytes + o, len[i]);
+    }
+    column(fi_io::kVolume, 1, fi->volume, n); column(fi_io::kArea, 1, fi->area, n);
+    column(fi_io::kE0, 1, fi->e0, n); column(fi_io::kE1, 1, fi->e1, n); column(fi_io::kE2, 1, fi->e2, n);
+    column(fi_io::kHist, kHistDim, fi->hist, n);
+    column(fi_io::kD2, kD2Dim, fi->d2, n);
+    column(fi_io::kWidth, kWidthDim, fi->width, n);
+    return fi;
+}
+
+// ----------------------------- 目标余量采样 -----------------------------
+
+namespace tsample {
+
+// 均匀 [0, 1)：取高 53 位，结果只依赖 mt19937_64（标准规定的序列），跨平台一致
+inline double unit(std::mt19937_64 &rng) { return double(rng() >> 11) * 0x1.0p-53; }
+
+// 单位正方形折叠到三角形 abc（保持均匀性）
+inline Eigen::Vector3d on_triangle(const Eigen::Vector3d &a, const Eigen::Vector3d &b, const Eigen::Vector3d &c,
+                                   double u, double v) {
+    if (u + v > 1.0) { u = 1.0 - u; v = 1.0 - v; }
+    return a + u * (b - a) + v * (c - a);
+}
+
+// 三角形面积与密度因子 1 + w · κ̂（w <= 0 时全为 1）
+void triangle_weights(const geometry::TriangleMesh &m, double w, std::vector<double> &area,
+                      std::vector<double> &factor) {
+    const auto &V = m.vertices_;
+    const auto &F = m.triangles_;
+    area.resize(F.size());
+    factor.assign(F.size(), 1.0);
+    std::vector<Eigen::Vector3d> vn(w > 0 ? V.size() : 0, Eigen::Vector3d::Zero());
+    for (size_t i = 0; i < F.size(); ++i) {
+        const Eigen::Vector3d cr = (V[F[i][1]] - V[F[i][0]]).cross(V[F[i][2]] - V[F[i][0]]);
+        area[i] = 0.5 * cr.norm();
+        if (w > 0) for (int k = 0; k < 3; ++k) vn[F[i][k]] += cr;   // 面积加权顶点法向
+    }
+    if (w <= 0 || F.empty()) return;
+    for (auto &n : vn) { const double l = n.norm(); if (l > 0) n /= l; }
+
+    // κ：三条边上 |Δn| / 边长 的均值（离散法曲率的量级）
+    std::vector<double> kappa(F.size());
+    for (size_t i = 0; i < F.size(); ++i) {
+        double k = 0;
+        for (int e = 0; e < 3; ++e) {
+            const int a = F[i][e], b = F[i][(e + 1) % 3];
+            k += (vn[a] - vn[b]).norm() / std::max((V[a] - V[b]).norm(), 1e-12);
+        }
+        kappa[i] = k / 3.0;
+    }
+    std::vector<double> tmp = kappa;
+    const size_t k95 = std::min(tmp.size() - 1, (size_t)std::floor(0.95 * tmp.size()));
+    std::nth_element(tmp.begin(), tmp.begin() + k95, tmp.end());
+    const double p95 = tmp[k95];
+    if (!(p95 > 0)) return;
+    for (size_t i = 0; i < F.size(); ++i) factor[i] = 1.0 + w * std::min(1.0, kappa[i] / p95);
+}
+
+// 系统抽样：沿 CDF 等距取 n 个点（统一随机偏移），tri[k] 为第 k 个点所在三角形（按三角形序）
+std::vector<int> stratify(const std::vector<double> &wt, size_t n, std::mt19937_64 &rng) {
+    double total = 0;
+    for (double x : wt) total += x;
+    std::vector<int> tri(n);
+    const double step = total / double(n);
+    double next = unit(rng) * step, acc = 0;
+    size_t k = 0;
+    for (size_t i = 0; i < wt.size() && k < n; ++i) {
+        acc += wt[i];
+        while (k < n && next < acc) { tri[k++] = (int)i; next += step; }
+    }
+    for (; k < n; ++k) tri[k] = (int)wt.size() - 1;   // 浮点累加误差兜底
+    return tri;
+}
+
+// 每个三角形内的点用 R2 序列（塑性常数）铺开，起点随三角形随机
+void stratified_points(const geometry::TriangleMesh &m, const std::vector<int> &tri, std::mt19937_64 &rng,
+                       std::vector<Eigen::Vector3d> &out) {
+    constexpr double g = 1.32471795724474602596, a1 = 1.0 / g, a2 = 1.0 / (g * g);
+    out.resize(tri.size());
+    for (size_t b = 0; b < tri.size();) {
+        size_t e = b;
+        while (e < tri.size() && tri[e] == tri[b]) ++e;
+        const auto &f = m.triangles_[tri[b]];
+        const double o1 = unit(rng), o2 = unit(rng);
+        for (size_t j = 0; j < e - b; ++j) {
+            double u = o1 + a1 * double(j), v = o2 + a2 * double(j);
+            u -= std::floor(u); v -= std::floor(v);
+            out[b + j] = on_triangle(m.vertices_[f[0]], m.vertices_[f[1]], m.vertices_[f[2]], u, v);
+        }
+        b = e;
+    }
+}
+
+// 加权样本消除：邻域权重 w_ij = (1 - d_ij / (r_i + r_j))^8，反复删去总权重最大的点直到剩 n 个。
+// r_i 为该点所在三角形密度下的六边形堆积半径，曲率加密区半径更小、保留更多点
+std::vector<Eigen::Vector3d> eliminate(const std::vector<Eigen::Vector3d> &cand, const std::vector<double> &r,
+                                       size_t n) {
+    const size_t N = cand.size();
+    if (N <= n) return cand;
+    geometry::PointCloud pc(cand);
+    geometry::KDTreeFlann kd(pc);
+    const double rmax = *std::max_element(r.begin(), r.end());
+
+    std::vector<std::vector<std::pair<int, float>>> nbr(N);
+#pragma omp parallel for schedule(dynamic, 1024)
+    for (int64_t i = 0; i < (int64_t)N; ++i) {
+        std::vector<int> idx;
+        std::vector<double> d2;
+        kd.SearchRadius(cand[i], r[i] + rmax, idx, d2);
+        for (size_t k = 0; k < idx.size(); ++k) {
+            const int j = idx[k];
+            if (j == (int)i) continue;
+            const double t = 1.0 - std::sqrt(d2[k]) / (r[i] + r[j]);
+            if (t > 0) nbr[i].emplace_back(j, (float)std::pow(t, 8));
+        }
+    }
+
+    std::vector<double> W(N, 0.0);
+    std::priority_queue<std::pair<double, int>> heap;   // 惰性更新：弹出时与 W 不符的条目作废
+    for (size_t i = 0; i < N; ++i) {
+        for (const auto &jw : nbr[i]) W[i] += jw.second;
+        heap.emplace(W[i], (int)i);
+    }
+    std::vector<char> removed(N, 0);
+    for (size_t left = N; left > n && !heap.empty();) {
+        const auto [w, i] = heap.top();
+        heap.pop();
+        if (removed[i] || w != W[i]) continue;
+        removed[i] = 1; --left;
+        for (const auto &jw : nbr[i])
+            if (!removed[jw.first]) { W[jw.first] -= jw.second; heap.emplace(W[jw.first], jw.first); }
+    }
+    std::vector<Eigen::Vector3d> out;
+    out.reserve(n);
+    for (size_t i = 0; i < N; ++i) if (!removed[i]) out.push_back(cand[i]);
+    return out;
+}
+
+}  // namespace tsample
+
+std::shared_ptr<geometry::PointCloud> sample_target(const geometry::TriangleMesh &m, size_t n,
+                                                    const SampleParams &P) {
+    using namespace tsample;
+    const bool uni = P.method == "uniform", strat = P.method == "stratified", pois = P.method == "poisson";
+    if (!uni && !strat && !pois) throw std::runtime_error("sampling method must be 'uniform', 'stratified' or 'poisson'");
+    if (P.curvature_weight < 0) throw std::runtime_error("curvature_weight must be >= 0");
+    StageTimer st(Stage::Sample);
+    auto pcd = std::make_shared<geometry::PointCloud>();
+    if (n == 0) return pcd;
+    if (m.triangles_.empty()) throw std::runtime_error("target mesh has no triangles");
+
+    std::vector<double> area, factor;
+    triangle_weights(m, P.curvature_weight, area, factor);
+    std::vector<double> wt(area.size());
+    for (size_t i = 0; i < wt.size(); ++i) wt[i] = area[i] * factor[i];
+
+    std::mt19937_64 rng(P.seed);
+    auto &pts = pcd->points_;
+    if (uni) {
+        std::vector<double> cdf(wt.size());
+        std::partial_sum(wt.begin(), wt.end(), cdf.begin());
+        pts.resize(n);
+        for (size_t k = 0; k < n; ++k) {
+            const double x = unit(rng) * cdf.back();
+            const size_t i = std::min<size_t>(std::upper_bound(cdf.begin(), cdf.end(), x) - cdf.begin(), wt.size() - 1);
+            const double u = unit(rng), v = unit(rng);
+            const auto &f = m.triangles_[i];
+            pts[k] = on_triangle(m.vertices_[f[0]], m.vertices_[f[1]], m.vertices_[f[2]], u, v);
+        }
+        return pcd;
+    }
+
+    const size_t pool = pois ? 4 * n : n;
+    const std::vector<int> tri = stratify(wt, pool, rng);
+    stratified_points(m, tri, rng, pts);
+    if (pois) {
+        // 六边形堆积半径：局部点密度 = n · factor / Σ wt
+        const double total = std::accumulate(wt.begin(), wt.end(), 0.0);
+        std::vector<double> r(pool);
+        for (size_t k = 0; k < pool; ++k) r[k] = std::sqrt(total / (2.0 * std::sqrt(3.0) * double(n) * factor[tri[k]]));
+        pts = eliminate(pts, r, n);
+    }
+    for (size_t k = pts.size(); k > 1; --k) std::swap(pts[k - 1], pts[rng() % k]);
+    return pcd;
+}
+
+// ----------------------------- 对齐 -----------------------------
+
+void target_level(TargetContext &t, const geometry::PointCloud &base, double voxel, double radius,
+                  double icp_thr) {
+    t.down = downsample(base, voxel);
+    est_normals(*t.down, radius);
+    t.fpfh = fpfh(*t.down, radius);
+    t.down_icp = std::make_shared<geometry::PointCloud>(*t.down);
+    est_normals(*t.down_icp, icp_thr);
+}
+
+TargetContext make_target_context(geometry::TriangleMesh &mT, double voxel, double radius,
+                                  double icp_thr, size_t samples, const SampleParams &S) {
+    TargetContext t;
+    target_level(t, *sample_pcd(mT, 50000), voxel, radius, icp_thr);
+    t.chamfer_pts = sample_pcd(mT, 20000);
+    t.chamfer_kd = std::make_shared<geometry::KDTreeFlann>(*t.chamfer_pts);
+    t.clearance_pts = samples > 0 ? sample_target(mT, samples, S)
+                                  : std::make_shared<geometry::PointCloud>();
+    return t;
+}
+
+void target_to_device(TargetContext &t, const core::Device &d) {
+    t.down_icp_dev = d.IsCUDA() ? pcd_to_device(*t.down_icp, d) : nullptr;
+}
+
+double chamfer_at(const geometry::PointCloud &local, const geometry::KDTreeFlann &kd,
+                  const Eigen::Matrix4d &G, const TargetContext &tgt, double best) {
+    return chamfer(local, kd, *tgt.chamfer_pts, *tgt.chamfer_kd, G, best);
+}
+
+static void atomic_min(std::atomic<double> &a, double v) {
+    double cur = a.load();
+    while (v < cur && !a.compare_exchange_weak(cur, v)) {}
+}
+
+const RegLevel &level_or_make(const PreparedMesh &S, double voxel, double radius, RegLevel &scratch,
+                              const core::Device &d) {
+    if (const RegLevel *L = S.find_level(voxel, radius)) return *L;
+    scratch = make_level(S.mesh(), voxel, radius);
+    level_to_device(scratch, d);
+    return scratch;
+}
+
+AlignResult align_dual(const RegLevel &L, const geometry::PointCloud &chamfer_src,
+                       const geometry::KDTreeFlann &chamfer_kd, const TargetContext &tgt, double icp_thr) {
+    std::atomic<double> best{std::numeric_limits<double>::infinity()};
+    auto branch = [&](const geometry::PointCloud &down, const pipelines::registration::Feature &f,
+                      const std::shared_ptr<t::geometry::PointCloud> &dev, const Eigen::Matrix4d &pre, double &ch) {
+        checkpoint();
+        Eigen::Matrix4d T = ransac_fpfh(down, *tgt.down, f, *tgt.fpfh, L.voxel);
+        checkpoint();
+        // 两侧都有设备副本时 ICP 在设备上做，否则 CPU
+        T = (dev && tgt.down_icp_dev) ? icp_p2l_dev(*dev, *tgt.down_icp_dev, T, icp_thr)
+                                      : icp_p2l(down, *tgt.down_icp, T, icp_thr);
+        T = T * pre;
+        checkpoint();
+        ch = chamfer_at(chamfer_src, chamfer_kd, T, tgt, best.load());
+        atomic_min(best, ch);
+        return T;
+    };
+
+    double ch0 = 1e9, chm = 1e9;
+    Eigen::Matrix4d T0, TmM;
+    if (!tasks_available()) {
+        T0 = branch(*L.down, *L.fpfh, L.down_dev, Eigen::Matrix4d::Identity(), ch0);
+        TmM = branch(*L.down_mirror, *L.fpfh_mirror, L.down_mirror_dev, mirror_yz(), chm);
+    } else {
+        // 镜像分支作为池任务（候选任务内也可被别的线程偷走），原始分支在当前线程
+        TaskGroup g;
+        g.run([&] { TmM = branch(*L.down_mirror, *L.fpfh_mirror, L.down_mirror_dev, mirror_yz(), chm); });
+        T0 = branch(*L.down, *L.fpfh, L.down_dev, Eigen::Matrix4d::Identity(), ch0);
+        g.wait();
+    }
+
+    AlignResult o;
+    o.mirrored = (chm < ch0);
+    o.T = o.mirrored ? TmM : T0;
+    o.chamfer = std::min(ch0, chm);
+    return o;
+}
+
+// ----------------------------- 多尺度 / 多起点配准 -----------------------------
+
+void scaled_about(const geometry::PointCloud &p, double s, const Eigen::Vector3d &c, geometry::PointCloud &out) {
+    out.points_.resize(p.points_.size());
+    for (size_t i = 0; i < p.points_.size(); ++i) out.points_[i] = c + s * (p.points_[i] - c);
+    out.normals_ = p.normals_;
+}
+
+double fit_score(const geometry::PointCloud &local, const Eigen::Matrix4d &T, const TargetContext &tgt) {
+    if (local.points_.empty()) return 1e9;
+    return nn_sum(local.points_, T, *tgt.chamfer_kd) / (double)local.points_.size();
+}
+
+Eigen::Matrix4d scale_about(double s, const Eigen::Vector3d &c) {
+    Eigen::Matrix4d S = Eigen::Matrix4d::Identity();
+    S.topLeftCorner<3, 3>() *= s;
+    S.topRightCorner<3, 1>() = (1.0 - s) * c;
+    return S;
+}
+
+MultiOut align_multi_mesh(geometry::TriangleMesh &mS, const Eigen::Vector3d &c,
+                          geometry::TriangleMesh &mT, std::vector<double> scales,
+                          const std::vector<RegParams> &params, bool mirror, double prune_ratio) {
+    if (params.empty()) throw std::runtime_error("param_sets must not be empty");
+    if (scales.empty()) scales = {1.0};
+    const size_t K = params.size();
+    std::vector<int> order(K);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return params[a].voxel > params[b].voxel; });
+
+    // 金字塔：两侧各采样一次，逐层下采样 + 法向 + FPFH；chamfer 点与 KD 树全层共享
+    auto baseS = sample_pcd(mS, 50000), baseT = sample_pcd(mT, 50000);
+    auto chS = sample_pcd(mS, 20000);
+    geometry::KDTreeFlann kdS(*chS);
+    auto chT = sample_pcd(mT, 20000);
+    auto kdT = std::make_shared<geometry::KDTreeFlann>(*chT);
+    std::vector<RegLevel> src(K);
+    std::vector<TargetContext> tgt(K);
+    for (size_t k = 0; k < K; ++k) {
+        const RegParams &P = params[order[k]];
+        src[k] = make_level_from(*baseS, P.voxel, P.fpfh_radius);
+        target_level(tgt[k], *baseT, P.voxel, P.fpfh_radius, P.icp_thr);
+        tgt[k].chamfer_pts = chT; tgt[k].chamfer_kd = kdT;
+    }
+    const TargetContext &fine = tgt[K - 1];
+
+    const Eigen::Matrix4d &M = mirror_yz();
+    const Eigen::Vector3d cm = M.topLeftCorner<3, 3>() * c;   // 镜像点云的缩放中心
+    auto cloud = [&](size_t k, bool m) -> const geometry::PointCloud & {
+        return m ? *src[k].down_mirror : *src[k].down;
+    };
+    // 缩放不复制点云，作为变换视图并入 ICP 初值：ICP 的刚体增量左乘初值，结果右乘 S⁻¹ 即作用于
+    // 缩放后源的变换（point-to-plane 只用目标法向，源法向随 S 变化无影响）
+    auto icp_scaled = [&](const geometry::PointCloud &P, size_t k, const Eigen::Matrix4d &T, bool m, double s) {
+        if (s == 1.0) return icp_p2l(P, *tgt[k].down_icp, T, params[order[k]].icp_thr);
+        const Eigen::Vector3d &cc = m ? cm : c;
+        return Eigen::Matrix4d(icp_p2l(P, *tgt[k].down_icp, T * scale_about(s, cc), params[order[k]].icp_thr) *
+                               scale_about(1.0 / s, cc));
+    };
+    auto refine = [&](Eigen::Matrix4d T, size_t k0, bool m, double s) {
+        for (size_t k = k0; k < K; ++k) {
+            checkpoint();
+            T = icp_scaled(cloud(k, m), k, T, m, s);
+        }
+        return T;
+    };
+    // 每个尺度维护当前最佳 chamfer；开启剪枝时超过 prune_ratio × 最佳即截断（结果不可能被选中，
+    // 也不会成为种子）
+    std::vector<std::atomic<double>> bound(scales.size());
+    for (auto &b : bound) b.store(std::numeric_limits<double>::infinity());
+    auto finish = [&](Hypothesis &h, const Eigen::Matrix4d &Ticp) {
+        h.T = h.mirrored ? Eigen::Matrix4d(Ticp * M) : Ticp;
+        const double cut = prune_ratio > 0 ? prune_ratio * bound[h.scale_idx].load()
+                                           : std::numeric_limits<double>::infinity();
+        h.chamfer = chamfer_at(*chS, kdS, h.T * scale_about(h.scale, c), fine, cut);
+        if (!std::isfinite(h.chamfer)) h.pruned = true;
+        else atomic_min(bound[h.scale_idx], h.chamfer);
+    };
+    // 参考尺度：起点 × 镜像
+    size_t ref = 0;
+    for (size_t i = 1; i < scales.size(); ++i)
+        if (std::abs(scales[i] - 1.0) < std::abs(scales[ref] - 1.0)) ref = i;
+    const double s_ref = scales[ref];
+
+    MultiOut out;
+    std::vector<size_t> lvl;
+    for (size_t k = 0; k < K; ++k)
+        for (int m = 0; m <= (mirror ? 1 : 0); ++m) {
+            Hypothesis h; h.scale = s_ref; h.scale_idx = ref; h.start = order[k]; h.mirrored = (m == 1);
+            out.hyps.push_back(h); lvl.push_back(k);
+        }
+    const int n0 = (int)out.hyps.size();
+    std::vector<Eigen::Matrix4d> Ticp(n0, Eigen::Matrix4d::Identity());
+
+    // 每个 起点 × 镜像（及下面的每个尺度）一个池任务
+    parallel_for(n0, [&](int i) {
+        Hypothesis &h = out.hyps[i];
+        const size_t k = lvl[i];
+        try {
+            // RANSAC 的对应检验依赖点坐标本身，参考尺度不为 1 时才缩放一份到线程暂存
+            const geometry::PointCloud &P = cloud(k, h.mirrored);
+            Scratch<geometry::PointCloud> tmp;
+            if (s_ref != 1.0) scaled_about(P, s_ref, h.mirrored ? cm : c, *tmp);
+            const geometry::PointCloud &S = s_ref != 1.0 ? *tmp : P;
+            const auto &f = h.mirrored ? *src[k].fpfh_mirror : *src[k].fpfh;
+            Eigen::Matrix4d T = ransac_fpfh(S, *tgt[k].down, f, *tgt[k].fpfh, src[k].voxel);
+            Ticp[i] = icp_p2l(S, *tgt[k].down_icp, T, params[order[k]].icp_thr);
+            h.score = fit_score(S, Ticp[i], fine);
+        } catch (const std::exception &e) {
+            h.error = e.what(); h.pruned = true;
+        }
+    });
+
+    double best_score = std::numeric_limits<double>::infinity();
+    for (const auto &h : out.hyps) if (!h.pruned) best_score = std::min(best_score, h.score);
+    if (prune_ratio > 0)
+        for (auto &h : out.hyps) if (!h.pruned && h.score > prune_ratio * best_score) h.pruned = true;
+
+    parallel_for(n0, [&](int i) {
+        Hypothesis &h = out.hyps[i];
+        if (h.pruned) return;
+        try {
+            finish(h, refine(Ticp[i], lvl[i] + 1, h.mirrored, s_ref));
+        } catch (const std::exception &e) {
+            h.error = e.what(); h.pruned = true;
+        }
+    });
+
+    // 参考尺度上每个镜像分支的最佳起点；整个分支明显更差时其它尺度也不再尝试
+    int seed[2] = {-1, -1};
+    for (int i = 0; i < n0; ++i) {
+        const Hypothesis &h = out.hyps[i];
+        if (h.pruned) continue;
+        int &b = seed[h.mirrored ? 1 : 0];
+        if (b < 0 || h.chamfer < out.hyps[b].chamfer) b = i;
+    }
+    if (seed[0] >= 0 && seed[1] >= 0 && prune_ratio > 0) {
+        const double ch0 = out.hyps[seed[0]].chamfer, ch1 = out.hyps[seed[1]].chamfer;
+        if (ch1 > prune_ratio * ch0) seed[1] = -1;
+        else if (ch0 > prune_ratio * ch1) seed[0] = -1;
+    }
+
+    // 其它尺度：沿用种子变换，逐层 ICP
+    for (size_t si = 0; si < scales.size(); ++si) {
+        if (si == ref) continue;
+        for (int m = 0; m <= (mirror ? 1 : 0); ++m) {
+            Hypothesis h; h.scale = scales[si]; h.scale_idx = si; h.mirrored = (m == 1);
+            h.pruned = (seed[m] < 0);
+            out.hyps.push_back(h);
+        }
+    }
+    const int nh = (int)out.hyps.size();
+    parallel_for(nh - n0, [&](int j) {
+        Hypothesis &h = out.hyps[n0 + j];
+        if (h.pruned) return;
+        const Hypothesis &sd = out.hyps[seed[h.mirrored ? 1 : 0]];
+        try {
+            Eigen::Matrix4d T0 = h.mirrored ? Eigen::Matrix4d(sd.T * M) : sd.T;   // M 为对合，去掉镜像
+            finish(h, refine(T0, 0, h.mirrored, h.scale));
+        } catch (const std::exception &e) {
+            h.error = e.what(); h.pruned = true;
+        }
+    });
+
+    out.best_per_scale.assign(scales.size(), -1);
+    for (int i = 0; i < nh; ++i) {
+        const Hypothesis &h = out.hyps[i];
+        if (h.pruned) continue;
+        int &b = out.best_per_scale[h.scale_idx];
+        if (b < 0 || h.chamfer < out.hyps[b].chamfer) b = i;
+        if (out.best < 0 || h.chamfer < out.hyps[out.best].chamfer) out.best = i;
+    }
+    return out;
+}
+
+// ----------------------------- 余量查询场景（BVH 句柄） -----------------------------
+
+ClearanceScene::ClearanceScene(std::shared_ptr<t::geometry::RaycastingScene> s) : scene(std::move(s)) {
+    if (!scene) throw std::runtime_error("ClearanceScene: null scene");
+    commit_scene(*scene);
+}
+
+ClearanceScene ClearanceScene::build(const geometry::TriangleMesh &m) {
+    if (m.triangles_.empty()) throw std::runtime_error("ClearanceScene: mesh has no triangles");
+    auto s = std::make_shared<t::geometry::RaycastingScene>();
+    scene_add_legacy(*s, m);
+    return ClearanceScene(std::move(s));
+}
+
+ClearanceScene ClearanceScene::of(const std::shared_ptr<const PreparedMesh> &pm) {
+    if (!pm) throw std::runtime_error("ClearanceScene: candidate is None");
+    ClearanceScene cs;
+    cs.scene = std::shared_ptr<t::geometry::RaycastingScene>(pm, &pm->scene());   // 别名指针：随 pm 存活
+    return cs;
+}
+
+ClearanceScene ClearanceScene::at(const Eigen::Matrix4d &T_) const {
+    // 相似变换：A^T A = s^2 I（det < 0 为镜像），底行为 (0, 0, 0, 1)
+    const Eigen::Matrix3d A = T_.topLeftCorner<3, 3>();
+    const double s = std::cbrt(std::abs(A.determinant()));
+    if (!std::isfinite(s) || s <= 0.0) throw std::runtime_error("T must be invertible");
+    const double err = (A.transpose() * A - s * s * Eigen::Matrix3d::Identity()).cwiseAbs().maxCoeff();
+    const double row = (T_.row(3) - Eigen::RowVector4d(0, 0, 0, 1)).cwiseAbs().maxCoeff();
+    if (err > 1e-6 * s * s || row > 1e-12)
+        throw std::runtime_error("T must be a similarity transform (rotation/mirror x uniform scale + translation)");
+    ClearanceScene cs;
+    cs.scene = scene;
+    cs.T = T_;
+    cs.Tinv = T_.inverse();
+    cs.scale = s;
+    cs.identity = T_.isIdentity(0.0);
+    return cs;
+}
+
+// ----------------------------- 采样式 SDF 余量 -----------------------------
+
+// 单遍求 min/mean/直方图（simd 内核），分位数用逐段 nth_element 选择，不做全排序。
+// 样本即 float32 的 -sd，放宽到 double 不改变取值
+static void reduce_clearance(std::vector<float> &inner, const QuantileSpec &spec, ClearanceResult &st) {
+    st.n_inside = inner.size();
+    st.hist.assign(std::max(1, spec.hist_bins), 0u);
+    st.hist_max = spec.hist_max;
+    if (inner.empty()) return;
+
+    const double bin_w = spec.hist_max / st.hist.size();
+    float min_c = inner[0];
+    double sum = 0.0;
+    simd::min_sum(inner.data(), inner.size(), min_c, sum);
+    simd::histogram(inner.data(), inner.size(), bin_w, (int)st.hist.size(), st.hist.data());
+    st.min_c = min_c;  // Minimum clearance (smallest distance from target to candidate interior)
+    st.mean_c = sum / inner.size();
+
+    std::vector<double> qs = spec.qs;
+    std::sort(qs.begin(), qs.end());
+    const size_t n = inner.size();
+    size_t lo = 0, last_k = (size_t)-1;
+    double last_v = 0.0;
+    for (double q : qs) {
+        if (!(q >= 0.0 && q <= 1.0)) throw std::runtime_error("quantiles must be in [0, 1]");
+        size_t k = std::min(n - 1, (size_t)std::floor(q * n));
+        if (k != last_k) {
+            std::nth_element(inner.begin() + lo, inner.begin() + k, inner.end());
+            last_v = inner[k]; last_k = k; lo = k + 1;
+        }
+        st.quantiles.emplace_back(q, last_v);
+    }
+    size_t k01 = std::min(n - 1, (size_t)std::floor(0.01 * n));
+    st.p01 = inner[k01];
+    for (const auto &qv : st.quantiles) if (std::abs(qv.first - 0.01) < 1e-12) st.p01 = qv.second;
+}
+
+ClearanceResult clearance_stats(const ClearanceScene &cs,
+                                const std::vector<Eigen::Vector3d> &pts,
+                                const QuantileSpec &spec) {
+    ClearanceResult st;
+    // sd < 0 means the point is INSIDE the candidate mesh; use its absolute value as clearance
+    // 池可用时按块提交任务（每块单线程查询）：各块压缩写进同一缓冲自己的区段 [b, b + cnt)，
+    // 之后按块序前移拼接；缓冲借用线程暂存，候选之间复用
+    const size_t kChunk = 16384;
+    const int nchunk = (int)((pts.size() + kChunk - 1) / kChunk);
+    Scratch<std::vector<float>> inner;
+    Scratch<std::vector<size_t>> cnt;
+    inner->resize(pts.size());
+    cnt->assign(nchunk, 0);
+    parallel_for(nchunk, [&](int c) {
+        const size_t b = c * kChunk, e = std::min(pts.size(), b + kChunk);
+        sdf_query_points_blocks(cs, pts, b, e, [&](size_t, size_t m, float *sd) {
+            (*cnt)[c] += simd::compact_inside(sd, m, inner->data() + b + (*cnt)[c]);
+        });
+    });
+    size_t n = 0;
+    for (int c = 0; c < nchunk; ++c) {
+        std::memmove(inner->data() + n, inner->data() + c * kChunk, (*cnt)[c] * sizeof(float));
+        n += (*cnt)[c];
+    }
+    inner->resize(n);
+    st.inside_ratio = (double)n / std::max<size_t>(1, pts.size());
+    reduce_clearance(*inner, spec, st);
+    return st;
+}
+
+QuantileSpec make_spec(const std::vector<double> &quantiles, int hist_bins, double hist_max) {
+    QuantileSpec spec;
+    spec.qs = quantiles; spec.hist_bins = hist_bins; spec.hist_max = hist_max;
+    return spec;
+}
+
+DecideOut clearance_decide(const ClearanceScene &cs,
+                           const std::vector<Eigen::Vector3d> &pts, double required,
+                           size_t coarse, size_t chunk) {
+    const size_t N = pts.size();
+    DecideOut o;
+    double min_c = std::numeric_limits<double>::infinity();
+    for (size_t b = 0; b < pts.size();) {
+        checkpoint();
+        const size_t m = std::min(b == 0 ? coarse : chunk, pts.size() - b);
+        sdf_query_points_blocks(cs, pts, b, b + m, [&](size_t, size_t k, float *sd) {
+            const simd::Inside in = simd::inside(sd, k);
+            if (in.n) min_c = std::min(min_c, (double)in.min);
+            o.n_outside += k - in.n;
+        });
+        o.evaluated += m; b += m;
+        if (min_c < required) { o.decided_by = "violation"; break; }
+        if (!inside_ratio_ok(N - o.n_outside, N)) { o.decided_by = "outside"; break; }
+    }
+    o.min_c = std::isfinite(min_c) ? min_c : 0.0;
+    o.pass = (std::strcmp(o.decided_by, "complete") == 0) &&
+             clearance_pass(o.evaluated - o.n_outside, N, min_c, required);
+    return o;
+}
+
+// ----------------------------- 批量并行：对齐 + 采样 SDF -----------------------------
+
+void check_aligned(const ClearanceScene &cs, const TargetContext &tgt,
+                   const BatchParams &P, BatchOut &o) {
+    const ClearanceScene aligned = cs.at(o.align.T);
+    const double required = P.clearance + P.safety_delta;
+    o.decide_only = P.decide_only;
+    if (P.decide_only) {
+        o.decide = clearance_decide(aligned, tgt.clearance_pts->points_, required);
+        o.pass = o.decide.pass;
+    } else {
+        o.clr = clearance_stats(aligned, tgt.clearance_pts->points_, P.spec);
+        o.pass = clearance_pass(o.clr, required);
+    }
+}
+
+void align_and_check_mesh(geometry::TriangleMesh &mS, const TargetContext &tgt,
+                          const BatchParams &P, BatchOut &o) {
+    auto chS = sample_pcd(mS, 20000);
+    RegLevel L = make_level(mS, P.voxel, P.fpfh_radius);
+    level_to_device(L, P.device);
+    o.align = align_dual(L, *chS, geometry::KDTreeFlann(*chS), tgt, P.icp_thr);
+
+    // clearance sampling：BVH 建在候选局部坐标系，目标采样点反变换后查询
+    check_aligned(ClearanceScene::build(mS), tgt, P, o);
+}
+
+void align_and_check_prepared(const std::shared_ptr<PreparedMesh> &c, const TargetContext &tgt,
+                              const BatchParams &P, BatchOut &o) {
+    if (!c) throw std::runtime_error("candidate is None");
+    const PreparedMesh &S = *c;
+    RegLevel scratch;
+    o.align = align_dual(level_or_make(S, P.voxel, P.fpfh_radius, scratch, P.device), *S.chamfer_pts,
+                         *S.chamfer_kd, tgt, P.icp_thr);
+    check_aligned(ClearanceScene::of(c), tgt, P, o);
+}
+
+void run_batch(geometry::TriangleMesh &mT, std::vector<std::shared_ptr<geometry::TriangleMesh>> &meshes,
+               const BatchParams &P, size_t samples, int threads, std::vector<BatchOut> &outs) {
+    CapScope cap(threads);
+    clean_mesh(mT);
+    TargetContext tgt = make_target_context(mT, P.voxel, P.fpfh_radius, P.icp_thr, samples, P.sampling);
+    target_to_device(tgt, P.device);
+
+    const int n = (int)meshes.size();
+    // 每个候选一个池任务；其内的镜像分支、余量分块再拆成子任务
+    parallel_for(n, [&](int i) {
+        if (!meshes[i]) return;
+        ProfileScope ps(P.profile ? &outs[i].prof : nullptr);
+        try {
+            clean_mesh(*meshes[i]);
+            align_and_check_mesh(*meshes[i], tgt, P, outs[i]);
+        } catch (const std::exception &e) {
+            outs[i].error = e.what();
+        }
+        meshes[i].reset();
+    });
+}
+
+void run_batch_prepared(geometry::TriangleMesh &mT, const std::vector<std::shared_ptr<PreparedMesh>> &cands,
+                        const BatchParams &P, size_t samples, int threads, std::vector<BatchOut> &outs) {
+    CapScope cap(threads);
+    auto tgt = make_target_context(mT, P.voxel, P.fpfh_radius, P.icp_thr, samples, P.sampling);
+    target_to_device(tgt, P.device);
+    // 候选层串行上传一次，之后常驻设备（已在该设备上的跳过）
+    for (auto &c : cands)
+        if (c) c->to_device(P.device);
+
+    parallel_for((int)cands.size(), [&](int i) {
+        ProfileScope ps(P.profile ? &outs[i].prof : nullptr);
+        try {
+            align_and_check_prepared(cands[i], tgt, P, outs[i]);
+        } catch (const std::exception &e) {
+            outs[i].error = e.what();
+        }
+    });
+}
+
+// ----------------------------- 异步批量作业 -----------------------------
+
+void BatchJob::State::push(size_t i, BatchOut &&o) {
+    if (cb) {
+        try { cb(i, o); } catch (...) {}   // 回调的异常不影响作业
+    }
+    Callback last;   // 此前的回调都已返回（各自入队前调用），在锁外析构
+    {
+        std::lock_guard<std::mutex> lk(m);
+        ready.emplace_back(i, std::move(o));
+        if (++completed == total) last = std::move(cb);
+    }
+    cv.notify_all();
+}
+
+// 后台线程：目标上下文 → 每个候选一个池任务，算完即 push；目标阶段失败时每个候选带同一错误
+template <class Body>
+static std::thread drive(const std::atomic<bool> *cancel, int threads, size_t n,
+                         std::function<void(std::optional<TargetContext> &)> target, Body body) {
+    return std::thread([=]() mutable {
+        CapScope cap(threads);
+        CancelScope cs(cancel);
+        std::optional<TargetContext> tgt;
+        std::string terr;
+        try {
+            target(tgt);
+        } catch (const std::exception &e) {
+            terr = e.what();
+        }
+        parallel_for((int)n, [&](int i) { body(i, tgt ? &*tgt : nullptr, terr); });
+    });
+}
+
+std::shared_ptr<BatchJob> BatchJob::start(std::shared_ptr<geometry::TriangleMesh> mT,
+                                          std::vector<std::shared_ptr<geometry::TriangleMesh>> meshes,
+                                          std::vector<std::string> errors, const BatchParams &P,
+                                          size_t samples, int threads, Callback cb) {
+    if (errors.size() != meshes.size()) errors.resize(meshes.size());
+    const size_t n = meshes.size();
+    auto st = std::make_shared<State>(n, P, n ? std::move(cb) : Callback{});
+    std::shared_ptr<BatchJob> job(new BatchJob(st));
+    auto ms = std::make_shared<std::vector<std::shared_ptr<geometry::TriangleMesh>>>(std::move(meshes));
+    auto es = std::make_shared<std::vector<std::string>>(std::move(errors));
+    job->driver_ = drive(
+        &st->cancel, threads, ms->size(),
+        [st, mT, samples](std::optional<TargetContext> &tgt) {
+            clean_mesh(*mT);
+            tgt.emplace(make_target_context(*mT, st->P.voxel, st->P.fpfh_radius, st->P.icp_thr, samples,
+                                            st->P.sampling));
+            target_to_device(*tgt, st->P.device);
+        },
+        [st, ms, es](int i, const TargetContext *tgt, const std::string &terr) {
+            BatchOut o;
+            {
+                ProfileScope ps(st->P.profile ? &o.prof : nullptr);
+                try {
+                    if (!(*es)[i].empty()) throw std::runtime_error((*es)[i]);
+                    if (!tgt) throw std::runtime_error(terr);
+                    if (!(*ms)[i]) throw std::runtime_error("mesh is null");
+                    checkpoint();
+                    clean_mesh(*(*ms)[i]);
+                    align_and_check_mesh(*(*ms)[i], *tgt, st->P, o);
+                } catch (const std::exception &e) {
+                    o.error = e.what();
+                }
+            }
+            (*ms)[i].reset();
+            st->push(i, std::move(o));
+        });
+    job->driver_id_ = job->driver_.get_id();
+    return job;
+}
+
+std::shared_ptr<BatchJob> BatchJob::start(std::shared_ptr<geometry::TriangleMesh> mT,
+                                          std::vector<std::shared_ptr<PreparedMesh>> cands, const BatchParams &P,
+                                          size_t samples, int threads, Callback cb) {
+    const size_t n = cands.size();
+    auto st = std::make_shared<State>(n, P, n ? std::move(cb) : Callback{});
+    std::shared_ptr<BatchJob> job(new BatchJob(st));
+    auto cs = std::make_shared<std::vector<std::shared_ptr<PreparedMesh>>>(std::move(cands));
+    job->driver_ = drive(
+        &st->cancel, threads, cs->size(),
+        [st, mT, cs, samples](std::optional<TargetContext> &tgt) {
+            clean_mesh(*mT);
+            tgt.emplace(make_target_context(*mT, st->P.voxel, st->P.fpfh_radius, st->P.icp_thr, samples,
+                                            st->P.sampling));
+            target_to_device(*tgt, st->P.device);
+            for (auto &c : *cs)
+                if (c) c->to_device(st->P.device);
+        },
+        [st, cs](int i, const TargetContext *tgt, const std::string &terr) {
+            BatchOut o;
+            {
+                ProfileScope ps(st->P.profile ? &o.prof : nullptr);
+                try {
+                    if (!tgt) throw std::runtime_error(terr);
+                    checkpoint();
+                    align_and_check_prepared((*cs)[i], *tgt, st->P, o);
+                } catch (const std::exception &e) {
+                    o.error = e.what();
+                }
+            }
+            st->push(i, std::move(o));
+        });
+    job->driver_id_ = job->driver_.get_id();
+    return job;
+}
+
+bool BatchJob::on_job_thread() const {
+    return in_task() || std::this_thread::get_id() == driver_id_;
+}
+
+// 回调里放掉最后一个句柄时析构跑在池任务（后台线程的 parallel_for 正等它）或后台线程本身上，
+// 这时不能 join：分离，后台线程持有 State，最后一个候选入队后自行退出
+BatchJob::~BatchJob() {
+    cancel();
+    std::lock_guard<std::mutex> lk(join_m_);
+    if (!driver_.joinable()) return;
+    if (on_job_thread()) driver_.detach();
+    else driver_.join();
+}
+
+void BatchJob::join() {
+    if (on_job_thread()) throw std::runtime_error("BatchJob.join() cannot be called from a pool task or job callback");
+    std::lock_guard<std::mutex> lk(join_m_);
+    if (driver_.joinable()) driver_.join();
+}
+
+std::vector<BatchJob::Item> BatchJob::next(double timeout, size_t max) {
+    State &S = *s_;
+    std::unique_lock<std::mutex> lk(S.m);
+    auto ready = [&] { return !S.ready.empty() || S.completed == S.total; };
+    if (timeout < 0) S.cv.wait(lk, ready);
+    else if (timeout > 0) S.cv.wait_for(lk, std::chrono::duration<double>(timeout), ready);
+    std::vector<Item> out;
+    while (!S.ready.empty() && out.size() < max) {
+        out.push_back(std::move(S.ready.front()));
+        S.ready.pop_front();
+    }
+    return out;
+}
+
+bool BatchJob::done() const {
+    std::lock_guard<std::mutex> lk(s_->m);
+    return s_->completed == s_->total;
+}
+
+size_t BatchJob::completed() const {
+    std::lock_guard<std::mutex> lk(s_->m);
+    return s_->completed;
+}
+
+// ----------------------------- 体素窄带 SDF（形式化复核） -----------------------------
+
+// 粗到细（八叉树式）生成窄带：距离场 1-Lipschitz，砖块中心距离 > band + 半对角线 时整块跳过，
+// 中心距离 + 半对角线 <= band 时整块入带；其余继续细分，到叶子砖块再逐体素查询。
+// 峰值内存随窄带表面积增长，而不是包围盒体积。
+struct Brick { int32_t x, y, z, s; };   // 起点（体素坐标）与边长（体素数，2 的幂）
+
+NarrowBand build_narrow_band(const geometry::TriangleMesh &mT, double voxel, double band_mm,
+                             int nthreads) {
+    if (voxel <= 0) throw std::runtime_error("voxel must be > 0");
+    t::geometry::RaycastingScene sceneT;
+    scene_add_legacy(sceneT, mT);
+
+    NarrowBand nb;
+    nb.voxel = voxel; nb.band_mm = band_mm;
+    auto bb = mT.GetAxisAlignedBoundingBox();
+    nb.origin = bb.min_bound_ - Eigen::Vector3d::Constant(band_mm);
+    Eigen::Vector3d max = bb.max_bound_ + Eigen::Vector3d::Constant(band_mm);
+
+    Eigen::Vector3i dims;
+    for (int i = 0; i < 3; ++i) dims[i] = std::max(1, (int)std::ceil((max[i] - nb.origin[i]) / voxel));
+    nb.NX = dims[0]; nb.NY = dims[1]; nb.NZ = dims[2];
+    if (nb.NX * nb.NY * nb.NZ > (int64_t)std::numeric_limits<uint32_t>::max())
+        throw std::runtime_error("narrow-band grid too large for uint32 indices; increase voxel");
+
+    const int32_t kTop = 64, kLeaf = 8;
+    const size_t kChunk = size_t(1) << 20;
+    const float band = (float)band_mm;
+    auto extent = [&](const Brick &b, int axis) {
+        int64_t n = axis == 0 ? nb.NX : axis == 1 ? nb.NY : nb.NZ;
+        int32_t o = axis == 0 ? b.x : axis == 1 ? b.y : b.z;
+        return (int32_t)std::min<int64_t>(b.s, n - o);
+    };
+    auto linear = [&](int64_t ix, int64_t iy, int64_t iz) { return (uint32_t)((ix * nb.NY + iy) * nb.NZ + iz); };
+    auto emit_all = [&](const Brick &b) {
+        const int32_t ex = extent(b, 0), ey = extent(b, 1), ez = extent(b, 2);
+        for (int32_t i = 0; i < ex; ++i)
+            for (int32_t j = 0; j < ey; ++j)
+                for (int32_t k = 0; k < ez; ++k) nb.cells.push_back(linear(b.x + i, b.y + j, b.z + k));
+    };
+
+    // 叶子砖块：逐体素中心分块查询
+    std::vector<uint32_t> pend; pend.reserve(std::min<size_t>(kChunk, 1 << 16));
+    auto flush = [&] {
+        if (pend.empty()) return;
+        core::Tensor Q = core::Tensor::Empty({(int64_t)pend.size(), 3}, core::Float32);
+        float *q = Q.GetDataPtr<float>();
+        simd::grid_centers(pend.data(), pend.size(), nb.origin.data(), voxel, nb.NY, nb.NZ, nullptr, q);
+        auto dT = sceneT.ComputeDistance(Q, nthreads); // unsigned
+        const float *d = dT.GetDataPtr<float>();
+        for (size_t k = 0; k < pend.size(); ++k) if (d[k] <= band) nb.cells.push_back(pend[k]);
+        pend.clear();
+    };
+
+    std::vector<Brick> level, next;
+    for (int32_t x = 0; x < nb.NX; x += kTop)
+        for (int32_t y = 0; y < nb.NY; y += kTop)
+            for (int32_t z = 0; z < nb.NZ; z += kTop) level.push_back({x, y, z, kTop});
+
+    while (!level.empty()) {
+        core::Tensor C = core::Tensor::Empty({(int64_t)level.size(), 3}, core::Float32);
+        float *c = C.GetDataPtr<float>();
+        for (size_t k = 0; k < level.size(); ++k) {
+            const Brick &b = level[k];
+            c[3 * k + 0] = (float)(nb.origin.x() + (b.x + 0.5 * extent(b, 0)) * voxel);
+            c[3 * k + 1] = (float)(nb.origin.y() + (b.y + 0.5 * extent(b, 1)) * voxel);
+            c[3 * k + 2] = (float)(nb.origin.z() + (b.z + 0.5 * extent(b, 2)) * voxel);
+        }
+        auto dC = sceneT.ComputeDistance(C, nthreads);
+        const float *d = dC.GetDataPtr<float>();
+
+        next.clear();
+        for (size_t k = 0; k < level.size(); ++k) {
+            const Brick &b = level[k];
+            const int32_t ex = extent(b, 0), ey = extent(b, 1), ez = extent(b, 2);
+            const float half = (float)(0.5 * voxel * std::sqrt(double(ex) * ex + double(ey) * ey + double(ez) * ez));
+            if (d[k] > band + half) continue;
+            if (d[k] + half <= band) { emit_all(b); continue; }
+            if (b.s > kLeaf) {
+                const int32_t h = b.s / 2;
+                for (int32_t i = 0; i < 2; ++i)
+                    for (int32_t j = 0; j < 2; ++j)
+                        for (int32_t l = 0; l < 2; ++l) {
+                            Brick ch{b.x + i * h, b.y + j * h, b.z + l * h, h};
+                            if (ch.x < nb.NX && ch.y < nb.NY && ch.z < nb.NZ) next.push_back(ch);
+                        }
+                continue;
+            }
+            for (int32_t i = 0; i < ex; ++i)
+                for (int32_t j = 0; j < ey; ++j)
+                    for (int32_t l = 0; l < ez; ++l) {
+                        pend.push_back(linear(b.x + i, b.y + j, b.z + l));
+                        if (pend.size() >= kChunk) flush();
+                    }
+        }
+        level.swap(next);
+    }
+    flush();
+
+    std::sort(nb.cells.begin(), nb.cells.end());
+    nb.cells.shrink_to_fit();
+    return nb;
+}
+
+FormalOut formal_check_band(const ClearanceScene &cs, const NarrowBand &nb,
+                            double clearance, int nthreads) {
+    FormalOut o;
+    if (nb.cells.empty()) { o.reason = "no samples in band"; return o; }
+
+    // 体素中心在目标坐标系，经句柄变回候选局部坐标（解码与变换一次完成）；距离乘 scale 换回
+    double M[12];
+    simd::affine_rows(cs.Tinv, M);
+    const double *A = cs.identity ? nullptr : M;
+    const float s = (float)cs.scale;
+    double min_c = 1e18, sum_c = 0.0;
+    size_t inside_cnt = 0;
+    sdf_query_blocks(cs.bvh(), 0, nb.cells.size(),
+                     [&](size_t b, size_t m, float *q) {
+                         simd::grid_centers(nb.cells.data() + b, m, nb.origin.data(), nb.voxel, nb.NY, nb.NZ, A, q);
+                     },
+                     [&](size_t, size_t m, float *sd) {
+                         if (s != 1.f) for (size_t k = 0; k < m; ++k) sd[k] *= s;
+                         const simd::Inside in = simd::inside(sd, m, true);
+                         if (in.n) min_c = std::min(min_c, (double)in.min);
+                         sum_c += in.sum; inside_cnt += in.n;
+                     }, nthreads);
+    if (inside_cnt > 0) { o.min_c = min_c; o.mean_c = sum_c / inside_cnt; }
+
+    double eps = 0.866 * nb.voxel; // 误差上界（sqrt(3)/2 * g）
+    o.pass = (o.min_c - eps >= clearance);
+    o.inside_ratio = (double)inside_cnt / (double)nb.cells.size();
+    return o;
+}
+
+// ----------------------------- 剖切线段 -----------------------------
+
+static inline uint64_t edge_key(int a, int b) {
+    if (a > b) std::swap(a, b);
+    return (uint64_t(uint32_t(a)) << 32) | uint32_t(b);
+}
+
+void chain_section(Section &S) {
+    const int n = (int)S.segs.size();
+    std::unordered_map<uint64_t, std::array<int, 2>> at;
+    at.reserve(2 * n);
+    for (int i = 0; i < n; ++i)
+        for (int e = 0; e < 2; ++e) {
+            auto &slot = at.try_emplace(S.segs[i].key[e], std::array<int, 2>{-1, -1}).first->second;
+            if (slot[0] < 0) slot[0] = i; else if (slot[1] < 0) slot[1] = i;   // 非流形边上多余的线段不串
+        }
+    auto other = [&](uint64_t k, int seg) {
+        const auto &slot = at.find(k)->second;
+        return slot[0] == seg ? slot[1] : slot[0];
+    };
+
+    std::vector<char> used(n, 0);
+    auto walk = [&](int start, int enter) {
+        std::vector<Eigen::Vector3d> pl{S.segs[start].p[enter]};
+        bool closed = false;
+        int seg = start, e = enter;
+        for (;;) {
+            used[seg] = 1;
+            const int x = 1 - e;
+            pl.push_back(S.segs[seg].p[x]);
+            const uint64_t k = S.segs[seg].key[x];
+            const int nxt = other(k, seg);
+            if (nxt == start) { closed = true; pl.pop_back(); break; }
+            if (nxt < 0 || used[nxt]) break;
+            e = S.segs[nxt].key[0] == k ? 0 : 1;
+            seg = nxt;
+        }
+        S.polylines.push_back(std::move(pl));
+        S.closed.push_back(closed);
+    };
+    for (int i = 0; i < n; ++i)
+        for (int e = 0; e < 2 && !used[i]; ++e)
+            if (other(S.segs[i].key[e], i) < 0) walk(i, e);
+    for (int i = 0; i < n; ++i)
+        if (!used[i]) walk(i, 0);
+}
+
+std::vector<Section> compute_sections(const geometry::TriangleMesh &m, const Eigen::Vector3d &N,
+                                      const std::vector<double> &offsets, bool chain) {
+    const int64_t nV = (int64_t)m.vertices_.size(), nF = (int64_t)m.triangles_.size();
+    const int K = (int)offsets.size();
+    std::vector<Section> out(K);
+    for (int k = 0; k < K; ++k) { out[k].offset = offsets[k]; out[k].normal = N; }
+    if (K == 0 || nF == 0) return out;
+
+    std::vector<int> order(K);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) { return offsets[a] < offsets[b]; });
+    std::vector<double> D(K);
+    for (int k = 0; k < K; ++k) D[k] = offsets[order[k]];
+
+    // 顶点符号距离与三角形 -> 排序后平面区间 [kb, ke)（lo < d <= hi），按块交给 simd 内核
+    constexpr int64_t kBlock = 16384;
+    std::vector<double> sv(nV);
+#pragma omp parallel for schedule(static)
+    for (int64_t b = 0; b < nV; b += kBlock)
+        simd::plane_dot(m.vertices_[b].data(), std::min(kBlock, nV - b), N.data(), sv.data() + b);
+
+    std::vector<int> kb(nF), ke(nF);
+    const int *tri = m.triangles_[0].data();
+#pragma omp parallel for schedule(static)
+    for (int64_t b = 0; b < nF; b += kBlock)
+        simd::plane_span(sv.data(), tri + 3 * b, std::min(kBlock, nF - b), D.data(), K, kb.data() + b, ke.data() + b);
+    // 计数排序成每个平面的三角形列表
+    std::vector<int64_t> off(K + 1, 0);
+    for (int64_t t = 0; t < nF; ++t) for (int k = kb[t]; k < ke[t]; ++k) off[k + 1]++;
+    for (int k = 0; k < K; ++k) off[k + 1] += off[k];
+    std::vector<int> bucket(off[K]);
+    {
+        std::vector<int64_t> pos(off.begin(), off.end() - 1);
+        for (int64_t t = 0; t < nF; ++t) for (int k = kb[t]; k < ke[t]; ++k) bucket[pos[k]++] = (int)t;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < K; ++k) {
+        Section &S = out[order[k]];
+        const double d = D[k];
+        S.segs.reserve(off[k + 1] - off[k]);
+        for (int64_t j = off[k]; j < off[k + 1]; ++j) {
+            const auto &tri = m.triangles_[bucket[j]];
+            SectionSeg g;
+            int c = 0;
+            for (int e = 0; e < 3 && c < 2; ++e) {
+                int a = tri(e), b = tri((e + 1) % 3);
+                if (a > b) std::swap(a, b);   // 固定方向插值，相邻三角形得到逐位相同的交点
+                const double da = sv[a] - d, db = sv[b] - d;
+                if ((da >= 0) == (db >= 0)) continue;
+                g.p[c] = m.vertices_[a] + (da / (da - db)) * (m.vertices_[b] - m.vertices_[a]);
+                g.key[c++] = edge_key(a, b);
+            }
+            if (c == 2) S.segs.push_back(g);
+        }
+        if (chain) chain_section(S);
+    }
+    return out;
+}
+
+static double point_seg_dist(const Eigen::Vector3d &p, const SectionSeg &s) {
+    const Eigen::Vector3d d = s.p[1] - s.p[0];
+    const double L2 = d.squaredNorm();
+    const double u = L2 > 0 ? std::clamp((p - s.p[0]).dot(d) / L2, 0.0, 1.0) : 0.0;
+    return (s.p[0] + u * d - p).norm();
+}
+
+// 截面平面内的均匀网格（CSR：格子 -> 线段）。线段登记到其投影包围盒覆盖的全部格子；
+// 格边长取 max(平均线段长, sqrt(包围盒面积 / 线段数))，格子数与线段数同量级
+struct SegGrid {
+    Eigen::Vector3d u, v;
+    double x0{0}, y0{0}, h{1};
+    int64_t nx{1}, ny{1};
+    std::vector<int64_t> off;
+    std::vector<int> ids;
+
+    explicit SegGrid(const Section &S) {
+        const Eigen::Vector3d n = S.normal.norm() > 0 ? S.normal.normalized() : Eigen::Vector3d(0, 0, 1);
+        u = n.unitOrthogonal(); v = n.cross(u);
+        const size_t m = S.segs.size();
+        std::vector<Eigen::Vector4d> box(m);   // (xmin, ymin, xmax, ymax)
+        double X0 = std::numeric_limits<double>::infinity(), Y0 = X0, X1 = -X0, Y1 = -X0, len = 0;
+        for (size_t i = 0; i < m; ++i) {
+            const Eigen::Vector2d a(S.segs[i].p[0].dot(u), S.segs[i].p[0].dot(v));
+            const Eigen::Vector2d b(S.segs[i].p[1].dot(u), S.segs[i].p[1].dot(v));
+            box[i] << std::min(a.x(), b.x()), std::min(a.y(), b.y()), std::max(a.x(), b.x()), std::max(a.y(), b.y());
+            X0 = std::min(X0, box[i][0]); Y0 = std::min(Y0, box[i][1]);
+            X1 = std::max(X1, box[i][2]); Y1 = std::max(Y1, box[i][3]);
+            len += (b - a).norm();
+        }
+        x0 = X0; y0 = Y0;
+        h = std::max({len / double(m), std::sqrt((X1 - X0) * (Y1 - Y0) / double(m)), 1e-9});
+        nx = (int64_t)((X1 - X0) / h) + 1; ny = (int64_t)((Y1 - Y0) / h) + 1;
+        auto cell = [&](double x, int64_t n) { return std::clamp((int64_t)(x / h), (int64_t)0, n - 1); };
+        off.assign(nx * ny + 1, 0);
+        auto each_cell = [&](size_t i, auto &&f) {
+            const int64_t ix1 = cell(box[i][2] - x0, nx), iy1 = cell(box[i][3] - y0, ny);
+            for (int64_t iy = cell(box[i][1] - y0, ny); iy <= iy1; ++iy)
+                for (int64_t ix = cell(box[i][0] - x0, nx); ix <= ix1; ++ix) f(iy * nx + ix);
+        };
+        for (size_t i = 0; i < m; ++i) each_cell(i, [&](int64_t c) { off[c + 1]++; });
+        for (int64_t c = 0; c < nx * ny; ++c) off[c + 1] += off[c];
+        ids.resize(off.back());
+        std::vector<int64_t> pos(off.begin(), off.end() - 1);
+        for (size_t i = 0; i < m; ++i) each_cell(i, [&](int64_t c) { ids[pos[c]++] = (int)i; });
+    }
+
+    // 查询点所在格子（可在网格外）第 r 环之外的线段，投影距离 >= r·h，而投影距离不超过真实距离
+    double nearest(const Eigen::Vector3d &p, const std::vector<SectionSeg> &segs) const {
+        constexpr double kFar = 1e9;   // 远离网格的点也不溢出
+        const int64_t cx = (int64_t)std::floor(std::clamp((p.dot(u) - x0) / h, -kFar, kFar));
+        const int64_t cy = (int64_t)std::floor(std::clamp((p.dot(v) - y0) / h, -kFar, kFar));
+        auto gap = [](int64_t c, int64_t n) { return c < 0 ? -c : c >= n ? c - (n - 1) : (int64_t)0; };
+        const int64_t r0 = std::max(gap(cx, nx), gap(cy, ny));
+        const int64_t r1 = std::max({cx, nx - 1 - cx, cy, ny - 1 - cy});
+        double best = std::numeric_limits<double>::infinity();
+        auto visit = [&](int64_t x, int64_t y) {
+            if (x < 0 || y < 0 || x >= nx || y >= ny) return;
+            const int64_t c = y * nx + x;
+            for (int64_t j = off[c]; j < off[c + 1]; ++j) best = std::min(best, point_seg_dist(p, segs[ids[j]]));
+        };
+        for (int64_t r = r0; r <= r1; ++r) {
+            for (int64_t y = std::max(cy - r, (int64_t)0); y <= std::min(cy + r, ny - 1); ++y) {
+                if (y == cy - r || y == cy + r) {
+                    for (int64_t x = std::max(cx - r, (int64_t)0); x <= std::min(cx + r, nx - 1); ++x) visit(x, y);
+                } else {
+                    visit(cx - r, y);
+                    visit(cx + r, y);
+                }
+            }
+            if (best <= double(r) * h) break;
+        }
+        return best;
+    }
+};
+
+SectionGap section_gap(const Section &tgt, const Section &cand) {
+    SectionGap g;
+    if (tgt.polylines.empty() || cand.segs.empty()) return g;
+    g.found = true; g.min_gap = std::numeric_limits<double>::infinity();
+    const SegGrid grid(cand);
+    size_t n = 0;
+    for (const auto &pl : tgt.polylines)
+        for (const auto &p : pl) {
+            const double best = grid.nearest(p, cand.segs);
+            g.min_gap = std::min(g.min_gap, best); g.max_gap = std::max(g.max_gap, best);
+            g.mean_gap += best; ++n;
+        }
+    g.mean_gap /= double(n);
+    return g;
+}
+
+// ----------------------------- 薄壁段聚类与区域标注 -----------------------------
+
+std::vector<Region> thin_regions_from(const std::vector<Eigen::Vector3d> &V, const float *clr,
+                                      double thr_mm, double radius_mm, const std::string &connectivity,
+                                      const std::vector<Eigen::Vector3i> *tris) {
+    if (connectivity != "radius" && connectivity != "mesh")
+        throw std::runtime_error("connectivity must be 'radius' or 'mesh'");
+    if (connectivity == "mesh" && (!tris || tris->empty()))
+        throw std::runtime_error("connectivity='mesh' needs target faces");
+    const size_t N = V.size();
+    std::vector<int> idxs; idxs.reserve(N);
+    std::vector<int> local(N, -1);   // 顶点 -> 薄壁点序号
+    for (size_t i = 0; i < N; ++i)
+        if (clr[i] >= 0.f && double(clr[i]) < thr_mm) { local[i] = (int)idxs.size(); idxs.push_back((int)i); }
+    if (idxs.empty()) return {};
+    const int n = (int)idxs.size();
+
+    DisjointSet ds(n);
+    if (connectivity == "mesh") {
+        for (const auto &t : *tris)
+            for (int e = 0; e < 3; ++e) {
+                const int a = local[t(e)], b = local[t((e + 1) % 3)];
+                if (a >= 0 && b >= 0) ds.unite(a, b);
+            }
+    } else {
+        geometry::PointCloud pc;
+        pc.points_.resize(n);
+        for (int k = 0; k < n; ++k) pc.points_[k] = V[idxs[k]];
+        geometry::KDTreeFlann kd(pc);
+        std::vector<int> nb; std::vector<double> d2;
+        for (int k = 0; k < n; ++k) {
+            kd.SearchRadius(pc.points_[k], radius_mm, nb, d2);
+            for (int j : nb) if (j > k) ds.unite(k, j);
+        }
+    }
+
+    // 按首次出现的顺序编号簇，计数排序分桶（桶内顶点索引递增）
+    std::vector<int> cid(n, -1), root_cid(n, -1);
+    int K = 0;
+    for (int k = 0; k < n; ++k) {
+        const int r = ds.find(k);
+        if (root_cid[r] < 0) root_cid[r] = K++;
+        cid[k] = root_cid[r];
+    }
+    std::vector<int> off(K + 1, 0), members(n);
+    for (int k = 0; k < n; ++k) off[cid[k] + 1]++;
+    for (int c = 0; c < K; ++c) off[c + 1] += off[c];
+    {
+        std::vector<int> pos(off.begin(), off.end() - 1);
+        for (int k = 0; k < n; ++k) members[pos[cid[k]]++] = idxs[k];
+    }
+
+    // 每簇一次遍历：最小余量、质心与协方差；PCA 主方向上投影的两端为骨架端点
+    std::vector<Region> R(K);
+#pragma omp parallel for schedule(dynamic)
+    for (int c = 0; c < K; ++c) {
+        Region &g = R[c];
+        const int b = off[c], e = off[c + 1];
+        Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+        Eigen::Matrix3d S = Eigen::Matrix3d::Zero();
+        for (int t = b; t < e; ++t) {
+            const Eigen::Vector3d &v = V[members[t]];
+            g.min_c = std::min(g.min_c, double(clr[members[t]]));
+            sum += v; S += v * v.transpose();
+        }
+        const double cnt = double(e - b);
+        g.centroid = sum / cnt;
+        const Eigen::Matrix3d C = S / cnt - g.centroid * g.centroid.transpose();
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(C);
+        const Eigen::Vector3d dir = es.eigenvectors().col(2);
+        double lo = std::numeric_limits<double>::infinity(), hi = -lo;
+        for (int t = b; t < e; ++t) {
+            const Eigen::Vector3d &v = V[members[t]];
+            const double s = dir.dot(v - g.centroid);
+            if (s < lo) { lo = s; g.pA = v; }
+            if (s > hi) { hi = s; g.pB = v; }
+        }
+    }
+
+    for (int c = 0; c < K; ++c) R[c].indices.assign(members.begin() + off[c], members.begin() + off[c + 1]);
+    return R;
+}
+
+// ----------------------------- 3DM 读取（openNURBS） -----------------------------
+
+#ifdef HYBRID_WITH_OPENNURBS
+namespace on3dm {
+
+constexpr int kMaxNesting = 8;     // 块引用最大嵌套层数
+constexpr int kTrimSegments = 24;  // 每条 trim 曲线在参数域的采样段数
+
+struct Sink {
+    std::vector<Eigen::Vector3d> V;
+    std::vector<Eigen::Vector3i> F;
+
+    void point(const ON_3dPoint &p, const ON_Xform &X) {
+        const ON_3dPoint q = X * p;
+        V.emplace_back(q.x, q.y, q.z);
+    }
+    void tri(int a, int b, int c, bool flip) {
+        if (flip) F.emplace_back(a, c, b);
+        else F.emplace_back(a, b, c);
+    }
+};
+
+// 镜像变换会翻转绕序
+bool flips(const ON_Xform &X) { return X.Determinant() < 0; }
+
+void append_mesh(const ON_Mesh &m, const ON_Xform &X, Sink &out) {
+    const int base = (int)out.V.size(), nv = m.VertexCount();
+    const bool flip = flips(X);
+    for (int i = 0; i < nv; ++i) out.point(m.Vertex(i), X);
+    for (int i = 0; i < m.FaceCount(); ++i) {
+        const ON_MeshFace &f = m.m_F[i];
+        if (!f.IsValid(nv)) continue;
+        out.tri(base + f.vi[0], base + f.vi[1], base + f.vi[2], flip);
+        if (f.IsQuad()) out.tri(base + f.vi[0], base + f.vi[2], base + f.vi[3], flip);
+    }
+}
+
+// 修剪环在参数域中的折线
+std::vector<std::vector<ON_2dPoint>> trim_loops(const ON_BrepFace &face) {
+    std::vector<std::vector<ON_2dPoint>> loops;
+    for (int li = 0; li < face.LoopCount(); ++li) {
+        const ON_BrepLoop *loop = face.Loop(li);
+        if (!loop) continue;
+        std::vector<ON_2dPoint> poly;
+        for (int ti = 0; ti < loop->TrimCount(); ++ti) {
+            const ON_BrepTrim *trim = loop->Trim(ti);
+            if (!trim) continue;
+            const ON_Interval d = trim->Domain();
+            for (int k = 0; k < kTrimSegments; ++k) {
+                const ON_3dPoint p = trim->PointAt(d.ParameterAt((double)k / kTrimSegments));
+                poly.emplace_back(p.x, p.y);
+            }
+        }
+        if (poly.size() >= 3) loops.push_back(std::move(poly));
+    }
+    return loops;
+}
+
+// 奇偶规则：外环和内环（洞）一起计数
+bool inside_loops(const std::vector<std::vector<ON_2dPoint>> &loops, double u, double v) {
+    bool in = false;
+    for (const auto &L : loops)
+        for (size_t i = 0, j = L.size() - 1; i < L.size(); j = i++)
+            if ((L[i].y > v) != (L[j].y > v) &&
+                u < (L[j].x - L[i].x) * (v - L[i].y) / (L[j].y - L[i].y) + L[i].x)
+                in = !in;
+    return in;
+}
+
+// 无渲染网格的面：参数域 (nu x nv) 网格，三角形质心落在修剪域外的丢弃
+void mesh_face(const ON_BrepFace &face, const ON_Xform &X, const Load3dmParams &P, Sink &out) {
+    const ON_Interval du = face.Domain(0), dv = face.Domain(1);
+    double w = 0, h = 0;
+    const double e = std::max(P.max_edge, 1e-6);
+    if (!face.GetSurfaceSize(&w, &h)) w = h = 8 * e;
+    const int nu = std::clamp((int)std::ceil(w / e), 2, std::max(2, P.max_grid));
+    const int nv = std::clamp((int)std::ceil(h / e), 2, std::max(2, P.max_grid));
+    const auto loops = trim_loops(face);
+    const bool flip = flips(X) != face.m_bRev;
+
+    const int base = (int)out.V.size();
+    for (int j = 0; j <= nv; ++j)
+        for (int i = 0; i <= nu; ++i)
+            out.point(face.PointAt(du.ParameterAt((double)i / nu), dv.ParameterAt((double)j / nv)), X);
+    auto id = [&](int i, int j) { return base + j * (nu + 1) + i; };
+    auto keep = [&](double fi, double fj) {
+        return loops.empty() || inside_loops(loops, du.ParameterAt(fi / nu), dv.ParameterAt(fj / nv));
+    };
+    for (int j = 0; j < nv; ++j)
+        for (int i = 0; i < nu; ++i) {
+            if (keep(i + 2.0 / 3, j + 1.0 / 3)) out.tri(id(i, j), id(i + 1, j), id(i + 1, j + 1), flip);
+            if (keep(i + 1.0 / 3, j + 2.0 / 3)) out.tri(id(i, j), id(i + 1, j + 1), id(i, j + 1), flip);
+        }
+}
+
+void append_brep(const ON_Brep &brep, const ON_Xform &X, const Load3dmParams &P, Sink &out) {
+    for (int fi = 0; fi < brep.m_F.Count(); ++fi) {
+        const ON_BrepFace &face = brep.m_F[fi];
+        const ON_Mesh *rm = P.render_meshes ? face.Mesh(ON::render_mesh) : nullptr;
+        if (rm && rm->FaceCount() > 0) append_mesh(*rm, X, out);
+        else mesh_face(face, X, P, out);
+    }
+}
+
+void append_geometry(const ONX_Model &model, const ON_Geometry *g, const ON_Xform &X,
+                     const Load3dmParams &P, Sink &out, int depth) {
+    if (!g) return;
+    if (const ON_Mesh *m = ON_Mesh::Cast(g)) { append_mesh(*m, X, out); return; }
+    if (const ON_Brep *b = ON_Brep::Cast(g)) { append_brep(*b, X, P, out); return; }
+    if (const ON_Extrusion *ex = ON_Extrusion::Cast(g)) {
+        const ON_Mesh *rm = P.render_meshes ? ex->Mesh(ON::render_mesh) : nullptr;
+        if (rm && rm->FaceCount() > 0) { append_mesh(*rm, X, out); return; }
+    }
+    if (const ON_InstanceRef *ir = ON_InstanceRef::Cast(g)) {
+        if (depth >= kMaxNesting) return;
+        const ON_ModelComponentReference r =
+            model.ComponentFromId(ON_ModelComponent::Type::InstanceDefinition, ir->m_instance_definition_uuid);
+        const ON_InstanceDefinition *idef = ON_InstanceDefinition::Cast(r.ModelComponent());
+        if (!idef) return;
+        const ON_Xform Y = X * ir->m_xform;
+        const ON_SimpleArray<ON_UUID> &ids = idef->InstanceGeometryIdList();
+        for (int k = 0; k < ids.Count(); ++k) {
+            const ON_ModelComponentReference gr = model.ComponentFromId(ON_ModelComponent::Type::ModelGeometry, ids[k]);
+            if (const ON_ModelGeometryComponent *mg = ON_ModelGeometryComponent::Cast(gr.ModelComponent()))
+                append_geometry(model, mg->Geometry(nullptr), Y, P, out, depth + 1);
+        }
+        return;
+    }
+    // 其余（Extrusion 无缓存网格、Surface 等）转 Brep 网格化
+    if (g->HasBrepForm()) {
+        std::unique_ptr<ON_Brep> b(g->BrepForm());
+        if (b) append_brep(*b, X, P, out);
+    }
+}
+
+std::once_flag g_begin;
+
+}  // namespace on3dm
+#endif
+
+bool has_opennurbs() {
+#ifdef HYBRID_WITH_OPENNURBS
+    return true;
+#else
+    return false;
+#endif
+}
+
+std::shared_ptr<geometry::TriangleMesh> read_3dm(const std::string &path, const Load3dmParams &P) {
+#ifdef HYBRID_WITH_OPENNURBS
+    StageTimer st(Stage::Ingest);
+    std::call_once(on3dm::g_begin, [] { ON::Begin(); });
+    ONX_Model model;
+    if (!model.Read(path.c_str(), nullptr)) throw std::runtime_error("cannot read 3dm: " + path);
+    on3dm::Sink out;
+    ONX_ModelComponentIterator it(model, ON_ModelComponent::Type::ModelGeometry);
+    for (const ON_ModelComponent *c = it.FirstComponent(); c; c = it.NextComponent()) {
+        const ON_ModelGeometryComponent *mg = ON_ModelGeometryComponent::Cast(c);
+        if (!mg) continue;
+        const ON_3dmObjectAttributes *attr = mg->Attributes(nullptr);
+        if (attr && attr->IsInstanceDefinitionObject()) continue;  // 只经块引用展开
+        on3dm::append_geometry(model, mg->Geometry(nullptr), ON_Xform::IdentityTransformation, P, out, 0);
+    }
+    if (out.F.empty()) throw std::runtime_error("no mesh data found in " + path);
+    auto m = std::make_shared<geometry::TriangleMesh>();
+    m->vertices_ = std::move(out.V);
+    m->triangles_ = std::move(out.F);
+    return m;
+#else
+    (void)P;
+    throw std::runtime_error("cannot read " + path + ": libshoematch was built without openNURBS (WITH_OPENNURBS=ON)");
+#endif
+}
+
+// ----------------------------- 候选库与端到端匹配 -----------------------------
+
+std::shared_ptr<geometry::TriangleMesh> read_mesh_file(const std::string &path, const Load3dmParams &P) {
+    std::string ext = std::filesystem::path(path).extension().string();
+    for (auto &ch : ext) ch = (char)std::tolower((unsigned char)ch);
+    if (ext == ".3dm") return read_3dm(path, P);
+    StageTimer st(Stage::Ingest);
+    if (ext == CandidateLibrary::kMeshExt) return PreparedMesh::load(path)->mesh_ptr();
+    auto m = std::make_shared<geometry::TriangleMesh>();
+    if (!io::ReadTriangleMesh(path, *m)) throw std::runtime_error("cannot read mesh: " + path);
+    if (m->triangles_.empty()) throw std::runtime_error("mesh has no faces: " + path);
+    return m;
+}
+
+std::vector<std::shared_ptr<geometry::TriangleMesh>>
+read_mesh_files(const std::vector<std::string> &paths, std::vector<std::string> &errors,
+                bool clean, int threads, const Load3dmParams &P) {
+    CapScope cap(threads);
+    const int n = (int)paths.size();
+    std::vector<std::shared_ptr<geometry::TriangleMesh>> out(n);
+    errors.assign(n, std::string());
+    parallel_for(n, [&](int i) {
+        try {
+            auto m = read_mesh_file(paths[i], P);
+            if (clean) clean_mesh(*m);
+            out[i] = std::move(m);
+        } catch (const std::exception &e) {
+            errors[i] = e.what();
+        }
+    });
+    return out;
+}
+
+// 目录下全部 .slpm 的 id（相对路径去扩展名，排序）
+static std::vector<std::string> library_ids(const std::filesystem::path &root) {
+    namespace fs = std::filesystem;
+    std::vector<std::string> ids;
+    for (const auto &e : fs::recursive_directory_iterator(root)) {
+        if (!e.is_regular_file() || e.path().extension() != CandidateLibrary::kMeshExt) continue;
+        fs::path rel = fs::relative(e.path(), root);
+        rel.replace_extension();
+        ids.push_back(rel.generic_string());
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+std::shared_ptr<CandidateLibrary> CandidateLibrary::open(const std::string &dir) {
+    namespace fs = std::filesystem;
+    auto lib = std::make_shared<CandidateLibrary>();
+    lib->root = fs::path(dir);
+    if (!fs::is_directory(lib->root)) throw std::runtime_error("not a library directory: " + dir);
+    const fs::path ip = lib->root / kIndexFile;
+    if (fs::exists(ip)) {
+        try {
+            lib->index = FeatureIndex::load(ip.string());
+            return lib;
+        } catch (const std::runtime_error &) {
+            // 旧版本索引：下面重建
+        }
+    }
+    const std::vector<std::string> ids = library_ids(lib->root);
+    lib->index = std::make_shared<FeatureIndex>();
+    for (const auto &id : ids) lib->index->add(id, lib->load(id)->feat);
+    try {
+        lib->index->save(ip.string());
+    } catch (const std::runtime_error &) {
+        // 只读目录：本次用内存中的索引，不落盘
+    }
+    return lib;
+}
+
+std::vector<std::string> build_library(const std::string &dir, const std::vector<std::string> &ids,
+                                       std::vector<std::shared_ptr<geometry::TriangleMesh>> &meshes,
+                                       const std::vector<std::pair<double, double>> &levels,
+                                       size_t chamfer_samples, int threads) {
+    namespace fs = std::filesystem;
+    if (ids.size() != meshes.size()) throw std::runtime_error("ids and meshes must have the same length");
+    CapScope cap(threads);
+    const int n = (int)ids.size();
+    const uint64_t params_hash = PreparedMesh::hash_params(levels, chamfer_samples);
+    std::vector<std::string> errors(n);
+    std::vector<CoarseFeat> feats(n);
+    parallel_for(n, [&](int i) {
+        try {
+            if (!meshes[i]) throw std::runtime_error("mesh is null");
+            clean_mesh(*meshes[i]);
+            const fs::path out = fs::path(dir) / (ids[i] + CandidateLibrary::kMeshExt);
+            // 已有 .slpm 的网格与参数哈希都一致时直接复用，不重新预处理
+            uint64_t mh = 0, ph = 0;
+            if (PreparedMesh::read_hashes(out.string(), mh, ph) && ph == params_hash &&
+                mh == PreparedMesh::hash_mesh(*meshes[i])) {
+                feats[i] = PreparedMesh::load(out.string())->feat;
+            } else {
+                auto pm = prepare_from_mesh(meshes[i], levels, chamfer_samples);
+                fs::create_directories(out.parent_path());
+                pm->save(out.string());
+                feats[i] = pm->feat;
+            }
+        } catch (const std::exception &e) {
+            errors[i] = e.what();
+        }
+        meshes[i].reset();
+    });
+
+    // 与已有索引合并：本次成功的 id 替换（同 id 取最后一个）或追加，其余 .slpm 仍在的条目保留；
+    // 没有可用索引时从目录里其它 .slpm 补齐，与 CandidateLibrary::open 的重建一致
+    const fs::path root(dir), ip = root / CandidateLibrary::kIndexFile;
+    auto slpm = [&](const std::string &id) { return root / (id + CandidateLibrary::kMeshExt); };
+    std::unordered_map<std::string, int> fresh;
+    for (int i = 0; i < n; ++i)
+        if (errors[i].empty()) fresh[ids[i]] = i;
+    std::shared_ptr<FeatureIndex> old;
+    if (fs::exists(ip)) {
+        try {
+            old = FeatureIndex::load(ip.string());
+        } catch (const std::runtime_error &) {
+            // 损坏或旧版本：下面按目录补齐
+        }
+    }
+    FeatureIndex index;
+    if (old) {
+        for (size_t k = 0; k < old->size(); ++k)
+            if (!fresh.count(old->ids[k]) && fs::exists(slpm(old->ids[k]))) index.append(*old, k);
+    } else {
+        std::vector<std::string> rest;
+        for (auto &id : library_ids(root))
+            if (!fresh.count(id)) rest.push_back(std::move(id));
+        std::vector<std::optional<CoarseFeat>> rf(rest.size());
+        parallel_for((int)rest.size(), [&](int k) {
+            try {
+                rf[k] = PreparedMesh::load(slpm(rest[k]).string())->feat;
+            } catch (const std::exception &) {
+                // 读不出的 .slpm 不进索引
+            }
+        });
+        for (size_t k = 0; k < rest.size(); ++k)
+            if (rf[k]) index.add(rest[k], *rf[k]);
+    }
+    for (int i = 0; i < n; ++i)
+        if (errors[i].empty() && fresh[ids[i]] == i) index.add(ids[i], feats[i]);
+    fs::create_directories(root);
+    index.save(ip.string());
+    return errors;
+}
+
+std::vector<MatchResult> match_library(const CandidateLibrary &lib, geometry::TriangleMesh &mT,
+                                       const MatchParams &M) {
+    CapScope cap(M.threads);
+    clean_mesh(mT);
+    const FeatureIndex &fi = *lib.index;
+    const auto hits = fi.query(coarse_features_from_mesh(mT), M.clearance, M.topk, M.w_hist, M.vol_tol,
+                               M.w_d2, M.w_width, M.max_width_shortfall);
+
+    // 只加载索引筛出的候选（并行读盘 + 反序列化）
+    const int n = (int)hits.size();
+    std::vector<MatchResult> res(n);
+    std::vector<std::shared_ptr<PreparedMesh>> cands(n);
+    parallel_for(n, [&](int i) {
+        res[i].id = fi.ids[hits[i].idx];
+        res[i].index_score = hits[i].score;
+        try {
+            cands[i] = lib.load(res[i].id);
+        } catch (const std::exception &e) {
+            res[i].result.error = e.what();
+        }
+    });
+
+    if (M.cascade) {
+        std::vector<std::string> ids(n);
+        for (int i = 0; i < n; ++i) ids[i] = res[i].id;
+        auto out = cascade_match(mT, ids, cands, M);
+        // 加载失败的候选 cascade 只见到 nullptr：换回加载错误与索引分
+        std::unordered_map<std::string, const MatchResult *> by_id;
+        for (const auto &r : res) by_id[r.id] = &r;
+        for (auto &r : out) {
+            const MatchResult &src = *by_id[r.id];
+            r.index_score = src.index_score;
+            if (!src.result.error.empty()) r.result.error = src.result.error;
+        }
+        return out;
+    }
+
+    const BatchParams P{M.voxel, M.fpfh_radius, M.icp_thr, M.clearance, M.safety_delta, M.decide_only,
+                        M.spec, resolve_device(M.device), M.profile, M.sampling};
+    std::vector<BatchOut> outs(n);
+    run_batch_prepared(mT, cands, P, M.samples, M.threads, outs);
+    for (int i = 0; i < n; ++i)
+        if (cands[i]) res[i].result = std::move(outs[i]);
+    return res;
+}
+
+// ----------------------------- 级联调度 -----------------------------
+
+namespace cascade {
+
+// 主轴框架：E 的列为按特征值降序的主轴（右手系），c 为质心
+struct Frame {
+    Eigen::Vector3d c{Eigen::Vector3d::Zero()};
+    Eigen::Matrix3d E{Eigen::Matrix3d::Identity()};
+};
+
+Frame pca_frame(const std::vector<Eigen::Vector3d> &p) {
+    Frame f;
+    if (p.empty()) return f;
+    for (const auto &x : p) f.c += x;
+    f.c /= (double)p.size();
+    Eigen::Matrix3d C = Eigen::Matrix3d::Zero();
+    for (const auto &x : p) { const Eigen::Vector3d d = x - f.c; C += d * d.transpose(); }
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es(C);
+    f.E = es.eigenvectors().rowwise().reverse();   // 升序 -> 降序
+    if (f.E.determinant() < 0) f.E.col(2) = -f.E.col(2);
+    return f;
+}
+
+// 等距子样本（至多 n 个，n = 0 取全部）
+std::vector<Eigen::Vector3d> strided(const std::vector<Eigen::Vector3d> &p, size_t n) {
+    if (n == 0 || p.size() <= n) return p;
+    std::vector<Eigen::Vector3d> q;
+    q.reserve(n);
+    const double step = (double)p.size() / (double)n;
+    for (size_t i = 0; i < n; ++i) q.push_back(p[(size_t)((double)i * step)]);
+    return q;
+}
+
+// PCA 主轴对齐：8 种轴向符号（其中 4 种为镜像）逐一算低分辨率 Chamfer，取最小。
+// 两侧只用子样本查询、对方全量 KD 树；与当前最优比较截断累加
+AlignResult pca_align(const PreparedMesh &S, const Frame &ft, const std::vector<Eigen::Vector3d> &tsub,
+                      const TargetContext &tgt, size_t n) {
+    StageTimer st(Stage::Chamfer);
+    const Frame fc = pca_frame(S.chamfer_pts->points_);
+    const auto csub = strided(S.chamfer_pts->points_, n);
+    const double total = (double)(csub.size() + tsub.size());
+
+    AlignResult best;
+    best.chamfer = std::numeric_limits<double>::infinity();
+    best.mirrored = false;
+    if (csub.empty() || tsub.empty()) return best;
+    for (int m = 0; m < 8; ++m) {
+        const Eigen::Vector3d d((m & 1) ? -1.0 : 1.0, (m & 2) ? -1.0 : 1.0, (m & 4) ? -1.0 : 1.0);
+        const Eigen::Matrix3d R = ft.E * d.asDiagonal() * fc.E.transpose();
+        Eigen::Matrix4d G = Eigen::Matrix4d::Identity();
+        G.topLeftCorner<3, 3>() = R;
+        G.topRightCorner<3, 1>() = ft.c - R * fc.c;
+        const double stop = best.chamfer * total;
+        double sum = nn_sum(csub, G, *tgt.chamfer_kd, 1.0, stop);
+        if (sum > stop) continue;
+        sum += nn_sum(tsub, G.inverse(), *S.chamfer_kd, 1.0, stop - sum);
+        if (sum > stop) continue;
+        best.T = G;
+        best.chamfer = sum / total;
+        best.mirrored = R.determinant() < 0;
+    }
+    return best;
+}
+
+}  // namespace cascade
+
+std::vector<MatchResult> cascade_match(geometry::TriangleMesh &mT, const std::vector<std::string> &ids,
+                                       const std::vector<std::shared_ptr<PreparedMesh>> &cands,
+                                       const MatchParams &M) {
+    if (ids.size() != cands.size()) throw std::runtime_error("cascade_match: ids and candidates differ in length");
+    CapScope cap(M.threads);
+    const BatchParams P{M.voxel, M.fpfh_radius, M.icp_thr, M.clearance, M.safety_delta, M.decide_only,
+                        M.spec, resolve_device(M.device), M.profile, M.sampling};
+    const size_t K = std::max<size_t>(1, M.final_k);
+    const double inf = std::numeric_limits<double>::infinity();
+    const int n = (int)cands.size();
+
+    std::vector<MatchResult> res(n);
+    for (int i = 0; i < n; ++i) {
+        res[i].id = ids[i];
+        if (!cands[i]) res[i].result.error = "candidate is None";
+    }
+
+    // 1 可行性：候选自带粗特征建临时索引，k = 0 取全部可行
+    {
+        FeatureIndex fi;
+        std::vector<int> where;
+        for (int i = 0; i < n; ++i) {
+            if (!cands[i]) continue;
+            fi.add(ids[i], cands[i]->feat);
+            where.push_back(i);
+            res[i].stage = 1;
+            res[i].cut_by = "infeasible";
+        }
+        for (const auto &h : fi.query(coarse_features_from_mesh(mT), M.clearance, 0, M.w_hist, M.vol_tol, M.w_d2,
+                                      M.w_width, M.max_width_shortfall)) {
+            MatchResult &r = res[where[h.idx]];
+            r.index_score = h.score;
+            r.cut_by = "";
+        }
+    }
+
+    auto tgt = make_target_context(mT, P.voxel, P.fpfh_radius, P.icp_thr, M.samples, P.sampling);
+    target_to_device(tgt, P.device);
+
+    // 2 粗配准：全部可行候选并行，之后按粗 chamfer 升序
+    std::vector<int> order;
+    for (int i = 0; i < n; ++i)
+        if (cands[i] && !*res[i].cut_by) order.push_back(i);
+    const cascade::Frame ft = cascade::pca_frame(tgt.chamfer_pts->points_);
+    const auto tsub = cascade::strided(tgt.chamfer_pts->points_, M.coarse_points);
+    parallel_for((int)order.size(), [&](int j) {
+        MatchResult &r = res[order[j]];
+        ProfileScope ps(P.profile ? &r.result.prof : nullptr);
+        r.stage = 2;
+        try {
+            r.coarse_chamfer = cascade::pca_align(*cands[order[j]], ft, tsub, tgt, M.coarse_points).chamfer;
+        } catch (const std::exception &e) {
+            r.result.error = e.what();
+        }
+    });
+    order.erase(std::remove_if(order.begin(), order.end(), [&](int i) { return !res[i].result.error.empty(); }),
+                order.end());
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int a, int b) { return res[a].coarse_chamfer < res[b].coarse_chamfer; });
+
+    // 3–5 分波：每波固定 kWave 个，波内并行完整配准 + 采样余量。界只在波开始时更新，波长与线程数无关，
+    // 名单不随机器核数变化。完整 chamfer 与第 K 名的完整 chamfer 比（bound），粗 chamfer 与第 K 名的
+    // 粗 chamfer 比（coarse）：两种 chamfer 口径不同，不能互相作界
+    constexpr size_t kWave = 8;
+    std::vector<std::pair<double, int>> top;   // (chamfer, i) 升序，至多 K 个
+    auto kth = [&] { return top.size() < K ? inf : top.back().first; };
+    auto kth_coarse = [&] { return top.size() < K ? inf : res[top.back().second].coarse_chamfer; };
+    std::optional<NarrowBand> nb;
+    size_t next = 0, aligned = 0;
+    const char *stop_by = "coarse";
+    while (next < order.size()) {
+        const double bound = kth(), coarse_bound = M.prune_ratio * kth_coarse();
+        std::vector<int> wave;
+        while (next < order.size() && wave.size() < kWave) {
+            const int i = order[next];
+            if (aligned >= M.max_align) { stop_by = "budget"; break; }
+            if (res[i].coarse_chamfer > coarse_bound) break;   // 粗 chamfer 升序：其后全部剪掉
+            wave.push_back(i);
+            ++aligned; ++next;
+        }
+        if (wave.empty()) break;
+        for (int i : wave) cands[i]->to_device(P.device);
+
+        parallel_for((int)wave.size(), [&](int j) {
+            const int i = wave[j];
+            MatchResult &r = res[i];
+            BatchOut &o = r.result;
+            ProfileScope ps(P.profile ? &o.prof : nullptr);
+            try {
+                const PreparedMesh &S = *cands[i];
+                RegLevel scratch;
+                r.stage = 3;
+                o.align = align_dual(level_or_make(S, P.voxel, P.fpfh_radius, scratch, P.device), *S.chamfer_pts,
+                                     *S.chamfer_kd, tgt, P.icp_thr);
+                if (o.align.chamfer >= bound) { r.cut_by = "bound"; return; }   // 进不了 top-K，不查余量
+                r.stage = 4;
+                check_aligned(ClearanceScene::of(cands[i]), tgt, P, o);
+                if (!o.pass) r.cut_by = "clearance";
+            } catch (const std::exception &e) {
+                o.error = e.what();
+            }
+        });
+
+        // 5 形式复核：只查能进入当前 top-K 的通过者；窄带首次需要时才建
+        std::vector<int> passed;
+        for (int i : wave)
+            if (res[i].result.error.empty() && res[i].result.pass) passed.push_back(i);
+        std::sort(passed.begin(), passed.end(),
+                  [&](int a, int b) { return res[a].result.align.chamfer < res[b].result.align.chamfer; });
+        for (int i : passed) {
+            MatchResult &r = res[i];
+            if (r.result.align.chamfer >= kth()) { r.cut_by = "rank"; continue; }
+            if (M.formal) {
+                ProfileScope ps(P.profile ? &r.result.prof : nullptr);
+                try {
+                    if (!nb) nb = build_narrow_band(mT, M.formal_voxel, M.formal_band);
+                    r.stage = 5;
+                    r.formal = formal_check_band(ClearanceScene::of(cands[i]).at(r.result.align.T), *nb,
+                                                 M.clearance, 0);
+                    r.has_formal = true;
+                } catch (const std::exception &e) {
+                    r.result.error = e.what();
+                    continue;
+                }
+                if (!r.formal.pass) { r.cut_by = "formal"; continue; }
+            }
+            top.emplace_back(r.result.align.chamfer, i);
+            std::sort(top.begin(), top.end());
+            if (top.size() > K) { res[top.back().second].cut_by = "rank"; top.pop_back(); }
+        }
+    }
+    for (; next < order.size(); ++next) res[order[next]].cut_by = stop_by;
+    for (size_t k = 0; k < top.size(); ++k) res[top[k].second].rank = (int)k;
+
+    // 入选者按名次在前；其余无错误的在前，再按到达级数降序、chamfer、粗 chamfer
+    std::stable_sort(res.begin(), res.end(), [](const MatchResult &x, const MatchResult &y) {
+        if ((x.rank >= 0) != (y.rank >= 0)) return x.rank >= 0;
+        if (x.rank >= 0) return x.rank < y.rank;
+        const bool ex = !x.result.error.empty(), ey = !y.result.error.empty();
+        if (ex != ey) return ey;
+        if (x.stage != y.stage) return x.stage > y.stage;
+        if (x.result.align.chamfer != y.result.align.chamfer) return x.result.align.chamfer < y.result.align.chamfer;
+        return x.coarse_chamfer < y.coarse_chamfer;
+    });
+    return res;
+}
+
+}  // namespace shoematch
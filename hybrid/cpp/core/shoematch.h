@@ -0,0 +1,1294 @@
+// shoematch.h - 鞋楦匹配 C++ 核心（不依赖 Python）
+// cppcore（pybind11 绑定）、cli/ 下的 shoematch 与 bench/ 下的原生基准都链接 libshoematch；
+// 这里只放纯 C++ 的结构与内核，结果为类型化结构（AlignResult / ClearanceResult / Region / MatchResult），
+// numpy 视图、dict 转换与 GIL 处理留在 bindings.cpp。
+// 依赖：Open3D >= 0.18, Eigen3
+
+#pragma once
+
+#include <open3d/Open3D.h>
+#include <open3d/t/geometry/TriangleMesh.h>
+#include <open3d/t/geometry/RaycastingScene.h>
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace shoematch {
+
+using namespace open3d;
+
+// ----------------------------- 性能计数 -----------------------------
+// 分阶段耗时与调用次数：每个结果可带一份 Profile（线程局部指针指向它，可空），
+// 同时无条件累加进进程级原子汇总（cppcore.stats()）。计时粒度是整段库调用（毫秒级），
+// 两次 steady_clock 读数加几次 relaxed 原子加，相对开销可忽略。
+
+enum class Stage : int { Ingest, Sample, Downsample, Normals, FPFH, RANSAC, ICP, Chamfer, BVH, SDF, kCount };
+constexpr int kStages = (int)Stage::kCount;
+inline constexpr const char *kStageNames[kStages] = {"ingest", "sample", "downsample", "normals", "fpfh",
+                                                     "ransac", "icp", "chamfer", "bvh", "sdf"};
+
+struct Profile {
+    std::array<double, kStages> sec{};
+    std::array<uint64_t, kStages> calls{};
+    uint64_t sdf_points{0};
+    uint64_t ransac_corr{0};                  // RANSAC 内点对应数（累计）
+    uint64_t icp_iterations{0};               // 仅张量 ICP 报告迭代数；legacy ICP 不暴露
+    double ransac_fitness{0}, icp_fitness{0}, icp_rmse{0};   // 最近一次
+
+    void merge(const Profile &o) {
+        for (int i = 0; i < kStages; ++i) { sec[i] += o.sec[i]; calls[i] += o.calls[i]; }
+        sdf_points += o.sdf_points; ransac_corr += o.ransac_corr; icp_iterations += o.icp_iterations;
+        if (o.calls[(int)Stage::RANSAC]) ransac_fitness = o.ransac_fitness;
+        if (o.calls[(int)Stage::ICP]) { icp_fitness = o.icp_fitness; icp_rmse = o.icp_rmse; }
+    }
+};
+
+struct GlobalStats {
+    std::array<std::atomic<uint64_t>, kStages> ns{}, calls{};
+    std::atomic<uint64_t> sdf_points{0}, ransac_corr{0}, icp_iterations{0};
+    std::atomic<uint64_t> scratch_misses{0};   // Scratch 取用时空闲表为空、新建缓冲的次数
+    std::atomic<int64_t> scratch_bytes{0};     // 各线程空闲表当前保留的容量（字节，不随 reset 清零）
+};
+extern GlobalStats g_stats;
+extern thread_local Profile *tl_profile;
+
+// 把当前线程的计数指向 p（可空），析构时恢复
+struct ProfileScope {
+    Profile *prev;
+    explicit ProfileScope(Profile *p) : prev(tl_profile) { tl_profile = p; }
+    ~ProfileScope() { tl_profile = prev; }
+};
+
+struct StageTimer {
+    Stage stage;
+    std::chrono::steady_clock::time_point t0{std::chrono::steady_clock::now()};
+    explicit StageTimer(Stage s) : stage(s) {}
+    ~StageTimer() {
+        const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - t0).count();
+        const int i = (int)stage;
+        g_stats.ns[i].fetch_add((uint64_t)ns, std::memory_order_relaxed);
+        g_stats.calls[i].fetch_add(1, std::memory_order_relaxed);
+        if (tl_profile) { tl_profile->sec[i] += ns * 1e-9; tl_profile->calls[i]++; }
+    }
+};
+
+void count_sdf_points(size_t n);
+
+void reset_global_stats();
+
+// ----------------------------- 工作窃取任务池 -----------------------------
+// 全进程一个线程池，线程数即全局线程预算（含等待中的调用线程）。每个工作线程一个双端队列：
+// 本线程从队尾（LIFO）取，空闲时从其它队列队首（FIFO）偷。任务执行期间 OpenMP 线程数临时为 1、
+// RaycastingScene 查询单线程，Open3D 内部并行不再与任务层叠加。候选 × 镜像 × 尺度配准、余量分块、
+// FPFH 分块都提交到同一个池，等待者边等边执行本组尚未开始的任务，尾延迟由最慢的子任务而不是最慢的候选决定。
+
+class TaskPool {
+public:
+    using Task = std::function<void()>;   // 不得抛异常（TaskGroup 会包一层）
+
+    explicit TaskPool(int threads);       // threads 含调用线程：工作线程 threads - 1 个
+    ~TaskPool();
+    TaskPool(const TaskPool &) = delete;
+    TaskPool &operator=(const TaskPool &) = delete;
+
+    int threads() const { return (int)workers_.size() + 1; }
+    void submit(Task t);                  // 工作线程提交到自己的队列，外部线程轮流投递
+
+private:
+    struct Queue {
+        std::mutex m;
+        std::deque<Task> q;
+    };
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::mutex sleep_m_;
+    std::condition_variable cv_;
+    std::atomic<size_t> queued_{0}, rr_{0};
+    bool stop_{false};
+
+    bool pop(Task &t);
+    void worker(size_t self);
+};
+
+// 全局线程预算：重建任务池并设 OpenMP 默认线程数（池外的数据并行内核用）。n <= 0 取进程启动时的
+// omp_get_max_threads()（受 OMP_NUM_THREADS 约束）。线程数不变时为空操作；不能在任务内调用。
+// 只在启动时或经 cppcore.set_thread_budget 设置一次，各入口的 threads 参数不改池（见 CapScope）
+void set_thread_budget(int n);
+int thread_budget();
+std::shared_ptr<TaskPool> task_pool();
+
+bool in_task();           // 当前线程正在执行池任务
+bool tasks_available();   // 池多于 1 线程且不在 OpenMP 并行区内
+
+// 单次调用的并发上限：该调用（含其全部子任务）同时占用的线程不超过 limit，全局池不变。
+// TaskGroup::run 提交前领一个名额，领不到就在当前线程直接执行；名额随 TaskGroup 带进子任务，
+// 嵌套的 parallel_for / TaskGroup 共用同一上限
+struct ThreadCap {
+    int limit;
+    std::atomic<int> active{1};   // 含发起调用的线程
+    explicit ThreadCap(int n) : limit(std::max(1, n)) {}
+    bool try_acquire() {
+        int a = active.load(std::memory_order_relaxed);
+        while (a < limit && !active.compare_exchange_weak(a, a + 1, std::memory_order_relaxed)) {}
+        return a < limit;
+    }
+    void release() { active.fetch_sub(1, std::memory_order_relaxed); }
+};
+extern thread_local ThreadCap *tl_cap;
+
+// threads > 0 时为本线程之后的并行工作设上限（外层已有上限时沿用外层），同时把本线程的 OpenMP
+// 线程数降到上限；threads <= 0 为空操作（用满全局预算）。析构时恢复
+class CapScope {
+public:
+    explicit CapScope(int threads);
+    ~CapScope();
+    CapScope(const CapScope &) = delete;
+    CapScope &operator=(const CapScope &) = delete;
+
+private:
+    std::unique_ptr<ThreadCap> cap_;
+    ThreadCap *prev_{tl_cap};
+    int prev_omp_{0};
+};
+
+// 当前调用可用的线程数：min(上限, 全局预算)
+int thread_cap();
+
+// 协作式取消：作业把取消标志挂到线程局部，TaskGroup 带进子任务；checkpoint() 见到已取消即抛 Cancelled。
+// 检查点在 RANSAC / ICP / Chamfer 之间、逐层 ICP、nn_sum 分块与 SDF 查询分块处（Open3D 单次调用内部不可中断）
+struct Cancelled : std::runtime_error {
+    Cancelled() : std::runtime_error("cancelled") {}
+};
+extern thread_local const std::atomic<bool> *tl_cancel;
+
+inline void checkpoint() {
+    if (tl_cancel && tl_cancel->load(std::memory_order_relaxed)) throw Cancelled();
+}
+
+struct CancelScope {
+    const std::atomic<bool> *prev;
+    explicit CancelScope(const std::atomic<bool> *c) : prev(tl_cancel) { tl_cancel = c; }
+    ~CancelScope() { tl_cancel = prev; }
+};
+
+// fork-join 任务组：run 提交，wait 帮忙执行直到全部完成，再重抛第一个异常。
+// 任务先进本组队列，池里只放取任务的票据：wait 只在当前线程执行本组尚未开始的任务（不接手别的组的长任务），
+// 其余都在别的线程上执行时睡在条件变量上，由最后完成的任务唤醒，不空转。
+// 提交线程带 Profile 时每个任务记到独立槽位，wait 后在提交线程并入，不跨线程写同一份 Profile。
+// 在 CapScope 内时，名额用完的 run 直接在当前线程执行
+class TaskGroup {
+public:
+    explicit TaskGroup(std::shared_ptr<TaskPool> p = task_pool())
+        : pool_(std::move(p)), s_(std::make_shared<Shared>()) {}
+    ~TaskGroup();   // 未 wait 时等待（丢弃异常）
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    void run(std::function<void()> f);
+    void wait();
+
+private:
+    // 票据持有共享状态：组已析构时残留的票据只会发现队列已空
+    struct Shared {
+        std::mutex m;
+        std::condition_variable cv;
+        std::deque<TaskPool::Task> queue;   // 已提交、尚未开始
+        size_t pending{0};                  // 排队 + 执行中
+        int sleepers{0};
+        std::deque<Profile> slots;
+        std::exception_ptr err;
+
+        void fail(std::exception_ptr e);   // 只留第一个异常
+        void finish();                     // 一个任务完成；最后一个唤醒等待者
+    };
+
+    std::shared_ptr<TaskPool> pool_;
+    Profile *owner_{tl_profile};
+    const std::atomic<bool> *cancel_{tl_cancel};
+    ThreadCap *cap_{tl_cap};
+    std::shared_ptr<Shared> s_;
+};
+
+// [0, n) 每 grain 个下标一个任务；池不可用或只有一组时在当前线程串行
+template <class F>
+void parallel_for(int n, F &&f, int grain = 1) {
+    grain = std::max(1, grain);
+    if (n <= grain || !tasks_available()) {
+        for (int i = 0; i < n; ++i) f(i);
+        return;
+    }
+    TaskGroup g;
+    for (int b = 0; b < n; b += grain) {
+        const int e = std::min(n, b + grain);
+        g.run([&f, b, e] { for (int i = b; i < e; ++i) f(i); });
+    }
+    g.wait();
+}
+
+// ----------------------------- 线程局部暂存 -----------------------------
+// 每线程按类型一张空闲表：Scratch<T> 构造时取出一个缓冲（内容已清空、容量保留），析构时还回本线程。
+// TaskGroup::wait 会在等待线程上执行别的任务，嵌套取用拿到的是另一个缓冲，借出期间跨越 wait 也安全。
+// 稳态下候选之间不再分配；每线程每类型最多留 kKeep 个、单个超过 kKeepBytes 的直接释放，
+// 常驻上限约为 线程数 × 类型数 × kKeep × kKeepBytes，实际值见 g_stats.scratch_bytes
+
+template <class T> inline size_t scratch_capacity(const std::vector<T> &v) { return v.capacity() * sizeof(T); }
+inline size_t scratch_capacity(const geometry::PointCloud &p) {
+    return (p.points_.capacity() + p.normals_.capacity() + p.colors_.capacity()) * sizeof(Eigen::Vector3d);
+}
+template <class T> inline void scratch_clear(std::vector<T> &v) { v.clear(); }
+inline void scratch_clear(geometry::PointCloud &p) { p.Clear(); }
+
+template <class T>
+class Scratch {
+public:
+    static constexpr size_t kKeep = 4, kKeepBytes = size_t(256) << 20;
+
+    Scratch() {
+        auto &fl = free_list().v;
+        if (fl.empty()) {
+            buf_ = std::make_unique<T>();
+            g_stats.scratch_misses.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            buf_ = std::move(fl.back());
+            fl.pop_back();
+            g_stats.scratch_bytes.fetch_sub((int64_t)scratch_capacity(*buf_), std::memory_order_relaxed);
+        }
+    }
+    ~Scratch() {
+        auto &fl = free_list().v;
+        const size_t bytes = scratch_capacity(*buf_);
+        if (fl.size() >= kKeep || bytes > kKeepBytes) return;
+        scratch_clear(*buf_);
+        g_stats.scratch_bytes.fetch_add((int64_t)bytes, std::memory_order_relaxed);
+        fl.push_back(std::move(buf_));
+    }
+    Scratch(const Scratch &) = delete;
+    Scratch &operator=(const Scratch &) = delete;
+
+    T &operator*() { return *buf_; }
+    T *operator->() { return buf_.get(); }
+
+private:
+    // 元素用 unique_ptr 保存：PointCloud 声明了析构函数没有移动构造，按值移动会退化成拷贝
+    struct FreeList {
+        std::vector<std::unique_ptr<T>> v;
+        ~FreeList() {
+            for (const auto &b : v)
+                g_stats.scratch_bytes.fetch_sub((int64_t)scratch_capacity(*b), std::memory_order_relaxed);
+        }
+    };
+    static FreeList &free_list() {
+        thread_local FreeList fl;
+        return fl;
+    }
+    std::unique_ptr<T> buf_;
+};
+
+// ----------------------------- SIMD 内核 -----------------------------
+// 余量后处理与粗特征的逐元素热循环，按块调用：x86-64 上运行时按 CPU 选 AVX-512 / AVX2（GCC/Clang target
+// 属性，同一翻译单元，不要求 -march），aarch64 用 NEON，其余走标量。坐标与变换保持 double、最后一步转 float32
+// 写进查询张量（Open3D 要求 {n, 3} 交织）；SDF 结果与余量样本是连续 float32 数组（SoA）。
+// 各实现只在求和顺序与 FMA 收缩上不同，计数、分箱与比较结果一致。
+
+namespace simd {
+
+enum class Isa : int { Scalar, Neon, Avx2, Avx512 };
+
+Isa isa();                     // 当前生效的实现（首次调用时按 CPU 与环境变量 SHOEMATCH_SIMD 选定）
+const char *isa_name(Isa i);   // "scalar" / "neon" / "avx2" / "avx512"
+// 指定实现（基准对比与排查用）；"" / "auto" 恢复自动选择，CPU 或构建不支持时抛 runtime_error
+void set_isa(const std::string &name);
+
+void affine_rows(const Eigen::Matrix4d &T, double M[12]);   // 取 T 的上 3 行（行主序 3x4）
+
+// p 为 n 个连续 double xyz（std::vector<Eigen::Vector3d> 的存储），M 为行主序 3x4 仿射（空 = 恒等），out 写 3n 个 float
+void pack_xyz(const double *p, size_t n, const double *M, float *out);
+
+// 线性体素索引 (ix * NY + iy) * NZ + iz -> 体素中心 o + (i + 0.5) * voxel，再经 M（可空）写成 float xyz
+void grid_centers(const uint32_t *cells, size_t n, const double o[3], double voxel, int64_t NY, int64_t NZ,
+                  const double *M, float *out);
+
+// SDF 结果的内部侧：sd < 0（closed 时 sd <= 0）的个数，及 -sd 的最小值（无内部点为 +inf）与和
+struct Inside {
+    float min{std::numeric_limits<float>::infinity()};
+    double sum{0};
+    size_t n{0};
+};
+Inside inside(const float *sd, size_t n, bool closed = false);
+
+// sd < 0 的 -sd 按原顺序写入 out（容量 >= n），返回个数
+size_t compact_inside(const float *sd, size_t n, float *out);
+
+// mn / sum 在原值上累积（sum 为 double）
+void min_sum(const float *v, size_t n, float &mn, double &sum);
+
+// v >= 0 等宽分箱累加进 hist：箱号 min(bins - 1, floor(v / w))，w <= 0 时全部落入最后一箱
+void histogram(const float *v, size_t n, double w, int bins, uint32_t *hist);
+
+// out[i] = N · p[i]（p 布局同 pack_xyz）
+void plane_dot(const double *p, size_t n, const double N[3], double *out);
+
+// 平面分类：三角形顶点符号距离的 [min, max] 落在升序偏移 D[0, K) 的哪段，
+// kb = #{D <= min}，ke = #{D <= max}（即 upper_bound），三角形与 D[kb, ke) 的平面相交
+void plane_span(const double *sv, const int *tri, size_t nF, const double *D, int K, int *kb, int *ke);
+
+// 粗特征的三角形遍历 [b, e)：X / Y / Z 为 SoA 顶点，area[t - b] 写面积，bin[t - b] 写法向方向箱（退化为 -1），
+// acc 累加 {6 × 有向体积, 面积, ∫x, ∫y, ∫z, ∫xx, ∫xy, ∫xz, ∫yy, ∫yz, ∫zz}（面积分）
+void tri_moments(const double *X, const double *Y, const double *Z, const int *tri, int64_t b, int64_t e,
+                 double *area, int *bin, double acc[11]);
+
+}  // namespace simd
+
+// ----------------------------- 工具函数 -----------------------------
+
+void clean_mesh(geometry::TriangleMesh &m);
+
+std::shared_ptr<geometry::PointCloud>
+sample_pcd(geometry::TriangleMesh &m, size_t n);
+
+std::shared_ptr<geometry::PointCloud> downsample(const geometry::PointCloud &p, double voxel);
+
+void est_normals(geometry::PointCloud &pcd, double radius);
+
+std::shared_ptr<pipelines::registration::Feature>
+fpfh(const geometry::PointCloud &pcd, double radius);
+
+// 已有法向与 FPFH 时直接做 RANSAC（预处理缓存路径）
+Eigen::Matrix4d ransac_fpfh(const geometry::PointCloud &src, const geometry::PointCloud &tgt,
+                            const pipelines::registration::Feature &fsrc,
+                            const pipelines::registration::Feature &ftgt, double voxel);
+
+Eigen::Matrix4d ransac(geometry::PointCloud &src, geometry::PointCloud &tgt,
+                       double radius, double voxel);
+
+// tgt 需已带法向（thr 半径估计）
+Eigen::Matrix4d icp_p2l(const geometry::PointCloud &src, const geometry::PointCloud &tgt,
+                        const Eigen::Matrix4d &init, double thr);
+
+Eigen::Matrix4d icp(geometry::PointCloud &src, geometry::PointCloud &tgt,
+                    const Eigen::Matrix4d &init, double thr);
+
+// 计算设备："CPU:0" / "CUDA:0"…；以 HYBRID_WITH_CUDA 编译且运行时有 GPU 时返回 CUDA，否则回退 CPU。
+// 只有 ICP 走设备（张量 ICP）；Open3D 0.18 的 RaycastingScene 只有 CPU（Embree）实现，余量查询仍在 CPU
+core::Device resolve_device(const std::string &device);
+
+std::shared_ptr<t::geometry::PointCloud> pcd_to_device(const geometry::PointCloud &p, const core::Device &d);
+
+// 张量版点到面 ICP（tgt 需带法向），与 icp_p2l 收敛条件一致
+Eigen::Matrix4d icp_p2l_dev(const t::geometry::PointCloud &src, const t::geometry::PointCloud &tgt,
+                            const Eigen::Matrix4d &init, double thr);
+
+// OpenMP 并行区内或正在执行池任务：内层不再开 OpenMP 并行
+bool in_parallel_region();
+
+// 单向最近距离之和：q 经 G（相似变换）映射后在 kd 上查询，距离乘 dscale（G 含缩放时用）。
+// 按块并行累加；部分和超过 stop 即返回（调用方据此判定结果已不可能优于当前最佳）
+double nn_sum(const std::vector<Eigen::Vector3d> &q, const Eigen::Matrix4d &G,
+              const geometry::KDTreeFlann &kd, double dscale = 1.0,
+              double stop = std::numeric_limits<double>::infinity());
+
+// 对称 Chamfer。A 在自身局部坐标系（kda 为其 KD 树），G 把 A 映射到 B 所在坐标系（刚体或等比相似）；
+// 两侧 KD 树都由调用方缓存，B→A 方向把 B 用 G⁻¹ 变回 A 的坐标系查询。
+// best 有限时为截断模式：部分和一旦使均值必然超过 best 就返回 +inf
+double chamfer(const geometry::PointCloud &A, const geometry::KDTreeFlann &kda,
+               const geometry::PointCloud &B, const geometry::KDTreeFlann &kdb,
+               const Eigen::Matrix4d &G = Eigen::Matrix4d::Identity(),
+               double best = std::numeric_limits<double>::infinity());
+
+double chamfer(const geometry::PointCloud &A, const geometry::PointCloud &B);
+
+// YZ 平面镜像（x -> -x）
+const Eigen::Matrix4d &mirror_yz();
+
+// RaycastingScene 首次查询时才 commit（非线程安全），共享前先用一次空查询强制 commit
+void commit_scene(t::geometry::RaycastingScene &scene);
+
+void scene_add_legacy(t::geometry::RaycastingScene &scene, const geometry::TriangleMesh &m);
+
+// 块式场景查询骨架：查询张量借用线程暂存（非拥有的 Blob 包装），块间 checkpoint()。
+// fill(b, m, q) 写 m 个 float32 查询点，query(b, m, Q, nthreads) 对该块调用场景查询
+template <class Fill, class Query>
+void scene_query_blocks(size_t begin, size_t end, Fill &&fill, Query &&query, int nthreads, size_t chunk) {
+    if (end <= begin) return;
+    if (nthreads == 0 && in_parallel_region()) nthreads = 1;   // 外层已并行（OpenMP 或池任务）
+    StageTimer st(Stage::SDF);
+    count_sdf_points(end - begin);
+    // 查询张量不每次调用新分配（结果张量仍由 Open3D 分配）
+    Scratch<std::vector<float>> qbuf;
+    qbuf->resize(3 * std::min(chunk, end - begin));
+    auto blob = std::make_shared<core::Blob>(core::Device("CPU:0"), qbuf->data(), [](void *) {});
+    for (size_t b = begin; b < end; b += chunk) {
+        const size_t m = std::min(chunk, end - b);
+        const core::Tensor Q({(int64_t)m, 3}, {3, 1}, qbuf->data(), core::Float32, blob);
+        checkpoint();
+        fill(b, m, qbuf->data());
+        query(b, m, Q, nthreads);
+    }
+}
+
+// 融合 clearance 查询：ComputeSignedDistance 内部已做 inside 判定（符号即占据，负为内部），
+// 不再额外调用 ComputeOccupancy。块式接口：fill(b, m, q) 写 m 个查询点，sink(b, m, sd) 收 m 个结果
+// （sd 可原地改写），分块复用同一查询张量，调用方用 simd:: 内核在线归约或写入预分配缓冲
+template <class Fill, class Sink>
+void sdf_query_blocks(t::geometry::RaycastingScene &scene, size_t begin, size_t end,
+                      Fill &&fill, Sink &&sink, int nthreads = 0, size_t chunk = size_t(1) << 20) {
+    scene_query_blocks(begin, end, fill, [&](size_t b, size_t m, const core::Tensor &Q, int nt) {
+        auto sdist = scene.ComputeSignedDistance(Q, nt);
+        sink(b, m, sdist.GetDataPtr<float>());
+    }, nthreads, chunk);
+}
+
+// 逐点版：fill(i, xyz) 写一个查询点，sink(i, sd) 收一个结果
+template <class Fill, class Sink>
+void sdf_query(t::geometry::RaycastingScene &scene, size_t begin, size_t end,
+               Fill &&fill, Sink &&sink, int nthreads = 0, size_t chunk = size_t(1) << 20) {
+    sdf_query_blocks(scene, begin, end,
+                     [&](size_t b, size_t m, float *q) { for (size_t k = 0; k < m; ++k) fill(b + k, q + 3 * k); },
+                     [&](size_t b, size_t m, float *sd) { for (size_t k = 0; k < m; ++k) sink(b + k, sd[k]); },
+                     nthreads, chunk);
+}
+
+// 点集经 Tinv 变换后查询（Tinv 为单位阵时即世界坐标）；打包走 simd::pack_xyz
+template <class Sink>
+void sdf_query_points_blocks(t::geometry::RaycastingScene &scene, const std::vector<Eigen::Vector3d> &pts,
+                             const Eigen::Matrix4d &Tinv, size_t begin, size_t end, Sink &&sink) {
+    double M[12];
+    simd::affine_rows(Tinv, M);
+    const double *A = Tinv.isIdentity(0.0) ? nullptr : M;
+    sdf_query_blocks(scene, begin, end,
+                     [&](size_t b, size_t m, float *q) { simd::pack_xyz(pts[b].data(), m, A, q); }, sink);
+}
+
+template <class Sink>
+void sdf_query_points(t::geometry::RaycastingScene &scene, const std::vector<Eigen::Vector3d> &pts,
+                      const Eigen::Matrix4d &Tinv, size_t begin, size_t end, Sink &&sink) {
+    sdf_query_points_blocks(scene, pts, Tinv, begin, end,
+                            [&](size_t b, size_t m, float *sd) { for (size_t k = 0; k < m; ++k) sink(b + k, sd[k]); });
+}
+
+// ----------------------------- 粗特征 -----------------------------
+
+struct CoarseFeat {
+    static constexpr int kHistDim = 8 * 16, kD2Bins = 32, kWidthBins = 16;
+
+    double volume{0};
+    double area{0};
+    Eigen::Vector3d extents{0, 0, 0};
+    std::vector<float> hist;               // 8 x 16 方向直方图（面积加权）
+    Eigen::Vector3d pca_extents{0, 0, 0};  // 主轴坐标系下的尺寸（降序，与姿态无关）
+    std::vector<float> d2;                 // D2 形状分布：表面点对距离 / 包围盒对角线
+    std::vector<float> width;              // 沿主轴各截面的次轴宽度（mm），按主轴偏度定向
+};
+
+// 一次融合的并行面遍历（SoA 坐标）：体积、面积、面积加权法向直方图与表面一、二阶矩；
+// 再由表面协方差得主轴，两次顶点遍历求 PCA 尺寸与截面宽度，D2 由固定种子的面积加权采样点对得到。
+CoarseFeat coarse_features_from_mesh(const geometry::TriangleMesh &m);
+
+// ----------------------------- 预处理候选缓存 -----------------------------
+// 候选库几乎不变：清理后的网格、各体素尺寸下的下采样点云/法向/FPFH（原始与镜像）、
+// Chamfer 采样点与粗特征一次算好并落盘；BVH（RaycastingScene）在局部坐标系懒构建。
+
+struct RegLevel {
+    double voxel{0};
+    double fpfh_radius{0};
+    std::shared_ptr<geometry::PointCloud> down;          // 下采样 + 法向（fpfh_radius）
+    std::shared_ptr<geometry::PointCloud> down_mirror;   // YZ 镜像（不落盘，由 down 导出）
+    std::shared_ptr<pipelines::registration::Feature> fpfh;
+    std::shared_ptr<pipelines::registration::Feature> fpfh_mirror;
+    std::shared_ptr<t::geometry::PointCloud> down_dev, down_mirror_dev;   // 设备常驻副本（可空，不落盘）
+};
+
+void level_to_device(RegLevel &L, const core::Device &d);
+
+// 镜像分支：点与法向直接反射（Transform 同时变换法向），FPFH 重排，不重新采样/估计
+void mirror_level(RegLevel &L);
+
+// base 为已采样的表面点（多分辨率时各层共用一次采样）
+RegLevel make_level_from(const geometry::PointCloud &base, double voxel, double radius);
+
+RegLevel make_level(geometry::TriangleMesh &m, double voxel, double radius);
+
+// .slpm 容器（v3，小端，见 shoematch.cpp「磁盘格式」）：段表 + 64 字节对齐的平铺数组，每段带内容哈希。
+// load 只 mmap 文件并按段表定位（只读共享映射，同一节点上多进程共用页缓存）：
+// 顶点（float32 AoS）与面（uint32）留在映射里，BVH 直接由映射建；各层点云 / FPFH 与 Chamfer 采样
+// 点按段 memcpy 进 Open3D 容器；legacy 网格只在需要时（缺层重采样、导出）才展开。
+struct MappedFile;
+
+struct PreparedMesh {
+    std::shared_ptr<geometry::PointCloud> chamfer_pts;    // Chamfer 用表面采样
+    std::shared_ptr<geometry::KDTreeFlann> chamfer_kd;    // chamfer_pts 上的 KD 树（不落盘）
+    std::vector<RegLevel> levels;
+    CoarseFeat feat;
+    size_t chamfer_samples{0};
+    uint64_t mesh_hash{0};     // 落盘网格（float32 顶点 + uint32 面）的内容哈希
+    uint64_t params_hash{0};   // 预处理参数（levels、chamfer_samples、格式版本）的哈希
+
+    PreparedMesh() = default;
+    explicit PreparedMesh(std::shared_ptr<geometry::TriangleMesh> m) : mesh_(std::move(m)) {}
+
+    // 清理后的网格（局部坐标系）；映射加载的对象首次调用时由映射展开
+    const std::shared_ptr<geometry::TriangleMesh> &mesh_ptr() const;
+    geometry::TriangleMesh &mesh() const { return *mesh_ptr(); }
+    size_t num_vertices() const;
+    size_t num_triangles() const;
+
+    const RegLevel *find_level(double voxel, double radius) const {
+        for (const auto &L : levels)
+            if (std::abs(L.voxel - voxel) <= 1e-9 * std::max(1.0, voxel) &&
+                std::abs(L.fpfh_radius - radius) <= 1e-9 * std::max(1.0, radius)) return &L;
+        return nullptr;
+    }
+
+    // 局部坐标系下的 BVH；带变换的查询经 ClearanceScene::of(pm).at(T)
+    t::geometry::RaycastingScene &scene() const;
+
+    // 各层点云上传到设备并常驻，跨查询复用；应在查询之前调用（同一对象不要与其它设备上的查询并发）
+    void to_device(const core::Device &d) {
+        std::lock_guard<std::mutex> lk(dev_mu_);
+        for (auto &L : levels) level_to_device(L, d);
+    }
+
+    void save(const std::string &path) const;
+    // verify=true 时逐段校验内容哈希（会读入全部页）；否则只校验头与段表
+    static std::shared_ptr<PreparedMesh> load(const std::string &path, bool verify = false);
+
+    // 与落盘口径一致的哈希：build_library 据此判断已有的 .slpm 是否仍然有效
+    static uint64_t hash_mesh(const geometry::TriangleMesh &m);
+    static uint64_t hash_params(const std::vector<std::pair<double, double>> &levels, size_t chamfer_samples);
+    // 只读头部取 (mesh_hash, params_hash)；不是 v3 容器时返回 false
+    static bool read_hashes(const std::string &path, uint64_t &mesh_hash, uint64_t &params_hash);
+
+private:
+    struct MeshView {
+        const float *V{nullptr};
+        const uint32_t *F{nullptr};
+        size_t nV{0}, nF{0};
+    };
+
+    mutable std::shared_ptr<geometry::TriangleMesh> mesh_;
+    mutable std::once_flag mesh_once_;
+    std::shared_ptr<const MappedFile> map_;   // 非空时 view_ 指向映射内
+    MeshView view_;
+    std::mutex dev_mu_;
+    mutable std::once_flag scene_once_;
+    mutable std::shared_ptr<t::geometry::RaycastingScene> scene_;
+};
+
+std::shared_ptr<PreparedMesh>
+prepare_from_mesh(std::shared_ptr<geometry::TriangleMesh> m,
+                  const std::vector<std::pair<double, double>> &levels, size_t chamfer_samples);
+
+// ----------------------------- 粗特征索引 -----------------------------
+// 全库 CoarseFeat 按列（SoA）存放，查询时顺序扫描：先做可行性（排序后 extents 包络
+// 目标 + 2·clearance，体积不小于 Steiner 下界，可选截面宽度缺口上限），再按 extents 余量
+// + 直方图 / D2 L1 距离 + 截面宽度缺口排序取 top-K，这样只有少数候选需要加载网格。
+
+struct FeatureIndex {
+    static constexpr int kHistDim = CoarseFeat::kHistDim;
+    static constexpr int kD2Dim = CoarseFeat::kD2Bins, kWidthDim = CoarseFeat::kWidthBins;
+
+    std::vector<std::string> ids;
+    std::vector<double> volume, area;
+    std::vector<float> e0, e1, e2;   // 降序 extents（与坐标轴朝向无关）
+    std::vector<float> hist;         // N x kHistDim 连续
+    std::vector<float> d2;           // N x kD2Dim
+    std::vector<float> width;        // N x kWidthDim
+
+    struct Hit { size_t idx; double score; };
+
+    size_t size() const { return ids.size(); }
+
+    void add(const std::string &id, const CoarseFeat &f) {
+        if (f.hist.size() != (size_t)kHistDim || f.d2.size() != (size_t)kD2Dim || f.width.size() != (size_t)kWidthDim)
+            throw std::runtime_error("FeatureIndex: unexpected descriptor size");
+        Eigen::Vector3d e = sorted_extents(f);
+        ids.push_back(id); volume.push_back(f.volume); area.push_back(f.area);
+        e0.push_back((float)e[0]); e1.push_back((float)e[1]); e2.push_back((float)e[2]);
+        hist.insert(hist.end(), f.hist.begin(), f.hist.end());
+        d2.insert(d2.end(), f.d2.begin(), f.d2.end());
+        width.insert(width.end(), f.width.begin(), f.width.end());
+    }
+
+    // 复制另一索引的第 k 条（合并索引用）
+    void append(const FeatureIndex &o, size_t k) {
+        ids.push_back(o.ids[k]); volume.push_back(o.volume[k]); area.push_back(o.area[k]);
+        e0.push_back(o.e0[k]); e1.push_back(o.e1[k]); e2.push_back(o.e2[k]);
+        hist.insert(hist.end(), o.hist.begin() + k * kHistDim, o.hist.begin() + (k + 1) * kHistDim);
+        d2.insert(d2.end(), o.d2.begin() + k * kD2Dim, o.d2.begin() + (k + 1) * kD2Dim);
+        width.insert(width.end(), o.width.begin() + k * kWidthDim, o.width.begin() + (k + 1) * kWidthDim);
+    }
+
+    // 截面宽度缺口：目标宽度 + 2·clearance 超出候选宽度的部分；主轴定向可能相反，取正反两向较小者。
+    // 返回 (最大缺口 mm, 平均相对缺口)
+    static std::pair<float, float> width_shortfall(const float *tw, const float *cw, float c2) {
+        std::pair<float, float> best{std::numeric_limits<float>::infinity(), 0.f};
+        for (int dir = 0; dir < 2; ++dir) {
+            float mx = 0.f, rel = 0.f; int n = 0;
+            for (int b = 0; b < kWidthDim; ++b) {
+                if (tw[b] <= 0.f) continue;
+                const float need = tw[b] + c2, have = cw[dir ? kWidthDim - 1 - b : b];
+                const float gap = std::max(0.f, need - have);
+                mx = std::max(mx, gap); rel += gap / need; ++n;
+            }
+            if (mx < best.first) best = {mx, n ? rel / n : 0.f};
+        }
+        return best;
+    }
+
+    // score = Σ 相对 extents 余量 + w_hist · L1(hist) + w_d2 · L1(d2) + w_width · 平均相对宽度缺口，越小越贴合
+    std::vector<Hit> query(const CoarseFeat &t, double clearance, size_t k,
+                           double w_hist, double vol_tol, double w_d2 = 0.0, double w_width = 0.0,
+                           double max_width_shortfall = std::numeric_limits<double>::infinity()) const {
+        const Eigen::Vector3d et = sorted_extents(t);
+        const float r0 = float(et[0] + 2 * clearance), r1 = float(et[1] + 2 * clearance), r2 = float(et[2] + 2 * clearance);
+        const double min_vol = (t.volume + t.area * clearance) * (1.0 - vol_tol);
+        const size_t N = size();
+
+        std::vector<double> score(N, std::numeric_limits<double>::infinity());
+        auto row = [&](size_t i) {
+            if (e0[i] < r0 || e1[i] < r1 || e2[i] < r2 || volume[i] < min_vol) return;
+            const auto ws = width_shortfall(t.width.data(), width.data() + (size_t)i * kWidthDim, float(2 * clearance));
+            if (ws.first > max_width_shortfall) return;
+            const float *h = hist.data() + (size_t)i * kHistDim;
+            float l1 = 0.f;
+            for (int j = 0; j < kHistDim; ++j) l1 += std::abs(h[j] - t.hist[j]);
+            const float *g = d2.data() + (size_t)i * kD2Dim;
+            float l1d = 0.f;
+            for (int j = 0; j < kD2Dim; ++j) l1d += std::abs(g[j] - t.d2[j]);
+            score[i] = (e0[i] - r0) / r0 + (e1[i] - r1) / r1 + (e2[i] - r2) / r2 + w_hist * l1
+                     + w_d2 * l1d + w_width * ws.second;
+        };
+        const size_t kBlock = 4096;   // 一块一个池任务；只有一块时串行
+        parallel_for((int)((N + kBlock - 1) / kBlock), [&](int blk) {
+            for (size_t i = blk * kBlock, e = std::min(N, i + kBlock); i < e; ++i) row(i);
+        });
+
+        std::vector<Hit> hits;
+        for (size_t i = 0; i < N; ++i) if (std::isfinite(score[i])) hits.push_back({i, score[i]});
+        auto by_score = [](const Hit &a, const Hit &b) { return a.score < b.score; };
+        if (k > 0 && k < hits.size()) {
+            std::partial_sort(hits.begin(), hits.begin() + k, hits.end(), by_score);
+            hits.resize(k);
+        } else {
+            std::sort(hits.begin(), hits.end(), by_score);
+        }
+        return hits;
+    }
+
+    void save(const std::string &path) const;
+    static std::shared_ptr<FeatureIndex> load(const std::string &path);
+
+private:
+    static Eigen::Vector3d sorted_extents(const CoarseFeat &f) {
+        Eigen::Vector3d e = f.extents;
+        std::sort(e.data(), e.data() + 3, std::greater<double>());
+        return e;
+    }
+};
+
+// ----------------------------- 目标余量采样 -----------------------------
+// 余量采样点决定能否打中薄点。采样自带 RNG（mt19937_64，按 seed 确定，不动 Open3D 全局随机数）：
+//   uniform    ：按权重抽三角形、均匀重心坐标（与 SamplePointsUniformly 同分布）
+//   stratified ：沿权重 CDF 系统抽样（每个三角形恰得 floor / ceil 个期望点数），三角形内用 R2 低差异序列
+//   poisson    ：stratified 过采样 4 倍后做加权样本消除（Yuksel 2015），得到间距近似均匀的蓝噪声点集
+// 三角形权重 = 面积 × (1 + curvature_weight · κ̂)，κ̂ 为边上顶点法向变化率按 95 分位归一化到 [0, 1]，
+// 鞋头 / 鞋跟等高曲率区因此加密。输出顺序经同一 RNG 打乱，clearance_decide 的前 coarse 个点也覆盖全表面。
+
+struct SampleParams {
+    std::string method{"uniform"};   // "uniform" | "stratified" | "poisson"
+    uint64_t seed{0};
+    double curvature_weight{0.0};
+};
+
+std::shared_ptr<geometry::PointCloud> sample_target(const geometry::TriangleMesh &m, size_t n,
+                                                    const SampleParams &P = {});
+
+// 一个目标只生成一次的采样集，跨候选与调用只读复用
+struct TargetSamples {
+    std::shared_ptr<geometry::PointCloud> pts;
+    SampleParams params;
+
+    static TargetSamples build(const geometry::TriangleMesh &m, size_t n, const SampleParams &P = {}) {
+        return TargetSamples{sample_target(m, n, P), P};
+    }
+    size_t size() const { return pts ? pts->points_.size() : 0; }
+};
+
+// ----------------------------- 对齐 -----------------------------
+
+// 目标侧上下文：每次查询只算一次，所有候选线程只读共享
+struct TargetContext {
+    std::shared_ptr<geometry::PointCloud> down;          // 法向 @ fpfh_radius
+    std::shared_ptr<geometry::PointCloud> down_icp;      // 法向 @ icp_thr
+    std::shared_ptr<pipelines::registration::Feature> fpfh;
+    std::shared_ptr<geometry::PointCloud> chamfer_pts;
+    std::shared_ptr<geometry::KDTreeFlann> chamfer_kd;   // chamfer_pts 上的 KD 树
+    std::shared_ptr<geometry::PointCloud> clearance_pts; // 余量采样点（samples == 0 时为空）
+    std::shared_ptr<t::geometry::PointCloud> down_icp_dev; // down_icp 的设备副本（CPU 时为空）
+};
+
+// 配准相关的一层（down / fpfh / down_icp），base 为已采样的表面点
+void target_level(TargetContext &t, const geometry::PointCloud &base, double voxel, double radius,
+                  double icp_thr);
+
+TargetContext make_target_context(geometry::TriangleMesh &mT, double voxel, double radius,
+                                  double icp_thr, size_t samples, const SampleParams &S = {});
+
+void target_to_device(TargetContext &t, const core::Device &d);
+
+struct AlignResult {
+    Eigen::Matrix4d T{Eigen::Matrix4d::Identity()};
+    double chamfer{1e9};
+    bool mirrored{false};
+};
+
+// 源侧 chamfer 点（局部坐标 + KD 树）在变换 G 下与目标的 Chamfer，best 见 chamfer()
+double chamfer_at(const geometry::PointCloud &local, const geometry::KDTreeFlann &kd,
+                  const Eigen::Matrix4d &G, const TargetContext &tgt,
+                  double best = std::numeric_limits<double>::infinity());
+
+// 缓存中没有对应 (voxel, radius) 时现算一层（按 d 上传），放在调用方提供的 scratch 中
+const RegLevel &level_or_make(const PreparedMesh &S, double voxel, double radius, RegLevel &scratch,
+                              const core::Device &d = core::Device("CPU:0"));
+
+// 双假设配准：原始与镜像分支共享源侧下采样/法向/FPFH（镜像由 mirror_level 导出）和目标侧上下文，
+// 各自 RANSAC → ICP → chamfer。不在外层并行区内时，镜像分支放到单独线程与原始分支并发；
+// 后完成的分支以先完成者的 chamfer 为界做截断计算
+AlignResult align_dual(const RegLevel &L, const geometry::PointCloud &chamfer_src,
+                       const geometry::KDTreeFlann &chamfer_kd, const TargetContext &tgt, double icp_thr);
+
+// ----------------------------- 多尺度 / 多起点配准 -----------------------------
+// 源与目标各采样一次，按 param_sets 建多分辨率金字塔（体素从粗到细）。参考尺度（最接近 1）上
+// 每个起点 × 镜像在自己那层做 RANSAC + ICP，粗分数明显差的假设剪掉，其余逐层 ICP 细化到最细层；
+// 其它尺度沿用参考尺度上同镜像的最佳变换，从最粗层逐层 ICP，不再跑 RANSAC。
+
+struct RegParams { double voxel, fpfh_radius, icp_thr; };
+
+struct Hypothesis {
+    double scale{1.0};
+    size_t scale_idx{0};
+    int start{-1};           // 起点（param_sets 下标）；-1 表示沿用参考尺度的结果
+    bool mirrored{false};
+    bool pruned{false};      // 粗层剪枝，或 chamfer 截断（超过 prune_ratio × 本尺度当前最佳）
+    double score{1e9};       // 起点层 ICP 后的单向拟合距离（剪枝用）
+    double chamfer{1e9};
+    Eigen::Matrix4d T{Eigen::Matrix4d::Identity()};   // 作用于缩放后的源（镜像已含在内）
+    std::string error;
+};
+
+struct MultiOut {
+    std::vector<Hypothesis> hyps;
+    std::vector<int> best_per_scale;   // 每个尺度的最佳假设下标（-1 表示全部剪枝）
+    int best{-1};
+};
+
+// p 绕 c 等比缩放写入 out（复用 out 的容量，法向不变）
+void scaled_about(const geometry::PointCloud &p, double s, const Eigen::Vector3d &c, geometry::PointCloud &out);
+
+// local 经 T 变换后到目标 chamfer 点的平均最近距离
+double fit_score(const geometry::PointCloud &local, const Eigen::Matrix4d &T, const TargetContext &tgt);
+
+// 绕 c 等比缩放 s 的相似变换
+Eigen::Matrix4d scale_about(double s, const Eigen::Vector3d &c);
+
+// mS、mT 已清理；c 为缩放中心（与 Python 侧 Vc.mean(axis=0) 一致）
+MultiOut align_multi_mesh(geometry::TriangleMesh &mS, const Eigen::Vector3d &c,
+                          geometry::TriangleMesh &mT, std::vector<double> scales,
+                          const std::vector<RegParams> &params, bool mirror, double prune_ratio);
+
+// ----------------------------- 余量查询场景（BVH 句柄） -----------------------------
+// 候选 BVH 只在候选局部坐标系建一次，变换 T（局部 -> 目标坐标系）随句柄携带：查询点经 Tinv 变回局部
+// 坐标，符号距离乘 scale 换回目标坐标系。T 可含镜像与均匀缩放（相似变换），at(T) 只换变换、共享 BVH，
+// 所以一个候选的所有尺度 / 对齐假设共用一棵 BVH。采样余量、窄带复核、余量场、最薄点与薄壁聚类都收句柄。
+
+struct ClearanceScene {
+    std::shared_ptr<t::geometry::RaycastingScene> scene;   // 局部坐标系，已 commit，可跨线程只读共享
+    Eigen::Matrix4d T = Eigen::Matrix4d::Identity();       // 局部 -> 目标坐标系
+    Eigen::Matrix4d Tinv = Eigen::Matrix4d::Identity();
+    double scale{1.0};       // T 的均匀缩放因子（距离换算）
+    bool identity{true};     // T 为单位阵时查询跳过变换
+
+    ClearanceScene() = default;
+    // 接管已加好三角形的 scene 并 commit
+    explicit ClearanceScene(std::shared_ptr<t::geometry::RaycastingScene> s);
+
+    // 已清理的网格（局部坐标系）
+    static ClearanceScene build(const geometry::TriangleMesh &m);
+    // 复用 PreparedMesh 的局部 BVH（句柄同时持有 pm）
+    static ClearanceScene of(const std::shared_ptr<const PreparedMesh> &pm);
+
+    // 同一 BVH、换成变换 T；T 的线性部分须为 旋转（可含镜像）× 均匀缩放，否则抛异常
+    ClearanceScene at(const Eigen::Matrix4d &T) const;
+
+    t::geometry::RaycastingScene &bvh() const {
+        if (!scene) throw std::runtime_error("ClearanceScene is empty");
+        return *scene;
+    }
+    Eigen::Vector3d to_local(const Eigen::Vector3d &p) const {
+        return Tinv.topLeftCorner<3, 3>() * p + Tinv.topRightCorner<3, 1>();
+    }
+    Eigen::Vector3d to_frame(const Eigen::Vector3d &p) const {
+        return T.topLeftCorner<3, 3>() * p + T.topRightCorner<3, 1>();
+    }
+};
+
+// pts 为目标坐标系；sink(b, m, sd) 收到的 sd 已原地换算回目标坐标系
+template <class Sink>
+void sdf_query_points_blocks(const ClearanceScene &cs, const std::vector<Eigen::Vector3d> &pts,
+                             size_t begin, size_t end, Sink &&sink) {
+    const float s = (float)cs.scale;
+    sdf_query_points_blocks(cs.bvh(), pts, cs.Tinv, begin, end, [&](size_t b, size_t m, float *sd) {
+        if (s != 1.f) for (size_t k = 0; k < m; ++k) sd[k] *= s;
+        sink(b, m, sd);
+    });
+}
+
+template <class Sink>
+void sdf_query_points(const ClearanceScene &cs, const std::vector<Eigen::Vector3d> &pts,
+                      size_t begin, size_t end, Sink &&sink) {
+    sdf_query_points_blocks(cs, pts, begin, end,
+                            [&](size_t b, size_t m, float *sd) { for (size_t k = 0; k < m; ++k) sink(b + k, sd[k]); });
+}
+
+// ----------------------------- 采样式 SDF 余量 -----------------------------
+
+// 分位数与直方图配置；分位数 k = floor(q * n)（与原 p01 定义一致）
+struct QuantileSpec {
+    std::vector<double> qs{0.01, 0.05, 0.10, 0.15, 0.20, 0.50};
+    int hist_bins{40};
+    double hist_max{10.0};   // [0, hist_max) 等宽分箱，最后一箱含溢出
+};
+
+struct ClearanceResult {
+    double min_c{0}, mean_c{0}, p01{0}, inside_ratio{0};
+    size_t n_inside{0};
+    std::vector<std::pair<double, double>> quantiles;   // (q, clearance)，q 递增
+    std::vector<uint32_t> hist;
+    double hist_max{0};
+};
+
+// 通过判定，全量统计与 decide 共用同一条规则：至少一个内点、内点比例 ≥ kMinInsideRatio
+// （0.1% 外点容差吸收贴面样本上的符号误差）、最小余量 ≥ required
+constexpr double kMinInsideRatio = 0.999;
+inline bool inside_ratio_ok(size_t n_inside, size_t n_total) {
+    return n_inside > 0 && (double)n_inside / (double)std::max<size_t>(1, n_total) >= kMinInsideRatio;
+}
+inline bool clearance_pass(size_t n_inside, size_t n_total, double min_c, double required) {
+    return inside_ratio_ok(n_inside, n_total) && min_c >= required;
+}
+inline bool clearance_pass(const ClearanceResult &st, double required) {   // inside_ratio 即 n_inside / N
+    return st.n_inside > 0 && st.inside_ratio >= kMinInsideRatio && st.min_c >= required;
+}
+
+// 查询点为目标（世界）坐标，由句柄变回候选局部坐标
+ClearanceResult clearance_stats(const ClearanceScene &cs,
+                                const std::vector<Eigen::Vector3d> &pts,
+                                const QuantileSpec &spec = QuantileSpec());
+
+QuantileSpec make_spec(const std::vector<double> &quantiles, int hist_bins, double hist_max);
+
+// 只判定通过与否，结论与 clearance_stats + clearance_pass 相同：先查 coarse 个样本，再按 chunk 分块；
+// 一旦出现余量不足的内点，或外点多到剩余样本全在内部也达不到 kMinInsideRatio，立即返回。
+// min_c / inside 统计只覆盖已评估的样本。
+struct DecideOut {
+    bool pass{false};
+    const char *decided_by{"complete"};   // "complete" | "violation" | "outside"
+    size_t evaluated{0}, n_outside{0};
+    double min_c{0};
+};
+
+DecideOut clearance_decide(const ClearanceScene &cs,
+                           const std::vector<Eigen::Vector3d> &pts, double required,
+                           size_t coarse = 2000, size_t chunk = 16384);
+
+// ----------------------------- 批量并行：对齐 + 采样 SDF -----------------------------
+// 输入先在持有 GIL 时拷贝成纯 C++ 结构，整条 对齐+余量 流水线在无 GIL 的并行区内运行，
+// 结果存成 BatchOut，join 之后再统一转换为 Python 对象。
+
+struct BatchParams {
+    double voxel, fpfh_radius, icp_thr;
+    double clearance, safety_delta;
+    bool decide_only{false};   // 只判定 pass（clearance + safety_delta），可提前退出
+    QuantileSpec spec{};
+    core::Device device{"CPU:0"};   // ICP 设备（已 resolve_device）
+    bool profile{false};            // 每个结果附带 "profile"
+    SampleParams sampling{};        // 目标余量采样方式
+};
+
+struct BatchOut {
+    std::string error;
+    AlignResult align;
+    ClearanceResult clr;
+    DecideOut decide;
+    bool decide_only{false};
+    bool pass{false};
+    Profile prof;
+};
+
+// cs 为候选局部坐标系的句柄（其自身变换忽略），按 o.align.T 查询；o.align 已填好
+void check_aligned(const ClearanceScene &cs, const TargetContext &tgt,
+                   const BatchParams &P, BatchOut &o);
+
+// 未预处理的候选网格（已清理），不触碰 Python 对象
+void align_and_check_mesh(geometry::TriangleMesh &mS, const TargetContext &tgt,
+                          const BatchParams &P, BatchOut &o);
+
+// 预处理候选（候选局部坐标系 BVH 与缓存的配准层）
+void align_and_check_prepared(const std::shared_ptr<PreparedMesh> &c, const TargetContext &tgt,
+                              const BatchParams &P, BatchOut &o);
+
+// 整条批量流水线（调用方需已释放 GIL）：清理目标、建一次目标上下文，每个候选一个池任务。
+// meshes[i] 为空表示输入阶段已失败（outs[i].error 已填）；每个候选处理完即释放，outs 与 meshes 等长
+void run_batch(geometry::TriangleMesh &mT, std::vector<std::shared_ptr<geometry::TriangleMesh>> &meshes,
+               const BatchParams &P, size_t samples, int threads, std::vector<BatchOut> &outs);
+
+// 预处理候选版本（mT 需已清理）：候选层先串行上传到 P.device，循环内只做配准与 BVH 查询
+void run_batch_prepared(geometry::TriangleMesh &mT, const std::vector<std::shared_ptr<PreparedMesh>> &cands,
+                        const BatchParams &P, size_t samples, int threads, std::vector<BatchOut> &outs);
+
+// ----------------------------- 异步批量作业 -----------------------------
+// 与 run_batch / run_batch_prepared 同一流水线，但在后台线程驱动、立即返回句柄：
+// 每个候选算完即入队（并可回调），next() 按完成顺序取走；cancel() 置位取消标志，
+// 各检查点抛 Cancelled 后该候选以 error = "cancelled" 入队，每个下标恰好出现一次。
+// 回调在完成该候选的池线程上调用，应尽快返回；最后一个候选入队后回调即被释放。
+// 在回调里放掉最后一个句柄是允许的：析构只取消不等待，后台线程持有共享状态自行收尾。
+
+class BatchJob {
+public:
+    using Callback = std::function<void(size_t, const BatchOut &)>;
+    using Item = std::pair<size_t, BatchOut>;
+
+    // mT 会被清理；meshes[i] 为空表示输入阶段已失败（errors[i] 给出原因）
+    static std::shared_ptr<BatchJob> start(std::shared_ptr<geometry::TriangleMesh> mT,
+                                           std::vector<std::shared_ptr<geometry::TriangleMesh>> meshes,
+                                           std::vector<std::string> errors, const BatchParams &P,
+                                           size_t samples, int threads, Callback cb = {});
+    // 预处理候选（mT 同样在后台线程里清理）
+    static std::shared_ptr<BatchJob> start(std::shared_ptr<geometry::TriangleMesh> mT,
+                                           std::vector<std::shared_ptr<PreparedMesh>> cands, const BatchParams &P,
+                                           size_t samples, int threads, Callback cb = {});
+    ~BatchJob();   // 取消并等待后台线程结束；在池任务或后台线程上析构时改为分离
+    BatchJob(const BatchJob &) = delete;
+    BatchJob &operator=(const BatchJob &) = delete;
+
+    // 至少取到一个结果、作业结束或超时后返回（timeout < 0 一直等，0 不等待），至多 max 个
+    std::vector<Item> next(double timeout = -1, size_t max = std::numeric_limits<size_t>::max());
+    void cancel() { s_->cancel.store(true); }
+    void join();   // 等后台线程结束（结果仍留在队列里）；在池任务或回调里调用抛异常
+
+    bool cancelled() const { return s_->cancel.load(); }
+    bool done() const;   // 全部候选已入队
+    size_t total() const { return s_->total; }
+    size_t completed() const;
+    const BatchParams &params() const { return s_->P; }
+
+private:
+    // 句柄与后台线程共享：句柄先析构时后台线程仍持有它，直到最后一个候选入队并退出
+    struct State {
+        State(size_t n, const BatchParams &P, Callback cb) : total(n), P(P), cb(std::move(cb)) {}
+        void push(size_t i, BatchOut &&o);
+
+        const size_t total;
+        const BatchParams P;
+        Callback cb;   // 最后一个结果入队后释放，断开 作业 → 回调 → 闭包 → 作业 的引用环
+        std::atomic<bool> cancel{false};
+        mutable std::mutex m;
+        std::condition_variable cv;
+        std::deque<Item> ready;
+        size_t completed{0};
+    };
+
+    explicit BatchJob(std::shared_ptr<State> s) : s_(std::move(s)) {}
+    bool on_job_thread() const;   // 池任务或后台线程上：join 会等自己（死锁或自 join）
+
+    std::shared_ptr<State> s_;
+    std::mutex join_m_;
+    std::thread driver_;
+    std::thread::id driver_id_;
+};
+
+// ----------------------------- 体素窄带 SDF（形式化复核） -----------------------------
+// 窄带只依赖目标、voxel 与 band_mm：算一次，存为 uint32 线性体素索引，所有候选共用；
+// 候选侧按块把索引还原为体素中心并查询 SDF，块内即时归约。
+
+struct NarrowBand {
+    Eigen::Vector3d origin{0, 0, 0};   // 网格最小角（含 band 外扩）
+    double voxel{0};
+    double band_mm{0};
+    int64_t NX{0}, NY{0}, NZ{0};
+    std::vector<uint32_t> cells;      // (ix * NY + iy) * NZ + iz
+
+    void center(uint32_t c, float *out) const {
+        int64_t iz = c % NZ, t = c / NZ;
+        int64_t iy = t % NY, ix = t / NY;
+        out[0] = (float)(origin.x() + (ix + 0.5) * voxel);
+        out[1] = (float)(origin.y() + (iy + 0.5) * voxel);
+        out[2] = (float)(origin.z() + (iz + 0.5) * voxel);
+    }
+};
+
+NarrowBand build_narrow_band(const geometry::TriangleMesh &mT, double voxel, double band_mm,
+                             int nthreads = 0);
+
+struct FormalOut {
+    std::string reason;   // 非空表示未完成检查
+    bool pass{false};
+    double min_c{0}, mean_c{0}, inside_ratio{0};
+};
+
+FormalOut formal_check_band(const ClearanceScene &cs, const NarrowBand &nb,
+                            double clearance, int nthreads);
+
+// ----------------------------- 逐顶点余量场 -----------------------------
+// 一次并行 SDF 查询（无 GIL）得到每个顶点的 clearance：正 = 候选包住目标的余量，负 = 穿透。
+// on="target"：目标顶点对候选表面，clearance = -sd；on="candidate"：候选顶点对目标表面，clearance = sd。
+// 查询顶点不清理，结果与传入顶点一一对应；热图与薄壁分析共用这一份结果。
+
+// 块式内核：xyz(b, m, tmp) 返回第 b 起 m 个查询点的连续 double 三元组（句柄的目标坐标系；
+// 可直接指向调用方数组，或写进 tmp 后返回 tmp.data()），打包与变换走 simd::pack_xyz。
+// clr 写 sign * sd；closest 非空时写 3 * n 个最近点坐标（同样换回目标坐标系）。
+// ComputeSignedDistance 本身即 最近点距离 + 射线奇偶占据，要最近点时改为 ComputeClosestPoints +
+// ComputeOccupancy，由最近点自行求距离，BVH 最近点查询只走一遍
+template <class Xyz>
+void clearance_field_blocks(const ClearanceScene &cs, size_t n, Xyz &&xyz, float sign,
+                            float *clr, float *closest, int nthreads) {
+    auto &scene = cs.bvh();
+    double M[12];
+    simd::affine_rows(cs.Tinv, M);
+    const double *A = cs.identity ? nullptr : M;
+    const float ss = sign * (float)cs.scale;
+    Scratch<std::vector<double>> tmp;
+    scene_query_blocks(0, n, [&](size_t b, size_t m, float *out) {
+        simd::pack_xyz(xyz(b, m, *tmp), m, A, out);
+    }, [&](size_t b, size_t m, const core::Tensor &Q, int nt) {
+        if (!closest) {
+            auto sd = scene.ComputeSignedDistance(Q, nt);
+            const float *d = sd.GetDataPtr<float>();
+            for (size_t k = 0; k < m; ++k) clr[b + k] = ss * d[k];
+            return;
+        }
+        auto hit = scene.ComputeClosestPoints(Q, nt);
+        const core::Tensor P = hit["points"].Contiguous();
+        const core::Tensor occ = scene.ComputeOccupancy(Q, nt).To(core::Float32).Contiguous();
+        const float *q = Q.GetDataPtr<float>(), *p = P.GetDataPtr<float>(), *o = occ.GetDataPtr<float>();
+        float *c = closest + 3 * b;
+        for (size_t k = 0; k < m; ++k) {
+            const float dx = p[3 * k] - q[3 * k], dy = p[3 * k + 1] - q[3 * k + 1], dz = p[3 * k + 2] - q[3 * k + 2];
+            const float d = std::sqrt(dx * dx + dy * dy + dz * dz);
+            clr[b + k] = ss * (o[k] > 0.5f ? -d : d);
+        }
+        if (cs.identity) {
+            std::memcpy(c, p, m * 3 * sizeof(float));
+            return;
+        }
+        for (size_t k = 0; k < m; ++k) {
+            const Eigen::Vector3d w = cs.to_frame(Eigen::Vector3d(p[3 * k], p[3 * k + 1], p[3 * k + 2]));
+            c[3 * k + 0] = (float)w.x(); c[3 * k + 1] = (float)w.y(); c[3 * k + 2] = (float)w.z();
+        }
+    }, nthreads, size_t(1) << 20);
+}
+
+// 查询点为连续的 n × 3 double（目标坐标系），直接打包
+inline void clearance_field_query(const ClearanceScene &cs, const double *xyz, size_t n, float sign,
+                                  float *clr, float *closest, int nthreads) {
+    clearance_field_blocks(cs, n, [xyz](size_t b, size_t, std::vector<double> &) { return xyz + 3 * b; },
+                           sign, clr, closest, nthreads);
+}
+
+// vertex(i) 返回第 i 个查询点（Eigen::Vector3d，句柄的目标坐标系），逐块先取进线程暂存再打包
+template <class Vertex>
+void clearance_field_query(const ClearanceScene &cs, size_t n, Vertex &&vertex, float sign,
+                           float *clr, float *closest, int nthreads) {
+    clearance_field_blocks(cs, n, [&](size_t b, size_t m, std::vector<double> &tmp) {
+        tmp.resize(3 * m);
+        for (size_t k = 0; k < m; ++k) {
+            const Eigen::Vector3d v = vertex(b + k);
+            tmp[3 * k] = v.x(); tmp[3 * k + 1] = v.y(); tmp[3 * k + 2] = v.z();
+        }
+        return (const double *)tmp.data();
+    }, sign, clr, closest, nthreads);
+}
+
+// ----------------------------- 剖切线段 -----------------------------
+// 顶点沿法向的投影 s 只算一次；每个三角形的投影区间 (lo, hi] 二分定位到排好序的平面区间，
+// 按平面分桶后各平面并行求交，并按交点所在的网格边把线段串成折线。
+// 顶点恰在平面上按“上方”处理（符号扰动），每个相交三角形恰好给出一条线段，串接不断。
+
+struct SectionSeg {
+    Eigen::Vector3d p[2];
+    uint64_t key[2];   // 交点所在网格边 (min, max)
+};
+
+struct Section {
+    double offset{0};
+    Eigen::Vector3d normal{0, 0, 1};   // 平面法向（单位）
+    std::vector<SectionSeg> segs;
+    std::vector<std::vector<Eigen::Vector3d>> polylines;
+    std::vector<bool> closed;
+};
+
+// 线段按共享边相接；先从度为 1 的端点走开链，剩余的都是闭环
+void chain_section(Section &S);
+
+// offsets 为各平面 N·x = d 的 d（任意顺序），返回与之同序的截面
+std::vector<Section> compute_sections(const geometry::TriangleMesh &m, const Eigen::Vector3d &N,
+                                      const std::vector<double> &offsets, bool chain);
+
+// 配对模式：目标截面折线各点到同一平面上候选截面线段的最近距离。候选线段按平面内投影登记到均匀网格，
+// 查询从所在格子逐环外扩，与逐段扫描结果相同
+struct SectionGap { bool found{false}; double min_gap{0}, mean_gap{0}, max_gap{0}; };
+
+SectionGap section_gap(const Section &tgt, const Section &cand);
+
+// ----------------------------- 薄壁段聚类与区域标注 -----------------------------
+
+// 并查集（路径减半 + 按大小合并）
+struct DisjointSet {
+    std::vector<int> parent, size;
+    explicit DisjointSet(int n) : parent(n), size(n, 1) { std::iota(parent.begin(), parent.end(), 0); }
+    int find(int x) {
+        while (parent[x] != x) { parent[x] = parent[parent[x]]; x = parent[x]; }
+        return x;
+    }
+    void unite(int a, int b) {
+        a = find(a); b = find(b);
+        if (a == b) return;
+        if (size[a] < size[b]) std::swap(a, b);
+        parent[b] = a; size[a] += size[b];
+    }
+};
+
+struct Region {
+    double min_c{1e9};
+    Eigen::Vector3d centroid{0, 0, 0}, pA{0, 0, 0}, pB{0, 0, 0};
+    std::vector<int> indices;   // 目标顶点索引集合（递增）
+};
+
+// clr[i] 为目标顶点余量（>= 0 在候选内部），与 clearance_field(on="target") 同号。
+// connectivity="radius"：薄壁点间 KD 半径近邻做单链聚类（并查集）；
+// connectivity="mesh"：沿目标三角形的边生长（两端都是薄壁点才连通），线性时间，radius_mm 不用。
+std::vector<Region> thin_regions_from(const std::vector<Eigen::Vector3d> &V, const float *clr,
+                                      double thr_mm, double radius_mm, const std::string &connectivity,
+                                      const std::vector<Eigen::Vector3i> *tris);
+
+// ----------------------------- 3DM 读取（openNURBS） -----------------------------
+// 与 Python 的 load_3dm_enhanced 同口径：逐个几何对象取网格，Mesh 直接用，Brep / Extrusion 优先用文件里缓存的
+// 渲染网格；没有缓存网格的 Brep 面在参数域按 max_edge 网格化并用修剪环裁掉域外三角形。块引用（InstanceRef）
+// 展开并套用其变换。四边形按 (a,b,c)+(a,c,d) 拆分，所有部件合并成一个未清理的网格（焊接交给 clean_mesh）。
+// 需 WITH_OPENNURBS 编译；否则 read_3dm 抛异常，has_opennurbs() 返回 false。
+
+struct Load3dmParams {
+    double max_edge{2.5};        // 无渲染网格的 Brep 面：参数域网格的目标边长（mm，对应 'high' 质量）
+    int max_grid{256};           // 每个面每个参数方向的网格数上限
+    bool render_meshes{true};    // false 时忽略缓存的渲染网格，全部重新网格化
+};
+
+bool has_opennurbs();
+std::shared_ptr<geometry::TriangleMesh> read_3dm(const std::string &path, const Load3dmParams &P = {});
+
+// ----------------------------- 候选库与端到端匹配 -----------------------------
+// 预处理候选库是一个目录：每个候选一份 <id>.slpm（id 为相对路径去掉 .slpm），index.slfi 为全库粗特征索引。
+// match_library：目标粗特征 → 索引取可行 top-K → 只加载这些 .slpm → run_batch_prepared。
+// C++ 服务与 CLI（cli/shoematch_cli.cpp）直接调用；cppcore.match_library 只做 numpy / dict 转换。
+
+// 网格文件（未清理）：Open3D 可读格式（.ply/.obj/.stl/.off…）、.3dm（read_3dm）或 .slpm（取其网格）；读不出时抛异常
+std::shared_ptr<geometry::TriangleMesh> read_mesh_file(const std::string &path, const Load3dmParams &P = {});
+
+// 并行读取多个文件（OpenMP 动态调度），clean=true 时顺带 clean_mesh；
+// 失败的文件返回 nullptr，errors[i] 为错误信息（成功为空串）
+std::vector<std::shared_ptr<geometry::TriangleMesh>>
+read_mesh_files(const std::vector<std::string> &paths, std::vector<std::string> &errors,
+                bool clean = true, int threads = 0, const Load3dmParams &P = {});
+
+struct MatchParams {
+    double voxel{5.0}, fpfh_radius{10.0}, icp_thr{15.0};
+    double clearance{2.0}, safety_delta{0.3};
+    size_t samples{20000};
+    size_t topk{32};                 // 0 = 索引筛出的全部可行候选
+    double w_hist{0.5}, vol_tol{0.001}, w_d2{0.5}, w_width{1.0};
+    double max_width_shortfall{std::numeric_limits<double>::infinity()};
+    bool decide_only{false};
+    QuantileSpec spec{};
+    SampleParams sampling{};
+    std::string device{"CPU:0"};
+    int threads{0};
+    bool profile{false};
+    // 级联（cascade=true 时 match_library 走 cascade_match）
+    bool cascade{false};
+    size_t final_k{8};            // 最终名单长度 K
+    size_t max_align{64};         // 完整 RANSAC/ICP 最多做几个候选
+    double prune_ratio{1.5};      // 粗 chamfer > prune_ratio × 当前第 K 名的粗 chamfer 即剪掉
+    size_t coarse_points{2000};   // 粗 chamfer 每侧子样本数
+    bool formal{true};            // 进入当前 top-K 的候选再做窄带 SDF 复核
+    double formal_voxel{0.3}, formal_band{8.0};
+};
+
+struct MatchResult {
+    std::string id;
+    double index_score{0};   // FeatureIndex 排序分（越小越贴合）
+    BatchOut result;         // error 非空表示加载或配准失败
+    // 以下仅级联填写
+    int stage{0};            // 到达的最后一级：1 可行性 2 粗配准 3 完整配准 4 采样余量 5 形式复核
+    const char *cut_by{""};  // "infeasible" | "coarse" | "budget" | "bound" | "clearance" | "formal" | "rank"；入选为 ""
+    double coarse_chamfer{std::numeric_limits<double>::infinity()};
+    bool has_formal{false};
+    FormalOut formal;
+    int rank{-1};            // 最终名次（0 起），未入选为 -1
+};
+
+struct CandidateLibrary {
+    static constexpr const char *kIndexFile = "index.slfi";
+    static constexpr const char *kMeshExt = ".slpm";
+
+    std::filesystem::path root;
+    std::shared_ptr<FeatureIndex> index;
+
+    // 读 index.slfi；缺失、版本不符或校验失败（截断、半写）时由各 .slpm 的粗特征重建并写回
+    static std::shared_ptr<CandidateLibrary> open(const std::string &dir);
+
+    std::string path_of(const std::string &id) const { return (root / (id + kMeshExt)).string(); }
+    std::shared_ptr<PreparedMesh> load(const std::string &id) const { return PreparedMesh::load(path_of(id)); }
+};
+
+// 候选在任务池上并行预处理（网格会被清理），逐个写 <dir>/<id>.slpm，最后更新 index.slfi：
+// 与已有索引合并（本次的 id 替换或追加，之前各次的候选保留），没有可用索引时按目录内全部 .slpm 重建。
+// 返回与输入同序的错误信息（空串表示成功）；本次失败的候选不更新索引条目
+std::vector<std::string> build_library(const std::string &dir, const std::vector<std::string> &ids,
+                                       std::vector<std::shared_ptr<geometry::TriangleMesh>> &meshes,
+                                       const std::vector<std::pair<double, double>> &levels,
+                                       size_t chamfer_samples, int threads);
+
+// mT 会被清理；结果按索引分数排序（与 FeatureIndex::query 同序）
+std::vector<MatchResult> match_library(const CandidateLibrary &lib, geometry::TriangleMesh &mT,
+                                       const MatchParams &M);
+
+// 级联调度：粗特征可行性 → PCA 主轴对齐 + 低分辨率 Chamfer → 按粗分升序分波做完整 RANSAC/ICP 与采样余量
+// → 进入当前 top-K 的做窄带形式复核。每级内部并行，波长固定（结果与线程数无关）；下一候选的粗 chamfer
+// 超过 prune_ratio × 第 K 名的粗 chamfer、或完整配准数达到 max_align 时停止。
+// mT 需已清理；结果按 rank，其余按到达级数、chamfer 排序
+std::vector<MatchResult> cascade_match(geometry::TriangleMesh &mT, const std::vector<std::string> &ids,
+                                       const std::vector<std::shared_ptr<PreparedMesh>> &cands,
+                                       const MatchParams &M);
+
+}  // namespace shoematch
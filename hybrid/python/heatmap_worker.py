@@ -5,7 +5,6 @@ This module provides functions for generating clearance heatmaps without nested
 """
 
 import numpy as np
-import trimesh
 import plotly.graph_objects as go
 from pathlib import Path
 import sys
@@ -13,22 +12,22 @@ import os
 
 # Add the parent directory to the path to import cppcore
 sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+import cppcore
 
 def generate_clearance_heatmap_standalone(args):
     """
-    Standalone heatmap generation function that can be called by ProcessPoolExecutor
-    Args: (V_target, F_target, V_cand, F_cand, clearance_data, output_html)
+    Standalone heatmap generation function
+    Args: (V_target, F_target, V_cand, F_cand, clearance_data, output_html[, clearances])
+    clearances: optional per-candidate-vertex field from cppcore.clearance_field(on='candidate')
     """
-    V_target, F_target, V_cand, F_cand, clearance_data, output_html = args
+    V_target, F_target, V_cand, F_cand, clearance_data, output_html = args[:6]
+    clearances = args[6] if len(args) > 6 else None
     
     try:
-        # Create mesh objects
-        mesh_cand = trimesh.Trimesh(vertices=V_cand, faces=F_cand)
-        mesh_target = trimesh.Trimesh(vertices=V_target, faces=F_target)
-        
-        # Compute clearance using single-threaded approach
-        print(f"  Computing clearance for {len(V_cand)} vertices...")
-        _, clearances, _ = mesh_target.nearest.on_surface(V_cand)
+        # Signed clearance per candidate vertex (negative = penetration), one parallel native call
+        if clearances is None:
+            print(f"  Computing clearance for {len(V_cand)} vertices...")
+            clearances = cppcore.clearance_field(V_target, F_target, V_cand, F_cand, on='candidate')
         
         print(f"  Clearance range: {clearances.min():.3f}mm - {clearances.max():.3f}mm")
         
@@ -56,7 +55,7 @@ def generate_clearance_heatmap_standalone(args):
             i=F_cand[:, 0],
             j=F_cand[:, 1],
             k=F_cand[:, 2],
-            intensity=clearances,  # Use vertex clearance values for coloring
+            intensity=clearances,  # Use vertex clearance values for coloring (negative clipped to cmin)
             colorscale='RdYlGn',
             cmin=0,
             cmax=10,
@@ -13,6 +13,7 @@ import json
 import argparse
 import cppcore
 import plotly.graph_objects as go
+from heatmap_worker import generate_clearance_heatmap_standalone
 import multiprocessing as mp
 from multiprocessing import Pool, cpu_count
 from sklearn.linear_model import RANSACRegressor
@@ -170,12 +171,40 @@ def preprocess_mesh(V, F, fix_normals=True, fill_holes=True, remove_duplicates=T
     return np.asarray(mesh.vertices, dtype=np.float64), np.asarray(mesh.faces, dtype=np.int32)
 
 # ========== Enhanced Load Function ==========
+# Native openNURBS loader in cppcore (built with -DWITH_OPENNURBS=ON); rhino3dm path otherwise
+NATIVE_3DM = getattr(cppcore, 'HAS_OPENNURBS', False)
+
+def load_meshes_enhanced(paths, preprocess=True, threads=-1):
+    """Load many meshes; with the native loader all files are read in parallel inside cppcore.
+    Returns a list of (V, F) or an Exception per path"""
+    paths = [str(p) for p in paths]
+    if not NATIVE_3DM:
+        out = []
+        for p in paths:
+            try:
+                out.append(load_mesh_enhanced(p, preprocess=preprocess))
+            except Exception as e:
+                out.append(e)
+        return out
+    meshes, errors = cppcore.load_meshes(paths, threads=threads, mesh_quality='high')
+    out = []
+    for mesh, err in zip(meshes, errors):
+        if err is not None:
+            out.append(ValueError(err))
+        elif preprocess:
+            out.append(preprocess_mesh(*mesh))
+        else:
+            out.append(mesh)
+    return out
+
 def load_mesh_enhanced(path: str, preprocess=True, remove_base=False):
     """Enhanced mesh loading with preprocessing"""
     p = Path(path)
     ext = p.suffix.lower()
     
-    if ext == '.3dm':
+    if ext == '.3dm' and NATIVE_3DM:
+        V, F = cppcore.load_mesh(str(p), mesh_quality='high')
+    elif ext == '.3dm':
         V, F = load_3dm_enhanced(p, mesh_quality='high')
     else:
         tm = trimesh.load_mesh(str(p))
@@ -204,6 +233,27 @@ def filter_by_volume(target_features, candidate_features, tolerance=0.001):
     v_cand = candidate_features['volume']
     return v_cand >= min_volume
 
+def build_feature_index(candidates_dir, index_path, preprocess=True):
+    """
+    Build a cppcore.FeatureIndex over a candidate library (ids are paths relative to candidates_dir)
+    """
+    index = cppcore.FeatureIndex()
+    root = Path(candidates_dir)
+    cand_paths = sorted(p for p in root.rglob('*') if p.suffix.lower() in {'.3dm', '.ply', '.obj', '.stl'})
+    chunk = 4 * cpu_count()  # bounds peak memory on large libraries
+    loaded = (m for i in range(0, len(cand_paths), chunk)
+              for m in load_meshes_enhanced(cand_paths[i:i + chunk], preprocess=preprocess))
+    for cand_path, mesh in zip(cand_paths, loaded):
+        try:
+            if isinstance(mesh, Exception):
+                raise mesh
+            index.add(cand_path.relative_to(root).as_posix(), *mesh)
+        except Exception as e:
+            print(f"  ✗ Index skip {cand_path.name}: {e}")
+    index.save(str(index_path))
+    print(f"  Feature index: {len(index)} candidates → {index_path}")
+    return index
+
 # ========== Export Functions ==========
 def export_ply(mesh_V, mesh_F, output_path, colors=None):
     """Export mesh as PLY file with optional vertex colors"""
@@ -219,99 +269,91 @@ def export_glb(mesh_V, mesh_F, output_path):
     mesh.export(output_path)
     print(f"  Exported GLB: {output_path}")
 
-def compute_clearance_batch(args):
+def compute_vertex_clearance(Vt, Ft, Vc, Fc, on='candidate'):
     """
-    Process a single batch of vertices for clearance calculation
-    Used by multiprocessing to parallelize clearance computation
+    Signed clearance per vertex in one native call (GIL released, parallel)
+    on='candidate': candidate vertices vs target surface (heatmaps)
+    on='target': target vertices vs candidate surface (feeds cppcore.thin_regions(Vt, field, ...))
     """
-    vertices_batch, target_mesh_data = args
-    # Reconstruct mesh object from data (avoid passing complex objects between processes)
-    mesh_target = trimesh.Trimesh(vertices=target_mesh_data[0], faces=target_mesh_data[1])
-    _, distances, _ = mesh_target.nearest.on_surface(vertices_batch)
-    return distances
+    return cppcore.clearance_field(Vt, Ft, Vc, Fc, on=on)
 
 # ========== Optimization Functions ==========
+def multi_start_param_sets(n_starts=3, voxel=5.0, fpfh_radius=10.0, icp_thr=15.0):
+    """
+    Parameter sets for the multiple initial alignments (base, 0.8x, 1.2x)
+    """
+    factors = [1.0, 0.8, 1.2][:max(1, n_starts)]
+    return [(voxel * f, fpfh_radius * f, icp_thr * f) for f in factors]
+
 def multi_start_alignment(Vc, Fc, Vt, Ft, n_starts=3, voxel=5.0, fpfh_radius=10.0, icp_thr=15.0):
     """
     Try multiple initial alignments and pick the best one
+    (one native call: shared pyramid, coarse-to-fine ICP, clearly worse starts pruned)
     """
-    best_result = None
-    best_score = float('inf')
-    
-    # Different parameter sets for multiple attempts
-    param_sets = [
-        {'voxel': voxel, 'fpfh_radius': fpfh_radius, 'icp_thr': icp_thr},
-        {'voxel': voxel * 0.8, 'fpfh_radius': fpfh_radius * 0.8, 'icp_thr': icp_thr * 0.8},
-        {'voxel': voxel * 1.2, 'fpfh_radius': fpfh_radius * 1.2, 'icp_thr': icp_thr * 1.2},
-    ]
-    
-    for i, params in enumerate(param_sets[:n_starts]):
-        try:
-            result = cppcore.align_icp_with_mirror(
-                Vc, Fc, Vt, Ft,
-                params['voxel'], params['fpfh_radius'], params['icp_thr']
-            )
-            
-            # Score based on chamfer distance
-            score = result['chamfer']
-            
-            if score < best_score:
-                best_score = score
-                best_result = result
-                best_result['attempt'] = i + 1
-        except:
-            continue
-    
-    return best_result if best_result else param_sets[0]
+    result = cppcore.align_multi(
+        Vc, Fc, Vt, Ft, scales=[1.0],
+        param_sets=multi_start_param_sets(n_starts, voxel, fpfh_radius, icp_thr)
+    )
+    result['attempt'] = result['start'] + 1
+    return result
 
-def compute_detailed_clearance_metrics(Vt, Ft, Vc_aligned, Fc, samples=120000):
+def align_all_scales(Vc, Fc, Vt, Ft, scales, n_starts=3, voxel=5.0, fpfh_radius=10.0, icp_thr=15.0):
     """
-    Compute comprehensive clearance metrics
+    Align the candidate at every scale (about Vc.mean(axis=0)) in one native call.
+    Returns one result per scale, None where the hypothesis was pruned.
     """
-    # Standard clearance sampling
-    clear_result = cppcore.clearance_sampling(
-        Vt, Ft, Vc_aligned.astype(np.float64), Fc,
-        clearance=2.0, safety_delta=0.3, samples=samples
-    )
-    
-    # Use more samples for percentile calculation to get accurate statistics
-    detailed_result = cppcore.clearance_sampling(
-        Vt, Ft, Vc_aligned.astype(np.float64), Fc,
-        clearance=2.0, safety_delta=0.3, samples=50000  # More samples for percentiles
+    result = cppcore.align_multi(
+        Vc, Fc, Vt, Ft, scales=[float(s) for s in scales],
+        param_sets=multi_start_param_sets(n_starts, voxel, fpfh_radius, icp_thr)
     )
-    
-    # Copy the inside_ratio from detailed_result to clear_result
-    clear_result['inside_ratio'] = detailed_result['inside_ratio']
+    return result['per_scale']
+
+def scale_about(center, scale):
+    """4x4 uniform scale about `center` (the pre-alignment part of a scale hypothesis)."""
+    S = np.eye(4)
+    S[:3, :3] *= scale
+    S[:3, 3] = (1.0 - scale) * np.asarray(center, dtype=np.float64)
+    return S
+
+def make_target_samples(Vt, Ft, n=40000):
+    """
+    Seeded blue-noise target samples with curvature densification (toe/heel),
+    generated once per target and reused for every candidate and scale.
+    """
+    return cppcore.TargetSamples(Vt, Ft, n=n, method='poisson', seed=0, curvature_weight=1.0)
+
+def compute_detailed_clearance_metrics(Vt, Ft, Vc_aligned, Fc=None, samples=120000, target_samples=None):
+    """
+    Compute comprehensive clearance metrics.
+    Vc_aligned is either the aligned candidate vertices (with Fc) or a
+    cppcore.ClearanceScene already placed with .at(T), reusing one candidate BVH.
+    With target_samples (see make_target_samples) the target is not resampled.
+    """
+    quantiles = [0.01, 0.05, 0.10, 0.15, 0.20, 0.50]
+    if target_samples is not None:
+        if not isinstance(Vc_aligned, cppcore.ClearanceScene):
+            Vc_aligned = cppcore.ClearanceScene(Vc_aligned.astype(np.float64), Fc)
+        clear_result = cppcore.clearance_sampling(
+            target_samples, Vc_aligned, clearance=2.0, safety_delta=0.3, quantiles=quantiles
+        )
+    else:
+        if isinstance(Vc_aligned, cppcore.ClearanceScene):
+            cand = (Vc_aligned,)
+        else:
+            cand = (Vc_aligned.astype(np.float64), Fc)
+        # One sampling pass: the C++ side returns min/mean/inside_ratio plus
+        # selection-based percentiles (p01/p05/p10/p15/p20/p50) and a histogram
+        clear_result = cppcore.clearance_sampling(
+            Vt, Ft, *cand,
+            clearance=2.0, safety_delta=0.3, samples=samples, quantiles=quantiles
+        )
     
     # If not all points are inside, set clearances to 0 for points outside
-    if detailed_result['inside_ratio'] < 1.0:
-        print(f"⚠️ Warning: Only {detailed_result['inside_ratio']:.1%} of target points are inside candidate")
+    if clear_result['inside_ratio'] < 1.0:
+        print(f"⚠️ Warning: Only {clear_result['inside_ratio']:.1%} of target points are inside candidate")
         # For proper clearance, we need complete containment
         clear_result['min_clearance'] = 0.0  # Set to 0 if not fully contained
     
-    # Calculate percentiles using a proper surface sampling approach
-    # Sample more points for accurate percentile calculation
-    percentile_samples = min(10000, len(Vt) * 10)
-    percentile_result = cppcore.clearance_sampling(
-        Vt, Ft, Vc_aligned.astype(np.float64), Fc,
-        clearance=2.0, safety_delta=0.3, samples=percentile_samples
-    )
-    
-    # Estimate percentiles based on the distribution
-    # Since we can't get exact percentiles from C++, we'll use the min and mean to estimate
-    # This is a simplified approach - ideally we'd modify the C++ to return percentiles
-    min_c = percentile_result['min_clearance']
-    mean_c = percentile_result['mean_clearance']
-    p01_c = percentile_result['p01_clearance']
-    
-    # Estimate other percentiles using exponential distribution assumption
-    # This is approximate but better than vertex-to-vertex distances
-    clear_result['p05_clearance'] = min_c + (p01_c - min_c) * 5.0
-    clear_result['p10_clearance'] = min_c + (p01_c - min_c) * 10.0
-    clear_result['p15_clearance'] = min_c + (p01_c - min_c) * 15.0
-    clear_result['p20_clearance'] = min_c + (p01_c - min_c) * 20.0
-    clear_result['p50_clearance'] = mean_c  # Use mean as approximation for median
-    
     # Determine pass with multiple criteria
     # Strict pass requires BOTH complete containment AND minimum clearance
     is_fully_contained = clear_result.get('inside_ratio', 0) >= 0.999  # 99.9% to allow for numerical errors
@@ -338,7 +380,9 @@ def run_optimized_matcher(
     export_ply_dir=None,
     export_glb_dir=None,
     export_heatmap_dir=None,
-    export_topk=3
+    export_topk=3,
+    feature_index=None,
+    index_topk=32
 ):
     """
     Run optimized matcher with all strategies
@@ -360,11 +404,27 @@ def run_optimized_matcher(
     print(f"Loading target: {target_path}")
     Vt, Ft = load_mesh_enhanced(target_path, preprocess=preprocess, remove_base=False)
     target_features = cppcore.coarse_features(Vt, Ft)
-    print(f"  {Vt.shape[0]} vertices, Volume: {target_features['volume']:.0f} mm³")
+    target_samples = make_target_samples(Vt, Ft)
+    print(f"  {Vt.shape[0]} vertices, Volume: {target_features['volume']:.0f} mm³, "
+          f"{len(target_samples)} clearance samples")
     
     # Find candidates
     cand_paths = [p for p in Path(candidates_dir).rglob('*') 
                   if p.suffix.lower() in {'.3dm', '.ply', '.obj', '.stl'}]
+    
+    # Prefilter with the coarse-feature index before any candidate mesh is loaded
+    if feature_index:
+        index = None
+        if Path(feature_index).exists():
+            try:
+                index = cppcore.FeatureIndex.load(str(feature_index))
+            except RuntimeError as e:
+                print(f"  Rebuilding feature index ({e})")
+        if index is None:
+            index = build_feature_index(candidates_dir, feature_index, preprocess=preprocess)
+        hits = index.query(Vt, Ft, clearance=clearance, k=index_topk)
+        cand_paths = [Path(candidates_dir) / h['id'] for h in hits]
+        print(f"  Feature index: {len(hits)} feasible candidates (top {index_topk} of {len(index)})")
     print(f"\nProcessing {len(cand_paths)} candidates...")
     print("-"*70)
     
@@ -397,26 +457,23 @@ def run_optimized_matcher(
             best_result = None
             best_metric = -float('inf')
             
-            for scale in scales_to_try:
-                # Scale candidate
-                center = Vc.mean(axis=0)
-                Vc_scaled = (Vc - center) * scale + center
-                
-                # Strategy 2: Multi-start alignment
-                if enable_multi_start:
-                    align_result = multi_start_alignment(Vc_scaled, Fc, Vt, Ft, n_starts=3)
-                else:
-                    align_result = cppcore.align_icp_with_mirror(
-                        Vc_scaled, Fc, Vt, Ft, 
-                        voxel=5.0, fpfh_radius=10.0, icp_thr=15.0
-                    )
-                
-                # Transform
+            # Strategy 2: Multi-start alignment, all scales in one native call
+            aligned = align_all_scales(Vc, Fc, Vt, Ft, scales_to_try,
+                                       n_starts=3 if enable_multi_start else 1)
+            
+            # One candidate BVH in its local frame; every scale/transform hypothesis reuses it
+            cand_scene = cppcore.ClearanceScene(Vc, Fc)
+            center = Vc.mean(axis=0)
+            
+            for scale, align_result in zip(scales_to_try, aligned):
+                if align_result is None:
+                    continue
+                # Scale about the centre, then align
                 T = np.asarray(align_result['T'])
-                Vc_aligned = (np.c_[Vc_scaled, np.ones((Vc_scaled.shape[0], 1))] @ T.T)[:, :3]
                 
                 # Strategy 3: Compute detailed metrics
-                clear_result = compute_detailed_clearance_metrics(Vt, Ft, Vc_aligned, Fc)
+                clear_result = compute_detailed_clearance_metrics(
+                    Vt, Ft, cand_scene.at(T @ scale_about(center, scale)), target_samples=target_samples)
                 
                 # Select metric based on adaptive threshold
                 if use_adaptive_threshold == 'min':
@@ -526,7 +583,8 @@ def run_optimized_matcher(
                 Vc_aligned = (np.c_[Vc_scaled, np.ones((Vc_scaled.shape[0], 1))] @ T.T)[:, :3]
                 
                 html_path = Path(export_heatmap_dir) / f"{i+1:02d}_{Path(r['path']).stem}_heatmap.html"
-                generate_clearance_heatmap(Vt, Ft, Vc_aligned, Fc, r, html_path)
+                field = compute_vertex_clearance(Vt, Ft, Vc_aligned, Fc, on='candidate')
+                generate_clearance_heatmap_standalone((Vt, Ft, Vc_aligned, Fc, r, str(html_path), field))
     
     # Save report
     if export_report:
@@ -587,6 +645,8 @@ if __name__ == '__main__':
     ap.add_argument('--no-preprocess', action='store_true', help='Disable mesh preprocessing')
     ap.add_argument('--remove-base', action='store_true', help='Remove fixture base (rough blanks)')
     ap.add_argument('--no-volume-filter', action='store_true', help='Disable volume filtering')
+    ap.add_argument('--feature-index', type=str, help='Coarse-feature index file (built on first use)')
+    ap.add_argument('--index-topk', type=int, default=32, help='Candidates kept by the feature index')
     
     # Export
     ap.add_argument('--export-report', type=str, help='Export JSON report')
@@ -618,5 +678,7 @@ if __name__ == '__main__':
         export_ply_dir=args.export_ply_dir,
         export_glb_dir=args.export_glb_dir,
         export_heatmap_dir=args.export_heatmap_dir,
-        export_topk=args.export_topk
+        export_topk=args.export_topk,
+        feature_index=args.feature_index,
+        index_topk=args.index_topk
     )
\ No newline at end of file
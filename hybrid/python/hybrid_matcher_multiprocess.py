@@ -26,8 +26,10 @@ os.environ['OMP_NUM_THREADS'] = '1'  # 每个进程内禁用OpenMP
 from hybrid_matcher import (
     load_mesh_enhanced,
     filter_by_volume,
-    multi_start_alignment,
+    align_all_scales,
     compute_detailed_clearance_metrics,
+    make_target_samples,
+    scale_about,
     export_ply,
     export_glb
 )
@@ -44,7 +46,7 @@ def process_single_candidate(args):
     
     try:
         # 解包参数
-        Vt, Ft, target_features = target_data
+        Vt, Ft, target_features, target_samples = target_data
         
         # 设置进程内环境
         os.environ['OMP_NUM_THREADS'] = '1'
@@ -78,34 +80,28 @@ def process_single_candidate(args):
         
         scales_to_try = params.get('scales', [1.0])
         
-        for scale in scales_to_try:
-            # 缩放候选模型
-            center = Vc.mean(axis=0)
-            Vc_scaled = (Vc - center) * scale + center
-            
-            # 对齐
-            if params['enable_multi_start']:
-                align_result = multi_start_alignment(
-                    Vc_scaled, Fc, Vt, Ft, 
-                    n_starts=3,
-                    voxel=params['voxel'],
-                    fpfh_radius=params['fpfh_radius'],
-                    icp_thr=params['icp_thr']
-                )
-            else:
-                align_result = cppcore.align_icp_with_mirror(
-                    Vc_scaled, Fc, Vt, Ft,
-                    params['voxel'],
-                    params['fpfh_radius'],
-                    params['icp_thr']
-                )
-            
-            # 变换
-            T = np.asarray(align_result['T'])
-            Vc_aligned = (np.c_[Vc_scaled, np.ones((Vc_scaled.shape[0], 1))] @ T.T)[:, :3]
+        # 对齐：所有缩放 × 起点 × 镜像一次原生调用（共享金字塔，逐层 ICP，剪枝）
+        aligned = align_all_scales(
+            Vc, Fc, Vt, Ft, scales_to_try,
+            n_starts=3 if params['enable_multi_start'] else 1,
+            voxel=params['voxel'],
+            fpfh_radius=params['fpfh_radius'],
+            icp_thr=params['icp_thr']
+        )
+        
+        # 候选 BVH 在局部坐标系只建一次，各缩放 / 对齐假设只换变换
+        cand_scene = cppcore.ClearanceScene(Vc, Fc)
+        center = Vc.mean(axis=0)
+        
+        for scale, align_result in zip(scales_to_try, aligned):
+            if align_result is None:
+                continue
+            # 缩放（绕中心）后对齐
+            T = np.asarray(align_result['T']) @ scale_about(center, scale)
             
             # 计算间隙指标
-            clear_result = compute_detailed_clearance_metrics(Vt, Ft, Vc_aligned, Fc)
+            clear_result = compute_detailed_clearance_metrics(Vt, Ft, cand_scene.at(T),
+                                                              target_samples=target_samples)
             
             # 选择评价指标
             threshold = params['use_adaptive_threshold']
@@ -128,7 +124,7 @@ def process_single_candidate(args):
                     'align': align_result,
                     'clearance': clear_result,
                     'metric': metric,
-                    'Vc_final': Vc_aligned,
+                    'Vc_final': (np.c_[Vc, np.ones((Vc.shape[0], 1))] @ T.T)[:, :3],
                     'Fc': Fc
                 }
             
@@ -257,8 +253,8 @@ def run_multiprocess_matcher(
         'icp_thr': 15.0
     }
     
-    # 准备目标数据（将在所有进程间共享）
-    target_data = (Vt, Ft, target_features)
+    # 准备目标数据（将在所有进程间共享）；余量采样集只生成一次，随任务 pickle 给各进程
+    target_data = (Vt, Ft, target_features, make_target_samples(Vt, Ft))
     
     # 创建任务列表
     tasks = [(cand_path, target_data, params) for cand_path in cand_paths]
@@ -299,7 +295,7 @@ def run_multiprocess_matcher(
                     glb_path = Path(export_glb_dir) / f"{base_name}.glb"
                     export_glb(Vc_final, Fc, glb_path)
     
-    # 生成热图 - 使用独立的ProcessPoolExecutor避免嵌套多进程死锁
+    # 生成热图
     print(f"Generating heatmaps to {export_heatmap_dir}...")
     if export_heatmap_dir and results:
         Path(export_heatmap_dir).mkdir(parents=True, exist_ok=True)
@@ -312,11 +308,12 @@ def run_multiprocess_matcher(
                 html_path = Path(export_heatmap_dir) / f"{i+1:02d}_{Path(r['path']).stem}_heatmap.html"
                 heatmap_tasks.append((Vt, Ft, Vc_final, Fc, r, str(html_path)))
         
-        # 使用ProcessPoolExecutor独立生成热图，避免嵌套多进程
+        # 余量场由 cppcore.clearance_field 在 C++ 内并行计算，主进程内顺序生成即可；
+        # 本脚本开头设了 OMP_NUM_THREADS=1，线程池导入时只有 1 个线程，这里先把预算放回全部核心
         if heatmap_tasks:
-            print(f"  Generating {len(heatmap_tasks)} heatmaps using separate process pool...")
-            with ProcessPoolExecutor(max_workers=min(3, len(heatmap_tasks))) as executor:
-                heatmap_results = list(executor.map(generate_clearance_heatmap_standalone, heatmap_tasks))
+            cppcore.set_thread_budget(cpu_count())
+            print(f"  Generating {len(heatmap_tasks)} heatmaps...")
+            heatmap_results = [generate_clearance_heatmap_standalone(t) for t in heatmap_tasks]
             
             # 检查结果
             successful = sum(1 for r in heatmap_results if r['success'])